@@ -33,6 +33,35 @@
 //      data transmission to the server to prevent sudden spikes and/or
 //      saturating the network bandwidth.
 //
+//      A slow reader is simulated with -sr: each connection then reads at
+//      most the given number of bytes per second, in one receive every
+//      SLOW_READ_INTERVAL milliseconds, while it keeps sending at full speed.
+//      Its receive buffer is shrunk to one second of data so that the
+//      server soon finds its sends backing up. This exercises the server's
+//      backpressure: chapter06's iocpserver should pause receiving on the
+//      connection instead of buffering the echo.
+//
+//      The statistics also show the connects completed per second and those
+//      still pending, refused or failed otherwise. Opening many connections
+//      at once (a large -c without -cr), or at a rate stepped up with -cr,
+//      makes a connection storm for testing how a server's accept path
+//      keeps up.
+//
+//      For benchmarks, -d runs the load for a fixed number of seconds and
+//      then prints the totals and average rates, so runs against different
+//      server settings can be compared; give a -x large enough to keep the
+//      connections busy until then.
+//
+//      With -i the connections are left idle once established: the data
+//      sent along with the connect is echoed and read back, and after that
+//      each connection only keeps its receive pending. This is how to hold
+//      a large number of mostly idle connections against a server. The
+//      connects can be paced with -cr, and since a local address has fewer
+//      than 64512 ports to bind, -la spreads the connections over that many
+//      consecutive IPv4 addresses starting with the one given with -l. For
+//      example, one million loopback connections:
+//          iocpclient.exe -n 127.0.0.1 -l 127.0.0.1 -la 16 -c 1000000 -cr 20000 -i -b 1
+//
 //      NOTE: This client only supports the TCP protocol.
 // 
 // Compile:
@@ -43,10 +72,15 @@
 //          -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]
 //          -b size    Buffer size for send/recv (in bytes)
 //          -c count   Number of connections to establish
+//          -cr rate   Connections to initiate per second [default = all at once]
+//          -d secs    Stop after this many seconds and print the totals
 //          -e port    Port number
+//          -i         Leave the connections idle after the connect data is echoed
 //          -n server  Server address or name to connect to
 //          -l addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]
+//          -la count  Number of consecutive IPv4 local addresses to bind to (starting with -l)
 //          -r rate    Rate at which to send data
+//          -sr rate   Read at most this many bytes per second per connection (slow reader)
 //          -t size    Use TransmitFile instead of sends (size of file to send)
 //          -x count   Number of sends
 //
@@ -65,6 +99,7 @@
 #define DEFAULT_CLIENT_CONNECTIONS  10     // Number of connections to initiate
 #define DEFAULT_FILE_SIZE           2000000// Default size of file for TransmitFile
 #define DEFAULT_SEND_COUNT          100    // How many send/TransmitFiles to perform
+#define SLOW_READ_INTERVAL          100    // Milliseconds between the receives of a slow reader
 
 int gAddressFamily = AF_UNSPEC,         // default to unspecified
     gSocketType    = SOCK_STREAM,       // default to TCP socket type
@@ -75,11 +110,16 @@ int gAddressFamily = AF_UNSPEC,         // default to unspecified
     gFileSize        = DEFAULT_FILE_SIZE,
     gSendCount       = DEFAULT_SEND_COUNT,
     gRateLimit       = -1,
-    gTimeout         = 0;
+    gTimeout         = 0,
+    gConnectRate     = 0,               // connects per second, 0 = all at once
+    gSlowReadRate    = 0,               // bytes read per second, 0 = as fast as possible
+    gDuration        = 0,               // seconds to run, 0 = until the sends are done
+    gLocalAddrCount  = 1;               // consecutive local addresses to bind to
 
 USHORT gLocalPort = 0x0000FFFD;
 
-BOOL gTransmitFile = FALSE;             // Use TransmitFile instead
+BOOL gTransmitFile = FALSE,             // Use TransmitFile instead
+     gIdle         = FALSE;             // Leave connections idle once connected
 
 HANDLE gTempFile   = INVALID_HANDLE_VALUE;
 
@@ -134,6 +174,7 @@ typedef struct _SOCKET_OBJ
     LPFN_TRANSMITFILE    lpfnTransmitFile;
 
     BUFFER_OBJ          *Repost;         // Send buffer to repost (used with rate limit)
+    BUFFER_OBJ          *RecvRepost;     // Receive to repost (used with slow reads)
 
     CRITICAL_SECTION     SockCritSec;
 
@@ -155,7 +196,10 @@ volatile LONG gBytesRead=0,
               gStartTimeLast=0,
               gTotalConnections=0,
               gCurrentConnections=0,
-              gConnectionRefused=0;
+              gConnectionRefused=0,
+              gConnectionFailed=0,      // Connects failing other than refused
+              gConnectsPending=0,       // ConnectEx not yet completed
+              gConnectsLast=0;          // Connects completed this interval
 
 //
 // Function: usage
@@ -170,11 +214,16 @@ void usage(char *progname)
     fprintf(stderr, "  -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]\n"
                     "  -b size    Buffer size for send/recv [default = %d]\n"
                     "  -c count   Number of connections to establish\n"
+                    "  -cr rate   Connections to initiate per second [default = all at once]\n"
+                    "  -d secs    Stop after this many seconds and print the totals\n"
                     "  -e port    Port number [default = %s]\n"
+                    "  -i         Leave the connections idle after the connect data is echoed\n"
                     "  -n server  Server address or name to connect to\n"
                     "  -p port    Local port number to bind to\n"
                     "  -l addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]\n"
+                    "  -la count  Number of consecutive IPv4 local addresses to bind to (starting with -l)\n"
                     "  -r rate    Use the QOS provider to limit send rate\n"
+                    "  -sr rate   Read at most this many bytes per second per connection (slow reader)\n"
                     "  -t size    Use TransmitFile instead of sends (size of file to send)\n"
                     "  -x count   Number of sends\n",
                     gBufferSize,
@@ -291,36 +340,18 @@ void FreeSocketObj(SOCKET_OBJ *obj)
 //
 // Description:
 //    Insert a SOCKET_OBJ into a list of socket objects. Insertions
-//    are performed at the end of the list.
+//    are performed at the head of the list so that establishing many
+//    connections doesn't walk the whole list each time.
 //
 void InsertSocketObj(SOCKET_OBJ **head, SOCKET_OBJ *obj)
 {
-    SOCKET_OBJ *end=NULL,
-               *ptr=NULL;
-
-    // Find the end of the list
-    ptr = *head;
-    if (ptr)
-    {
-        while (ptr->next)
-            ptr = ptr->next;
-        end = ptr;
-    }
+    obj->prev = NULL;
+    obj->next = *head;
 
-    obj->next = NULL;
-    obj->prev = end;
+    if (*head)
+        (*head)->prev = obj;
 
-    if (end == NULL)
-    {
-        // List is empty
-        *head = obj;
-    }
-    else
-    {
-        // Put new object at the end
-        end->next = obj;
-        obj->prev = end;
-    }
+    *head = obj;
 }
 
 //
@@ -484,20 +515,38 @@ void ValidateArgs(int argc, char **argv)
                         usage(argv[0]);
                     gBufferSize = atol(argv[++i]);
                     break;
-                case 'c':               // Number of connections to make
+                case 'c':
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)           // Number of connections to make
+                        gConnectionCount = atol(argv[++i]);
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'r'))
+                        gConnectRate = atol(argv[++i]); // Connects per second
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'd':               // Duration of the run
                     if (i+1 >= argc)
                         usage(argv[0]);
-                    gConnectionCount = atol(argv[++i]);
+                    gDuration = atol(argv[++i]);
                     break;
                 case 'e':               // endpoint - port number
                     if (i+1 >= argc)
                         usage(argv[0]);
                     gBindPort = argv[++i];
                     break;
-                case 'l':               // local address for binding
+                case 'i':               // Idle connections
+                    gIdle = TRUE;
+                    break;
+                case 'l':
                     if (i+1 >= argc)
                         usage(argv[0]);
-                    gBindAddr = argv[++i];
+                    if (strlen(argv[i]) == 2)           // local address for binding
+                        gBindAddr = argv[++i];
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'a'))
+                        gLocalAddrCount = atol(argv[++i]);  // local addresses to use
+                    else
+                        usage(argv[0]);
                     break;
                 case 'n':               // server address/name to connect to
                     if (i+1 >= argc)
@@ -519,6 +568,11 @@ void ValidateArgs(int argc, char **argv)
                         usage(argv[0]);
                     gRateLimit = atol(argv[++i]);
                     break;
+                case 's':               // Slow reader
+                    if ((i+1 >= argc) || (strlen(argv[i]) != 3) || (tolower(argv[i][2]) != 'r'))
+                        usage(argv[0]);
+                    gSlowReadRate = atol(argv[++i]);
+                    break;
                 case 't':               // Use TransmitFile instead of sends
                     gTransmitFile = TRUE;
                     if (i+1 >= argc)
@@ -568,6 +622,8 @@ void PrintStatistics()
     printf("Current Connections: %lu\n", gCurrentConnections);
     printf("Total Connections  : %lu\n", gTotalConnections);
     printf("Connections Refused: %lu\n", gConnectionRefused);
+    printf("Connections Failed : %lu\n", gConnectionFailed);
+    printf("Connects Pending   : %lu\n", gConnectsPending);
 
 
     // Calculate average bytes per second
@@ -589,12 +645,30 @@ void PrintStatistics()
     bps = gBytesReadLast / elapsed;
     printf("Current BPS read   : %lu\n", bps);
 
+    printf("Current connects/s : %lu\n", gConnectsLast / elapsed);
+
     InterlockedExchange(&gBytesSentLast, 0);
     InterlockedExchange(&gBytesReadLast, 0);
+    InterlockedExchange(&gConnectsLast, 0);
 
     gStartTimeLast = tick;
 }
 
+//
+// Function: SlowReadSize
+//
+// Description:
+//    Returns the bytes a slow reader (-sr) receives per SLOW_READ_INTERVAL.
+//
+int SlowReadSize()
+{
+    int     size;
+
+    size = (int)(((LONGLONG)gSlowReadRate * SLOW_READ_INTERVAL) / 1000);
+
+    return (size > 0) ? size : 1;
+}
+
 //
 // Function: PostRecv
 // 
@@ -728,6 +802,7 @@ int PostConnect(SOCKET_OBJ *sock, BUFFER_OBJ *connobj)
 
     // Increment the outstanding overlapped count for this socket
     InterlockedIncrement(&sock->OutstandingOps);
+    InterlockedIncrement(&gConnectsPending);
 
     //printf("POST_CONNECT: op %d\n", sock->OutstandingOps);
 
@@ -811,6 +886,11 @@ int HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD err
             {
                 InterlockedIncrement(&gConnectionRefused);
             }
+            else
+            {
+                InterlockedIncrement(&gConnectionFailed);
+            }
+            InterlockedDecrement(&gConnectsPending);
 
             FreeBufferObj(buf);
 			RemoveSocketObj(&gConnectionList, sock);
@@ -839,6 +919,8 @@ int HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD err
             // Update counters
             InterlockedIncrement(&gCurrentConnections);
             InterlockedIncrement(&gTotalConnections);
+            InterlockedIncrement(&gConnectsLast);
+            InterlockedDecrement(&gConnectsPending);
             InterlockedExchangeAdd(&gBytesSent, BytesTransfered);
             InterlockedExchangeAdd(&gBytesSentLast, BytesTransfered);
 
@@ -858,10 +940,14 @@ int HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD err
 
             sock->bConnected = TRUE;
 
-            // Post the specified number of receives on the succeeded connection
-            for(i=0; i < gOverlappedCount ;i++)
+            // Post the specified number of receives on the succeeded connection.
+            //    A slow reader only has one, of the size it reads per interval.
+            for(i=0; i < ((gSlowReadRate > 0) ? 1 : gOverlappedCount) ;i++)
             {
-                recvobj = GetBufferObj(gBufferSize);
+                if (gSlowReadRate > 0)
+                    recvobj = GetBufferObj(SlowReadSize());
+                else
+                    recvobj = GetBufferObj(gBufferSize);
 
                 if (PostRecv(sock, recvobj) != NO_ERROR)
                 {
@@ -871,7 +957,8 @@ int HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD err
                 }
             }
 
-            for(i=0; ((i < gOverlappedCount) && (!bCleanupSocket)) ;i++)
+            // Idle connections (-i) send nothing beyond the connect data
+            for(i=0; ((i < gOverlappedCount) && (!bCleanupSocket) && (!gIdle)) ;i++)
             {
                 sendobj = GetBufferObj(gBufferSize);
 
@@ -905,7 +992,14 @@ int HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD err
                 InterlockedExchangeAdd(&gBytesRead, BytesTransfered);
                 InterlockedExchangeAdd(&gBytesReadLast, BytesTransfered);
 
-                if (PostRecv(sock, buf) != NO_ERROR)
+                if (gSlowReadRate > 0)
+                {
+                    // A slow reader leaves the receive to the read thread
+                    EnterCriticalSection(&sock->SockCritSec);
+                    sock->RecvRepost = buf;
+                    LeaveCriticalSection(&sock->SockCritSec);
+                }
+                else if (PostRecv(sock, buf) != NO_ERROR)
                 {
                     // In the event the recv fails, clean up the connection
                     FreeBufferObj(buf);
@@ -1158,6 +1252,48 @@ DWORD WINAPI SendThread(LPVOID lpParam)
     return 0;
 }
 
+//
+// Function: ReadThread
+//
+// Description:
+//    This thread paces the receives of a slow reader (-sr). Every
+//    SLOW_READ_INTERVAL it reposts the receive of each connection whose
+//    last receive has completed, so no connection reads more than one
+//    buffer of SlowReadSize bytes per interval.
+//
+DWORD WINAPI ReadThread(LPVOID lpParam)
+{
+    SOCKET_OBJ *connobj=NULL;
+    BUFFER_OBJ *buf=NULL;
+
+    while (1)
+    {
+        Sleep(SLOW_READ_INTERVAL);
+
+        // Walk the connection list to repost receives
+        for(connobj=gConnectionList; connobj ;connobj=connobj->next)
+        {
+            EnterCriticalSection(&connobj->SockCritSec);
+
+            if ((connobj->s != INVALID_SOCKET) && (connobj->RecvRepost != NULL))
+            {
+                buf = connobj->RecvRepost;
+                connobj->RecvRepost = NULL;
+
+                if (PostRecv(connobj, buf) != NO_ERROR)
+                {
+                    FreeBufferObj(buf);
+                }
+            }
+
+            LeaveCriticalSection(&connobj->SockCritSec);
+        }
+    }
+
+    ExitThread(0);
+    return 0;
+}
+
 //
 // Function: main
 //
@@ -1181,11 +1317,18 @@ int __cdecl main(int argc, char **argv)
     OVERLAPPED  *lpOverlapped=NULL;
     HANDLE       CompletionPort,
                  hThread,
+                 hReadThread,
                  hrc;
 
     WSADATA      wsd;
-    ULONG        lastprint=0;
-    int          error,
+    SOCKADDR_IN *localaddr=NULL;
+    ULONG        lastprint=0,
+                 connectstart=0,
+                 connects=0,
+                 due;
+    USHORT       firstport;
+    int          addrindex,
+                 error,
                  rc,
                  i;
     struct addrinfo *resremote=NULL,
@@ -1195,6 +1338,14 @@ int __cdecl main(int argc, char **argv)
     // Validate the command line
     ValidateArgs(argc, argv);
 
+    firstport = gLocalPort;
+
+    if ((gLocalAddrCount > 1) && (gBindAddr == NULL))
+    {
+        fprintf(stderr, "-la needs the first local address (-l)\n");
+        return -1;
+    }
+
     if (gTransmitFile && (gOverlappedCount > 1))
     {
         printf("Can only have one TransmitFile oustanding per connection!\n");
@@ -1252,7 +1403,7 @@ int __cdecl main(int argc, char **argv)
     }
 
     // Start the timer for statistics counting
-    gStartTime = gStartTimeLast = GetTickCount();
+    gStartTime = gStartTimeLast = connectstart = GetTickCount();
 
     // For each local address returned, create a listening/receiving socket
     ptr = resremote;
@@ -1261,6 +1412,8 @@ int __cdecl main(int argc, char **argv)
         reslocal = ResolveAddress(gBindAddr, "0", ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
         if (reslocal)
         {
+            addrindex = 0;
+
             // Initiate the specified number of connections for each server
             //    address returned.
             for(i=0; i < gConnectionCount ;i++)
@@ -1276,6 +1429,24 @@ int __cdecl main(int argc, char **argv)
                     return -1;
                 }
 
+                // A slow reader's receive window only holds a second of data
+                //    so the server notices it falling behind
+                if (gSlowReadRate > 0)
+                {
+                    rc = setsockopt(
+                            sockobj->s,
+                            SOL_SOCKET,
+                            SO_RCVBUF,
+                            (char *)&gSlowReadRate,
+                            sizeof(gSlowReadRate)
+                            );
+                    if (rc == SOCKET_ERROR)
+                    {
+                        fprintf(stderr, "setsockopt: SO_RCVBUF failed: %d\n",
+                                WSAGetLastError());
+                    }
+                }
+
                 // Associate the socket and its SOCKET_OBJ to the completion port
                 hrc = CreateIoCompletionPort((HANDLE)sockobj->s, CompletionPort, (ULONG_PTR)sockobj, 0);
                 if (hrc == NULL)
@@ -1287,25 +1458,30 @@ int __cdecl main(int argc, char **argv)
                 // bind the socket to a local address and port
                 do
                 {
-                    SetPort(reslocal->ai_family, reslocal->ai_addr, gLocalPort);
-
-                    rc = bind(sockobj->s, reslocal->ai_addr, reslocal->ai_addrlen);
-                    if (rc == SOCKET_ERROR)
+                    // Once the ports of a local address are used up move on
+                    //    to the next address (-la)
+                    if ((gLocalPort <= 1024) &&
+                        (reslocal->ai_family == AF_INET) &&
+                        (addrindex + 1 < gLocalAddrCount))
                     {
-                        // Bail out if the port gets too low
-                        if (--gLocalPort == 1024)
-                        {
-                            fprintf(stderr, "bind failed: %d\n", WSAGetLastError());
-                            return -1;
-                        }
+                        localaddr = (SOCKADDR_IN *)reslocal->ai_addr;
+                        localaddr->sin_addr.s_addr = htonl(ntohl(localaddr->sin_addr.s_addr) + 1);
+
+                        addrindex++;
+                        gLocalPort = firstport;
                     }
-                    else
+
+                    // Bail out if the port gets too low
+                    if (gLocalPort <= 1024)
                     {
-                        break;
+                        fprintf(stderr, "bind failed: no local ports left\n");
+                        return -1;
                     }
-                } while (1);
 
-                gLocalPort--;
+                    SetPort(reslocal->ai_family, reslocal->ai_addr, gLocalPort--);
+
+                    rc = bind(sockobj->s, reslocal->ai_addr, reslocal->ai_addrlen);
+                } while (rc == SOCKET_ERROR);
 
                 // Need to load the Winsock extension functions from each provider
                 //    -- e.g. AF_INET and AF_INET6. 
@@ -1359,6 +1535,16 @@ int __cdecl main(int argc, char **argv)
 
                 if (gRateLimit != -1)
                     Sleep(gTimeout);
+
+                // Pace the connects (-cr) by sleeping until the next one is due
+                if (gConnectRate > 0)
+                {
+                    connects++;
+
+                    due = (ULONG)(((ULONGLONG)connects * 1000) / gConnectRate);
+                    if (GetTickCount() - connectstart < due)
+                        Sleep(due - (GetTickCount() - connectstart));
+                }
             }
             freeaddrinfo(reslocal);
         }
@@ -1377,6 +1563,17 @@ int __cdecl main(int argc, char **argv)
         }
     }
 
+    if (gSlowReadRate > 0)
+    {
+        hReadThread = CreateThread(NULL, 0, ReadThread, (LPVOID)NULL, 0, NULL);
+        if (hReadThread == NULL)
+        {
+            fprintf(stderr, "CreateThread failed: %d\n", GetLastError());
+            return -1;
+        }
+        CloseHandle(hReadThread);
+    }
+
     lastprint = GetTickCount();
 
     // Our worker thread is simly our main thread, process the completion
@@ -1432,6 +1629,12 @@ int __cdecl main(int argc, char **argv)
             }
         }
 
+        // A timed run (-d) stops with the connections still busy
+        if ((gDuration > 0) && ((GetTickCount() - gStartTime) / 1000 >= (ULONG)gDuration))
+        {
+            break;
+        }
+
         if (gRateLimit != -1)
         {
             rc = WaitForSingleObject(hThread, 0);
@@ -0,0 +1,270 @@
+//
+// Platform routines
+//
+// Files:
+//      compat.h        - Header file for the platform routines
+//
+// Description:
+//      This file lets the server build on Linux as well as on Windows. On
+//      Windows it simply includes the Winsock and Win32 headers. On Linux
+//      it declares the Win32 types and routines the server uses in terms
+//      of POSIX: critical sections are recursive pthread mutexes, the
+//      interlocked routines are GCC atomic builtins, the heap is malloc
+//      and the performance counter is the monotonic clock.
+//
+//      Only the names used by this sample are provided. The overlapped
+//      socket calls themselves are not emulated here; the server posts
+//      its operations through the proactor routines (see proactor.h),
+//      which have an io_uring and an epoll backend on Linux.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _COMPAT_H_
+#define _COMPAT_H_
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <windows.h>
+
+#define FMT_I64U                "I64u"  // printf format of a ULONGLONG
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define FMT_I64U                "llu"   // printf format of a ULONGLONG
+
+typedef int                     BOOL;
+typedef unsigned char           BYTE;
+typedef unsigned short          WORD;
+typedef unsigned int            DWORD;
+typedef long                    LONG;
+typedef unsigned long           ULONG;
+typedef long long               LONGLONG;
+typedef unsigned long long      ULONGLONG;
+typedef uintptr_t               ULONG_PTR;
+typedef void                   *LPVOID;
+typedef void                   *HANDLE;
+typedef int                     SOCKET;
+typedef struct sockaddr         SOCKADDR;
+typedef struct sockaddr_storage SOCKADDR_STORAGE;
+typedef pthread_mutex_t         CRITICAL_SECTION;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID lpParam);
+
+typedef union _LARGE_INTEGER
+{
+    LONGLONG    QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _SYSTEM_INFO
+{
+    DWORD       dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+typedef struct _WSADATA
+{
+    WORD        wVersion;
+} WSADATA;
+
+//
+// Same layout as struct iovec so that an array of these can be handed to
+//    sendmsg and recvmsg as is
+//
+typedef struct _WSABUF
+{
+    char       *buf;
+    size_t      len;
+} WSABUF;
+
+#define TRUE                    1
+#define FALSE                   0
+#define INFINITE                0xFFFFFFFF
+#define NO_ERROR                0
+#define SOCKET_ERROR            (-1)
+#define INVALID_SOCKET          (-1)
+#define WSAEFAULT               EFAULT
+#define WAIT_FAILED             (-1)
+#define WAIT_TIMEOUT            258
+
+#define HEAP_ZERO_MEMORY        0x00000008
+#define MEM_COMMIT              0x00001000
+#define MEM_RESERVE             0x00002000
+#define PAGE_READWRITE          0x04
+
+#define WINAPI
+#define __cdecl
+#define __declspec(x)           __declspec_##x
+#define __declspec_thread       __thread
+
+#define MAKEWORD(a, b)          ((WORD)(((BYTE)(a)) | ((WORD)((BYTE)(b))) << 8))
+
+#define CONTAINING_RECORD(address, type, field) \
+        ((type *)((char *)(address) - offsetof(type, field)))
+
+#define _strnicmp               strncasecmp
+#define closesocket             close
+
+static inline DWORD GetLastError()      { return (DWORD)errno; }
+static inline int   WSAGetLastError()   { return errno; }
+
+static inline int   WSAStartup(WORD wVersion, WSADATA *lpWSAData) { lpWSAData->wVersion = wVersion; return 0; }
+static inline int   WSACleanup()        { return 0; }
+
+static inline void  ExitProcess(int code) { exit(code); }
+static inline void  ExitThread(DWORD code) { pthread_exit(NULL); }
+static inline void  Sleep(DWORD ms)     { usleep((useconds_t)ms * 1000); }
+
+static inline HANDLE GetProcessHeap()   { return NULL; }
+
+static inline void *HeapAlloc(HANDLE heap, DWORD flags, size_t bytes)
+{
+    // A zero byte allocation must still return a distinct pointer
+    if (bytes == 0)
+        bytes = 1;
+    return (flags & HEAP_ZERO_MEMORY) ? calloc(1, bytes) : malloc(bytes);
+}
+
+static inline BOOL HeapFree(HANDLE heap, DWORD flags, void *mem)
+{
+    free(mem);
+    return TRUE;
+}
+
+static inline void *VirtualAlloc(void *addr, size_t bytes, DWORD type, DWORD protect)
+{
+    void   *mem;
+
+    mem = mmap(addr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (mem == MAP_FAILED) ? NULL : mem;
+}
+
+//
+// Critical sections may be entered again by the thread owning them
+//
+static inline void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(cs, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void EnterCriticalSection(CRITICAL_SECTION *cs)   { pthread_mutex_lock(cs); }
+static inline void LeaveCriticalSection(CRITICAL_SECTION *cs)   { pthread_mutex_unlock(cs); }
+static inline void DeleteCriticalSection(CRITICAL_SECTION *cs)  { pthread_mutex_destroy(cs); }
+
+static inline LONG InterlockedIncrement(volatile LONG *p)       { return __sync_add_and_fetch(p, 1); }
+static inline LONG InterlockedDecrement(volatile LONG *p)       { return __sync_sub_and_fetch(p, 1); }
+static inline LONG InterlockedExchange(volatile LONG *p, LONG v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static inline LONG InterlockedExchangeAdd(volatile LONG *p, LONG v) { return __sync_fetch_and_add(p, v); }
+static inline LONG InterlockedCompareExchange(volatile LONG *p, LONG v, LONG cmp)
+{
+    return __sync_val_compare_and_swap(p, cmp, v);
+}
+
+static inline unsigned char _BitScanReverse(unsigned long *index, unsigned long mask)
+{
+    if (mask == 0)
+        return 0;
+    *index = (unsigned long)(63 - __builtin_clzl(mask));
+    return 1;
+}
+
+static inline DWORD GetTickCount()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+    freq->QuadPart = 1000000000;
+    return TRUE;
+}
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    count->QuadPart = ((LONGLONG)ts.tv_sec * 1000000000) + ts.tv_nsec;
+    return TRUE;
+}
+
+static inline void GetSystemInfo(SYSTEM_INFO *info)
+{
+    info->dwNumberOfProcessors = (DWORD)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+//
+// Threads are started through a small trampoline since the Win32 thread
+//    routine returns a DWORD
+//
+typedef struct _THREAD_START
+{
+    LPTHREAD_START_ROUTINE  lpStartAddress;
+    LPVOID                  lpParameter;
+} THREAD_START;
+
+static inline void *ThreadTrampoline(void *arg)
+{
+    THREAD_START    start;
+
+    start = *(THREAD_START *)arg;
+    free(arg);
+
+    start.lpStartAddress(start.lpParameter);
+    return NULL;
+}
+
+static inline HANDLE CreateThread(void *attr, size_t stack, LPTHREAD_START_ROUTINE lpStartAddress,
+                                  LPVOID lpParameter, DWORD flags, DWORD *lpThreadId)
+{
+    THREAD_START   *start;
+    pthread_t       thread;
+
+    start = (THREAD_START *)malloc(sizeof(THREAD_START));
+    if (start == NULL)
+        return NULL;
+
+    start->lpStartAddress = lpStartAddress;
+    start->lpParameter    = lpParameter;
+
+    if ((errno = pthread_create(&thread, NULL, ThreadTrampoline, start)) != 0)
+    {
+        free(start);
+        return NULL;
+    }
+    return (HANDLE)thread;
+}
+
+#endif
+
+#endif
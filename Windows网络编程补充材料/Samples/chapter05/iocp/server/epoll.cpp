@@ -0,0 +1,338 @@
+//
+// epoll completion queue
+//
+// Files:
+//      epoll.cpp       - epoll backend of the completion queue (Linux)
+//      proactor.h      - Header file for the completion queue routines
+//
+// Description:
+//      This file contains the epoll backend of the completion queue (see
+//      proactor.h), used where io_uring is not available. epoll only says
+//      when a socket is ready, so the completions are emulated on top of
+//      it: an associated socket is made non-blocking and registered once,
+//      edge triggered, for both directions. A posted operation is tried
+//      right away; if it would block it is queued on the socket (receives
+//      and accepts on one queue, sends on the other, each in the order
+//      posted) and tried again whenever epoll reports the socket ready.
+//
+//      An operation which is done, successfully or not, goes on the queue's
+//      list of finished operations and is returned by
+//      EpollGetCompletions. Operations finished by a thread posting them
+//      wake a waiting thread through an eventfd; those finished in
+//      EpollGetCompletions are returned by the thread which ran them.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include "compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "proactor.h"
+
+//
+// Function: EpollCreate
+//
+// Description:
+//    Creates the epoll instance and the eventfd which wakes a waiting
+//    thread when operations finish outside of EpollGetCompletions.
+//
+int EpollCreate(PROACTOR *proactor)
+{
+    struct epoll_event  event;
+
+    proactor->EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (proactor->EpollFd < 0)
+    {
+        fprintf(stderr, "EpollCreate: epoll_create1 failed: %d\n", errno);
+        return SOCKET_ERROR;
+    }
+
+    proactor->WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (proactor->WakeFd < 0)
+    {
+        fprintf(stderr, "EpollCreate: eventfd failed: %d\n", errno);
+        close(proactor->EpollFd);
+        return SOCKET_ERROR;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events  = EPOLLIN | EPOLLET;
+    event.data.fd = proactor->WakeFd;
+    if (epoll_ctl(proactor->EpollFd, EPOLL_CTL_ADD, proactor->WakeFd, &event) != 0)
+    {
+        fprintf(stderr, "EpollCreate: epoll_ctl failed: %d\n", errno);
+        close(proactor->WakeFd);
+        close(proactor->EpollFd);
+        return SOCKET_ERROR;
+    }
+
+    pthread_mutex_init(&proactor->DoneLock, NULL);
+
+    return NO_ERROR;
+}
+
+//
+// Function: EpollAssociate
+//
+// Description:
+//    Makes the socket non-blocking and registers it for both directions.
+//    Being edge triggered, a ready socket is reported once, to one thread.
+//
+int EpollAssociate(PROACTOR *proactor, SOCKET s)
+{
+    struct epoll_event  event;
+    int                 flags;
+
+    flags = fcntl(s, F_GETFL, 0);
+    if ((flags < 0) || (fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0))
+    {
+        fprintf(stderr, "EpollAssociate: fcntl failed: %d\n", errno);
+        return SOCKET_ERROR;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = s;
+    if (epoll_ctl(proactor->EpollFd, EPOLL_CTL_ADD, s, &event) != 0)
+    {
+        fprintf(stderr, "EpollAssociate: epoll_ctl failed: %d\n", errno);
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: EpollTryOperation
+//
+// Description:
+//    Makes one attempt at an operation. Returns FALSE if it would block
+//    (or is a stream send with bytes left) and must wait for the socket to
+//    be ready again, TRUE once it is done.
+//
+BOOL EpollTryOperation(OVERLAPPED *ol)
+{
+    int     rc;
+
+    while (1)
+    {
+        switch (ol->Operation)
+        {
+            case PROACTOR_OP_RECV:
+                rc = (int)recvmsg(ol->s, &ol->Msg, 0);
+                break;
+            case PROACTOR_OP_SEND:
+                rc = (int)sendmsg(ol->s, &ol->Msg, MSG_NOSIGNAL);
+                break;
+            default:
+                rc = accept4(ol->s, NULL, NULL, SOCK_CLOEXEC);
+                break;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return FALSE;
+            rc = -errno;
+        }
+
+        ProactorSetResult(ol, rc);
+        if (ProactorSendPending(ol) == FALSE)
+            return TRUE;
+    }
+}
+
+//
+// Function: EpollFinish
+//
+// Description:
+//    Puts a finished operation on the list returned by EpollGetCompletions.
+//    If wake is set and the list was empty a waiting thread is woken.
+//
+void EpollFinish(PROACTOR *proactor, OVERLAPPED *ol, BOOL wake)
+{
+    BOOL        bWasEmpty;
+    ULONGLONG   one=1;
+
+    ol->next = NULL;
+
+    pthread_mutex_lock(&proactor->DoneLock);
+    bWasEmpty = (proactor->DoneHead == NULL);
+    if (proactor->DoneTail)
+        proactor->DoneTail->next = ol;
+    else
+        proactor->DoneHead = ol;
+    proactor->DoneTail = ol;
+    pthread_mutex_unlock(&proactor->DoneLock);
+
+    if ((wake) && (bWasEmpty))
+    {
+        write(proactor->WakeFd, &one, sizeof(one));
+    }
+}
+
+//
+// Function: EpollRunQueue
+//
+// Description:
+//    Tries the operations queued on a socket in order until one would
+//    block. Must be called with the socket's lock held.
+//
+void EpollRunQueue(PROACTOR *proactor, OVERLAPPED **head, OVERLAPPED **tail, BOOL wake)
+{
+    OVERLAPPED *ol=NULL;
+
+    while (((ol = *head) != NULL) && (EpollTryOperation(ol)))
+    {
+        *head = ol->next;
+        if (*head == NULL)
+            *tail = NULL;
+
+        EpollFinish(proactor, ol, wake);
+    }
+}
+
+//
+// Function: EpollSubmit
+//
+// Description:
+//    Posts an operation. It is tried right away unless others are already
+//    waiting on the same queue, in which case it waits its turn. Trying and
+//    queueing under the socket's lock means a readiness edge reported in
+//    between is not lost: the thread handling it takes the lock next and
+//    finds the operation queued.
+//
+int EpollSubmit(PROACTOR *proactor, PROACTOR_SOCKET *psock, OVERLAPPED *ol)
+{
+    OVERLAPPED **head,
+               **tail;
+
+    if (ol->Operation == PROACTOR_OP_SEND)
+    {
+        head = &psock->SendHead;
+        tail = &psock->SendTail;
+    }
+    else
+    {
+        head = &psock->RecvHead;
+        tail = &psock->RecvTail;
+    }
+
+    pthread_mutex_lock(&psock->Lock);
+
+    if (*tail)
+        (*tail)->next = ol;
+    else
+        *head = ol;
+    *tail = ol;
+
+    if (*head == ol)
+        EpollRunQueue(proactor, head, tail, TRUE);
+
+    pthread_mutex_unlock(&psock->Lock);
+
+    return NO_ERROR;
+}
+
+//
+// Function: EpollTakeFinished
+//
+// Description:
+//    Removes up to count finished operations and fills in their events. If
+//    more are left another thread is woken for them.
+//
+int EpollTakeFinished(PROACTOR *proactor, PROACTOR_EVENT *events, int count)
+{
+    OVERLAPPED *ol=NULL;
+    ULONGLONG   one=1;
+    int         removed;
+    BOOL        bMore;
+
+    removed = 0;
+
+    pthread_mutex_lock(&proactor->DoneLock);
+    while ((removed < count) && ((ol = proactor->DoneHead) != NULL))
+    {
+        proactor->DoneHead = ol->next;
+        if (proactor->DoneHead == NULL)
+            proactor->DoneTail = NULL;
+
+        ProactorSetEvent(&events[removed++], ol);
+    }
+    bMore = (proactor->DoneHead != NULL);
+    pthread_mutex_unlock(&proactor->DoneLock);
+
+    if ((removed > 0) && (bMore))
+    {
+        write(proactor->WakeFd, &one, sizeof(one));
+    }
+    return removed;
+}
+
+//
+// Function: EpollGetCompletions
+//
+// Description:
+//    Returns up to count finished operations, waiting in epoll_wait for
+//    sockets to become ready if there are none. The operations queued on
+//    each ready socket are run by the calling thread. Returns the number of
+//    events filled in, or SOCKET_ERROR on timeout or failure.
+//
+int EpollGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout)
+{
+    struct epoll_event  ready[MAX_PROACTOR_BATCH];
+    PROACTOR_SOCKET    *psock=NULL;
+    ULONGLONG           value;
+    int                 removed,
+                        rc,
+                        i;
+
+    while (1)
+    {
+        removed = EpollTakeFinished(proactor, events, count);
+        if (removed > 0)
+            return removed;
+
+        rc = epoll_wait(proactor->EpollFd, ready, MAX_PROACTOR_BATCH, (Timeout == INFINITE) ? -1 : (int)Timeout);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "EpollGetCompletions: epoll_wait failed: %d\n", errno);
+            return SOCKET_ERROR;
+        }
+        if (rc == 0)
+        {
+            errno = ETIMEDOUT;
+            return SOCKET_ERROR;
+        }
+
+        for(i=0; i < rc ;i++)
+        {
+            if (ready[i].data.fd == proactor->WakeFd)
+            {
+                read(proactor->WakeFd, &value, sizeof(value));
+                continue;
+            }
+
+            psock = ProactorGetSocket(ready[i].data.fd);
+            if (psock == NULL)
+                continue;
+
+            // An error or hang up makes both queues fail or finish
+            pthread_mutex_lock(&psock->Lock);
+            if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                EpollRunQueue(proactor, &psock->RecvHead, &psock->RecvTail, FALSE);
+            if (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                EpollRunQueue(proactor, &psock->SendHead, &psock->SendTail, FALSE);
+            pthread_mutex_unlock(&psock->Lock);
+        }
+    }
+}
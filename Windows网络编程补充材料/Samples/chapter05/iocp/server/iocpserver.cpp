@@ -3,8 +3,15 @@
 //
 // Files:
 //      iocpserver.cpp    - this file
+//      compat.h          - Win32 names on Linux
+//      proactor.cpp      - Completion queue routines
+//      proactor.h        - Header file for completion queue routines
+//      uring.cpp         - io_uring completion queue (Linux)
+//      epoll.cpp         - epoll completion queue (Linux)
 //      resolve.cpp       - Common name resolution routines
 //      resolve.h         - Header file for name resolution routines
+//      stats.cpp         - Per-thread counters and latency histograms
+//      stats.h           - Header file for statistics routines
 //
 // Description:
 //      This sample illustrates overlapped IO with a completion port for
@@ -23,10 +30,23 @@
 //      are posted. The AcceptEx is reposted as well. Once data is received
 //      on a client socket, it is echoed back. 
 //
+//      With -zc, a TCP connection which receives at least the given number of
+//      bytes at once has its send buffer disabled so that its sends go out
+//      directly from the receive buffers rather than being copied into the
+//      socket's send buffer. Use a buffer size (-b) of at least the threshold.
+//
 //      For UDP, an echo socket is creatd for each IP address family available.
 //      For each socket, several receives are posted. Once these receives 
 //      complete, the data is sent back to the receiver.
 //
+//      The server also builds and runs on Linux (see Compile), so the same
+//      server logic can be measured there, e.g. over loopback. All I/O is
+//      posted and completed through the proactor routines (proactor.h),
+//      whose Linux backend is io_uring, or epoll where io_uring is not
+//      available (-q picks one). Linux has no AcceptEx: an accept completes
+//      with the new socket but without any data, so the echo of the first
+//      receive is left to the receives posted on the connection.
+//
 //      The important thing to remember with IOCP is that the completion events
 //      may occur out of order; however, the buffers are guaranteed to be filled
 //      in the order posted. For our echo server this can cause problems as 
@@ -36,17 +56,18 @@
 //      N and N+1 at that time (to maintain the data ordering). To do this properly
 //      you'll have to call WSAGetOverlappedResult on receive N in order to find
 //      out how many bytes were received to echo it back. The second approach
-//      (which is implemented in this sample) is to keep a list of receive
-//      buffers that completed out of order. This list is maintained in the
-//      per-socket data structure. When receive N+1 completes, it will notice that
-//      receive N has not completed. The buffer is then queued in the out of
-//      order send list. Once receive N completes, its buffer is queued -- the
-//      queue is ordered in the same order that the receive operations are.
-//      Another routine (DoSends) goes through this list and sends those buffers
-//      that are available and in order. If any gaps are detected no further buffers
-//      are sent (as we will wait for that receive to complete and insert its
-//      buffer into the list so that the next call to DoSends will correctly
-//      send the buffers in the right order).
+//      (which is implemented in this sample) is to keep a ring of receive
+//      buffers indexed by their sequence number. This ring is maintained in the
+//      per-socket data structure. When receive N+1 completes, its buffer is
+//      stored in slot N+1 of the ring even though receive N has not completed.
+//      Once receive N completes, its buffer is stored in slot N. Another routine
+//      (DoSends) sends the buffers starting at the slot of the next sequence
+//      number to send for as long as the slots are filled. If any gaps are
+//      detected no further buffers are sent (as we will wait for that receive
+//      to complete and fill its slot so that the next call to DoSends will
+//      correctly send the buffers in the right order). A receive is not reposted
+//      while the ring has no free slot for its sequence number; it is parked
+//      until DoSends has drained enough of the ring.
 //
 //      For example:
 //          If this sample is called with the following command lines:
@@ -64,40 +85,63 @@
 //          listens both IPv4 and IPv6 (if installed).
 //
 // Compile:
-//      cl -o iocpserver.exe iocpserver.cpp resolve.cpp ws2_32.lib
+//      cl -D_WIN32_WINNT=0x0600 -o iocpserver.exe iocpserver.cpp proactor.cpp resolve.cpp stats.cpp ws2_32.lib
+//
+//      Needs the Windows Vista SDK or later and runs on Windows Vista or
+//      Windows Server 2008 or later (the makefile sets APPVER=6.0), as the
+//      completions are dequeued in batches with GetQueuedCompletionStatusEx.
+//
+//      On Linux (io_uring needs kernel 5.11, otherwise epoll is used) run
+//      make, which reads GNUmakefile, or:
+//      g++ -O2 -o iocpserver iocpserver.cpp proactor.cpp uring.cpp epoll.cpp resolve.cpp stats.cpp -lpthread
 //
 // Usage:
 //      iocpserver.exe [options]
 //          -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]
 //          -b size    Buffer size for send/recv
 //          -e port    Port number
+//          -f file    Append latency percentiles to file (comma separated)
+//          -g bytes   Maximum bytes gathered into one send (0 = no gathering)
 //          -l addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]
 //          -p proto   Which protocol to use [default = TCP]
 //              tcp         Use TCP
 //              udp         Use UDP
+//          -q queue   Completion queue on Linux [default = io_uring, else epoll]
+//              uring       Use io_uring
+//              epoll       Use epoll
+//          -zc bytes  Send without copying on connections receiving this much at once
 //
 
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <mswsock.h>
-#include <windows.h>
+#include "compat.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "proactor.h"
 #include "resolve.h"
+#include "stats.h"
 
 #define DEFAULT_BUFFER_SIZE         4096   // default buffer size
 #define DEFAULT_OVERLAPPED_COUNT    5      // Number of overlapped recv per socket
 #define MAX_COMPLETION_THREAD_COUNT 32     // Maximum number of completion threads allowed
+#define DEFAULT_GATHER_BYTES        65536  // Maximum bytes gathered into one send
+#define MAX_GATHER_BUFFERS          16     // Maximum buffers gathered into one send
 
 int gAddressFamily = AF_UNSPEC,         // default to unspecified
     gSocketType    = SOCK_STREAM,       // default to TCP socket type
     gProtocol      = IPPROTO_TCP,       // default to TCP protocol
     gBufferSize    = DEFAULT_BUFFER_SIZE,
-    gOverlappedCount = DEFAULT_OVERLAPPED_COUNT;
+    gOverlappedCount = DEFAULT_OVERLAPPED_COUNT,
+    gMaxGatherBytes  = DEFAULT_GATHER_BYTES,
+    gZeroCopyThreshold = 0,             // Receive size which switches a connection to zero copy sends
+    gProactorBackend = PROACTOR_DEFAULT; // Completion queue backend (-q)
+
+ULONG gSendRingSize = 0;                // Slots in each socket's send ring (power of two)
 
 char *gBindAddr    = NULL,              // local interface to bind to
-     *gBindPort    = "5150";            // local port to bind to
+     *gBindPort    = "5150",            // local port to bind to
+     *gLatencyFile = NULL;              // file latency percentiles are written to
+
+FILE *gLatencyFp   = NULL;
 
 //
 // This is our per I/O buffer. It contains a WSAOVERLAPPED structure as well
@@ -122,7 +166,11 @@ typedef struct _BUFFER_OBJ
 
     ULONG                IoOrder;       // Order in which this I/O was posted
 
-    struct _BUFFER_OBJ  *next;
+    LONGLONG             QueuedTime,    // When the data to echo was received (performance counter)
+                         PostTime;      // When the operation was posted (performance counter)
+
+    struct _BUFFER_OBJ  *next,
+                        *GatherNext;    // Next buffer sent with the same WSASend
 
 } BUFFER_OBJ;
 
@@ -135,7 +183,8 @@ typedef struct _SOCKET_OBJ
     SOCKET               s;              // Socket handle
 
     int                  af,             // Address family of socket (AF_INET, AF_INET6)
-                         bClosing;       // Is the socket closing?
+                         bClosing,       // Is the socket closing?
+                         bZeroCopy;      // Has the send buffer been disabled (SO_SNDBUF 0)?
 
     volatile LONG        OutstandingOps; // Number of outstanding overlapped ops on 
                                          //    socket
@@ -144,13 +193,17 @@ typedef struct _SOCKET_OBJ
                                          //   (used for listening sockets only)
 
     ULONG                LastSendIssued, // Last sequence number sent
-                         IoCountIssued;  // Next sequence number assigned to receives
-    BUFFER_OBJ          *OutOfOrderSends;// List of send buffers that completed out of order
+                         IoCountIssued,  // Next sequence number assigned to receives
+                         SendRingCount;  // Number of buffers waiting in SendRing
+    BUFFER_OBJ         **SendRing,       // Completed receives indexed by sequence number
+                        *DeferredRecvs;  // Receives waiting for a free slot in SendRing
 
+#ifdef _WIN32
     // Pointers to Microsoft specific extensions. These are used by listening
     //   sockets only
     LPFN_ACCEPTEX        lpfnAcceptEx;
     LPFN_GETACCEPTEXSOCKADDRS lpfnGetAcceptExSockaddrs;
+#endif
 
     CRITICAL_SECTION     SockCritSec;    // Protect access to this structure
 
@@ -158,14 +211,30 @@ typedef struct _SOCKET_OBJ
 } SOCKET_OBJ;
 
 //
-// Statistics counters
+// Statistics counters. These are kept per thread (see stats.h) and summed
+//    when printed.
+//
+#define STAT_BYTES_READ     0
+#define STAT_BYTES_SENT     1
+#define STAT_SENDS_POSTED   2
+#define STAT_BUFFERS_SENT   3
+#define STAT_ZEROCOPY_BYTES 4           // Bytes sent directly from the receive buffers
+
+//
+// Latency histograms
 //
-volatile LONG gBytesRead=0,
-              gBytesSent=0,
-              gStartTime=0,
-              gBytesReadLast=0,
+#define HIST_ACCEPT         0           // AcceptEx posted until completed
+#define HIST_TURNAROUND     1           // Receive completed until echoed back
+#define HIST_SEND           2           // WSASend posted until completed
+
+volatile LONG gStartTime=0,
+              gStartTimeLast=0,
+              gZeroCopyConnections=0;   // Connections whose sends bypass the send buffer
+
+ULONGLONG     gBytesReadLast=0,         // Counter values at the start of the interval
               gBytesSentLast=0,
-              gStartTimeLast=0;
+              gSendsPostedLast=0,
+              gBuffersSentLast=0;
 
 //
 // Function: usage
@@ -180,10 +249,15 @@ void usage(char *progname)
     fprintf(stderr, "  -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]\n"
                     "  -b size    Buffer size for send/recv [default = %d]\n"
                     "  -e port    Port number [default = %s]\n"
+                    "  -f file    Append latency percentiles to file (comma separated)\n"
+                    "  -g bytes   Maximum bytes gathered into one send [default = %d, 0 = no gathering]\n"
                     "  -l addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]\n"
-                    "  -p tcp|udp Which protocol to use [default = TCP]\n",
+                    "  -p tcp|udp Which protocol to use [default = TCP]\n"
+                    "  -q uring|epoll Completion queue on Linux [default = io_uring, else epoll]\n"
+                    "  -zc bytes  Send without copying on connections receiving this much at once\n",
                     gBufferSize,
-                    gBindPort
+                    gBindPort,
+                    gMaxGatherBytes
                     );
     ExitProcess(-1);
 }
@@ -245,13 +319,23 @@ BUFFER_OBJ *GetBufferObj(SOCKET_OBJ *sock, int buflen)
 // Function: FreeBufferObj
 // 
 // Description:
-//    Free the buffer object. To increase performance, a lookaside list should be
-//    implemented to cache BUFFER_OBJ when freed.
+//    Free the buffer object along with any buffers gathered into the same send.
+//    To increase performance, a lookaside list should be implemented to cache
+//    BUFFER_OBJ when freed.
 //
 void FreeBufferObj(BUFFER_OBJ *obj)
 {
-    HeapFree(GetProcessHeap(), 0, obj->buf);
-    HeapFree(GetProcessHeap(), 0, obj);
+    BUFFER_OBJ *next=NULL;
+
+    while (obj)
+    {
+        next = obj->GatherNext;
+
+        HeapFree(GetProcessHeap(), 0, obj->buf);
+        HeapFree(GetProcessHeap(), 0, obj);
+
+        obj = next;
+    }
 }
 
 //
@@ -282,6 +366,15 @@ SOCKET_OBJ *GetSocketObj(SOCKET s, int af)
     //    to receive data
     sockobj->IoCountIssued = ((gProtocol == IPPROTO_TCP) ? 1 : 0);
 
+    // Allocate the ring which holds completed receives until they can be
+    //    echoed in order
+    sockobj->SendRing = (BUFFER_OBJ **)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BUFFER_OBJ *) * gSendRingSize);
+    if (sockobj->SendRing == NULL)
+    {
+        fprintf(stderr, "GetSocketObj: HeapAlloc failed: %d\n", GetLastError());
+        ExitProcess(-1);
+    }
+
     InitializeCriticalSection(&sockobj->SockCritSec);
 
     return sockobj;
@@ -298,6 +391,7 @@ void FreeSocketObj(SOCKET_OBJ *obj)
 {
     BUFFER_OBJ  *ptr=NULL,
                 *tmp=NULL;
+    ULONG        i;
 
     if (obj->OutstandingOps != 0)
     {
@@ -311,6 +405,25 @@ void FreeSocketObj(SOCKET_OBJ *obj)
         obj->s = INVALID_SOCKET;
     }
 
+    // Free any buffers that were never echoed
+    for(i=0; i < gSendRingSize ;i++)
+    {
+        if (obj->SendRing[i])
+            FreeBufferObj(obj->SendRing[i]);
+    }
+    HeapFree(GetProcessHeap(), 0, obj->SendRing);
+
+    ptr = obj->DeferredRecvs;
+    while (ptr)
+    {
+        tmp = ptr->next;
+        FreeBufferObj(ptr);
+        ptr = tmp;
+    }
+
+    if (obj->bZeroCopy)
+        InterlockedDecrement(&gZeroCopyConnections);
+
     DeleteCriticalSection(&obj->SockCritSec);
 
     HeapFree(GetProcessHeap(), 0, obj);
@@ -356,6 +469,16 @@ void ValidateArgs(int argc, char **argv)
                         usage(argv[0]);
                     gBindPort = argv[++i];
                     break;
+                case 'f':               // latency output file
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gLatencyFile = argv[++i];
+                    break;
+                case 'g':               // gather byte limit
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gMaxGatherBytes = atol(argv[++i]);
+                    break;
                 case 'l':               // local address for binding
                     if (i+1 >= argc)
                         usage(argv[0]);
@@ -383,6 +506,22 @@ void ValidateArgs(int argc, char **argv)
                         usage(argv[0]);
                     i++;
                     break;
+                case 'q':               // completion queue backend
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (_strnicmp(argv[i+1], "uring", 5) == 0)
+                        gProactorBackend = PROACTOR_URING;
+                    else if (_strnicmp(argv[i+1], "epoll", 5) == 0)
+                        gProactorBackend = PROACTOR_EPOLL;
+                    else
+                        usage(argv[0]);
+                    i++;
+                    break;
+                case 'z':               // zero copy sends
+                    if ((i+1 >= argc) || (strlen(argv[i]) != 3) || (tolower(argv[i][2]) != 'c'))
+                        usage(argv[0]);
+                    gZeroCopyThreshold = atol(argv[++i]);
+                    break;
                 default:
                     usage(argv[0]);
                     break;
@@ -399,7 +538,11 @@ void ValidateArgs(int argc, char **argv)
 //
 void PrintStatistics()
 {
-    ULONG       bps, tick, elapsed;
+    ULONGLONG   BytesRead,
+                BytesSent,
+                SendsPosted,
+                BuffersSent;
+    ULONG       tick, elapsed;
 
     tick = GetTickCount();
 
@@ -408,14 +551,28 @@ void PrintStatistics()
     if (elapsed == 0)
         return;
 
+    BytesRead   = StatsRead(STAT_BYTES_READ);
+    BytesSent   = StatsRead(STAT_BYTES_SENT);
+    SendsPosted = StatsRead(STAT_SENDS_POSTED);
+    BuffersSent = StatsRead(STAT_BUFFERS_SENT);
+
     printf("\n");
 
     // Calculate average bytes per second
-    bps = gBytesSent / elapsed;
-    printf("Average BPS sent: %lu [%lu]\n", bps, gBytesSent);
+    printf("Average BPS sent: %" FMT_I64U " [%" FMT_I64U "]\n", BytesSent / elapsed, BytesSent);
+    printf("Average BPS read: %" FMT_I64U " [%" FMT_I64U "]\n", BytesRead / elapsed, BytesRead);
 
-    bps = gBytesRead / elapsed;
-    printf("Average BPS read: %lu [%lu]\n", bps, gBytesRead);
+    StatsPrintLatency(HIST_ACCEPT,     "Accept");
+    StatsPrintLatency(HIST_TURNAROUND, "Turnaround");
+    StatsPrintLatency(HIST_SEND,       "Send");
+
+    if (gLatencyFp)
+    {
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_ACCEPT,     "accept");
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_TURNAROUND, "turnaround");
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_SEND,       "send");
+        fflush(gLatencyFp);
+    }
 
     elapsed = (tick - gStartTimeLast) / 1000;
 
@@ -423,14 +580,30 @@ void PrintStatistics()
         return;
 
     // Calculate bytes per second over the last X seconds
-    bps = gBytesSentLast / elapsed;
-    printf("Current BPS sent: %lu\n", bps);
+    printf("Current BPS sent: %" FMT_I64U "\n", (BytesSent - gBytesSentLast) / elapsed);
+    printf("Current BPS read: %" FMT_I64U "\n", (BytesRead - gBytesReadLast) / elapsed);
+
+    // Show how many echoed buffers went out with each WSASend
+    if (SendsPosted > gSendsPostedLast)
+    {
+        printf("Buffers per send: %" FMT_I64U ".%02" FMT_I64U "\n",
+                (BuffersSent - gBuffersSentLast) / (SendsPosted - gSendsPostedLast),
+                (((BuffersSent - gBuffersSentLast) % (SendsPosted - gSendsPostedLast)) * 100) / (SendsPosted - gSendsPostedLast)
+                );
+    }
 
-    bps = gBytesReadLast / elapsed;
-    printf("Current BPS read: %lu\n", bps);
+    if (gZeroCopyThreshold > 0)
+    {
+        printf("Zero copy: %" FMT_I64U " bytes sent on %lu connections\n",
+                StatsRead(STAT_ZEROCOPY_BYTES),
+                gZeroCopyConnections
+                );
+    }
 
-    InterlockedExchange(&gBytesSentLast, 0);
-    InterlockedExchange(&gBytesReadLast, 0);
+    gBytesSentLast   = BytesSent;
+    gBytesReadLast   = BytesRead;
+    gSendsPostedLast = SendsPosted;
+    gBuffersSentLast = BuffersSent;
 
     gStartTimeLast = tick;
 }
@@ -444,8 +617,6 @@ void PrintStatistics()
 int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
 {
     WSABUF  wbuf;
-    DWORD   bytes,
-            flags;
     int     rc;
 
 
@@ -454,8 +625,6 @@ int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
     wbuf.buf = recvobj->buf;
     wbuf.len = recvobj->buflen;
 
-    flags = 0;
-
     EnterCriticalSection(&sock->SockCritSec);
 
     // Assign the IO order to this receive. This must be performned within
@@ -466,28 +635,19 @@ int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
 
     if (gProtocol == IPPROTO_TCP)
     {
-        rc = WSARecv(
-                sock->s,
-               &wbuf,
-                1,
-               &bytes,
-               &flags,
-               &recvobj->ol,
-                NULL
-                );
+        rc = ProactorRecv(sock->s, &wbuf, 1, NULL, NULL, &recvobj->ol);
     }
     else
     {
-        rc = WSARecvFrom(
+        recvobj->addrlen = sizeof(recvobj->addr);
+
+        rc = ProactorRecv(
                 sock->s,
                &wbuf,
                 1,
-               &bytes,
-               &flags,
                 (SOCKADDR *)&recvobj->addr,
                &recvobj->addrlen,
-               &recvobj->ol,
-                NULL
+               &recvobj->ol
                 );
     }
 
@@ -495,11 +655,8 @@ int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
 
     if (rc == SOCKET_ERROR)
     {
-        if (WSAGetLastError() != WSA_IO_PENDING)
-        {
-            dbgprint("PostRecv: WSARecv* failed: %d\n", WSAGetLastError());
-            return SOCKET_ERROR;
-        }
+        dbgprint("PostRecv: ProactorRecv failed: %d\n", WSAGetLastError());
+        return SOCKET_ERROR;
     }
 
     // Increment outstanding overlapped operations
@@ -512,49 +669,48 @@ int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
 // Function: PostSend
 // 
 // Description:
-//    Post an overlapped send operation on the socket.
+//    Post an overlapped send operation on the socket. If other buffers are
+//    chained to the send object through GatherNext they are all sent with
+//    a single WSASend.
 //
 int PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj)
 {
-    WSABUF  wbuf;
-    DWORD   bytes;
-    int     rc;
+    BUFFER_OBJ *ptr=NULL;
+    WSABUF      wbuf[MAX_GATHER_BUFFERS];
+    DWORD       count;
+    int         rc;
 
     sendobj->operation = OP_WRITE;
 
-    wbuf.buf = sendobj->buf;
-    wbuf.len = sendobj->buflen;
+    count = 0;
+    for(ptr=sendobj; (ptr) && (count < MAX_GATHER_BUFFERS) ;ptr=ptr->GatherNext)
+    {
+        wbuf[count].buf = ptr->buf;
+        wbuf[count].len = ptr->buflen;
+        count++;
+    }
+
+    sendobj->PostTime = StatsTimestamp();
 
     EnterCriticalSection(&sock->SockCritSec);
 
     // Incrmenting the last send issued and issuing the send should not be
-    //    interuptable.
-    sock->LastSendIssued++;
+    //    interuptable. Each buffer gathered into this send counts.
+    sock->LastSendIssued += count;
 
     if (gProtocol == IPPROTO_TCP)
     {
-        rc = WSASend(
-                sock->s,
-               &wbuf,
-                1,
-               &bytes,
-                0,
-               &sendobj->ol,
-                NULL
-                );
+        rc = ProactorSend(sock->s, wbuf, count, NULL, 0, &sendobj->ol);
     }
     else
     {
-        rc = WSASendTo(
+        rc = ProactorSend(
                 sock->s,
-               &wbuf,
-                1,
-               &bytes,
-                0,
+                wbuf,
+                count,
                 (SOCKADDR *)&sendobj->addr,
                 sendobj->addrlen,
-               &sendobj->ol,
-                NULL
+               &sendobj->ol
                 );
     }
 
@@ -562,13 +718,13 @@ int PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj)
 
     if (rc == SOCKET_ERROR)
     {
-        if (WSAGetLastError() != WSA_IO_PENDING)
-        {
-            dbgprint("PostSend: WSASend* failed: %d\n", WSAGetLastError());
-            return SOCKET_ERROR;
-        }
+        dbgprint("PostSend: ProactorSend failed: %d\n", WSAGetLastError());
+        return SOCKET_ERROR;
     }
 
+    StatsAdd(STAT_SENDS_POSTED, 1);
+    StatsAdd(STAT_BUFFERS_SENT, count);
+
     // Increment the outstanding operation count
     InterlockedIncrement(&sock->OutstandingOps);
 
@@ -579,15 +735,20 @@ int PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj)
 // Function: PostAccept
 // 
 // Description:
-//    Post an overlapped accept on a listening socket.
+//    Post an overlapped accept on a listening socket. On Linux the client
+//    socket is only created once the connection has been accepted.
 //
 int PostAccept(SOCKET_OBJ *sock, BUFFER_OBJ *acceptobj)
 {
+#ifdef _WIN32
     DWORD   bytes;
+#endif
     int     rc;
 
     acceptobj->operation = OP_ACCEPT;
 
+#ifdef _WIN32
+
     // Create the client socket for an incoming connection
     acceptobj->sclient = socket(sock->af, SOCK_STREAM, IPPROTO_TCP);
     if (acceptobj->sclient == INVALID_SOCKET)
@@ -596,6 +757,8 @@ int PostAccept(SOCKET_OBJ *sock, BUFFER_OBJ *acceptobj)
         return -1;
     }
 
+    acceptobj->PostTime = StatsTimestamp();
+
     rc = sock->lpfnAcceptEx(
             sock->s,
             acceptobj->sclient,
@@ -615,6 +778,17 @@ int PostAccept(SOCKET_OBJ *sock, BUFFER_OBJ *acceptobj)
             return SOCKET_ERROR;
         }
     }
+#else
+    acceptobj->PostTime = StatsTimestamp();
+
+    rc = ProactorAccept(sock->s, &acceptobj->sclient, &acceptobj->ol);
+    if (rc == SOCKET_ERROR)
+    {
+        dbgprint("PostAccept: ProactorAccept failed: %d\n",
+                WSAGetLastError());
+        return SOCKET_ERROR;
+    }
+#endif
 
     // Increment the outstanding overlapped count for this socket
     InterlockedIncrement(&sock->OutstandingOps);
@@ -626,72 +800,107 @@ int PostAccept(SOCKET_OBJ *sock, BUFFER_OBJ *acceptobj)
 // Function: InsertPendingSend
 // 
 // Description:
-//    This routine inserts a send buffer object into the socket's list
-//    of out of order sends. The routine DoSends will go through this
-//    list to issue those sends that are in the correct order.
+//    This routine stores a send buffer object in the socket's send ring at
+//    the slot for its sequence number. The routine DoSends will go through
+//    the ring to issue those sends that are in the correct order.
 //
 void InsertPendingSend(SOCKET_OBJ *sock, BUFFER_OBJ *send)
 {
-    BUFFER_OBJ *ptr=NULL,
-               *prev=NULL;
-
-
     EnterCriticalSection(&sock->SockCritSec);
 
     send->next = NULL;
 
-    // This loop finds the place to put the send within the list.
-    //    The send list is in the same order as the receives were
-    //    posted.
-    ptr = sock->OutOfOrderSends;
-    while (ptr)
-    {
-        if (send->IoOrder < ptr->IoOrder)
-        {
-            break;
-        }
+    sock->SendRing[send->IoOrder & (gSendRingSize - 1)] = send;
+    sock->SendRingCount++;
 
-        prev = ptr;
-        ptr = ptr->next;
-    }
-    if (prev == NULL)
+    LeaveCriticalSection(&sock->SockCritSec);
+}
+
+//
+// Function: RepostRecv
+//
+// Description:
+//    Post another receive on the socket unless the send ring has no free slot
+//    for the sequence number it would be assigned. In that case the buffer is
+//    parked on the socket and DoSends posts it once the ring drains.
+//
+int RepostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
+{
+    int     rc;
+
+    EnterCriticalSection(&sock->SockCritSec);
+
+    if (sock->IoCountIssued - sock->LastSendIssued >= gSendRingSize)
     {
-        // Inserting at head
-        sock->OutOfOrderSends = send;
-        send->next = ptr;
+        recvobj->next = sock->DeferredRecvs;
+        sock->DeferredRecvs = recvobj;
+
+        rc = NO_ERROR;
     }
     else
     {
-        // Insertion somewhere in the middle
-        prev->next = send;
-        send->next = ptr;
+        rc = PostRecv(sock, recvobj);
     }
 
     LeaveCriticalSection(&sock->SockCritSec);
+
+    return rc;
 }
 
 //
 // Function: DoSends
 //
 // Description:
-//    This routine goes through a socket object's list of out of order send
-//    buffers and sends as many of them up to the current send count. For each
-//    send posted, the LastSendIssued is incremented. This means that the next
-//    buffer sent must have an IO sequence nubmer equal to the LastSendIssued.
-//    This is to preserve the order of data echoed back.
+//    This routine goes through a socket object's send ring and sends as many
+//    buffers as are available in order starting at the slot for LastSendIssued.
+//    For each buffer sent, the LastSendIssued is incremented. This means that the
+//    next buffer sent must have an IO sequence nubmer equal to the LastSendIssued.
+//    This is to preserve the order of data echoed back. For TCP, consecutive
+//    buffers that are ready together are gathered into a single WSASend of
+//    up to gMaxGatherBytes bytes. Receives parked by RepostRecv are posted
+//    again once the ring has room for them.
 //
 int DoSends(SOCKET_OBJ *sock)
 {
-    BUFFER_OBJ *sendobj=NULL;
-    int         ret;
+    BUFFER_OBJ *sendobj=NULL,
+               *last=NULL,
+               *next=NULL;
+    ULONG       mask;
+    int         ret,
+                count,
+                bytes;
 
     ret = NO_ERROR;
+    mask = gSendRingSize - 1;
 
     EnterCriticalSection(&sock->SockCritSec);
 
-    sendobj = sock->OutOfOrderSends;
-    while ((sendobj) && (sendobj->IoOrder == sock->LastSendIssued))
+    sendobj = sock->SendRing[sock->LastSendIssued & mask];
+    while (sendobj)
     {
+        sock->SendRing[sendobj->IoOrder & mask] = NULL;
+        sock->SendRingCount--;
+
+        // Gather the buffers that directly follow this one. Datagrams must
+        //    be sent individually.
+        last  = sendobj;
+        count = 1;
+        bytes = sendobj->buflen;
+        while ((gProtocol == IPPROTO_TCP) &&
+               (count < MAX_GATHER_BUFFERS) &&
+               ((next = sock->SendRing[(last->IoOrder + 1) & mask]) != NULL) &&
+               (bytes + next->buflen <= gMaxGatherBytes))
+        {
+            sock->SendRing[next->IoOrder & mask] = NULL;
+            sock->SendRingCount--;
+
+            last->GatherNext = next;
+            last             = next;
+            bytes           += last->buflen;
+            count++;
+        }
+        last->GatherNext = NULL;
+
         if (PostSend(sock, sendobj) != NO_ERROR)
         {
             FreeBufferObj(sendobj);
@@ -699,7 +908,24 @@ int DoSends(SOCKET_OBJ *sock)
             ret = SOCKET_ERROR;
             break;
         }
-        sock->OutOfOrderSends = sendobj = sendobj->next;
+        sendobj = sock->SendRing[sock->LastSendIssued & mask];
+    }
+
+    // Post the receives that were waiting for room in the ring
+    while ((ret == NO_ERROR) &&
+           (sock->DeferredRecvs) &&
+           (!sock->bClosing) &&
+           (sock->IoCountIssued - sock->LastSendIssued < gSendRingSize))
+    {
+        next = sock->DeferredRecvs;
+        sock->DeferredRecvs = next->next;
+
+        if (PostRecv(sock, next) != NO_ERROR)
+        {
+            FreeBufferObj(next);
+
+            ret = SOCKET_ERROR;
+        }
     }
 
     LeaveCriticalSection(&sock->SockCritSec);
@@ -707,6 +933,41 @@ int DoSends(SOCKET_OBJ *sock)
     return ret;
 }
 
+//
+// Function: CheckZeroCopySend
+//
+// Description:
+//    Called with the size of each TCP receive. Once a connection receives at
+//    least the zero copy threshold (-zc) in one go, its send buffer is set
+//    to zero. From then on Winsock sends straight out of the echoed receive
+//    buffers instead of copying them into the socket's send buffer, and a
+//    send only completes (and its buffer is freed) once the transport no
+//    longer needs the data.
+//
+void CheckZeroCopySend(SOCKET_OBJ *sock, DWORD BytesTransfered)
+{
+    int     optval;
+
+    if ((gZeroCopyThreshold <= 0) ||
+        (gProtocol != IPPROTO_TCP) ||
+        (sock->bZeroCopy) ||
+        (BytesTransfered < (DWORD)gZeroCopyThreshold) )
+    {
+        return;
+    }
+
+    optval = 0;
+    if (setsockopt(sock->s, SOL_SOCKET, SO_SNDBUF, (char *)&optval, sizeof(optval)) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "CheckZeroCopySend: setsockopt SO_SNDBUF failed: %d\n", WSAGetLastError());
+        return;
+    }
+
+    // Only counted (and uncounted when freed) once the option is set
+    sock->bZeroCopy = TRUE;
+    InterlockedIncrement(&gZeroCopyConnections);
+}
+
 //
 // Function: HandleIo
 //
@@ -715,7 +976,7 @@ int DoSends(SOCKET_OBJ *sock)
 //    completed receive is posted again. For completed accepts, another AcceptEx
 //    is posted. For completed sends, the buffer is freed.
 //
-void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTransfered, DWORD error)
+void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, PROACTOR *proactor, DWORD BytesTransfered, DWORD error)
 {
     SOCKET_OBJ *clientobj=NULL;     // New client object for accepted connections
     BUFFER_OBJ *recvobj=NULL,       // Used to post new receives on accepted connections
@@ -748,16 +1009,16 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
     EnterCriticalSection(&sock->SockCritSec);
     if (buf->operation == OP_ACCEPT)
     {
-        HANDLE            hrc;
+        // Update counters
+        StatsAdd(STAT_BYTES_READ, BytesTransfered);
+        StatsRecordLatency(HIST_ACCEPT, buf->PostTime);
+
+#ifdef _WIN32
         SOCKADDR_STORAGE *LocalSockaddr=NULL,
                          *RemoteSockaddr=NULL;
         int               LocalSockaddrLen,
                           RemoteSockaddrLen;
 
-        // Update counters
-        InterlockedExchangeAdd(&gBytesRead, BytesTransfered);
-        InterlockedExchangeAdd(&gBytesReadLast, BytesTransfered);
-
         // Print the client's addresss
         sock->lpfnGetAcceptExSockaddrs(
                 buf->buf,
@@ -775,29 +1036,25 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
         PrintAddress((SOCKADDR *)RemoteSockaddr, RemoteSockaddrLen);
         printf("\n");
         */
+#endif
 
         // Get a new SOCKET_OBJ for the client connection
         clientobj = GetSocketObj(buf->sclient, sock->af);
 
-        // Associate the new connection to our completion port
-        hrc = CreateIoCompletionPort(
-                (HANDLE)buf->sclient,
-                CompPort,
-                (ULONG_PTR)clientobj,
-                0
-                );
-        if (hrc == NULL)
+        // Associate the new connection to our completion queue
+        if (ProactorAssociate(proactor, buf->sclient, (ULONG_PTR)clientobj) == SOCKET_ERROR)
         {
-            fprintf(stderr, "CompletionThread: CreateIoCompletionPort failed: %d\n",
-                    GetLastError());
             return;
         }
 
+        CheckZeroCopySend(clientobj, BytesTransfered);
+
         // Get a BUFFER_OBJ to echo the data received with the accept back to the client
         sendobj = GetBufferObj(clientobj, BytesTransfered);
 
         // Copy the buffer to the sending object
         memcpy(sendobj->buf, buf->buf, BytesTransfered);
+        sendobj->QueuedTime = StatsTimestamp();
 
         // Post the send
         if (PostSend(clientobj, sendobj) == NO_ERROR)
@@ -848,8 +1105,9 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
         //
         if ((BytesTransfered > 0) || (gProtocol == IPPROTO_UDP))
         {
-            InterlockedExchangeAdd(&gBytesRead, BytesTransfered);
-            InterlockedExchangeAdd(&gBytesReadLast, BytesTransfered);
+            StatsAdd(STAT_BYTES_READ, BytesTransfered);
+
+            CheckZeroCopySend(sock, BytesTransfered);
 
             // Create a buffer to send
             sendobj = GetBufferObj(sock, gBufferSize);
@@ -864,6 +1122,7 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
             sendobj->buflen  = BytesTransfered;
             sendobj->buf     = buf->buf;
             sendobj->IoOrder = buf->IoOrder;
+            sendobj->QueuedTime = StatsTimestamp();
 
             buf->buf    = tmp;
             buf->buflen = gBufferSize;
@@ -877,7 +1136,7 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
             else
             {
                 // Post another receive
-                if (PostRecv(sock, buf) != NO_ERROR)
+                if (RepostRecv(sock, buf) != NO_ERROR)
                 {
                     // In the event the recv fails, clean up the connection
                     FreeBufferObj(buf);
@@ -902,7 +1161,7 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
             }
 
             // If this was the last outstanding operation on socket, clean it up
-            if ((sock->OutstandingOps == 0) && (sock->OutOfOrderSends == NULL))
+            if ((sock->OutstandingOps == 0) && (sock->SendRingCount == 0))
             {
                 dbgprint("1: cleaning up in zero byte handler\n");
                 bCleanupSocket = TRUE;
@@ -920,8 +1179,14 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
     else if (buf->operation == OP_WRITE)
     {
         // Update the counters
-        InterlockedExchangeAdd(&gBytesSent, BytesTransfered);
-        InterlockedExchangeAdd(&gBytesSentLast, BytesTransfered);
+        StatsAdd(STAT_BYTES_SENT, BytesTransfered);
+        if (sock->bZeroCopy)
+            StatsAdd(STAT_ZEROCOPY_BYTES, BytesTransfered);
+        StatsRecordLatency(HIST_SEND, buf->PostTime);
+        for(sendobj=buf; sendobj ;sendobj=sendobj->GatherNext)
+        {
+            StatsRecordLatency(HIST_TURNAROUND, sendobj->QueuedTime);
+        }
 
         FreeBufferObj(buf);
 
@@ -942,7 +1207,7 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
     //
     if ( (InterlockedDecrement(&sock->OutstandingOps) == 0) &&
          (sock->bClosing) &&
-         (sock->OutOfOrderSends == NULL) )
+         (sock->SendRingCount == 0) )
     {
         bCleanupSocket = TRUE;
     }
@@ -973,54 +1238,63 @@ void HandleIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTra
 // Description:
 //    This is the completion thread which services our completion port. One of
 //    these threads is created per processor on the system. The thread sits in 
-//    an infinite loop calling GetQueuedCompletionStatus and handling socket
-//    IO that completed.
+//    an infinite loop dequeuing batches of completed socket IO and handling
+//    each of them.
 //
 DWORD WINAPI CompletionThread(LPVOID lpParam)
 {
-    SOCKET_OBJ  *sockobj=NULL;          // Per socket object for completed I/O
-    BUFFER_OBJ  *bufobj=NULL;           // Per I/O object for completed I/O
-    OVERLAPPED  *lpOverlapped=NULL;     // Pointer to overlapped structure for completed I/O
-    HANDLE       CompletionPort;        // Completion port handle
-    DWORD        BytesTransfered,       // Number of bytes transfered
-                 Flags;                 // Flags for completed I/O
-    int          rc, 
-                 error;
-
-    CompletionPort = (HANDLE)lpParam;
+    PROACTOR       *proactor;           // Completion queue
+    PROACTOR_EVENT  events[MAX_PROACTOR_BATCH], // Completed I/O
+                   *event;
+    SOCKET_OBJ     *sockobj=NULL;       // Per socket object for completed I/O
+    BUFFER_OBJ     *bufobj=NULL;        // Per I/O object for completed I/O
+    DWORD           BytesTransfered,    // Number of bytes transfered
+                    Flags;              // Flags for completed I/O
+    int             rc, 
+                    error,
+                    count,
+                    i;
+
+    proactor = (PROACTOR *)lpParam;
     while (1)
     {
-        error = NO_ERROR;
-        rc = GetQueuedCompletionStatus(
-                CompletionPort,
-               &BytesTransfered,
-                (PULONG_PTR)&sockobj,
-               &lpOverlapped,
-                INFINITE
-                );
-
-        bufobj = CONTAINING_RECORD(lpOverlapped, BUFFER_OBJ, ol);
-
-        if (rc == FALSE)
+        count = ProactorGetCompletions(proactor, events, MAX_PROACTOR_BATCH, INFINITE);
+        if (count == SOCKET_ERROR)
         {
-            // If the call fails, call WSAGetOverlappedResult to translate the
-            //    error code into a Winsock error code.
-            dbgprint("CompletionThread: GetQueuedCompletionStatus failed: %d\n",
+            fprintf(stderr, "CompletionThread: ProactorGetCompletions failed: %d\n",
                     GetLastError());
-            rc = WSAGetOverlappedResult(
-                    sockobj->s,
-                   &bufobj->ol,
-                   &BytesTransfered,
-                    FALSE,
-                   &Flags
-                    );
-            if (rc == FALSE)
+            break;
+        }
+
+        for(i=0; i < count ;i++)
+        {
+            event           = &events[i];
+            sockobj         = (SOCKET_OBJ *)event->Key;
+            bufobj          = CONTAINING_RECORD(event->lpOverlapped, BUFFER_OBJ, ol);
+            BytesTransfered = event->BytesTransfered;
+            error           = NO_ERROR;
+
+            if (event->Error != NO_ERROR)
             {
-                error = WSAGetLastError();
+                // If the operation failed, call WSAGetOverlappedResult to translate the
+                //    error code into a Winsock error code.
+                dbgprint("CompletionThread: operation failed: 0x%x\n",
+                        event->Error);
+                rc = WSAGetOverlappedResult(
+                        sockobj->s,
+                       &bufobj->ol,
+                       &BytesTransfered,
+                        FALSE,
+                       &Flags
+                        );
+                if (rc == FALSE)
+                {
+                    error = WSAGetLastError();
+                }
             }
+            // Handle the IO operation
+            HandleIo(sockobj, bufobj, proactor, BytesTransfered, error);
         }
-        // Handle the IO operation
-        HandleIo(sockobj, bufobj, CompletionPort, BytesTransfered, error);
     }
 
     ExitThread(0);
@@ -1044,9 +1318,8 @@ int __cdecl main(int argc, char **argv)
     SYSTEM_INFO      sysinfo;
     SOCKET_OBJ      *sockobj=NULL,
                     *ListenSockets=NULL;
-    HANDLE           CompletionPort,
-                     CompThreads[MAX_COMPLETION_THREAD_COUNT],
-                     hrc;
+    PROACTOR        *proactor=NULL;
+    HANDLE           CompThreads[MAX_COMPLETION_THREAD_COUNT];
     int              endpointcount=0,
                      interval,
                      rc,
@@ -1057,6 +1330,32 @@ int __cdecl main(int argc, char **argv)
     // Validate the command line
     ValidateArgs(argc, argv);
 
+    // Size the send ring so every receive posted can hold a slot while
+    //    the sends ahead of it are still outstanding
+    for(gSendRingSize=2; gSendRingSize < (ULONG)(gOverlappedCount * 2) ;gSendRingSize <<= 1)
+        ;
+
+    StatsInit();
+
+    // A receive never returns more than a buffer
+    if (gZeroCopyThreshold > gBufferSize)
+    {
+        fprintf(stderr, "zero copy threshold %d exceeds the buffer size, using %d\n",
+                gZeroCopyThreshold, gBufferSize);
+        gZeroCopyThreshold = gBufferSize;
+    }
+
+    if (gLatencyFile)
+    {
+        gLatencyFp = fopen(gLatencyFile, "a");
+        if (gLatencyFp == NULL)
+        {
+            fprintf(stderr, "unable to open %s\n", gLatencyFile);
+            return -1;
+        }
+        fprintf(gLatencyFp, "seconds,operation,count,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    }
+
     // Load Winsock
     if (WSAStartup(MAKEWORD(2,2), &wsd) != 0)
     {
@@ -1064,13 +1363,13 @@ int __cdecl main(int argc, char **argv)
         return -1;
     }
 
-    // Create the completion port used by this server
-    CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, (ULONG_PTR)NULL, 0);
-    if (CompletionPort == NULL)
+    // Create the completion queue used by this server
+    proactor = ProactorCreate(0, gProactorBackend);
+    if (proactor == NULL)
     {
-        fprintf(stderr, "CreateIoCompletionPort failed: %d\n", GetLastError());
         return -1;
     }
+    printf("Completion queue: %s\n", ProactorName(proactor));
 
     // Find out how many processors are on this system
     GetSystemInfo(&sysinfo);
@@ -1083,7 +1382,7 @@ int __cdecl main(int argc, char **argv)
     // Create the worker threads to service the completion notifications
     for(i=0; i < (int)sysinfo.dwNumberOfProcessors ;i++)
     {
-        CompThreads[i] = CreateThread(NULL, 0, CompletionThread, (LPVOID)CompletionPort, 0, NULL);
+        CompThreads[i] = CreateThread(NULL, 0, CompletionThread, (LPVOID)proactor, 0, NULL);
         if (CompThreads[i] == NULL)
         {
             fprintf(stderr, "CreatThread failed: %d\n", GetLastError());
@@ -1117,14 +1416,38 @@ int __cdecl main(int argc, char **argv)
             return -1;
         }
 
-        // Associate the socket and its SOCKET_OBJ to the completion port
-        hrc = CreateIoCompletionPort((HANDLE)sockobj->s, CompletionPort, (ULONG_PTR)sockobj, 0);
-        if (hrc == NULL)
+        // Associate the socket and its SOCKET_OBJ to the completion queue
+        if (ProactorAssociate(proactor, sockobj->s, (ULONG_PTR)sockobj) == SOCKET_ERROR)
         {
-            fprintf(stderr, "CreateIoCompletionPort failed: %d\n", GetLastError());
             return -1;
         }
 
+        // IPv4 gets its own socket, as Windows does by default (Linux
+        //    would accept IPv4 on the IPv6 socket and fail the second bind)
+        if (ptr->ai_family == AF_INET6)
+        {
+            int     optval=1;
+
+            if (setsockopt(sockobj->s, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&optval, sizeof(optval)) == SOCKET_ERROR)
+            {
+                fprintf(stderr, "setsockopt: IPV6_V6ONLY failed: %d\n", WSAGetLastError());
+            }
+        }
+
+#ifndef _WIN32
+        // Linux refuses the port while connections of an earlier run are in
+        //    TIME_WAIT (on Windows SO_REUSEADDR lets another socket take the
+        //    port over, so it is not set there)
+        {
+            int     optval=1;
+
+            if (setsockopt(sockobj->s, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) == SOCKET_ERROR)
+            {
+                fprintf(stderr, "setsockopt: SO_REUSEADDR failed: %d\n", WSAGetLastError());
+            }
+        }
+#endif
+
         // bind the socket to a local address and port
         rc = bind(sockobj->s, ptr->ai_addr, ptr->ai_addrlen);
         if (rc == SOCKET_ERROR)
@@ -1136,6 +1459,7 @@ int __cdecl main(int argc, char **argv)
         if (gProtocol == IPPROTO_TCP)
         {
             BUFFER_OBJ *acceptobj=NULL;
+#ifdef _WIN32
             GUID        guidAcceptEx = WSAID_ACCEPTEX,
                         guidGetAcceptExSockaddrs = WSAID_GETACCEPTEXSOCKADDRS;
             DWORD       bytes;
@@ -1176,6 +1500,7 @@ int __cdecl main(int argc, char **argv)
                         WSAGetLastError());
                 return -1;
             }
+#endif
 
             // For TCP sockets, we need to "listen" on them
             rc = listen(sockobj->s, 100);
@@ -1219,6 +1544,7 @@ int __cdecl main(int argc, char **argv)
         else
         {
             BUFFER_OBJ *recvobj=NULL;
+#ifdef _WIN32
             DWORD       bytes;
             int         optval;
 
@@ -1240,6 +1566,7 @@ int __cdecl main(int argc, char **argv)
                 fprintf(stderr, "WSAIoctl: SIO_UDP_CONNRESET failed: %d\n", 
                         WSAGetLastError());
             }
+#endif
 
             // For UDP, simply post some receives
             for(i=0; i < gOverlappedCount ;i++)
@@ -1261,6 +1588,7 @@ int __cdecl main(int argc, char **argv)
     interval = 0;
     while (1)
     {
+#ifdef _WIN32
         rc = WSAWaitForMultipleEvents(
                 sysinfo.dwNumberOfProcessors,
                 CompThreads,
@@ -1268,6 +1596,12 @@ int __cdecl main(int argc, char **argv)
                 5000,
                 FALSE
                 );
+#else
+        // The completion threads are not waited on; they exit the process
+        //    only through a fatal error
+        Sleep(5000);
+        rc = WAIT_TIMEOUT;
+#endif
         if (rc == WAIT_FAILED)
         {
             fprintf(stderr, "WSAWaitForMultipleEvents failed: %d\n", WSAGetLastError());
@@ -1278,7 +1612,9 @@ int __cdecl main(int argc, char **argv)
             interval++;
 
             PrintStatistics();
+            ProactorPrintStatistics(proactor);
 
+#ifdef _WIN32
             if (interval == 12)
             {
                 SOCKET_OBJ  *listenptr=NULL;
@@ -1320,6 +1656,7 @@ int __cdecl main(int argc, char **argv)
                 }
                 interval = 0;
             }
+#endif
         }
     }
 
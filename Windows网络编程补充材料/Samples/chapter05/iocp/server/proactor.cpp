@@ -0,0 +1,704 @@
+//
+// Completion queue (proactor) routines
+//
+// Files:
+//      proactor.cpp    - Completion queue routines
+//      proactor.h      - Header file for the completion queue routines
+//      uring.cpp       - io_uring backend (Linux)
+//      epoll.cpp       - epoll backend (Linux)
+//
+// Description:
+//      This file contains the I/O completion port implementation of the
+//      completion queue used by the server and, on Linux, the routines
+//      which pick the io_uring or epoll backend and hand the operations
+//      to it. See proactor.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include "compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <fcntl.h>
+#endif
+
+#include "proactor.h"
+
+//
+// Function: ProactorCountBatch
+//
+// Description:
+//    Records a batch of completions returned by one dequeue call.
+//
+void ProactorCountBatch(PROACTOR *proactor, int count)
+{
+    LONG    maxbatch;
+
+    InterlockedIncrement(&proactor->DequeueCalls);
+    InterlockedExchangeAdd(&proactor->Completions, count);
+
+    maxbatch = proactor->MaxBatch;
+    while ((LONG)count > maxbatch)
+    {
+        if (InterlockedCompareExchange(&proactor->MaxBatch, count, maxbatch) == maxbatch)
+            break;
+        maxbatch = proactor->MaxBatch;
+    }
+}
+
+#ifdef _WIN32
+
+//
+// Function: ProactorCreate
+//
+// Description:
+//    Creates the completion queue. Concurrency is the number of threads
+//    allowed to process completions at the same time (0 = one per CPU).
+//    The completion port is the only backend on Windows.
+//
+PROACTOR *ProactorCreate(DWORD Concurrency, int Backend)
+{
+    PROACTOR *proactor=NULL;
+
+    if (Backend != PROACTOR_DEFAULT)
+    {
+        fprintf(stderr, "ProactorCreate: only the completion port is available on Windows\n");
+        return NULL;
+    }
+
+    proactor = (PROACTOR *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROACTOR));
+    if (proactor == NULL)
+    {
+        fprintf(stderr, "ProactorCreate: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+
+    proactor->CompletionPort = CreateIoCompletionPort(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            (ULONG_PTR)NULL,
+            Concurrency
+            );
+    if (proactor->CompletionPort == NULL)
+    {
+        fprintf(stderr, "ProactorCreate: CreateIoCompletionPort failed: %d\n", GetLastError());
+        HeapFree(GetProcessHeap(), 0, proactor);
+        return NULL;
+    }
+
+    return proactor;
+}
+
+//
+// Function: ProactorName
+//
+// Description:
+//    Returns the name of the backend, for printing.
+//
+char *ProactorName(PROACTOR *proactor)
+{
+    return "completion port";
+}
+
+//
+// Function: ProactorAssociate
+//
+// Description:
+//    Associates a socket with the completion queue. All operations completing
+//    on the socket are returned with the given key.
+//
+int ProactorAssociate(PROACTOR *proactor, SOCKET s, ULONG_PTR Key)
+{
+    HANDLE  hrc;
+
+    hrc = CreateIoCompletionPort((HANDLE)s, proactor->CompletionPort, Key, 0);
+    if (hrc == NULL)
+    {
+        fprintf(stderr, "ProactorAssociate: CreateIoCompletionPort failed: %d\n",
+                GetLastError());
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorRecv
+//
+// Description:
+//    Posts an overlapped receive into the given buffers. For a datagram
+//    socket from receives the source address; for a stream socket it is
+//    NULL. Returns NO_ERROR if the receive was posted (its completion is
+//    always queued), otherwise SOCKET_ERROR with the error available from
+//    WSAGetLastError.
+//
+int ProactorRecv(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *from, int *fromlen, OVERLAPPED *ol)
+{
+    DWORD   bytes,
+            flags;
+    int     rc;
+
+    flags = 0;
+
+    if (from == NULL)
+        rc = WSARecv(s, bufs, count, &bytes, &flags, ol, NULL);
+    else
+        rc = WSARecvFrom(s, bufs, count, &bytes, &flags, from, fromlen, ol, NULL);
+
+    if ((rc == SOCKET_ERROR) && (WSAGetLastError() != WSA_IO_PENDING))
+    {
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorSend
+//
+// Description:
+//    Posts an overlapped send of the given buffers, to the given address
+//    for a datagram socket (to is NULL for a stream socket). Returns as
+//    ProactorRecv does.
+//
+int ProactorSend(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *to, int tolen, OVERLAPPED *ol)
+{
+    DWORD   bytes;
+    int     rc;
+
+    if (to == NULL)
+        rc = WSASend(s, bufs, count, &bytes, 0, ol, NULL);
+    else
+        rc = WSASendTo(s, bufs, count, &bytes, 0, to, tolen, ol, NULL);
+
+    if ((rc == SOCKET_ERROR) && (WSAGetLastError() != WSA_IO_PENDING))
+    {
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorGetCompletion
+//
+// Description:
+//    Waits for the next completed operation. If the operation itself failed
+//    the event is still returned with its Error field set. SOCKET_ERROR is
+//    only returned when no completion was dequeued (timeout or a failure of
+//    the queue itself).
+//
+int ProactorGetCompletion(PROACTOR *proactor, PROACTOR_EVENT *event, DWORD Timeout)
+{
+    BOOL    rc;
+
+    event->lpOverlapped = NULL;
+    event->Error        = NO_ERROR;
+
+    rc = GetQueuedCompletionStatus(
+            proactor->CompletionPort,
+           &event->BytesTransfered,
+           &event->Key,
+           &event->lpOverlapped,
+            Timeout
+            );
+    if (rc == FALSE)
+    {
+        if (event->lpOverlapped == NULL)
+        {
+            return SOCKET_ERROR;
+        }
+        event->Error = GetLastError();
+    }
+
+    ProactorCountBatch(proactor, 1);
+
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorGetCompletions
+//
+// Description:
+//    Waits for completed operations and returns up to count of them with a
+//    single call into the kernel. Returns the number of events filled in, or
+//    SOCKET_ERROR if nothing was dequeued. As with ProactorGetCompletion the
+//    Error field of each event is set if that particular operation failed.
+//
+int ProactorGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout)
+{
+    OVERLAPPED_ENTRY entries[MAX_PROACTOR_BATCH];
+    ULONG            removed=0,
+                     i;
+    BOOL             rc;
+
+    if (count > MAX_PROACTOR_BATCH)
+        count = MAX_PROACTOR_BATCH;
+
+    rc = GetQueuedCompletionStatusEx(
+            proactor->CompletionPort,
+            entries,
+            count,
+           &removed,
+            Timeout,
+            FALSE
+            );
+    if ((rc == FALSE) || (removed == 0))
+    {
+        return SOCKET_ERROR;
+    }
+
+    for(i=0; i < removed ;i++)
+    {
+        events[i].Key             = entries[i].lpCompletionKey;
+        events[i].lpOverlapped    = entries[i].lpOverlapped;
+        events[i].BytesTransfered = entries[i].dwNumberOfBytesTransferred;
+
+        // The status of each operation is kept in its overlapped structure
+        events[i].Error           = (DWORD)entries[i].lpOverlapped->Internal;
+    }
+
+    ProactorCountBatch(proactor, (int)removed);
+
+    return (int)removed;
+}
+
+#else
+
+PROACTOR_SOCKET *gProactorSockets=NULL; // Associated sockets indexed by descriptor
+int              gProactorSocketCount=0;
+
+//
+// Function: ProactorCreate
+//
+// Description:
+//    Creates the completion queue. By default io_uring is used and epoll
+//    when io_uring cannot be set up (an old kernel, or io_uring disabled);
+//    Backend picks one of them instead. Concurrency is not used on Linux.
+//
+PROACTOR *ProactorCreate(DWORD Concurrency, int Backend)
+{
+    PROACTOR     *proactor=NULL;
+    struct rlimit limit;
+
+    // Size the socket table for every descriptor the process may open
+    if (gProactorSockets == NULL)
+    {
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            fprintf(stderr, "ProactorCreate: getrlimit failed: %d\n", errno);
+            return NULL;
+        }
+        if ((limit.rlim_cur == RLIM_INFINITY) || (limit.rlim_cur > (1 << 24)))
+            limit.rlim_cur = (1 << 24);
+
+        gProactorSocketCount = (int)limit.rlim_cur;
+        gProactorSockets     = (PROACTOR_SOCKET *)calloc(gProactorSocketCount, sizeof(PROACTOR_SOCKET));
+        if (gProactorSockets == NULL)
+        {
+            fprintf(stderr, "ProactorCreate: calloc failed: %d\n", errno);
+            return NULL;
+        }
+    }
+
+    proactor = (PROACTOR *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROACTOR));
+    if (proactor == NULL)
+    {
+        fprintf(stderr, "ProactorCreate: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+    proactor->RingFd  = -1;
+    proactor->EpollFd = -1;
+    proactor->WakeFd  = -1;
+
+    if ((Backend == PROACTOR_DEFAULT) || (Backend == PROACTOR_URING))
+    {
+        if (UringCreate(proactor, 4096) == NO_ERROR)
+        {
+            proactor->Backend = PROACTOR_URING;
+            return proactor;
+        }
+        if (Backend == PROACTOR_URING)
+        {
+            HeapFree(GetProcessHeap(), 0, proactor);
+            return NULL;
+        }
+    }
+
+    if (EpollCreate(proactor) != NO_ERROR)
+    {
+        HeapFree(GetProcessHeap(), 0, proactor);
+        return NULL;
+    }
+    proactor->Backend = PROACTOR_EPOLL;
+
+    return proactor;
+}
+
+//
+// Function: ProactorName
+//
+// Description:
+//    Returns the name of the backend, for printing.
+//
+char *ProactorName(PROACTOR *proactor)
+{
+    if (proactor->Backend == PROACTOR_URING)
+        return "io_uring";
+    return "epoll";
+}
+
+//
+// Function: ProactorGetSocket
+//
+// Description:
+//    Returns the entry of the socket table for the given socket, or NULL if
+//    the descriptor is out of range.
+//
+PROACTOR_SOCKET *ProactorGetSocket(SOCKET s)
+{
+    if ((s < 0) || (s >= gProactorSocketCount))
+        return NULL;
+    return &gProactorSockets[s];
+}
+
+//
+// Function: ProactorAssociate
+//
+// Description:
+//    Associates a socket with the completion queue. All operations completing
+//    on the socket are returned with the given key. No operation may be
+//    outstanding on a descriptor which is associated again after a close.
+//
+int ProactorAssociate(PROACTOR *proactor, SOCKET s, ULONG_PTR Key)
+{
+    PROACTOR_SOCKET *psock=NULL;
+
+    psock = ProactorGetSocket(s);
+    if (psock == NULL)
+    {
+        fprintf(stderr, "ProactorAssociate: socket %d is out of range\n", s);
+        return SOCKET_ERROR;
+    }
+
+    if (psock->bInitialized == FALSE)
+    {
+        pthread_mutex_init(&psock->Lock, NULL);
+        psock->bInitialized = TRUE;
+    }
+
+    psock->proactor = proactor;
+    psock->Key      = Key;
+    psock->RecvHead = psock->RecvTail = NULL;
+    psock->SendHead = psock->SendTail = NULL;
+
+    if ((proactor->Backend == PROACTOR_EPOLL) && (EpollAssociate(proactor, s) != NO_ERROR))
+    {
+        psock->proactor = NULL;
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorPost
+//
+// Description:
+//    Hands a prepared operation to the backend of the completion queue the
+//    socket is associated with.
+//
+int ProactorPost(SOCKET s, OVERLAPPED *ol)
+{
+    PROACTOR_SOCKET *psock=NULL;
+
+    psock = ProactorGetSocket(s);
+    if ((psock == NULL) || (psock->proactor == NULL))
+    {
+        errno = EBADF;
+        return SOCKET_ERROR;
+    }
+
+    ol->s            = s;
+    ol->Key          = psock->Key;
+    ol->Internal     = NO_ERROR;
+    ol->InternalHigh = 0;
+    ol->next         = NULL;
+
+    if (psock->proactor->Backend == PROACTOR_URING)
+        return UringPost(psock->proactor, psock, ol);
+    else
+        return EpollSubmit(psock->proactor, psock, ol);
+}
+
+//
+// Function: ProactorPrepare
+//
+// Description:
+//    Fills in the message header of a send or receive.
+//
+int ProactorPrepare(OVERLAPPED *ol, int Operation, WSABUF *bufs, DWORD count, SOCKADDR *addr, int addrlen)
+{
+    DWORD   i;
+
+    if (count > MAX_PROACTOR_IOV)
+    {
+        errno = EINVAL;
+        return SOCKET_ERROR;
+    }
+
+    ol->Operation = Operation;
+    ol->Accepted  = NULL;
+    ol->AddrLen   = NULL;
+    ol->Length    = 0;
+
+    for(i=0; i < count ;i++)
+    {
+        ol->Iov[i].iov_base = bufs[i].buf;
+        ol->Iov[i].iov_len  = bufs[i].len;
+        ol->Length         += bufs[i].len;
+    }
+
+    memset(&ol->Msg, 0, sizeof(ol->Msg));
+    ol->Msg.msg_name    = addr;
+    ol->Msg.msg_namelen = (addr) ? addrlen : 0;
+    ol->Msg.msg_iov     = ol->Iov;
+    ol->Msg.msg_iovlen  = count;
+
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorRecv
+//
+// Description:
+//    Posts a receive into the given buffers. For a datagram socket from
+//    receives the source address; for a stream socket it is NULL. Returns
+//    NO_ERROR if the receive was posted (its completion is always queued),
+//    otherwise SOCKET_ERROR with the error available from WSAGetLastError.
+//
+int ProactorRecv(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *from, int *fromlen, OVERLAPPED *ol)
+{
+    if (ProactorPrepare(ol, PROACTOR_OP_RECV, bufs, count, from, (from) ? *fromlen : 0) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+
+    ol->AddrLen = (from) ? fromlen : NULL;
+
+    return ProactorPost(s, ol);
+}
+
+//
+// Function: ProactorSend
+//
+// Description:
+//    Posts a send of the given buffers, to the given address for a
+//    datagram socket (to is NULL for a stream socket). As with an
+//    overlapped WSASend, a send on a stream socket only completes once all
+//    of its bytes have been sent (or it failed). Returns as ProactorRecv
+//    does.
+//
+int ProactorSend(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *to, int tolen, OVERLAPPED *ol)
+{
+    if (ProactorPrepare(ol, PROACTOR_OP_SEND, bufs, count, to, tolen) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+
+    return ProactorPost(s, ol);
+}
+
+//
+// Function: ProactorAccept
+//
+// Description:
+//    Posts an accept on a listening socket. Unlike AcceptEx the client
+//    socket is created when the connection arrives and stored in sclient,
+//    and no data is received with the connection.
+//
+int ProactorAccept(SOCKET s, SOCKET *sclient, OVERLAPPED *ol)
+{
+    ProactorPrepare(ol, PROACTOR_OP_ACCEPT, NULL, 0, NULL, 0);
+
+    *sclient     = INVALID_SOCKET;
+    ol->Accepted = sclient;
+
+    return ProactorPost(s, ol);
+}
+
+//
+// Function: ProactorSetResult
+//
+// Description:
+//    Records the result of one attempt at an operation: a negative errno
+//    value or the bytes transfered (the new socket for an accept). A
+//    partial send advances the buffers past the bytes sent; see
+//    ProactorSendPending.
+//
+void ProactorSetResult(OVERLAPPED *ol, int result)
+{
+    struct iovec *iov;
+    size_t        bytes;
+
+    if (result < 0)
+    {
+        ol->Internal = -result;
+        return;
+    }
+
+    if (ol->Operation == PROACTOR_OP_ACCEPT)
+    {
+        *ol->Accepted = result;
+        return;
+    }
+
+    ol->InternalHigh += result;
+
+    if (ol->Operation == PROACTOR_OP_RECV)
+    {
+        if (ol->AddrLen)
+            *ol->AddrLen = ol->Msg.msg_namelen;
+        return;
+    }
+
+    // Skip the buffers (and the part of a buffer) already sent
+    bytes = result;
+    iov   = ol->Msg.msg_iov;
+    while ((ol->Msg.msg_iovlen > 0) && (bytes >= iov->iov_len))
+    {
+        bytes -= iov->iov_len;
+        iov++;
+        ol->Msg.msg_iovlen--;
+    }
+    if (ol->Msg.msg_iovlen > 0)
+    {
+        iov->iov_base  = (char *)iov->iov_base + bytes;
+        iov->iov_len  -= bytes;
+    }
+    ol->Msg.msg_iov = iov;
+}
+
+//
+// Function: ProactorSendPending
+//
+// Description:
+//    Returns TRUE if a stream send has been partly sent and the rest must be
+//    sent before it completes.
+//
+BOOL ProactorSendPending(OVERLAPPED *ol)
+{
+    return ((ol->Operation == PROACTOR_OP_SEND) &&
+            (ol->Msg.msg_name == NULL) &&
+            (ol->Internal == NO_ERROR) &&
+            (ol->InternalHigh > 0) &&
+            (ol->InternalHigh < ol->Length));
+}
+
+//
+// Function: ProactorSetEvent
+//
+// Description:
+//    Fills in the event returned for a completed operation.
+//
+void ProactorSetEvent(PROACTOR_EVENT *event, OVERLAPPED *ol)
+{
+    event->Key             = ol->Key;
+    event->lpOverlapped    = ol;
+    event->BytesTransfered = (DWORD)ol->InternalHigh;
+    event->Error           = (DWORD)ol->Internal;
+}
+
+//
+// Function: WSAGetOverlappedResult
+//
+// Description:
+//    Returns the result of a completed operation as Winsock does, with the
+//    error of a failed operation in errno.
+//
+BOOL WSAGetOverlappedResult(SOCKET s, OVERLAPPED *ol, DWORD *bytes, BOOL wait, DWORD *flags)
+{
+    *bytes = (DWORD)ol->InternalHigh;
+    *flags = 0;
+
+    if (ol->Internal != NO_ERROR)
+    {
+        errno = (int)ol->Internal;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Function: ProactorGetCompletion
+//
+// Description:
+//    Waits for the next completed operation. If the operation itself failed
+//    the event is still returned with its Error field set. SOCKET_ERROR is
+//    only returned when no completion was dequeued (timeout or a failure of
+//    the queue itself).
+//
+int ProactorGetCompletion(PROACTOR *proactor, PROACTOR_EVENT *event, DWORD Timeout)
+{
+    if (ProactorGetCompletions(proactor, event, 1, Timeout) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorGetCompletions
+//
+// Description:
+//    Waits for completed operations and returns up to count of them. Returns
+//    the number of events filled in, or SOCKET_ERROR if nothing was
+//    dequeued. As with ProactorGetCompletion the Error field of each event
+//    is set if that particular operation failed.
+//
+int ProactorGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout)
+{
+    int     removed;
+
+    if (count > MAX_PROACTOR_BATCH)
+        count = MAX_PROACTOR_BATCH;
+
+    if (proactor->Backend == PROACTOR_URING)
+        removed = UringGetCompletions(proactor, events, count, Timeout);
+    else
+        removed = EpollGetCompletions(proactor, events, count, Timeout);
+
+    if ((removed == SOCKET_ERROR) || (removed == 0))
+        return SOCKET_ERROR;
+
+    ProactorCountBatch(proactor, removed);
+
+    return removed;
+}
+
+#endif
+
+//
+// Function: ProactorPrintStatistics
+//
+// Description:
+//    Prints how many completions were harvested per call into the kernel
+//    since the last time this routine was called.
+//
+void ProactorPrintStatistics(PROACTOR *proactor)
+{
+    LONG    calls,
+            completions,
+            maxbatch;
+
+    calls       = InterlockedExchange(&proactor->DequeueCalls, 0);
+    completions = InterlockedExchange(&proactor->Completions, 0);
+    maxbatch    = InterlockedExchange(&proactor->MaxBatch, 0);
+
+    if (calls == 0)
+        return;
+
+    printf("Completions per dequeue: %lu.%02lu (%lu completions, %lu calls, max batch %lu)\n",
+            completions / calls,
+            ((completions % calls) * 100) / calls,
+            completions,
+            calls,
+            maxbatch
+            );
+}
@@ -0,0 +1,185 @@
+//
+// Completion queue (proactor) routines
+//
+// Files:
+//      proactor.h      - Header file for the completion queue routines
+//
+// Description:
+//      This file declares a small abstraction over the completion queue
+//      used by the server. The server posts overlapped operations and
+//      then waits for their completions through these routines only, so
+//      the completion driven state machine in HandleIo does not depend
+//      on how operations are started or how completions are harvested.
+//
+//      On Windows the backend is the I/O completion port. On Linux it is
+//      io_uring (uring.cpp), which runs the receives, sends and accepts
+//      in the kernel and reports each one as a completion just like the
+//      port does. The server relies on the receives of a socket filling
+//      their buffers, and its sends going out, in the order posted (see
+//      iocpserver.cpp). A completion port guarantees that but io_uring
+//      does not, so on Linux the receives and the sends of a socket are
+//      queued on it and only the oldest of each is in the kernel at a
+//      time. Where io_uring is not available the epoll backend
+//      (epoll.cpp) is used instead: the socket is made non-blocking and
+//      the operation is tried right away; if it would block it is queued
+//      on the socket and retried when epoll reports the socket ready. In
+//      both cases the completion is returned by ProactorGetCompletions.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _PROACTOR_H_
+#define _PROACTOR_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define MAX_PROACTOR_BATCH      64      // Most completions dequeued per call
+
+#define PROACTOR_DEFAULT        0       // ProactorCreate backends: best available
+#define PROACTOR_URING          1       // Linux io_uring
+#define PROACTOR_EPOLL          2       // Linux epoll
+
+#ifndef _WIN32
+
+#define MAX_PROACTOR_IOV        16      // Most buffers in one send or receive
+
+#define PROACTOR_OP_RECV        0       // Operation of an OVERLAPPED
+#define PROACTOR_OP_SEND        1
+#define PROACTOR_OP_ACCEPT      2
+
+//
+// The state of an outstanding operation. As on Windows it is embedded in
+//    the per I/O structure of the caller and handed back with the
+//    completion. Internal holds the error and InternalHigh the bytes
+//    transfered once the operation has completed.
+//
+typedef struct _OVERLAPPED
+{
+    ULONG_PTR            Internal,
+                         InternalHigh;
+
+    int                  Operation;     // PROACTOR_OP_*
+    SOCKET               s;             // Socket the operation is posted on
+    ULONG_PTR            Key;           // Completion key of the socket
+    SOCKET              *Accepted;      // Receives the new socket of an accept
+    int                 *AddrLen;       // Receives the length of the source address
+    size_t               Length;        // Bytes to send (a stream send completes when all are sent)
+
+    struct msghdr        Msg;
+    struct iovec         Iov[MAX_PROACTOR_IOV];
+
+    struct _OVERLAPPED  *next;          // Operations queued on a socket
+} OVERLAPPED, WSAOVERLAPPED;
+
+//
+// A socket associated with a completion queue. Indexed by the descriptor.
+//
+typedef struct _PROACTOR_SOCKET
+{
+    struct _PROACTOR    *proactor;
+    ULONG_PTR            Key;
+
+    BOOL                 bInitialized;  // Has Lock been initialized?
+    pthread_mutex_t      Lock;          // Protects the queues
+    OVERLAPPED          *RecvHead,      // Receives (and accepts with epoll) in the order posted
+                        *RecvTail,
+                        *SendHead,      // Sends in the order posted
+                        *SendTail;
+} PROACTOR_SOCKET;
+
+#endif
+
+//
+// The completion queue. For the completion port backend this is simply
+//    the port handle; on Linux it is the io_uring or the epoll instance.
+//
+typedef struct _PROACTOR
+{
+#ifdef _WIN32
+    HANDLE          CompletionPort;
+#else
+    int             Backend;            // PROACTOR_URING or PROACTOR_EPOLL
+
+    // io_uring
+    int             RingFd;
+    unsigned       *SqHead,
+                   *SqTail,
+                   *SqMask,
+                   *SqArray,
+                   *CqHead,
+                   *CqTail,
+                   *CqMask;
+    struct io_uring_sqe *Sqes;
+    struct io_uring_cqe *Cqes;
+    pthread_mutex_t SqLock,             // Serializes the submissions
+                    CqLock;             // Serializes the harvesting
+
+    // epoll
+    int             EpollFd,
+                    WakeFd;             // Eventfd signalled when Done gets entries
+    pthread_mutex_t DoneLock;
+    OVERLAPPED     *DoneHead,           // Operations which completed outside epoll_wait
+                   *DoneTail;
+#endif
+
+    // Batch statistics (see ProactorGetCompletions)
+    volatile LONG   DequeueCalls,       // Number of successful dequeue calls
+                    Completions,        // Completions returned by those calls
+                    MaxBatch;           // Largest batch returned
+} PROACTOR;
+
+//
+// A single completed operation as returned by ProactorGetCompletion
+//
+typedef struct _PROACTOR_EVENT
+{
+    ULONG_PTR       Key;                // Completion key given to ProactorAssociate
+    OVERLAPPED     *lpOverlapped;       // Overlapped structure of the completed I/O
+    DWORD           BytesTransfered;    // Number of bytes transfered
+    DWORD           Error;              // Completion status (NO_ERROR on success)
+} PROACTOR_EVENT;
+
+PROACTOR *ProactorCreate(DWORD Concurrency, int Backend);
+char     *ProactorName(PROACTOR *proactor);
+int       ProactorAssociate(PROACTOR *proactor, SOCKET s, ULONG_PTR Key);
+int       ProactorRecv(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *from, int *fromlen, OVERLAPPED *ol);
+int       ProactorSend(SOCKET s, WSABUF *bufs, DWORD count, SOCKADDR *to, int tolen, OVERLAPPED *ol);
+int       ProactorGetCompletion(PROACTOR *proactor, PROACTOR_EVENT *event, DWORD Timeout);
+int       ProactorGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout);
+void      ProactorPrintStatistics(PROACTOR *proactor);
+
+#ifndef _WIN32
+
+int       ProactorAccept(SOCKET s, SOCKET *sclient, OVERLAPPED *ol);
+BOOL      WSAGetOverlappedResult(SOCKET s, OVERLAPPED *ol, DWORD *bytes, BOOL wait, DWORD *flags);
+
+// Shared by the backends (proactor.cpp)
+PROACTOR_SOCKET *ProactorGetSocket(SOCKET s);
+void      ProactorSetResult(OVERLAPPED *ol, int result);
+BOOL      ProactorSendPending(OVERLAPPED *ol);
+void      ProactorSetEvent(PROACTOR_EVENT *event, OVERLAPPED *ol);
+void      ProactorCountBatch(PROACTOR *proactor, int count);
+
+// io_uring backend (uring.cpp)
+int       UringCreate(PROACTOR *proactor, DWORD entries);
+int       UringPost(PROACTOR *proactor, PROACTOR_SOCKET *psock, OVERLAPPED *ol);
+int       UringGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout);
+
+// epoll backend (epoll.cpp)
+int       EpollCreate(PROACTOR *proactor);
+int       EpollAssociate(PROACTOR *proactor, SOCKET s);
+int       EpollSubmit(PROACTOR *proactor, PROACTOR_SOCKET *psock, OVERLAPPED *ol);
+int       EpollGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout);
+
+#endif
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
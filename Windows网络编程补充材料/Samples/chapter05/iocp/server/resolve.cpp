@@ -15,8 +15,7 @@
 // Usage:
 //      See iocpserver.cpp
 //
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "compat.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -0,0 +1,63 @@
+//
+// Server statistics routines
+//
+// Files:
+//      stats.h         - Header file for the statistics routines
+//
+// Description:
+//      This file declares the counters and latency histograms used by the
+//      server statistics. Each thread updates its own block of 64-bit
+//      counters and histograms without any interlocked operations; the
+//      blocks are only summed when the statistics are read. A block is
+//      page aligned so that two threads never share a cache line.
+//
+//      The histograms are HDR style: values below 2*HISTOGRAM_SUB_BUCKETS are
+//      recorded exactly and larger values fall into one of
+//      HISTOGRAM_SUB_BUCKETS linear buckets per power of two. This keeps the
+//      relative error of a reported percentile within 1/HISTOGRAM_SUB_BUCKETS
+//      over the whole range from one microsecond to several days.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define MAX_STATS_THREADS       1024    // Most threads which may update statistics
+#define MAX_STAT_COUNTERS       8       // Counters per thread (one cache line)
+#define MAX_STAT_HISTOGRAMS     4       // Latency histograms per thread
+
+#define HISTOGRAM_SUB_BITS      5
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS      40      // Largest value recorded is 2^40 microseconds
+#define HISTOGRAM_BUCKETS       ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+//
+// The statistics updated by a single thread
+//
+typedef struct _THREAD_STATS
+{
+    ULONGLONG       Counters[MAX_STAT_COUNTERS];
+    ULONGLONG       Histograms[MAX_STAT_HISTOGRAMS][HISTOGRAM_BUCKETS];
+} THREAD_STATS;
+
+void      StatsInit();
+void      StatsAdd(int counter, ULONGLONG value);
+ULONGLONG StatsRead(int counter);
+LONGLONG  StatsTimestamp();
+void      StatsRecordLatency(int histogram, LONGLONG StartTime);
+void      StatsPrintLatency(int histogram, char *name);
+void      StatsWriteLatency(FILE *fp, ULONG elapsed, int histogram, char *name);
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
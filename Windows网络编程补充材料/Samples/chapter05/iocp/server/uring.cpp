@@ -0,0 +1,402 @@
+//
+// io_uring completion queue
+//
+// Files:
+//      uring.cpp       - io_uring backend of the completion queue (Linux)
+//      proactor.h      - Header file for the completion queue routines
+//
+// Description:
+//      This file contains the io_uring backend of the completion queue
+//      (see proactor.h). io_uring is the closest Linux has to a completion
+//      port: the receive, send and accept requests are placed in the
+//      submission ring and the kernel reports each one in the completion
+//      ring once it is done, carrying the OVERLAPPED pointer as its user
+//      data. The rings are set up with the raw system calls so that no
+//      library beyond libc is needed.
+//
+//      io_uring may complete two receives posted on the same socket in
+//      either order, and likewise two sends. The receives and sends of a
+//      socket are therefore queued on it and only the oldest of each is
+//      submitted; the next one is submitted when it completes. Accepts
+//      need no order and are submitted right away. Any number of threads
+//      may submit and harvest: a lock serializes each ring, and waiting
+//      for completions is done outside the lock. A stream send which the
+//      kernel only partly sent is submitted again for the rest before it
+//      is reported complete.
+//
+//      Requires Linux 5.11 (waiting with a timeout through
+//      IORING_ENTER_EXT_ARG); ProactorCreate falls back to epoll on older
+//      kernels.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include "compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "proactor.h"
+
+//
+// Function: io_uring_setup, io_uring_enter
+//
+// Description:
+//    The io_uring system calls, which glibc does not wrap.
+//
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+//
+// Function: UringCreate
+//
+// Description:
+//    Sets up the rings and maps them into the process. The completion ring
+//    is four times the size of the submission ring so that it holds the
+//    completions of many more requests than are submitted at once.
+//
+int UringCreate(PROACTOR *proactor, DWORD entries)
+{
+    struct io_uring_params params;
+    char   *sq,
+           *cq;
+    size_t  sqsize,
+            cqsize;
+    int     fd;
+
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    fd = io_uring_setup(entries, &params);
+    if (fd < 0)
+    {
+        fprintf(stderr, "UringCreate: io_uring_setup failed: %d\n", errno);
+        return SOCKET_ERROR;
+    }
+
+    if (((params.features & IORING_FEAT_NODROP) == 0) ||
+        ((params.features & IORING_FEAT_EXT_ARG) == 0) )
+    {
+        fprintf(stderr, "UringCreate: io_uring of this kernel is too old\n");
+        close(fd);
+        return SOCKET_ERROR;
+    }
+
+    sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both rings may share a single mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cqsize > sqsize)
+            sqsize = cqsize;
+        cqsize = sqsize;
+    }
+
+    sq = (char *)mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        fprintf(stderr, "UringCreate: mmap failed: %d\n", errno);
+        close(fd);
+        return SOCKET_ERROR;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cq = sq;
+    }
+    else
+    {
+        cq = (char *)mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            fprintf(stderr, "UringCreate: mmap failed: %d\n", errno);
+            munmap(sq, sqsize);
+            close(fd);
+            return SOCKET_ERROR;
+        }
+    }
+
+    proactor->Sqes = (struct io_uring_sqe *)mmap(
+            NULL,
+            params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            fd,
+            IORING_OFF_SQES
+            );
+    if (proactor->Sqes == MAP_FAILED)
+    {
+        fprintf(stderr, "UringCreate: mmap failed: %d\n", errno);
+        if (cq != sq)
+            munmap(cq, cqsize);
+        munmap(sq, sqsize);
+        close(fd);
+        return SOCKET_ERROR;
+    }
+
+    proactor->RingFd  = fd;
+    proactor->SqHead  = (unsigned *)(sq + params.sq_off.head);
+    proactor->SqTail  = (unsigned *)(sq + params.sq_off.tail);
+    proactor->SqMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    proactor->SqArray = (unsigned *)(sq + params.sq_off.array);
+    proactor->CqHead  = (unsigned *)(cq + params.cq_off.head);
+    proactor->CqTail  = (unsigned *)(cq + params.cq_off.tail);
+    proactor->CqMask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    proactor->Cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    pthread_mutex_init(&proactor->SqLock, NULL);
+    pthread_mutex_init(&proactor->CqLock, NULL);
+
+    return NO_ERROR;
+}
+
+//
+// Function: UringSubmit
+//
+// Description:
+//    Places the request for an operation in the submission ring and submits
+//    it. The kernel consumes the ring during io_uring_enter, so the ring
+//    never holds more than the request being submitted.
+//
+static int UringSubmit(PROACTOR *proactor, OVERLAPPED *ol)
+{
+    struct io_uring_sqe *sqe;
+    unsigned             tail,
+                         index;
+    int                  rc;
+
+    pthread_mutex_lock(&proactor->SqLock);
+
+    tail  = *proactor->SqTail;
+    index = tail & *proactor->SqMask;
+    sqe   = &proactor->Sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd        = ol->s;
+    sqe->user_data = (__u64)(ULONG_PTR)ol;
+
+    switch (ol->Operation)
+    {
+        case PROACTOR_OP_RECV:
+            sqe->opcode    = IORING_OP_RECVMSG;
+            sqe->addr      = (__u64)(ULONG_PTR)&ol->Msg;
+            sqe->len       = 1;
+            break;
+        case PROACTOR_OP_SEND:
+            sqe->opcode    = IORING_OP_SENDMSG;
+            sqe->addr      = (__u64)(ULONG_PTR)&ol->Msg;
+            sqe->len       = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            break;
+        case PROACTOR_OP_ACCEPT:
+            sqe->opcode       = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+    }
+
+    proactor->SqArray[index] = index;
+    __atomic_store_n(proactor->SqTail, tail + 1, __ATOMIC_RELEASE);
+
+    do
+    {
+        rc = io_uring_enter(proactor->RingFd, 1, 0, 0, NULL, 0);
+    } while ((rc < 0) && ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)));
+
+    pthread_mutex_unlock(&proactor->SqLock);
+
+    if (rc < 0)
+    {
+        // The request is in the ring and may still be submitted later, so it
+        //    cannot be handed back to the caller as failed
+        fprintf(stderr, "UringSubmit: io_uring_enter failed: %d\n", errno);
+        ExitProcess(-1);
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: UringPost
+//
+// Description:
+//    Posts an operation. A receive or send is queued on the socket and only
+//    submitted if no other of its kind is in the kernel.
+//
+int UringPost(PROACTOR *proactor, PROACTOR_SOCKET *psock, OVERLAPPED *ol)
+{
+    OVERLAPPED **head,
+               **tail;
+
+    if (ol->Operation == PROACTOR_OP_ACCEPT)
+        return UringSubmit(proactor, ol);
+
+    if (ol->Operation == PROACTOR_OP_SEND)
+    {
+        head = &psock->SendHead;
+        tail = &psock->SendTail;
+    }
+    else
+    {
+        head = &psock->RecvHead;
+        tail = &psock->RecvTail;
+    }
+
+    pthread_mutex_lock(&psock->Lock);
+
+    if (*tail)
+        (*tail)->next = ol;
+    else
+        *head = ol;
+    *tail = ol;
+
+    if (*head == ol)
+        UringSubmit(proactor, ol);
+
+    pthread_mutex_unlock(&psock->Lock);
+
+    return NO_ERROR;
+}
+
+//
+// Function: UringComplete
+//
+// Description:
+//    Removes a completed receive or send from its socket's queue and
+//    submits the next one queued behind it.
+//
+static void UringComplete(PROACTOR *proactor, OVERLAPPED *ol)
+{
+    PROACTOR_SOCKET *psock=NULL;
+    OVERLAPPED     **head,
+                   **tail;
+
+    if (ol->Operation == PROACTOR_OP_ACCEPT)
+        return;
+
+    psock = ProactorGetSocket(ol->s);
+
+    if (ol->Operation == PROACTOR_OP_SEND)
+    {
+        head = &psock->SendHead;
+        tail = &psock->SendTail;
+    }
+    else
+    {
+        head = &psock->RecvHead;
+        tail = &psock->RecvTail;
+    }
+
+    pthread_mutex_lock(&psock->Lock);
+
+    *head = ol->next;
+    if (*head == NULL)
+        *tail = NULL;
+    else
+        UringSubmit(proactor, *head);
+
+    pthread_mutex_unlock(&psock->Lock);
+}
+
+//
+// Function: UringGetCompletions
+//
+// Description:
+//    Harvests up to count completions from the completion ring, waiting for
+//    at least one. A stream send which was only partly sent is submitted
+//    again for the rest instead of being returned. The operations queued
+//    behind the completed ones are submitted before the completions are
+//    returned. Returns the number of events filled in, or SOCKET_ERROR on
+//    timeout or failure.
+//
+int UringGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    struct io_uring_cqe          *cqe;
+    OVERLAPPED                   *resubmit[MAX_PROACTOR_BATCH],
+                                 *ol;
+    unsigned                      head,
+                                  tail;
+    int                           removed,
+                                  pending,
+                                  rc,
+                                  i;
+
+    while (1)
+    {
+        removed = 0;
+        pending = 0;
+
+        pthread_mutex_lock(&proactor->CqLock);
+
+        head = *proactor->CqHead;
+        tail = __atomic_load_n(proactor->CqTail, __ATOMIC_ACQUIRE);
+        while ((head != tail) && (removed + pending < count))
+        {
+            cqe = &proactor->Cqes[head & *proactor->CqMask];
+            ol  = (OVERLAPPED *)(ULONG_PTR)cqe->user_data;
+
+            ProactorSetResult(ol, cqe->res);
+            if (ProactorSendPending(ol))
+                resubmit[pending++] = ol;
+            else
+                ProactorSetEvent(&events[removed++], ol);
+
+            head++;
+        }
+        __atomic_store_n(proactor->CqHead, head, __ATOMIC_RELEASE);
+
+        pthread_mutex_unlock(&proactor->CqLock);
+
+        for(i=0; i < pending ;i++)
+        {
+            UringSubmit(proactor, resubmit[i]);
+        }
+        for(i=0; i < removed ;i++)
+        {
+            UringComplete(proactor, events[i].lpOverlapped);
+        }
+
+        if (removed > 0)
+            return removed;
+        if (pending > 0)
+            continue;
+
+        memset(&arg, 0, sizeof(arg));
+        if (Timeout != INFINITE)
+        {
+            ts.tv_sec  = Timeout / 1000;
+            ts.tv_nsec = (Timeout % 1000) * 1000000;
+            arg.ts     = (__u64)(ULONG_PTR)&ts;
+        }
+
+        rc = io_uring_enter(
+                proactor->RingFd,
+                0,
+                1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+               &arg,
+                sizeof(arg)
+                );
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == ETIME)
+                errno = ETIMEDOUT;
+            return SOCKET_ERROR;
+        }
+    }
+}
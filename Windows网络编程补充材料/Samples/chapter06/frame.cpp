@@ -0,0 +1,518 @@
+//
+// Message framing routines
+//
+// Files:
+//      frame.cpp       - Message framing routines
+//      frame.h         - Header file for the message framing routines
+//
+// Description:
+//      This file contains the parser for length prefixed and delimited
+//      messages, the responses handed back by the application and a
+//      handler which echoes each message. See frame.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame.h"
+
+LPFRAME_RELEASE gFrameRelease=NULL;     // Frees a buffer once unreferenced
+
+SLIST_HEADER  gFreeResponseList;        // Lookaside list of responses
+
+volatile LONG gFrameResponseAllocs=0,   // Responses allocated
+              gFrameErrors=0,           // Malformed or oversized messages
+              gFrameBytesCopied=0;      // Bytes copied to keep frames from fragmenting
+
+//
+// Function: FrameInit
+//
+// Description:
+//    Initializes the framing routines. Release is called for each receive
+//    buffer once no frame or response refers to it any longer.
+//
+void FrameInit(LPFRAME_RELEASE Release)
+{
+    gFrameRelease = Release;
+
+    InitializeSListHead(&gFreeResponseList);
+}
+
+//
+// Function: FrameParserInit
+//
+// Description:
+//    Initializes the parser state of a connection.
+//
+void FrameParserInit(FRAME_PARSER *parser, int Mode, ULONG MaxLength, char Delimiter)
+{
+    memset(parser, 0, sizeof(FRAME_PARSER));
+
+    parser->Mode      = Mode;
+    parser->MaxLength = MaxLength;
+    parser->Delimiter = Delimiter;
+}
+
+//
+// Function: FrameParserReset
+//
+// Description:
+//    Drops the frame being assembled (or just handled) along with the
+//    references it holds, and starts on the next message.
+//
+void FrameParserReset(FRAME_PARSER *parser)
+{
+    FRAME  *frame=&parser->Frame;
+    ULONG   i;
+
+    for(i=0; i < frame->SegmentCount ;i++)
+    {
+        FrameBufferRelease(frame->Owners[i]);
+    }
+
+    frame->SegmentCount = 0;
+    frame->Length       = 0;
+
+    parser->HeaderBytes = 0;
+    parser->Remaining   = 0;
+}
+
+//
+// Function: FrameParserExpect
+//
+// Description:
+//    Makes the next frame exactly len bytes long, regardless of the mode.
+//    This may be called by the handler of the preceding frame; the block
+//    survives the FrameParserReset which follows it. Returns FALSE if len
+//    is larger than the parser accepts.
+//
+BOOL FrameParserExpect(FRAME_PARSER *parser, ULONG len)
+{
+    if (len > parser->MaxLength)
+    {
+        InterlockedIncrement(&gFrameErrors);
+        return FALSE;
+    }
+    parser->Expect = len;
+
+    return TRUE;
+}
+
+//
+// Function: FrameBufferInit
+//
+// Description:
+//    Initializes the reference count of a receive buffer of size bytes of
+//    which the first bytes hold data. The caller holds the only reference
+//    and drops it with FrameBufferRelease once it has parsed the data.
+//
+void FrameBufferInit(FRAME_BUFFER *buffer, char *data, ULONG bytes, ULONG size)
+{
+    buffer->RefCount = 1;
+    buffer->End      = data + bytes;
+    buffer->Limit    = data + size;
+}
+
+//
+// Function: FrameBufferRelease
+//
+// Description:
+//    Drops a reference to a receive buffer and frees it if it was the last.
+//
+void FrameBufferRelease(FRAME_BUFFER *buffer)
+{
+    if (--buffer->RefCount == 0)
+    {
+        gFrameRelease(buffer);
+    }
+}
+
+//
+// Function: FrameAddSegment
+//
+// Description:
+//    Appends received data to the frame being assembled. Data which fits
+//    behind the frame's last segment in that segment's buffer is copied
+//    there; otherwise it becomes a new segment referencing its buffer.
+//    Returns FALSE if the frame has run out of segments.
+//
+BOOL FrameAddSegment(FRAME_PARSER *parser, FRAME_BUFFER *buffer, char *data, ULONG len)
+{
+    FRAME        *frame=&parser->Frame;
+    FRAME_BUFFER *owner=NULL;
+    WSABUF       *last=NULL;
+
+    frame->Length += len;
+
+    if (frame->SegmentCount > 0)
+    {
+        last  = &frame->Segments[frame->SegmentCount - 1];
+        owner = frame->Owners[frame->SegmentCount - 1];
+
+        if ((last->buf + last->len == owner->End) &&
+            (len <= (ULONG)(owner->Limit - owner->End)) )
+        {
+            memcpy(owner->End, data, len);
+
+            owner->End += len;
+            last->len  += len;
+
+            InterlockedExchangeAdd(&gFrameBytesCopied, len);
+            return TRUE;
+        }
+    }
+
+    if (frame->SegmentCount >= FRAME_MAX_SEGMENTS)
+        return FALSE;
+
+    frame->Segments[frame->SegmentCount].buf = data;
+    frame->Segments[frame->SegmentCount].len = len;
+    frame->Owners[frame->SegmentCount]       = buffer;
+    frame->SegmentCount++;
+
+    buffer->RefCount++;
+
+    return TRUE;
+}
+
+//
+// Function: FrameParse
+//
+// Description:
+//    Parses len bytes of received data held in buffer. Returns FRAME_COMPLETE
+//    once a message is complete (parser->Frame), FRAME_INCOMPLETE if all of
+//    the data was consumed without completing one or FRAME_ERROR if the
+//    message is larger than allowed. The number of bytes consumed is
+//    returned in used; the rest belongs to the following messages. After a
+//    complete frame has been handled, FrameParserReset must be called before
+//    parsing continues.
+//
+int FrameParse(FRAME_PARSER *parser, FRAME_BUFFER *buffer, char *data, ULONG len, ULONG *used)
+{
+    char   *delim=NULL;
+    ULONG   take;
+
+    *used = 0;
+
+    // A block of known length announced by the previous frame's handler
+    if (parser->Expect > 0)
+    {
+        take = (len < parser->Expect) ? len : parser->Expect;
+
+        if (FrameAddSegment(parser, buffer, data, take) == FALSE)
+        {
+            InterlockedIncrement(&gFrameErrors);
+            return FRAME_ERROR;
+        }
+        *used           = take;
+        parser->Expect -= take;
+
+        return (parser->Expect == 0) ? FRAME_COMPLETE : FRAME_INCOMPLETE;
+    }
+
+    if (parser->Mode == FRAME_MODE_LENGTH)
+    {
+        if (parser->HeaderBytes < FRAME_HEADER_BYTES)
+        {
+            // The length prefix may be split over two receives
+            while ((parser->HeaderBytes < FRAME_HEADER_BYTES) && (*used < len))
+            {
+                parser->Header[parser->HeaderBytes++] = data[(*used)++];
+            }
+            if (parser->HeaderBytes < FRAME_HEADER_BYTES)
+                return FRAME_INCOMPLETE;
+
+            parser->Remaining = ((ULONG)parser->Header[0] << 24) |
+                                ((ULONG)parser->Header[1] << 16) |
+                                ((ULONG)parser->Header[2] << 8)  |
+                                 (ULONG)parser->Header[3];
+            if (parser->Remaining > parser->MaxLength)
+            {
+                InterlockedIncrement(&gFrameErrors);
+                return FRAME_ERROR;
+            }
+        }
+
+        take = len - *used;
+        if (take > parser->Remaining)
+            take = parser->Remaining;
+
+        if (take > 0)
+        {
+            if (FrameAddSegment(parser, buffer, data + *used, take) == FALSE)
+            {
+                InterlockedIncrement(&gFrameErrors);
+                return FRAME_ERROR;
+            }
+            *used             += take;
+            parser->Remaining -= take;
+        }
+
+        return (parser->Remaining == 0) ? FRAME_COMPLETE : FRAME_INCOMPLETE;
+    }
+
+    // Delimiter mode: the delimiter ends the message but is not part of it
+    delim = (char *)memchr(data, parser->Delimiter, len);
+
+    take = (delim) ? (ULONG)(delim - data) : len;
+
+    if ((parser->Frame.Length + take > parser->MaxLength) ||
+        ((take > 0) && (FrameAddSegment(parser, buffer, data, take) == FALSE)) )
+    {
+        InterlockedIncrement(&gFrameErrors);
+        return FRAME_ERROR;
+    }
+
+    if (delim == NULL)
+    {
+        *used = len;
+        return FRAME_INCOMPLETE;
+    }
+
+    *used = take + 1;
+
+    return FRAME_COMPLETE;
+}
+
+//
+// Function: FrameCopy
+//
+// Description:
+//    Copies up to len bytes of the frame's payload, starting at offset, into
+//    dest. This is for handlers which need part of a message (e.g. a
+//    command) in one piece. Returns the number of bytes copied.
+//
+ULONG FrameCopy(FRAME *frame, ULONG offset, char *dest, ULONG len)
+{
+    ULONG   copied=0,
+            take,
+            i;
+
+    for(i=0; (i < frame->SegmentCount) && (copied < len) ;i++)
+    {
+        if (offset >= frame->Segments[i].len)
+        {
+            offset -= frame->Segments[i].len;
+            continue;
+        }
+
+        take = frame->Segments[i].len - offset;
+        if (take > len - copied)
+            take = len - copied;
+
+        memcpy(dest + copied, frame->Segments[i].buf + offset, take);
+
+        copied += take;
+        offset  = 0;
+    }
+
+    return copied;
+}
+
+//
+// Function: FrameResponseGet
+//
+// Description:
+//    Returns an empty response from the lookaside list, allocating a new one
+//    if the list is empty.
+//
+FRAME_RESPONSE *FrameResponseGet()
+{
+    FRAME_RESPONSE *response=NULL;
+    SLIST_ENTRY    *entry=NULL;
+
+    entry = InterlockedPopEntrySList(&gFreeResponseList);
+    if (entry)
+    {
+        response = CONTAINING_RECORD(entry, FRAME_RESPONSE, Entry);
+    }
+    else
+    {
+        // The heap aligns to MEMORY_ALLOCATION_ALIGNMENT as SLIST entries need
+        response = (FRAME_RESPONSE *)HeapAlloc(GetProcessHeap(), 0, sizeof(FRAME_RESPONSE));
+        if (response == NULL)
+        {
+            fprintf(stderr, "FrameResponseGet: HeapAlloc failed: %d\n", GetLastError());
+            return NULL;
+        }
+        InterlockedIncrement(&gFrameResponseAllocs);
+    }
+
+    response->Length      = 0;
+    response->First       = 1;
+    response->BufferCount = 1;
+    response->ScratchUsed = 0;
+
+    response->Buffers[0].buf = NULL;
+    response->Buffers[0].len = 0;
+    response->Owners[0]      = NULL;
+
+    return response;
+}
+
+//
+// Function: FrameResponseFree
+//
+// Description:
+//    Drops the references held by a response and returns it to the
+//    lookaside list.
+//
+void FrameResponseFree(FRAME_RESPONSE *response)
+{
+    ULONG   i;
+
+    for(i=0; i < response->BufferCount ;i++)
+    {
+        if (response->Owners[i])
+            FrameBufferRelease(response->Owners[i]);
+    }
+    response->BufferCount = 0;
+
+    InterlockedPushEntrySList(&gFreeResponseList, &response->Entry);
+}
+
+//
+// Function: FrameResponseAdd
+//
+// Description:
+//    Appends a buffer to the response. If owner is given the buffer lies in
+//    that receive buffer, which is kept until the response has been sent.
+//    Otherwise the data must stay valid until then by other means. Returns
+//    FALSE if the response has no room for another buffer.
+//
+BOOL FrameResponseAdd(FRAME_RESPONSE *response, char *buf, ULONG len, FRAME_BUFFER *owner)
+{
+    // Keep the last slot for the delimiter
+    if (response->BufferCount >= FRAME_MAX_SEGMENTS + 1)
+        return FALSE;
+
+    response->Buffers[response->BufferCount].buf = buf;
+    response->Buffers[response->BufferCount].len = len;
+    response->Owners[response->BufferCount]      = owner;
+    response->BufferCount++;
+
+    response->Length += len;
+
+    if (owner)
+        owner->RefCount++;
+
+    return TRUE;
+}
+
+//
+// Function: FrameResponseAddFrame
+//
+// Description:
+//    Appends the payload of a frame to the response without copying it.
+//
+BOOL FrameResponseAddFrame(FRAME_RESPONSE *response, FRAME *frame)
+{
+    ULONG   i;
+
+    for(i=0; i < frame->SegmentCount ;i++)
+    {
+        if (FrameResponseAdd(response, frame->Segments[i].buf, frame->Segments[i].len, frame->Owners[i]) == FALSE)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Function: FrameResponseWrite
+//
+// Description:
+//    Copies a small piece of data into the response itself and appends it.
+//    Returns FALSE if it doesn't fit.
+//
+BOOL FrameResponseWrite(FRAME_RESPONSE *response, char *data, ULONG len)
+{
+    char   *dest=NULL;
+
+    if (len > FRAME_SCRATCH_BYTES - response->ScratchUsed)
+        return FALSE;
+
+    dest = response->Scratch + response->ScratchUsed;
+
+    memcpy(dest, data, len);
+
+    if (FrameResponseAdd(response, dest, len, NULL) == FALSE)
+        return FALSE;
+
+    response->ScratchUsed += len;
+
+    return TRUE;
+}
+
+//
+// Function: FrameResponseEncode
+//
+// Description:
+//    Frames the response the same way as the connection's requests: the
+//    length prefix is filled into the reserved first buffer, or the
+//    delimiter is appended.
+//
+void FrameResponseEncode(FRAME_PARSER *parser, FRAME_RESPONSE *response)
+{
+    ULONG   len=response->Length;
+
+    if (parser->Mode == FRAME_MODE_LENGTH)
+    {
+        response->Header[0] = (UCHAR)(len >> 24);
+        response->Header[1] = (UCHAR)(len >> 16);
+        response->Header[2] = (UCHAR)(len >> 8);
+        response->Header[3] = (UCHAR)len;
+
+        response->Buffers[0].buf = (char *)response->Header;
+        response->Buffers[0].len = FRAME_HEADER_BYTES;
+
+        response->First   = 0;
+        response->Length += FRAME_HEADER_BYTES;
+    }
+    else if (parser->Mode == FRAME_MODE_DELIMITER)
+    {
+        response->Delimiter = parser->Delimiter;
+
+        response->Buffers[response->BufferCount].buf = &response->Delimiter;
+        response->Buffers[response->BufferCount].len = 1;
+        response->Owners[response->BufferCount]      = NULL;
+        response->BufferCount++;
+
+        response->Length++;
+    }
+}
+
+//
+// Function: FrameEchoHandler
+//
+// Description:
+//    Handler which sends each message back as it was received.
+//
+int FrameEchoHandler(FRAME *request, FRAME_RESPONSE *response)
+{
+    if (FrameResponseAddFrame(response, request) == FALSE)
+        return FRAME_CLOSE;
+
+    return FRAME_REPLY;
+}
+
+//
+// Function: FramePrintStatistics
+//
+// Description:
+//    Prints the framing counters.
+//
+void FramePrintStatistics()
+{
+    printf("Framing: %lu errors, %lu bytes coalesced, %lu responses allocated\n",
+            gFrameErrors,
+            gFrameBytesCopied,
+            gFrameResponseAllocs
+            );
+}
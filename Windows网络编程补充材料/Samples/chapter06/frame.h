@@ -0,0 +1,167 @@
+//
+// Message framing routines
+//
+// Files:
+//      frame.h         - Header file for the message framing routines
+//
+// Description:
+//      This file declares the framing layer which lets the server run a
+//      request/response protocol instead of a plain echo. Messages are
+//      either prefixed with a four byte length in network byte order or
+//      terminated by a delimiter character. They are parsed straight out of
+//      the receive buffers: a FRAME is a list of segments pointing into the
+//      buffers the message arrived in, so a message spanning several
+//      receives is never copied into one piece.
+//
+//      The application supplies a handler which is called with each complete
+//      frame and builds a FRAME_RESPONSE. A response is a list of buffers
+//      sent with a single gathered send. The handler may add (parts of) the
+//      request to it without copying, data with a static lifetime, or small
+//      pieces copied into the response itself. The length prefix or the
+//      delimiter of the response is added by FrameResponseEncode.
+//
+//      Receive buffers are reference counted with a FRAME_BUFFER embedded in
+//      the caller's buffer object. Frames and responses hold a reference on
+//      every buffer they point into and the release routine passed to
+//      FrameInit is called once the last one is dropped. The counts are not
+//      interlocked: all references to a buffer must be taken and dropped by
+//      one thread at a time (the server does so on the connection's strand).
+//
+//      Some text protocols follow a line with a block of known length which
+//      may itself contain the delimiter (e.g. the data of a memcached set).
+//      A handler announces such a block with FrameParserExpect and the next
+//      frame is then exactly that many bytes, whatever the mode.
+//
+//      A message arriving in many small receives would need many segments.
+//      To bound this, a piece which fits behind the previous segment in its
+//      buffer is copied there instead of taking a segment of its own, so a
+//      frame of N bytes never spans more than 2 * N / buffer size + 2
+//      segments.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define FRAME_MAX_SEGMENTS      32      // Segments per frame
+#define FRAME_HEADER_BYTES      4       // Size of the length prefix
+#define FRAME_SCRATCH_BYTES     256     // Bytes a handler may copy into a response
+
+#define FRAME_MODE_RAW          0       // No framing (the server echoes the raw data)
+#define FRAME_MODE_LENGTH       1       // Four byte length prefix
+#define FRAME_MODE_DELIMITER    2       // Terminated by a delimiter character
+
+#define FRAME_INCOMPLETE        0       // FrameParse results
+#define FRAME_COMPLETE          1
+#define FRAME_ERROR             -1
+
+#define FRAME_NO_REPLY          0       // Handler results
+#define FRAME_REPLY             1
+#define FRAME_CLOSE             -1
+
+//
+// Reference count of a receive buffer. This is embedded in the buffer object.
+//
+typedef struct _FRAME_BUFFER
+{
+    LONG            RefCount;           // References held by the caller, frames and responses
+
+    char           *End,                // End of the data received into the buffer
+                   *Limit;              // End of the buffer
+} FRAME_BUFFER;
+
+//
+// Called when the last reference to a buffer is dropped
+//
+typedef void (*LPFRAME_RELEASE)(FRAME_BUFFER *buffer);
+
+//
+// A complete message. The payload (without the length prefix or delimiter)
+//    is the concatenation of the segments.
+//
+typedef struct _FRAME
+{
+    ULONG           Length,             // Payload bytes
+                    SegmentCount;
+
+    WSABUF          Segments[FRAME_MAX_SEGMENTS];
+    FRAME_BUFFER   *Owners[FRAME_MAX_SEGMENTS];     // Buffer of each segment
+} FRAME;
+
+//
+// Parser state of a connection
+//
+typedef struct _FRAME_PARSER
+{
+    int             Mode;               // FRAME_MODE_*
+    char            Delimiter;          // Terminates messages in delimiter mode
+    ULONG           MaxLength;          // Largest payload accepted
+
+    UCHAR           Header[FRAME_HEADER_BYTES]; // Length prefix received so far
+    ULONG           HeaderBytes,
+                    Remaining,          // Payload bytes still to come (length mode)
+                    Expect;             // Bytes of a block announced by FrameParserExpect
+
+    FRAME           Frame;              // Frame being assembled
+} FRAME_PARSER;
+
+//
+// A response to a frame. Buffers[0] is reserved for the length prefix.
+//
+typedef struct _FRAME_RESPONSE
+{
+    SLIST_ENTRY     Entry;              // Link in the free list
+
+    ULONG           Length,             // Bytes in the buffers
+                    First,              // First buffer to send
+                    BufferCount,
+                    ScratchUsed;
+
+    WSABUF          Buffers[FRAME_MAX_SEGMENTS + 2];
+    FRAME_BUFFER   *Owners[FRAME_MAX_SEGMENTS + 2]; // NULL if not a receive buffer
+
+    UCHAR           Header[FRAME_HEADER_BYTES];
+    char            Delimiter;
+    char            Scratch[FRAME_SCRATCH_BYTES];
+} FRAME_RESPONSE;
+
+//
+// Called with each complete frame. Returns FRAME_REPLY to send the response,
+//    FRAME_NO_REPLY to send nothing or FRAME_CLOSE to close the connection.
+//    The frame is only valid during the call; the response keeps whatever
+//    it refers to alive until it has been sent.
+//
+typedef int (*LPFRAME_HANDLER)(FRAME *request, FRAME_RESPONSE *response);
+
+void            FrameInit(LPFRAME_RELEASE Release);
+void            FrameParserInit(FRAME_PARSER *parser, int Mode, ULONG MaxLength, char Delimiter);
+void            FrameParserReset(FRAME_PARSER *parser);
+BOOL            FrameParserExpect(FRAME_PARSER *parser, ULONG len);
+void            FrameBufferInit(FRAME_BUFFER *buffer, char *data, ULONG bytes, ULONG size);
+void            FrameBufferRelease(FRAME_BUFFER *buffer);
+int             FrameParse(FRAME_PARSER *parser, FRAME_BUFFER *buffer, char *data, ULONG len, ULONG *used);
+ULONG           FrameCopy(FRAME *frame, ULONG offset, char *dest, ULONG len);
+
+FRAME_RESPONSE *FrameResponseGet();
+void            FrameResponseFree(FRAME_RESPONSE *response);
+BOOL            FrameResponseAdd(FRAME_RESPONSE *response, char *buf, ULONG len, FRAME_BUFFER *owner);
+BOOL            FrameResponseAddFrame(FRAME_RESPONSE *response, FRAME *frame);
+BOOL            FrameResponseWrite(FRAME_RESPONSE *response, char *data, ULONG len);
+void            FrameResponseEncode(FRAME_PARSER *parser, FRAME_RESPONSE *response);
+
+int             FrameEchoHandler(FRAME *request, FRAME_RESPONSE *response);
+void            FramePrintStatistics();
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
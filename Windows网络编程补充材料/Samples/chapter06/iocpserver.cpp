@@ -3,8 +3,27 @@
 //
 // Files:
 //      iocpserver.cpp    - this file
+//      frame.cpp         - Length prefixed and delimited message framing
+//      frame.h           - Header file for message framing routines
+//      kvbench.cpp       - Loopback load generator for the key-value mode
+//      kvstore.cpp       - Partitioned storage of the key-value mode
+//      kvstore.h         - Header file for key-value store routines
+//      proactor.cpp      - Completion queue routines
+//      proactor.h        - Header file for completion queue routines
+//      pubsub.cpp        - Topics and shared messages of the publish/subscribe mode
+//      pubsub.h          - Header file for publish/subscribe routines
 //      resolve.cpp       - Common name resolution routines
 //      resolve.h         - Header file for name resolution routines
+//      slab.cpp          - NUMA local, large page buffer slabs
+//      slab.h            - Header file for buffer slab routines
+//      stats.cpp         - Per-thread counters and latency histograms
+//      stats.h           - Header file for statistics routines
+//      strand.cpp        - Lock-free serialization of per connection work
+//      strand.h          - Header file for strand routines
+//      topology.cpp      - Processor and NUMA placement of the worker threads
+//      topology.h        - Header file for topology routines
+//      timer.cpp         - Hierarchical timer wheel
+//      timer.h           - Header file for timer wheel routines
 //
 // Description:
 //      This sample illustrates how to write a scalable, high-performance
@@ -21,6 +40,248 @@
 //      sends would block as the client is not receiving data (and the TCP
 //      window size goes to zero).
 //
+//      Data received but not yet echoed is also limited in bytes. Once a
+//      connection has more than the high watermark (-wh) queued, no further
+//      receive is posted until its sends have drained it below the low
+//      watermark (-wl). The client's TCP window then closes instead of the
+//      server buffering its data. In addition the server as a whole only
+//      buffers up to a byte budget (-m). When the budget is used up, every
+//      connection pauses receiving after its current receive completes, and
+//      the paused connections are resumed once usage falls to three quarters
+//      of the budget. The statistics show the buffered bytes, the connections
+//      paused right now and how often receives were paused and resumed. To
+//      see it work, connect a slow reader (chapter05's iocpclient with -sr):
+//          iocpserver.exe -wh 65536 -wl 16384
+//          iocpclient.exe -n 127.0.0.1 -c 1 -x 100000 -sr 10000
+//      The connection stays paused most of the time with its queued data
+//      near the high watermark. The pauses and resumes each go up once per
+//      drain from the high to the low watermark, here about every five
+//      seconds. Running many slow readers against a small budget (-m)
+//      instead keeps the buffered bytes near the budget while the other
+//      connections keep echoing.
+//
+//      With -z an idle connection holds no receive buffer: between messages
+//      it only has a zero byte receive pending, and a buffer is taken once
+//      that completes because data has arrived. The statistics show the
+//      memory held by buffers and connection objects per live connection.
+//      To measure it at scale, hold idle connections open with chapter05's
+//      iocpclient and compare the figure with and without -z, e.g. for one
+//      million loopback connections:
+//          iocpserver.exe -z -ti 0
+//          iocpclient.exe -n 127.0.0.1 -l 127.0.0.1 -la 16 -c 1000000 -cr 20000 -i -b 1
+//      and read it once the server's current connections reach the count.
+//      The idle timeout has to be off (-ti 0), or the connections are closed
+//      after five minutes.
+//
+//      Each connection has a timer on its shard's timer wheel which the
+//      completion threads advance between batches. A connection is closed
+//      when it stays idle longer than the idle timeout (-ti), when it trickles
+//      data at less than the minimum rate (-tr) over a ten second window, or,
+//      if a first byte deadline is given (-tf), when it sends nothing within
+//      that time of connecting. With a first byte deadline the AcceptEx calls
+//      do not wait for data, so the deadline covers the time before the
+//      first receive as well.
+//
+//      The number of AcceptEx calls kept pending on each listening socket
+//      follows the load. The pool is sized from the measured accept rate and
+//      the time the server takes to replace a completed accept, and doubles
+//      whenever a connection arrives to find no AcceptEx pending (FD_ACCEPT).
+//      It stays between the initial (-o) and maximum (-oa) counts. The
+//      statistics show the pool size, accepts per second and the number of
+//      connections dropped while being accepted. To benchmark it under a
+//      connection storm, let chapter05's iocpclient open many connections at
+//      once, then again at stepped rates (-cr), and compare its connects per
+//      second and refused count with the pool's size and exhaustions, e.g.
+//          iocpserver.exe -o 5 -oa 5000
+//          iocpclient.exe -n 127.0.0.1 -c 50000 -x 1
+//          iocpclient.exe -n 127.0.0.1 -c 50000 -x 1 -cr 10000
+//      With a fixed pool (-o equal to -oa) for comparison, the refused count
+//      shows what the controller saves.
+//
+//      The echo itself never copies data: each receive buffer is sent back
+//      as is. For large messages the remaining copy is the one into the
+//      socket's send buffer. With -zc, a connection that receives at least
+//      the given number of bytes at once has its send buffer disabled, so
+//      its sends go out directly from the receive buffers. Such a connection
+//      needs several sends in flight to keep the link busy, so raise the
+//      high watermark (-wh) and use a buffer size (-b) of at least the
+//      threshold.
+//
+//      Bulk mode (-bk) handles long transfers with fewer, larger operations.
+//      A connection which receives the given number of bytes in full
+//      buffers in a row switches to bulk buffers (-bb, 64KB by default) of
+//      their own slabs and to sends without the copy into the socket's send
+//      buffer (as with -zc), so each byte is copied once, by the stack, and
+//      the CPU never touches the data otherwise. A receive which returns
+//      less than a normal buffer switches the connection back. Raise the
+//      high watermark (-wh) to a few bulk buffers so a bulk connection
+//      keeps several of them in flight. To measure it, run a few
+//      connections of large echoes (e.g. chapter05's iocpclient with a
+//      large -b) with and without -bk and compare the BPS and the
+//      processor time per GB in the statistics.
+//
+//      Completion threads allocate and free the per I/O objects through a
+//      cache of their own (two magazines of MAGAZINE_SIZE objects) and only
+//      take the global lock to trade a magazine with the depot. To see how
+//      this scales, -ab runs a microbenchmark instead of the server: 1, 2,
+//      4, ... threads allocate and free batches of objects, first all under
+//      the lock and then through magazines, and the allocations per second
+//      of each run are printed, e.g.
+//          iocpserver.exe -ab 32
+//
+//      The per I/O objects are carved from slabs rather than the process heap.
+//      Each slab keeps the object headers in one dense array and the data
+//      buffers in a separate region, both allocated on the NUMA node of the
+//      thread which first needs them. With -lp the data buffers are in large
+//      pages, which also keeps them locked in memory.
+//
+//      Instead of echoing the raw data, the server can parse messages out
+//      of it (-p): either messages prefixed with a four byte length in
+//      network byte order, or lines ending in a newline. Each message is
+//      passed to a handler (gFrameHandler, which echoes it) as a list of
+//      pieces of the receive buffers it arrived in, and the handler's
+//      response is sent back with a single gathered send. Messages larger
+//      than -pm bytes close the connection.
+//
+//      Ready mode (-r) trades the one-operation-per-buffer model for one
+//      notification per burst. Each connection only keeps a zero byte
+//      receive pending; when it completes, the data waiting on the socket
+//      is read with non-blocking recv calls into buffers taken from the
+//      shared pool, and the zero byte receive is posted again. Buffers are
+//      thus only held for data actually in flight. Likewise a completed
+//      AcceptEx also takes the connections already waiting in the backlog
+//      with accept, so a burst of connections needs only one completion.
+//      To compare the two models, run the same timed client load against
+//      the server with and without -r:
+//          iocpserver.exe -f classic.csv
+//          iocpserver.exe -r -f ready.csv
+//          iocpclient.exe -n 127.0.0.1 -c 1000 -x 1000000 -d 60
+//      and compare the client's average BPS read, the latency percentiles
+//      written to the two files and the buffer objects per connection in
+//      the statistics.
+//
+//      By default one completion thread (worker) is started per processor,
+//      across all processor groups. The number of workers (-n), the
+//      processors they run on (-c, e.g. 0-7,16-23) and their placement
+//      (-pin) can be given on the command line or in a configuration file
+//      (-cf) holding the same options, with # starting a comment. Workers
+//      can be pinned to a processor (cpu), bound to the processor's NUMA
+//      node (node) or left to the scheduler (none, the default unless
+//      sharded). With rss, workers are pinned and in sharded mode each
+//      connection is serviced by the worker on the processor its packets
+//      are delivered to by receive side scaling, or failing that one on the
+//      same node; list the adapter's RSS processors with -c to line the
+//      workers up with the receive queues. The statistics show each
+//      worker's processor utilization and completion rate.
+//
+//      Low latency mode (-sp) has each worker poll its completion queue
+//      without blocking for the given number of microseconds after handling
+//      a batch, and only then wait for completions in the kernel. Completions
+//      found while polling are handled without the wakeup of a blocked
+//      thread, at the cost of processor time spent polling. To pick a spin
+//      budget, run the same load with several budgets (0, 20, 100, ...) and
+//      compare the Turnaround p50/p99 with the worker utilization and the
+//      processor time per completion in the statistics.
+//
+//      With -u the server echoes UDP instead of TCP. Each UDP socket keeps
+//      many receives (-uo) pending and the completion threads dequeue their
+//      completions in batches, so a burst of datagrams costs one wakeup
+//      rather than one per datagram. Where the stack supports receive
+//      segment coalescing (URO), a receive can return a whole train of
+//      datagrams from the same sender up to -ug bytes; it is echoed with a
+//      single send which the stack splits back into the same datagrams
+//      (UDP_SEND_MSG_SIZE). Each datagram is received into and sent back
+//      from the same buffer. A UDP socket is serviced by all the workers,
+//      so run without -s to spread the datagrams over the processors. The
+//      statistics show datagrams per second and per receive, and each
+//      worker's datagrams per second next to its processor utilization;
+//      run with different worker counts (-n) to see how they scale.
+//      Coalescing and send offload need Windows 10; older systems echo one
+//      datagram per receive.
+//
+//      Overload control (-q) keeps a saturated server from degrading every
+//      connection at once. Each worker regularly posts a probe to its own
+//      completion queue and times how long it takes to come back out: the
+//      completion queue delay. When the delay passes the given number of
+//      microseconds, or the buffered byte budget is used up, the server is
+//      under high load: it stops reposting accepts, so new connections wait
+//      in the listen backlog, and connections accepted meanwhile only get
+//      their first receive once the load is back to normal. At four times
+//      the delay it sheds load: new connections are reset right after they
+//      are accepted. The level drops again once the delay has fallen to half
+//      the mark. The statistics show the load level, the queue delay and
+//      the number of connections shed and deferred.
+//
+//      With -x the server is a reverse proxy instead of an echo server: each
+//      client connection is relayed to one of the given backends. For each
+//      backend a pool of connections (-xp) is established ahead of time with
+//      ConnectEx, as chapter05's iocpclient does, so a client is paired with
+//      a backend connection as soon as it is accepted and the pool is topped
+//      up behind it. With -s the pool is split evenly between the shards and
+//      a client is only paired with a connection of its own shard, so both
+//      legs complete on the shard running their strand. A pooled connection
+//      is used for one client only since the relay knows nothing of the
+//      protocol spoken on it. The client goes to the healthy backend with the
+//      fewest relayed connections. Each pooled connection keeps a zero byte
+//      receive pending, so a backend closing or resetting its idle
+//      connections is noticed right away; a backend whose connect fails is
+//      taken out of rotation and retried after a delay which doubles with
+//      each failure. The two legs of a relayed connection share the client's
+//      strand and a buffer received on one leg is queued as is for sending on
+//      the other, so the data is never copied. The watermarks apply to the
+//      data received on a leg and waiting to be sent on the other. When one
+//      side closes, the other is shut down for sending once the data in
+//      flight has been delivered; an error on either leg closes both. To try
+//      it on one machine, start a second instance as the backend:
+//          iocpserver.exe -e 5151
+//          iocpserver.exe -e 5150 -x localhost:5151
+//      and connect clients (e.g. chapter05's iocpclient) to port 5150. The
+//      statistics show each backend's state, pool and relayed connections.
+//
+//      Publish/subscribe mode (-ps) turns the server into a message broker.
+//      Clients send framed messages (-p len or line, line by default):
+//      "S topic" subscribes to a topic, "U topic" unsubscribes and
+//      "P topic data" publishes "topic data" to every subscriber of the
+//      topic. A published message is encoded once into a single reference
+//      counted buffer and each subscriber's send refers to that buffer, so a
+//      message going to thousands of subscribers costs one copy plus an
+//      object header per subscriber. The deliveries are queued on each
+//      subscriber's strand; a subscriber whose queue already holds the
+//      subscriber queue limit (-pq) is a slow consumer, and the policy given
+//      with -ps decides whether the message is dropped for it (drop) or the
+//      subscriber is disconnected (close). To benchmark the fan-out, connect
+//      many subscribers to a topic and a few publishers and compare the
+//      delivered messages per second and the memory per message in flight
+//      shown in the statistics; the latter is also given for a copy per
+//      subscriber.
+//
+//      Key-value mode (-k) makes the server a cache speaking the get, set
+//      and delete commands of the memcached text protocol, so memcached
+//      clients can use it as is. The commands are parsed as lines and the
+//      data block of a set is received as a frame of the announced length,
+//      so values are stored straight from the receive buffers. Commands are
+//      served on the completion threads, on the connection's strand, with
+//      no hand-off to other threads, and the replies to pipelined commands
+//      are collected into as few sends as possible. The store holds up to
+//      the given number of megabytes and -ki items, split into one
+//      partition per worker with its own lock, open addressing hash table
+//      and slab allocated values; items are evicted with the CLOCK
+//      algorithm (see kvstore.h). Values can't be larger than -pm bytes. To
+//      benchmark it on one machine, run kvbench against the server:
+//          iocpserver.exe -k 1024 -s
+//          kvbench.exe -c 32 -g 90 -d 30
+//      kvbench reports the operations per second and the latency
+//      percentiles of gets and sets; the server's statistics show the
+//      commands per second, the hit rate and the evictions.
+//
+//      Connections have no lock. Everything done to a connection -- its
+//      completions, its turn in the send scheduler, resuming its receives
+//      and checking its timeouts -- runs as work on the connection's strand,
+//      one item at a time. A thread which finds the strand idle runs the work
+//      itself; otherwise it queues the work for the thread that is already
+//      running the strand and moves on. In sharded mode a connection's
+//      strand only ever runs on its shard's thread.
+//
 //      This sample illustrates overlapped IO with a completion port for
 //      TCP over both IPv4 and IPv6. This sample uses the 
 //      getaddrinfo/getnameinfo APIs which allows this application to be 
@@ -74,17 +335,56 @@
 //          listens both IPv4 and IPv6 (if installed).
 //
 // Compile:
-//      cl -o iocpserver.exe iocpserver.cpp resolve.cpp ws2_32.lib
+//      cl -D_WIN32_WINNT=0x0601 -o iocpserver.exe iocpserver.cpp frame.cpp kvstore.cpp proactor.cpp pubsub.cpp resolve.cpp slab.cpp stats.cpp strand.cpp timer.cpp topology.cpp ws2_32.lib advapi32.lib
+//
+//      Needs the Windows 7 SDK or later and runs on Windows 7 or later (the
+//      makefile sets APPVER=6.1). RSS placement (-pin rss) needs the
+//      Windows 8 SDK; built with older headers the workers are still pinned
+//      but connections are handed to the shards in turn. UDP receive
+//      coalescing and send offload (-u) only take effect on Windows 10 or
+//      later; the option values are defined below for older SDKs.
 //
 // Usage:
 //      iocpserver.exe [options]
 //          -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]
+//          -ab count  Benchmark buffer allocation on 1 to count threads and exit
 //          -b size    Buffer size for send/recv
+//          -bb size   Buffer size of bulk connections
+//          -bk bytes  Switch connections receiving this much in full buffers to bulk mode
+//          -c list    Processors to run the workers on, e.g. 0-7,16-23 [default = all]
+//          -cf file   Read options from a configuration file
 //          -e port    Port number
+//          -f file    Append latency percentiles to file (comma separated)
+//          -k mbytes  Key-value mode (memcached get/set/delete) storing up to this many megabytes
+//          -ki count  Most items kept in key-value mode
 //          -l addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]
+//          -lp        Allocate the I/O buffers in large pages (needs "Lock pages in memory")
+//          -m bytes   Budget for data buffered by all connections
+//          -n count   Number of worker threads [default = one per processor]
 //          -os count  Maximum number of overlapped send operations to allow simultaneously (per socket)
 //          -oa count  Maximum number of overlapped accepts to allow simultaneously
-//          -o  count  Number of initial overlapped accepts to post
+//          -o  count  Number of initial (and minimum) overlapped accepts to post
+//          -p  mode   Message framing: raw (echo data as is), len (length prefixed) or line
+//          -pm bytes  Largest message accepted with -p len or -p line
+//          -pin mode  Worker placement: none, cpu, node or rss
+//          -ps policy Publish/subscribe mode; slow consumers: drop (messages) or close
+//          -pq bytes  Queued bytes which make a subscriber a slow consumer
+//          -wh bytes  Stop receiving on a connection with this many bytes queued
+//          -wl bytes  Resume receiving once the queued bytes fall to this many
+//          -ti secs   Close connections idle this long (0 = never)
+//          -tf secs   Close connections which send nothing this long after connecting
+//          -tr rate   Close connections sending fewer bytes per second than this
+//          -x list    Relay connections to these backends, e.g. host1:80,host2:80
+//          -xp count  Connections to keep ready to each backend
+//          -u         Echo UDP datagrams instead of TCP
+//          -ug bytes  Largest coalesced UDP receive, 0 = no segmentation offload
+//          -uo count  Number of receives to keep pending per UDP socket
+//          -q usecs   Shed load when the completion queue delay exceeds this (0 = never)
+//          -r         Ready mode: read ready data with recv and drain the accept backlog (implies -z)
+//          -s         Sharded mode: one completion queue and worker thread per CPU
+//          -sp usecs  Poll the completion queue this long before blocking (0 = never poll)
+//          -z         Post zero byte receives on idle connections
+//          -zc bytes  Send without copying on connections receiving this much at once
 //
 
 #include <winsock2.h>
@@ -94,16 +394,83 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "frame.h"
+#include "kvstore.h"
+#include "proactor.h"
+#include "pubsub.h"
 #include "resolve.h"
+#include "slab.h"
+#include "stats.h"
+#include "strand.h"
+#include "timer.h"
+#include "topology.h"
+
+// UDP segmentation offload and receive coalescing are only defined by the
+//    Windows 10 SDK; older stacks fail these options and the server falls
+//    back to one datagram per receive and send
+#ifndef UDP_SEND_MSG_SIZE
+#define UDP_SEND_MSG_SIZE           2
+#endif
+#ifndef UDP_RECV_MAX_COALESCED_SIZE
+#define UDP_RECV_MAX_COALESCED_SIZE 3
+#endif
+#ifndef UDP_COALESCED_INFO
+#define UDP_COALESCED_INFO          UDP_RECV_MAX_COALESCED_SIZE
+#endif
 
 #define DEFAULT_BUFFER_SIZE         4096   // default buffer size
+#define DEFAULT_BULK_BUFFER_SIZE    65536  // buffer size of bulk connections
 #define DEFAULT_OVERLAPPED_COUNT    5      // Number of overlapped recv per socket
 #define MAX_OVERLAPPED_ACCEPTS      500
 #define MAX_OVERLAPPED_SENDS        200
 #define MAX_OVERLAPPED_RECVS        200
-#define MAX_COMPLETION_THREAD_COUNT 32     // Maximum number of completion threads allowed
+#define MAX_COMPLETION_THREAD_COUNT 512    // Maximum number of completion threads allowed
+#define MAX_CONFIG_ARGS             256    // Most options in a configuration file
+
+#define ACCEPT_CONTROL_INTERVAL     1000   // Milliseconds between accept pool adjustments
+#define ACCEPT_HEADROOM             4      // Refill periods worth of accepts kept pending
+#define ACCEPT_DRAIN_COUNT          64     // Most backlog connections taken per completed accept
+
+#define RECV_DRAIN_COUNT            4      // Most buffers read per ready notification
+
+#define MAGAZINE_SIZE               32     // BUFFER_OBJ cached per magazine
+#define ALLOC_BENCH_TIME            2000   // Milliseconds each allocation benchmark run lasts
+#define ALLOC_BENCH_BATCH           100    // BUFFER_OBJ a benchmark thread holds at once
+
+#define DEFAULT_HIGH_WATERMARK      65536  // Queued bytes at which a connection stops receiving
+#define DEFAULT_LOW_WATERMARK       16384  // Queued bytes at which it receives again
+#define DEFAULT_BUFFER_BUDGET       (64 * 1024 * 1024) // Bytes buffered by all connections
+
+#define TIMER_TICK                  100    // Milliseconds per tick of the timer wheels
+#define DEFAULT_IDLE_TIMEOUT        300    // Seconds a connection may be idle
+#define MIN_RATE_WINDOW             10000  // Milliseconds over which the minimum rate is measured
+
+#define DEFAULT_MAX_FRAME           16384  // Largest message accepted when framing
+
+#define DEFAULT_SUBSCRIBER_QUEUE    262144 // Queued bytes which make a subscriber a slow consumer
+
+#define DEFAULT_KV_ITEMS            1048576 // Most items kept in key-value mode
+#define KV_MAX_COMMAND              2048   // Longest command line in key-value mode
+#define KV_MAX_TOKENS               128    // Most words in a command line
+
+#define SLOW_CONSUMER_DROP          0      // Slow consumer policies (-ps)
+#define SLOW_CONSUMER_CLOSE         1
+
+#define LOAD_PROBE_INTERVAL         50     // Milliseconds between completion queue delay probes
+#define LOAD_SHED_FACTOR            4      // Multiple of the delay mark (-q) at which load is shed
 
-#define BURST_ACCEPT_COUNT          100
+#define LOAD_NORMAL                 0      // Load levels (see UpdateLoadLevel)
+#define LOAD_HIGH                   1
+#define LOAD_SHED                   2
+
+#define DEFAULT_BACKEND_POOL        8      // Connections kept ready to each backend of the relay
+#define BACKEND_RETRY_MIN           1000   // Milliseconds before a failed backend is tried again
+#define BACKEND_RETRY_MAX           30000  // Longest delay between tries of a failed backend
+
+#define DEFAULT_DGRAM_RECVS         64     // Receives pending per UDP socket
+#define DEFAULT_DGRAM_COALESCE      65527  // Largest coalesced UDP receive (64KB less the UDP header)
+#define DGRAM_SOCKET_BUFFER         (4 * 1024 * 1024) // Receive buffer absorbing bursts of datagrams
+#define DGRAM_CONTROL_SIZE          64     // Ancillary data of a datagram receive or send
 
 int gAddressFamily = AF_UNSPEC,         // default to unspecified
     gSocketType    = SOCK_STREAM,       // default to TCP socket type
@@ -112,23 +479,112 @@ int gAddressFamily = AF_UNSPEC,         // default to unspecified
     gInitialAccepts= DEFAULT_OVERLAPPED_COUNT,
     gMaxAccepts    = MAX_OVERLAPPED_ACCEPTS,
     gMaxReceives   = MAX_OVERLAPPED_RECVS,
-    gMaxSends      = MAX_OVERLAPPED_SENDS;
+    gMaxSends      = MAX_OVERLAPPED_SENDS,
+    gHighWatermark = DEFAULT_HIGH_WATERMARK,
+    gLowWatermark  = DEFAULT_LOW_WATERMARK,
+    gIdleTimeout   = DEFAULT_IDLE_TIMEOUT,
+    gFirstByteTimeout = 0,
+    gMinRate       = 0,
+    gZeroCopyThreshold = 0,             // Receive size which switches a connection to zero copy sends
+    gBulkThreshold = 0,                 // Bytes in full buffers which switch a connection to bulk mode
+    gBulkBufferSize= DEFAULT_BULK_BUFFER_SIZE,
+    gSpinBudget    = 0,                 // Microseconds workers poll before blocking (-sp)
+    gOverloadDelay = 0,                 // Completion queue delay (microseconds) of high load (-q)
+    gFrameMode     = FRAME_MODE_RAW,    // Message framing (-p)
+    gMaxFrameLength= DEFAULT_MAX_FRAME,
+    gSubscriberQueue = DEFAULT_SUBSCRIBER_QUEUE,
+    gSlowConsumerPolicy = SLOW_CONSUMER_DROP,
+    gKvMemory      = 0,                 // Megabytes of the key-value store (-k)
+    gKvItems       = DEFAULT_KV_ITEMS,
+    gBackendPool   = DEFAULT_BACKEND_POOL,  // Connections kept ready to each backend (-xp)
+    gDgramReceives = DEFAULT_DGRAM_RECVS,
+    gDgramCoalesce = DEFAULT_DGRAM_COALESCE;
+
+LPFRAME_HANDLER gFrameHandler = FrameEchoHandler;   // Called with each message when framing
+
+LONGLONG gMaxBufferedBytes    = DEFAULT_BUFFER_BUDGET,
+         gResumeBufferedBytes = 0;      // Paused connections resume below this
+
+BOOL gSharded      = FALSE,             // one completion queue per worker thread?
+     gZeroByteRecv = FALSE,             // post zero byte receives on idle connections?
+     gLargePages   = FALSE,             // allocate buffer slabs in large pages?
+     gReadyMode    = FALSE,             // read ready data and drain the accept backlog synchronously?
+     gPubSub       = FALSE,             // publish/subscribe instead of echo?
+     gKvStore      = FALSE;             // key-value store instead of echo?
+
+int   gWorkerCount = 0,                 // completion threads, 0 = one per processor
+      gAllocBenchThreads = 0,           // most threads of the allocation benchmark (-ab)
+      gPlacement   = -1;                // PLACE_* for the workers, -1 = by mode
+
+char *gCpuList     = NULL;              // processors to run the workers on
 
 char *gBindAddr    = NULL,              // local interface to bind to
-     *gBindPort    = "5150";            // local port to bind to
+     *gBindPort    = "5150",            // local port to bind to
+     *gLatencyFile = NULL,              // file latency percentiles are written to
+     *gBackendList = NULL;              // backends of the relay (-x)
+
+FILE *gLatencyFp   = NULL;
 
 //
-// Statistics counters
+// Statistics counters. These are kept per thread (see stats.h) and summed
+//    when printed.
 //
-volatile LONG gBytesRead=0,
-              gBytesSent=0,
-              gStartTime=0,
-              gBytesReadLast=0,
-              gBytesSentLast=0,
+#define STAT_BYTES_READ     0
+#define STAT_BYTES_SENT     1
+#define STAT_CONNECTIONS    2
+#define STAT_ZEROCOPY_BYTES 3           // Bytes sent directly from the receive buffers
+#define STAT_FRAMES         4           // Messages handled when framing
+#define STAT_RECV_WAKEUPS   5           // Zero byte receives completed
+#define STAT_READY_READS    6           // Buffers read with recv in ready mode
+#define STAT_DGRAMS_READ    7           // UDP datagrams received
+#define STAT_DGRAMS_SENT    8           // UDP datagrams echoed
+#define STAT_DGRAM_RECVS    9           // UDP receives completed (several datagrams if coalesced)
+#define STAT_BULK_BYTES     10          // Bytes received into bulk buffers
+#define STAT_PUBLISHED      11          // Messages published
+#define STAT_FANOUT_SENT    12          // Published messages sent to a subscriber
+#define STAT_FANOUT_DROPS   13          // Published messages dropped for slow consumers
+#define STAT_KV_COMMANDS    14          // Commands handled in key-value mode
+
+//
+// Latency histograms
+//
+#define HIST_ACCEPT         0           // AcceptEx posted until completed
+#define HIST_TURNAROUND     1           // Receive completed until echoed back
+#define HIST_SEND           2           // WSASend posted until completed
+#define HIST_SCHEDULER      3           // Send queued until the scheduler posted it
+
+volatile LONG gStartTime=0,
               gStartTimeLast=0,
-              gConnections=0,
+              gCurrentConnections=0,
+              gOutstandingSends=0,
+              gPausedConnections=0,     // Connections with their receive paused
+              gRecvPauses=0,            // Times a receive was paused
+              gRecvResumes=0,           // Times a paused receive was posted
+              gFirstByteTimeouts=0,     // Connections closed by the timer wheel
+              gIdleTimeouts=0,
+              gSlowTimeouts=0,
+              gZeroCopyConnections=0,   // Connections whose sends bypass the send buffer
+              gBulkConnections=0,       // Connections using bulk buffers
+              gLoadLevel=LOAD_NORMAL,   // Current LOAD_* level
+              gLoadChanges=0,           // Times the level changed
+              gShedConnections=0,       // Connections reset while shedding load
+              gDeferredConnections=0,   // Connections whose first receive waited for the load to drop
+              gRelayRejected=0,         // Clients closed for lack of a backend connection
+              gSlowConsumers=0,         // Subscribers closed for falling behind
+              gDeliveries=0;            // Sends of published messages not yet completed
+
+volatile LONGLONG gBufferedBytes=0;     // Bytes received by all connections but not yet sent
+
+ULONGLONG     gBytesReadLast=0,         // Counter values at the start of the interval
+              gBytesSentLast=0,
               gConnectionsLast=0,
-              gOutstandingSends=0;
+              gDgramsReadLast=0,
+              gDgramsSentLast=0,
+              gDgramRecvsLast=0,
+              gPublishedLast=0,
+              gFanoutSentLast=0,
+              gKvCommandsLast=0,
+              gCpuTimeLast=0;           // Process time (100ns units)
 
 
 //
@@ -146,40 +602,198 @@ typedef struct _BUFFER_OBJ
     int                  buflen;        // Length of the buffer
 
     int                  operation;     // Type of operation issued
+    BOOL                 bBulk;         // Is the data buffer a bulk buffer?
 #define OP_ACCEPT       0                   // AcceptEx
 #define OP_READ         1                   // WSARecv/WSARecvFrom
 #define OP_WRITE        2                   // WSASend/WSASendTo
+#define OP_READ_ZERO    3                   // Zero byte WSARecv (no data buffer)
+#define OP_ACCEPTED     4                   // Accepted connection handed to its strand
+#define OP_READ_DGRAM   5                   // WSARecvMsg on a UDP socket
+#define OP_WRITE_DGRAM  6                   // WSASendMsg of the datagrams received
+#define OP_PROBE        7                   // Completion queue delay probe (see PostLoadProbe)
+#define OP_CONNECT      8                   // ConnectEx to a backend of the relay
 
     SOCKADDR_STORAGE     addr;
     int                  addrlen;
 
+    LONGLONG             QueuedTime,    // When a send was queued (performance counter)
+                         PostTime;      // When the operation was posted (performance counter)
+
     struct _SOCKET_OBJ  *sock;
 
-    struct _BUFFER_OBJ  *next;
+    FRAME_BUFFER         Frame;         // References to the received data when framing
+    FRAME_RESPONSE      *response;      // Gathered send of a framed response
+    PUBSUB_MESSAGE      *message;       // Published message sent to a subscriber
+
+    STRAND_WORK          Work;          // Runs the completion on the socket's strand
+    DWORD                BytesTransfered,
+                         Error;         // Result of the completed operation
+
+    struct _BUFFER_OBJ  *next,
+                        *prev;          // Used for the listening object's pending accepts
 
 } BUFFER_OBJ;
 
+//
+// A shard is a completion queue together with the send scheduler's list of
+//    ready sockets. Normally there is a single shard serviced by all the
+//    completion threads. In sharded mode (-s) each completion thread has its
+//    own shard and each connection is serviced by only one of them.
+//
+typedef struct _SHARD
+{
+    SLIST_HEADER       ReadyList;       // Sockets with queued sends waiting for the scheduler
+    SLIST_HEADER       PausedList;      // Sockets waiting for the buffered byte budget
+    CRITICAL_SECTION   DeferredCritSec; // Protects the deferred list
+    struct _SOCKET_OBJ *DeferredHead;   // New connections waiting for the load to drop
+    volatile LONG      bResumeDeferred; // Has the load dropped back to normal since?
+
+    PROACTOR          *proactor;        // Completion queue of this shard
+    TIMER_WHEEL       *wheel;           // Timers of the connections in this shard
+
+    BUFFER_OBJ         Probe;           // Measures the completion queue delay
+    volatile LONG      bProbePending;   // Is the probe in the queue?
+    ULONG              ProbeTime;       // GetTickCount when the probe was last posted
+    volatile LONG      QueueDelay;      // Smoothed completion queue delay (microseconds)
+} SHARD;
+
+//
+// A completion thread. Workers are assigned to the shards round robin.
+//
+typedef struct _WORKER
+{
+    HANDLE             Thread;
+    SHARD             *shard;           // Shard serviced by this worker
+    int                Cpu;             // Processor the worker is placed on
+
+    ULONGLONG          Completions,     // Completions handled (updated by the worker)
+                       SpinHits,        // Batches found while polling (see -sp)
+                       Parks,           // Waits which blocked in the kernel
+                       Dgrams,          // UDP datagrams received
+                       CompletionsLast, // Values at the last statistics interval
+                       SpinHitsLast,
+                       ParksLast,
+                       DgramsLast,
+                       CpuTimeLast;     // Processor time (100ns units)
+    ULONG              LastSample;      // GetTickCount of the last interval
+} WORKER;
+
 //
 // This is our per socket buffer. It contains information about the socket handle
 //    which is returned from each GetQueuedCompletionStatus call.
 //
 typedef struct _SOCKET_OBJ
 {
+    SLIST_ENTRY        ReadyEntry,      // Link in the send scheduler's ready list
+                       PausedEntry;     // Link in the shard's paused list
+
     SOCKET             s;               // Socket handle
 
     int                af,              // Address family of socket (AF_INET, AF_INET6)
                        bClosing;        // Is the socket closing?
 
-    volatile LONG      OutstandingRecv, // Number of outstanding overlapped ops on 
+    LONG               OutstandingRecv, // Number of outstanding overlapped ops on 
                        OutstandingSend,
                        PendingSend;
 
-
-    CRITICAL_SECTION   SockCritSec;     // Protect access to this structure
+    BUFFER_OBJ        *PendingSendHead, // Sends waiting to be posted on this socket
+                      *PendingSendTail;
+    BOOL               bReady;          // Is the socket on the ready list?
+    LONG               Deficit;         // Deficit round robin byte credit
+
+    LONG               QueuedBytes;     // Bytes received but not yet sent
+    BOOL               bRecvPaused,     // Is the next receive held back?
+                       bOnPausedList,   // Is the socket on the shard's paused list?
+                       bZeroCopy,       // Has the send buffer been disabled (SO_SNDBUF 0)?
+                       bBulk,           // Are bulk buffers received into?
+                       bDeferred,       // Was it accepted under high load (see PostNextRecv)?
+                       bOnDeferredList; // Is the socket on the shard's deferred list?
+    struct _SOCKET_OBJ *DeferredPrev,   // Links in the shard's deferred list
+                      *DeferredNext;
+    LONG               FullRun;         // Bytes received in full buffers in a row
+    int                SendBufferSize;  // SO_SNDBUF before zero copy sends were enabled
+
+    SHARD             *shard;           // Shard servicing this connection
+
+    TIMER              Timer;           // Idle, first byte and minimum rate deadlines
+    ULONG              AcceptTime,      // GetTickCount when the connection was accepted
+                       LastActivity,    // GetTickCount of the last completed receive or send
+                       RateCheckTime;   // Start of the current minimum rate window
+    ULONGLONG          BytesReceived,   // Bytes received on the connection
+                       BytesAtRateCheck;// BytesReceived at the start of the window
+
+    FRAME_PARSER       Parser;          // Message being received when framing
+    PUBSUB_CLIENT      PubSub;          // Topics subscribed to (-ps)
+
+    BUFFER_OBJ        *KvReply;         // Reply being collected in key-value mode (-k)
+    char               KvKey[KV_MAX_KEY]; // Key of a set waiting for its data block
+    ULONG              KvKeyLength,
+                       KvFlags;
+    LONG               KvExptime;
+    BOOL               bKvData,         // Is the next message a set's data block?
+                       bKvNoReply;      // Was the set sent with noreply?
+
+    STRAND             Strand;          // Serializes all work on this structure
+    STRAND            *strand;          // Strand the work runs on: Strand, or the client's
+                                        //    for a backend connection paired with a client
+    STRAND_WORK        Kick;            // Handles the signals below on the strand
+    volatile LONG      Signals;         // Work requested by other threads
+#define SIGNAL_SEND     1                   // Scheduler turn to send queued data
+#define SIGNAL_RESUME   2                   // Budget available to resume receiving
+#define SIGNAL_TIMER    4                   // Timer expired, check the deadlines
+
+    struct _SOCKET_OBJ *peer;           // Other leg of a relayed connection
+    struct _BACKEND    *backend;        // Backend of a pooled connection, NULL for a client
+    int                 PoolState;      // State of a backend connection (see GetBackendStrand)
+#define POOL_CONNECTING 0                   // ConnectEx outstanding
+#define POOL_IDLE       1                   // In the backend's pool
+#define POOL_PAIRED     2                   // Relaying for a client
+#define POOL_DROPPED    3                   // Closed by the backend while idle
+    BOOL                bShutdown;      // Has the end of the relayed data been sent?
 
     struct _SOCKET_OBJ  *next;
 } SOCKET_OBJ;
 
+//
+// The connections to a backend serviced by one shard. A client is only
+//    paired with a connection from its own shard's pool.
+//
+typedef struct _BACKEND_POOL
+{
+    SOCKET_OBJ         *Idle;           // Connections ready to be paired
+    int                 IdleCount,
+                        Connecting;     // ConnectEx outstanding
+} BACKEND_POOL;
+
+//
+// A backend of the relay (-x). Connections to it are established ahead of
+//    time and kept in a pool until a client is paired with one.
+//
+typedef struct _BACKEND
+{
+    char               *host,           // As given with -x
+                       *port;
+    SOCKADDR_STORAGE    addr;           // Address connections are made to
+    int                 addrlen;
+
+    LPFN_CONNECTEX      lpfnConnectEx;
+
+    CRITICAL_SECTION    BackendCritSec; // Protects the pools and the PoolState of their connections
+    BACKEND_POOL       *Pools;          // One per shard, indexed as gShards
+    int                 IdleCount,      // Totals over the pools
+                        Connecting;
+    BOOL                bHealthy;       // Is it paired with clients?
+    ULONG               RetryDelay,     // Milliseconds to wait after the next failure
+                        DownUntil;      // GetTickCount before which no connect is tried
+
+    volatile LONG       Active,         // Relayed connections, the balancing measure
+                        Relayed,        // Clients paired with it
+                        Failures,       // Failed connects
+                        Dropped;        // Idle connections closed by the backend
+
+    struct _BACKEND    *next;
+} BACKEND;
+
 //
 //
 //
@@ -193,12 +807,26 @@ typedef struct _LISTEN_OBJ
                                
     volatile long   PendingAcceptCount;
 
-    int             HiWaterMark,
-                    LoWaterMark;
+    // The pool of pending accepts is topped up to TargetAcceptCount. The
+    //    target is adjusted by UpdateAcceptTarget on the main thread; the
+    //    accept and refused counts are updated by the completion threads.
+    volatile long   TargetAcceptCount;
+
+    volatile long   AcceptCount,        // Accepts completed
+                    RefusedCount,       // Connections dropped while being accepted
+                    ExhaustedCount,     // Times a connection found no AcceptEx pending
+                    DrainedCount;       // Connections taken from the backlog with accept
+
+    long            AcceptCountLast,
+                    ExhaustedCountLast;
+
+    ULONG           AcceptRate,         // Smoothed accepts per second
+                    RefillLatency,      // Smoothed microseconds to replace a completed accept
+                    LastUpdate;         // GetTickCount of the last adjustment
 
     HANDLE          AcceptEvent;
     HANDLE          RepostAccept;
-    volatile long   RepostCount;
+    volatile LONGLONG RepostRequested;  // When the oldest unanswered repost was requested
 
     // Pointers to Microsoft specific extensions.
     LPFN_ACCEPTEX             lpfnAcceptEx;
@@ -209,21 +837,127 @@ typedef struct _LISTEN_OBJ
     struct _LISTEN_OBJ *next;
 } LISTEN_OBJ;
 
+//
+// A UDP socket of the datagram echo (-u)
+//
+typedef struct _DGRAM_OBJ
+{
+    SOCKET              s;
+    int                 AddressFamily;
+    LPFN_WSARECVMSG     lpfnWSARecvMsg;
+    DWORD               Coalesce;       // Largest coalesced receive, 0 if not supported
+
+    struct _DGRAM_OBJ  *next;
+} DGRAM_OBJ;
+
+//
+// A receive on a UDP socket. Once it completes, the same buffer is sent back
+//    and then received into again, so the datagrams are never copied.
+//
+typedef struct _DGRAM_BUFFER
+{
+    BUFFER_OBJ          Buffer;         // Overlapped, data buffer and sender's address
+    WSAMSG              Msg;
+    WSABUF              Data;
+    char                Control[DGRAM_CONTROL_SIZE];
+    DWORD               Segment;        // Size of the datagrams in a coalesced receive
+} DGRAM_BUFFER;
+
+//
+// A magazine is a small stack of free BUFFER_OBJ. Each completion thread holds
+//    two magazines (loaded and previous) so that most allocations and frees are
+//    satisfied without taking any lock. Only when both are empty (or full) does
+//    the thread exchange a magazine with the global depot.
+//
+typedef struct _BUFFER_MAGAZINE
+{
+    int                      Count;     // Number of valid entries in Objs
+    BUFFER_OBJ              *Objs[MAGAZINE_SIZE];
+
+    struct _BUFFER_MAGAZINE *next;
+} BUFFER_MAGAZINE;
+
+//
+// Per completion thread cache of BUFFER_OBJ
+//
+typedef struct _BUFFER_CACHE
+{
+    BUFFER_MAGAZINE *Loaded,            // Magazine allocations/frees go to first
+                    *Previous;          // Swapped with Loaded before visiting the depot
+} BUFFER_CACHE;
+
+//
+// A thread of the allocation benchmark (-ab)
+//
+typedef struct _ALLOC_BENCH
+{
+    HANDLE           Thread;
+    HANDLE           Start;             // Set when all threads of the run may go
+    volatile LONG   *Stop;              // Set when the run is over
+    BOOL             bCached;           // Use a magazine cache like a completion thread?
+    ULONGLONG        Allocs;            // Objects allocated and freed
+} ALLOC_BENCH;
+
 // Serialize access to the free lists below
 CRITICAL_SECTION gBufferListCs,
-                 gSocketListCs,
-                 gPendingCritSec;
+                 gSocketListCs;
 
 // Lookaside lists for free buffers and socket objects
-BUFFER_OBJ *gFreeBufferList=NULL;
+BUFFER_OBJ *gFreeBufferList=NULL,
+           *gFreeZeroByteList=NULL,     // BUFFER_OBJ without data for zero byte receives
+           *gFreeBulkList=NULL;         // BUFFER_OBJ with bulk buffers
 SOCKET_OBJ *gFreeSocketList=NULL;
 
-BUFFER_OBJ *gPendingSendList=NULL,
-           *gPendingSendListEnd=NULL;
+// Magazine depot (protected by gBufferListCs)
+BUFFER_MAGAZINE *gFullMagazines=NULL,
+                *gEmptyMagazines=NULL;
+
+// Slab each NUMA node's new BUFFER_OBJ are carved from (protected by gBufferListCs)
+BUFFER_SLAB     *gBufferSlabs[SLAB_MAX_NODES],
+                *gBulkSlabs[SLAB_MAX_NODES];
+
+// Buffer cache of the calling completion thread (NULL for other threads)
+__declspec(thread) BUFFER_CACHE *tBufferCache=NULL;
+
+// The calling completion thread (NULL for other threads)
+__declspec(thread) WORKER       *tWorker=NULL;
+
+volatile LONG gBufferObjAllocs=0,       // BUFFER_OBJ allocated from the heap
+              gBulkObjAllocs=0,         // BUFFER_OBJ with bulk buffers allocated
+              gZeroByteObjAllocs=0,     // Zero byte receive objects allocated from the heap
+              gSocketObjAllocs=0,       // SOCKET_OBJ allocated from the heap
+              gMagazineExchanges=0;     // Magazines exchanged with the depot
+
+// Completion queues and their send schedulers
+SHARD        *gShards=NULL;
+int           gShardCount=1;
+volatile LONG gNextShard=0;             // Round robin assignment of connections to shards
+
+LISTEN_OBJ   *gListenSockets=NULL;      // Listeners woken when the load drops
+
+BACKEND      *gBackends=NULL;           // Backends of the relay (-x), NULL when echoing
+
+// Completion threads
+WORKER       *gWorkers=NULL;
+HANDLE        gWorkerExit=NULL;         // Set when a worker exits
+int           gCpuShard[TOPOLOGY_MAX_CPUS]; // Shard servicing connections received on each processor
+volatile LONG gRssPlaced=0;             // Connections placed on their RSS processor's shard
+
+LARGE_INTEGER gPerfFrequency;           // Performance counter ticks per second
 
 int  PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj);
 int  PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj);
 void FreeBufferObj(BUFFER_OBJ *obj);
+void FreeSocketObj(SOCKET_OBJ *obj);
+void DeferSocket(SOCKET_OBJ *sock);
+BOOL UndeferSocket(SOCKET_OBJ *sock);
+void ResumeRecv(SOCKET_OBJ *sock);
+void EnableZeroCopySend(SOCKET_OBJ *sock);
+void UpdateLoadLevel();
+void ValidateArgs(int argc, char **argv);
+void SignalSocket(SOCKET_OBJ *sock, LONG signal);
+BOOL PostSocketSignal(SOCKET_OBJ *sock, LONG signal);
+void SocketSignalWork(STRAND_WORK *work);
 
 //
 // Function: usage
@@ -233,18 +967,61 @@ void FreeBufferObj(BUFFER_OBJ *obj);
 //
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s [-a 4|6] [-e port] [-l local-addr] [-p udp|tcp]\n",
+    fprintf(stderr, "usage: %s [-a 4|6] [-e port] [-l local-addr] [-p raw|len|line]\n",
             progname);
     fprintf(stderr, "  -a  4|6     Address family, 4 = IPv4, 6 = IPv6 [default = IPv4]\n"
+                    "  -ab count   Benchmark buffer allocation on 1 to count threads and exit\n"
                     "  -b  size    Buffer size for send/recv [default = %d]\n"
+                    "  -bb size    Buffer size of bulk connections [default = %d]\n"
+                    "  -bk bytes   Switch connections receiving this much in full buffers to bulk mode\n"
+                    "  -c  list    Processors to run the workers on, e.g. 0-7,16-23 [default = all]\n"
+                    "  -cf file    Read options from a configuration file\n"
                     "  -e  port    Port number [default = %s]\n"
+                    "  -f  file    Append latency percentiles to file (comma separated)\n"
+                    "  -k  mbytes  Key-value mode (memcached get/set/delete) storing up to this many megabytes\n"
+                    "  -ki count   Most items kept in key-value mode [default = %d]\n"
                     "  -l  addr    Local address to bind to [default INADDR_ANY for IPv4 or INADDR6_ANY for IPv6]\n"
+                    "  -lp         Allocate the I/O buffers in large pages\n"
+                    "  -m  bytes   Budget for data buffered by all connections [default = %I64d]\n"
+                    "  -n  count   Number of worker threads [default = one per processor]\n"
                     "  -oa count   Maximum overlapped accepts to allow\n"
                     "  -os count   Maximum overlapped sends to allow\n"
                     "  -or count   Maximum overlapped receives to allow\n"
-                    "  -o  count   Initial number of overlapped accepts to post\n",
+                    "  -o  count   Initial (and minimum) number of overlapped accepts to post\n"
+                    "  -p  mode    Message framing: raw, len (length prefixed) or line [default = raw]\n"
+                    "  -pm bytes   Largest message accepted when framing [default = %d]\n"
+                    "  -pin mode   Worker placement: none, cpu, node or rss [default = cpu if sharded, else none]\n"
+                    "  -ps policy  Publish/subscribe mode; slow consumers: drop (messages) or close\n"
+                    "  -pq bytes   Queued bytes which make a subscriber a slow consumer [default = %d]\n"
+                    "  -wh bytes   Stop receiving on a connection with this many bytes queued [default = %d]\n"
+                    "  -wl bytes   Resume receiving once the queued bytes fall to this many [default = %d]\n"
+                    "  -ti secs    Close connections idle this long, 0 = never [default = %d]\n"
+                    "  -tf secs    Close connections which send nothing this long after connecting\n"
+                    "  -tr rate    Close connections sending fewer bytes per second than this\n"
+                    "  -x  list    Relay connections to these backends, e.g. host1:80,host2:80\n"
+                    "  -xp count   Connections to keep ready to each backend [default = %d]\n"
+                    "  -u          Echo UDP datagrams instead of TCP\n"
+                    "  -ug bytes   Largest coalesced UDP receive, 0 = no offload [default = %d]\n"
+                    "  -uo count   Receives to keep pending per UDP socket [default = %d]\n"
+                    "  -q  usecs   Shed load when the completion queue delay exceeds this [default = never]\n"
+                    "  -r          Ready mode: read ready data with recv and drain the accept backlog\n"
+                    "  -s          Sharded mode: one completion queue and worker thread per CPU\n"
+                    "  -sp usecs   Poll the completion queue this long before blocking [default = 0]\n"
+                    "  -z          Post zero byte receives on idle connections\n"
+                    "  -zc bytes   Send without copying on connections receiving this much at once\n",
                     gBufferSize,
-                    gBindPort
+                    DEFAULT_BULK_BUFFER_SIZE,
+                    gBindPort,
+                    DEFAULT_KV_ITEMS,
+                    gMaxBufferedBytes,
+                    DEFAULT_MAX_FRAME,
+                    DEFAULT_SUBSCRIBER_QUEUE,
+                    gHighWatermark,
+                    gLowWatermark,
+                    gIdleTimeout,
+                    DEFAULT_BACKEND_POOL,
+                    DEFAULT_DGRAM_COALESCE,
+                    DEFAULT_DGRAM_RECVS
                     );
     ExitProcess(-1);
 }
@@ -270,101 +1047,259 @@ void dbgprint(char *format,...)
 #endif
 }
 
+//
+// Function: EchoTarget
+//
+// Description:
+//    Returns the connection the data received on sock is sent out on: sock
+//    itself when echoing, the other leg when relaying (-x). Its queued bytes
+//    are what the watermarks of sock's receives are measured against.
+//
+SOCKET_OBJ *EchoTarget(SOCKET_OBJ *sock)
+{
+    return (sock->peer) ? sock->peer : sock;
+}
+
+//
+// Function: CloseRelayPeer
+//
+// Description:
+//    Closes the other leg of a relayed connection after an error on sock.
+//    As with a timed out connection, its outstanding operations then fail
+//    and a paused receive is dropped. Must be called on the socket's strand.
+//
+void CloseRelayPeer(SOCKET_OBJ *sock)
+{
+    SOCKET_OBJ *peer=NULL;
+
+    peer = sock->peer;
+    if ((peer == NULL) || (peer->s == INVALID_SOCKET))
+        return;
+
+    peer->bClosing = TRUE;
+
+    closesocket(peer->s);
+    peer->s = INVALID_SOCKET;
+
+    ResumeRecv(peer);
+}
+
 //
 // Function: EnqueuePendingOperation
 //
 // Description:
-//    Enqueues a buffer object into a list (at the end).
+//    Enqueues a send buffer object at the end of the socket's pending send
+//    queue. If the socket was idle it is placed on the scheduler's ready list.
+//    Must be called on the socket's strand.
 //
-void EnqueuePendingOperation(BUFFER_OBJ **head, BUFFER_OBJ **end, BUFFER_OBJ *obj, int op)
+void EnqueuePendingOperation(SOCKET_OBJ *sock, BUFFER_OBJ *obj)
 {
-    EnterCriticalSection(&gPendingCritSec);
+    LARGE_INTEGER now;
 
-    if (op == OP_READ)
-        ;
-    else if (op == OP_WRITE)
-        InterlockedIncrement(&obj->sock->PendingSend);
+    QueryPerformanceCounter(&now);
 
-    obj->next = NULL;
-    if (*end)
+    obj->QueuedTime = now.QuadPart;
+    obj->next       = NULL;
+
+    sock->PendingSend++;
+
+    sock->QueuedBytes += obj->buflen;
+    InterlockedExchangeAdd64(&gBufferedBytes, obj->buflen);
+
+    if (sock->PendingSendTail)
     {
-        (*end)->next = obj;
-        (*end) = obj;
+        sock->PendingSendTail->next = obj;
+        sock->PendingSendTail       = obj;
     }
     else
     {
-        (*head) = (*end) = obj;
+        sock->PendingSendHead = sock->PendingSendTail = obj;
+    }
+
+    if (sock->bReady == FALSE)
+    {
+        sock->bReady = TRUE;
+        InterlockedPushEntrySList(&sock->shard->ReadyList, &sock->ReadyEntry);
     }
-    LeaveCriticalSection(&gPendingCritSec);
 
     return;
 }
 
 //
-// Function: DequeuePendingOperation
+// Function: ReleaseQueuedBytes
 //
 // Description:
-//    Dequeues the first entry in the list.
+//    Removes data that has been sent (or dropped) from the connection's and
+//    the server's buffered byte counts. When the server's usage falls below
+//    the resume mark, shards holding connections paused for the budget are
+//    woken so they can resume them. Must be called on the socket's strand.
 //
-BUFFER_OBJ *DequeuePendingOperation(BUFFER_OBJ **head, BUFFER_OBJ **end, int op)
+void ReleaseQueuedBytes(SOCKET_OBJ *sock, int bytes)
 {
-    BUFFER_OBJ *obj=NULL;
-
-    EnterCriticalSection(&gPendingCritSec);
+    LONGLONG    total;
+    int         i;
 
-    if (*head)
-    {
-        obj = *head;
+    sock->QueuedBytes -= bytes;
 
-        (*head) = obj->next;
+    total = InterlockedExchangeAdd64(&gBufferedBytes, -bytes) - bytes;
 
-        // If next is NULL, no more objects are in the queue
-        if (obj->next == NULL)
+    if ((total < gResumeBufferedBytes) && (total + bytes >= gResumeBufferedBytes))
+    {
+        for(i=0; i < gShardCount ;i++)
         {
-            (*end) = NULL;
+            if (QueryDepthSList(&gShards[i].PausedList) > 0)
+            {
+                ProactorPost(gShards[i].proactor, 0, NULL, 0);
+            }
         }
+    }
+}
 
-        if (op == OP_READ)
-            ;
-        else if (op == OP_WRITE)
-            InterlockedDecrement(&obj->sock->PendingSend);
+//
+// Function: DequeuePendingOperation
+//
+// Description:
+//    Dequeues the first send on the socket if the socket's deficit covers it.
+//    The time spent in the queue is recorded in the scheduler histogram. Must
+//    be called on the socket's strand.
+//
+BUFFER_OBJ *DequeuePendingOperation(SOCKET_OBJ *sock)
+{
+    BUFFER_OBJ   *obj=NULL;
+
+    obj = sock->PendingSendHead;
+    if ((obj == NULL) || (obj->buflen > sock->Deficit))
+    {
+        return NULL;
+    }
+
+    sock->PendingSendHead = obj->next;
+
+    // If next is NULL, no more objects are in the queue
+    if (obj->next == NULL)
+    {
+        sock->PendingSendTail = NULL;
     }
+    obj->next = NULL;
 
-    LeaveCriticalSection(&gPendingCritSec);
+    sock->Deficit -= obj->buflen;
+
+    // How long the send waited for the scheduler
+    StatsRecordLatency(HIST_SCHEDULER, obj->QueuedTime);
 
     return obj;
 }
 
 //
-// Function: ProcessPendingOperations
+// Function: SendQueuedOperations
 //
 // Description:
-//    This function goes through the list of pending send operations and posts them
-//    as long as the maximum number of ouststanding sends is not exceeded.
+//    Gives a socket its turn in the send scheduler. The socket is granted
+//    one buffer's worth of byte credit (deficit round robin) and its queued
+//    sends are posted as long as the credit covers them and the maximum
+//    number of outstanding sends is not exceeded. A socket that still has
+//    sends queued goes back on the ready list. Once a send fails the socket
+//    is closing and the rest of its queue is freed. Must be called on the
+//    socket's strand.
 //
-void ProcessPendingOperations()
+void SendQueuedOperations(SOCKET_OBJ *sock)
 {
-    BUFFER_OBJ *sendobj=NULL;
+    BUFFER_OBJ  *sendobj=NULL;
 
-    while(gOutstandingSends < gMaxSends)
+    if (gOutstandingSends < gMaxSends)
     {
-        sendobj = DequeuePendingOperation(&gPendingSendList, &gPendingSendListEnd, OP_WRITE);
-        if (sendobj)
-        {
+        sock->Deficit += gBufferSize;
 
-            if (PostSend(sendobj->sock, sendobj) == SOCKET_ERROR)
+        while ((gOutstandingSends < gMaxSends) &&
+               ((sendobj = DequeuePendingOperation(sock)) != NULL))
+        {
+            if (PostSend(sock, sendobj) == SOCKET_ERROR)
             {
                 // Cleanup
-                printf("ProcessPendingOperations: PostSend failed!\n");
+                dbgprint("SendQueuedOperations: PostSend failed!\n");
+
+                ReleaseQueuedBytes(sock, sendobj->buflen);
 
                 FreeBufferObj(sendobj);
 
+                sock->PendingSend--;
+
+                // Nothing more will be sent on the socket
+                while ((sendobj = sock->PendingSendHead) != NULL)
+                {
+                    sock->PendingSendHead = sendobj->next;
+
+                    ReleaseQueuedBytes(sock, sendobj->buflen);
+
+                    FreeBufferObj(sendobj);
+
+                    sock->PendingSend--;
+                }
+                sock->PendingSendTail = NULL;
+
+                sock->bClosing = TRUE;
+
+                CloseRelayPeer(sock);
+                ResumeRecv(sock);
                 break;
             }
+            // The send is no longer pending once it has been posted
+            sock->PendingSend--;
         }
-        else
-        {
+    }
+
+    if (sock->PendingSendHead)
+    {
+        InterlockedPushEntrySList(&sock->shard->ReadyList, &sock->ReadyEntry);
+    }
+    else
+    {
+        sock->bReady  = FALSE;
+        sock->Deficit = 0;
+    }
+}
+
+//
+// Function: ProcessPendingOperations
+//
+// Description:
+//    This is the send scheduler. It takes the sockets on the shard's ready list and
+//    visits them round robin, giving each its turn (see SendQueuedOperations)
+//    on the socket's strand. The turn is taken right away unless another
+//    thread is working on the socket, in which case that thread takes it.
+//
+void ProcessPendingOperations(SHARD *shard)
+{
+    SLIST_ENTRY *entry=NULL,
+                *next=NULL,
+                *batch=NULL;
+    SOCKET_OBJ  *sock=NULL;
+
+    while (gOutstandingSends < gMaxSends)
+    {
+        // Grab the current ready list. Sockets are pushed LIFO so reverse
+        //    the list to visit them in the order they became ready.
+        entry = InterlockedFlushSList(&shard->ReadyList);
+        if (entry == NULL)
             break;
+
+        batch = NULL;
+        while (entry)
+        {
+            next        = entry->Next;
+            entry->Next = batch;
+            batch       = entry;
+            entry       = next;
+        }
+
+        while (batch)
+        {
+            next = batch->Next;
+            sock = CONTAINING_RECORD(batch, SOCKET_OBJ, ReadyEntry);
+
+            SignalSocket(sock, SIGNAL_SEND);
+
+            batch = next;
         }
     }
 
@@ -379,19 +1314,18 @@ void ProcessPendingOperations()
 //
 void InsertPendingAccept(LISTEN_OBJ *listenobj, BUFFER_OBJ *obj)
 {
-    obj->next = NULL;
+    obj->prev = NULL;
 
     EnterCriticalSection(&listenobj->ListenCritSec);
-    if (listenobj->PendingAccepts == NULL)
-    {
-        listenobj->PendingAccepts = obj;
-    }
-    else
+
+    // Insert at head - order doesn't really matter
+    obj->next = listenobj->PendingAccepts;
+    if (listenobj->PendingAccepts)
     {
-        // Insert at head - order doesn't really matter
-        obj->next = listenobj->PendingAccepts;
-        listenobj->PendingAccepts = obj;
+        listenobj->PendingAccepts->prev = obj;
     }
+    listenobj->PendingAccepts = obj;
+
     LeaveCriticalSection(&listenobj->ListenCritSec);
 }
 
@@ -400,768 +1334,4824 @@ void InsertPendingAccept(LISTEN_OBJ *listenobj, BUFFER_OBJ *obj)
 //
 // Description:
 //    Removes the indicated accept buffer object from the list of pending
-//    accepts in the listening object.
+//    accepts in the listening object. The list is doubly linked so the
+//    object is unlinked without searching for it.
 //
 void RemovePendingAccept(LISTEN_OBJ *listenobj, BUFFER_OBJ *obj)
 {
-    BUFFER_OBJ *ptr=NULL, *prev=NULL;
-
     EnterCriticalSection(&listenobj->ListenCritSec);
-   
-    // Search list until we find the object
-    ptr = listenobj->PendingAccepts;
-    while ( (ptr) && (ptr != obj) )
-    {
-        prev = ptr;
-        ptr  = ptr->next;
-    }
-    if (prev)
+
+    if (obj->prev)
     {
         // Object is somewhere after the first entry
-        prev->next = obj->next;
+        obj->prev->next = obj->next;
     }
     else
     {
         // Object is the first entry
         listenobj->PendingAccepts = obj->next;
     }
+    if (obj->next)
+    {
+        obj->next->prev = obj->prev;
+    }
+    obj->next = obj->prev = NULL;
 
     LeaveCriticalSection(&listenobj->ListenCritSec);
 }
 
 //
-// Function: GetBufferObj
-// 
+// Function: AllocBufferMagazine
+//
 // Description:
-//    Allocate a BUFFER_OBJ. A lookaside list is maintained to increase performance
-//    as these objects are allocated frequently.
+//    Allocate an empty magazine, reusing one from the depot if possible.
+//    Must be called with gBufferListCs held.
 //
-BUFFER_OBJ *GetBufferObj(int buflen)
+BUFFER_MAGAZINE *AllocBufferMagazine()
 {
-    BUFFER_OBJ *newobj=NULL;
+    BUFFER_MAGAZINE *mag=NULL;
 
-    EnterCriticalSection(&gBufferListCs);
-    if (gFreeBufferList == NULL)
+    if (gEmptyMagazines)
     {
-        // Allocate the object
-        newobj = (BUFFER_OBJ *)HeapAlloc(
-                GetProcessHeap(), 
-                HEAP_ZERO_MEMORY, 
-                sizeof(BUFFER_OBJ) + (sizeof(BYTE) * buflen)
-                );
-        if (newobj == NULL)
-        {
-            fprintf(stderr, "GetBufferObj: HeapAlloc failed: %d\n", GetLastError());
-        }
+        mag = gEmptyMagazines;
+        gEmptyMagazines = mag->next;
     }
     else
     {
-        newobj          = gFreeBufferList;
-        gFreeBufferList = newobj->next;
-        newobj->next    = NULL;
-    }
-    LeaveCriticalSection(&gBufferListCs);
-    
-    if (newobj)
-    {
-        newobj->buf     = (char *)(((char *)newobj) + sizeof(BUFFER_OBJ));
-        newobj->buflen  = buflen;
-        newobj->addrlen = sizeof(newobj->addr);
+        mag = (BUFFER_MAGAZINE *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BUFFER_MAGAZINE));
+        if (mag == NULL)
+        {
+            fprintf(stderr, "AllocBufferMagazine: HeapAlloc failed: %d\n", GetLastError());
+            return NULL;
+        }
     }
+    mag->Count = 0;
+    mag->next  = NULL;
 
-    return newobj;
+    return mag;
 }
 
 //
-// Function: FreeBufferObj
-// 
+// Function: InitBufferCache
+//
 // Description:
-//    Free the buffer object. This adds the object to the free lookaside list.
+//    Sets up the per thread magazine cache for the calling completion thread.
 //
-void FreeBufferObj(BUFFER_OBJ *obj)
+BOOL InitBufferCache()
 {
-    EnterCriticalSection(&gBufferListCs);
+    BUFFER_CACHE *cache=NULL;
 
-    memset(obj, 0, sizeof(BUFFER_OBJ) + gBufferSize);
-    obj->next = gFreeBufferList;
-    gFreeBufferList = obj;
+    cache = (BUFFER_CACHE *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BUFFER_CACHE));
+    if (cache == NULL)
+    {
+        fprintf(stderr, "InitBufferCache: HeapAlloc failed: %d\n", GetLastError());
+        return FALSE;
+    }
 
+    EnterCriticalSection(&gBufferListCs);
+    cache->Loaded   = AllocBufferMagazine();
+    cache->Previous = AllocBufferMagazine();
     LeaveCriticalSection(&gBufferListCs);
+
+    if ((cache->Loaded == NULL) || (cache->Previous == NULL))
+        return FALSE;
+
+    tBufferCache = cache;
+
+    return TRUE;
 }
 
 //
-// Function: GetSocketObj
+// Function: FreeBufferCache
 //
 // Description:
-//    Allocate a socket object and initialize its members. A socket object is
-//    allocated for each socket created (either by socket or accept).
-//    Socket objects are returned from a lookaside list if available. Otherwise,
-//    a new object is allocated.
+//    Returns the calling thread's magazines to the depot, so the objects they
+//    hold can be used by other threads once this thread stops allocating.
 //
-SOCKET_OBJ *GetSocketObj(SOCKET s, int af)
+void FreeBufferCache()
 {
-    SOCKET_OBJ  *sockobj=NULL;
+    BUFFER_CACHE    *cache=tBufferCache;
+    BUFFER_MAGAZINE *mag=NULL;
+    int              i;
 
-    EnterCriticalSection(&gSocketListCs);
-    if (gFreeSocketList == NULL)
+    if (cache == NULL)
+        return;
+
+    EnterCriticalSection(&gBufferListCs);
+    for(i=0; i < 2 ;i++)
     {
-        sockobj = (SOCKET_OBJ *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SOCKET_OBJ));
-        if (sockobj == NULL)
+        mag = (i == 0) ? cache->Loaded : cache->Previous;
+        if (mag->Count > 0)
         {
-            fprintf(stderr, "GetSocketObj: HeapAlloc failed: %d\n", GetLastError());
+            mag->next      = gFullMagazines;
+            gFullMagazines = mag;
         }
         else
         {
-            InitializeCriticalSection(&sockobj->SockCritSec);
+            mag->next       = gEmptyMagazines;
+            gEmptyMagazines = mag;
         }
     }
-    else
-    {
-        sockobj         = gFreeSocketList;
-        gFreeSocketList = sockobj->next;
-        sockobj->next   = NULL;
-    }
-    LeaveCriticalSection(&gSocketListCs);
+    LeaveCriticalSection(&gBufferListCs);
 
-    // Initialize the members
-    if (sockobj)
-    {
-        sockobj->s  = s;
-        sockobj->af = af;
-    }
+    tBufferCache = NULL;
 
-    return sockobj;
+    HeapFree(GetProcessHeap(), 0, cache);
 }
 
 //
-// Function: FreeSocketObj
+// Function: CacheGetBufferObj
 //
 // Description:
-//    Frees a socket object. The object is added to the lookaside list.
+//    Pop a free BUFFER_OBJ from the calling thread's magazines. If both are
+//    empty, the previous magazine is traded in for a full one from the depot.
+//    Returns NULL if no cached object is available.
 //
-void FreeSocketObj(SOCKET_OBJ *obj)
+BUFFER_OBJ *CacheGetBufferObj(BUFFER_CACHE *cache)
 {
-    CRITICAL_SECTION cstmp;
-    BUFFER_OBJ      *ptr=NULL;
+    BUFFER_MAGAZINE *tmp=NULL;
 
-    // Close the socket if it hasn't already been closed
-    if (obj->s != INVALID_SOCKET)
+    if (cache->Loaded->Count > 0)
     {
-        printf("FreeSocketObj: closing socket\n");
-        closesocket(obj->s);
-        obj->s = INVALID_SOCKET;
+        return cache->Loaded->Objs[--cache->Loaded->Count];
     }
+    if (cache->Previous->Count > 0)
+    {
+        tmp             = cache->Previous;
+        cache->Previous = cache->Loaded;
+        cache->Loaded   = tmp;
 
-    EnterCriticalSection(&gSocketListCs);
+        return cache->Loaded->Objs[--cache->Loaded->Count];
+    }
 
-    cstmp = obj->SockCritSec;
-    memset(obj, 0, sizeof(SOCKET_OBJ));
-    obj->SockCritSec = cstmp;
+    // Both magazines are empty - go to the depot
+    EnterCriticalSection(&gBufferListCs);
+    if (gFullMagazines)
+    {
+        tmp            = gFullMagazines;
+        gFullMagazines = tmp->next;
 
-    obj->next = gFreeSocketList;
-    gFreeSocketList = obj;
+        cache->Previous->next = gEmptyMagazines;
+        gEmptyMagazines       = cache->Previous;
 
-    LeaveCriticalSection(&gSocketListCs);
-}
+        cache->Previous = cache->Loaded;
+        cache->Loaded   = tmp;
+        tmp             = NULL;
 
-//
-// Function: ValidateArgs
-//
-// Description:
-//      Parses the command line arguments and sets up some global 
-//      variables.
-//
-void ValidateArgs(int argc, char **argv)
-{
-    int     i;
+        InterlockedIncrement(&gMagazineExchanges);
+    }
+    LeaveCriticalSection(&gBufferListCs);
 
-    for(i=1; i < argc ;i++)
+    if (cache->Loaded->Count > 0)
     {
-        if (((argv[i][0] != '/') && (argv[i][0] != '-')) || (strlen(argv[i]) < 2))
-            usage(argv[0]);
-        else
-        {
-            switch (tolower(argv[i][1]))
-            {
-                case 'a':               // address family - IPv4 or IPv6
-                    if (i+1 >= argc)
-                        usage(argv[0]);
-                    if (argv[i+1][0] == '4')
-                        gAddressFamily = AF_INET;
-                    else if (argv[i+1][0] == '6')
-                        gAddressFamily = AF_INET6;
-                    else
-                        usage(argv[0]);
-                    i++;
-                    break;
-                case 'b':               // buffer size for send/recv
-                    if (i+1 >= argc)
-                        usage(argv[0]);
-                    gBufferSize = atol(argv[++i]);
-                    break;
-                case 'e':               // endpoint - port number
-                    if (i+1 >= argc)
-                        usage(argv[0]);
-                    gBindPort = argv[++i];
-                    break;
-                case 'l':               // local address for binding
-                    if (i+1 >= argc)
-                        usage(argv[0]);
-                    gBindAddr = argv[++i];
-                    break;
-                case 'o':               // overlapped count
-                    if (i+1 >= argc)
-                        usage(argv[0]);
-                    if (strlen(argv[i]) == 2)       // Overlapped accept initial count
-                    {
-                        gInitialAccepts = atol(argv[++i]);
-                    }
-                    else if (strlen(argv[i]) == 3)
-                    {
-                        if (tolower(argv[i][2]) == 'a')
-                            gMaxAccepts = atol(argv[++i]);
-                        else if (tolower(argv[i][2]) == 's')
-                            gMaxSends = atol(argv[++i]);
-                        else if (tolower(argv[i][2]) == 'r')
-                            gMaxReceives = atol(argv[++i]);
-                        else
-                            usage(argv[0]);
-                    }
-                    else
-                    {
-                        usage(argv[0]);
-                    }
-                    break;
-                default:
-                    usage(argv[0]);
-                    break;
-            }
-        }
+        return cache->Loaded->Objs[--cache->Loaded->Count];
     }
+
+    return NULL;
 }
 
 //
-// Function: PrintStatistics
+// Function: CacheFreeBufferObj
 //
 // Description:
-//    Print the send/recv statistics for the server
+//    Push a BUFFER_OBJ onto the calling thread's magazines. If both are full,
+//    the previous magazine is handed to the depot in exchange for an empty one.
+//    Returns FALSE if the object could not be cached.
 //
-void PrintStatistics()
+BOOL CacheFreeBufferObj(BUFFER_CACHE *cache, BUFFER_OBJ *obj)
 {
-    ULONG       bps, tick, elapsed, cps;
+    BUFFER_MAGAZINE *tmp=NULL;
 
-    tick = GetTickCount();
+    if (cache->Loaded->Count < MAGAZINE_SIZE)
+    {
+        cache->Loaded->Objs[cache->Loaded->Count++] = obj;
+        return TRUE;
+    }
+    if (cache->Previous->Count == 0)
+    {
+        tmp             = cache->Previous;
+        cache->Previous = cache->Loaded;
+        cache->Loaded   = tmp;
 
-    elapsed = (tick - gStartTime) / 1000;
+        cache->Loaded->Objs[cache->Loaded->Count++] = obj;
+        return TRUE;
+    }
 
-    if (elapsed == 0)
-        return;
+    // Both magazines are full - go to the depot
+    EnterCriticalSection(&gBufferListCs);
+    tmp = AllocBufferMagazine();
+    if (tmp)
+    {
+        cache->Previous->next = gFullMagazines;
+        gFullMagazines        = cache->Previous;
 
-    printf("\n");
+        cache->Previous = cache->Loaded;
+        cache->Loaded   = tmp;
 
-    // Calculate average bytes per second
-    bps = gBytesSent / elapsed;
-    printf("Average BPS sent: %lu [%lu]\n", bps, gBytesSent);
+        InterlockedIncrement(&gMagazineExchanges);
+    }
+    LeaveCriticalSection(&gBufferListCs);
 
-    bps = gBytesRead / elapsed;
-    printf("Average BPS read: %lu [%lu]\n", bps, gBytesRead);
+    if (tmp == NULL)
+        return FALSE;
 
-    elapsed = (tick - gStartTimeLast) / 1000;
+    cache->Loaded->Objs[cache->Loaded->Count++] = obj;
 
-    if (elapsed == 0)
-        return;
+    return TRUE;
+}
 
-    // Calculate bytes per second over the last X seconds
-    bps = gBytesSentLast / elapsed;
-    printf("Current BPS sent: %lu\n", bps);
+//
+// Function: CarveBufferObj
+//
+// Description:
+//    Carves a new BUFFER_OBJ from the slab of the caller's NUMA node in the
+//    given set of slabs, starting a new slab when it is used up. The header
+//    and the data buffer come from separate regions of the slab (see
+//    slab.h). Must be called with gBufferListCs held.
+//
+BUFFER_OBJ *CarveBufferObj(BUFFER_SLAB **slabs, int buflen)
+{
+    BUFFER_SLAB *slab=NULL;
+    BUFFER_OBJ  *newobj=NULL;
+    char        *payload=NULL;
+    ULONG        node;
 
-    bps = gBytesReadLast / elapsed;
-    printf("Current BPS read: %lu\n", bps);
+    node = SlabCurrentNode();
 
-    cps = gConnectionsLast / elapsed;
-    printf("Current conns/sec: %lu\n", cps);
-    
-    printf("Total connections: %lu\n", gConnections);
+    slab = slabs[node];
+    if ((slab == NULL) ||
+        (slab->PayloadStride < (ULONG)buflen) ||
+        (SlabCarve(slab, (void **)&newobj, &payload) == FALSE) )
+    {
+        slab = SlabCreate(sizeof(BUFFER_OBJ), buflen, node);
+        if (slab == NULL)
+            return NULL;
 
-    InterlockedExchange(&gBytesSentLast, 0);
-    InterlockedExchange(&gBytesReadLast, 0);
-    InterlockedExchange(&gConnectionsLast, 0);
+        slab->next          = slabs[node];
+        slabs[node]         = slab;
 
-    gStartTimeLast = tick;
+        SlabCarve(slab, (void **)&newobj, &payload);
+    }
+
+    newobj->buf = payload;
+
+    return newobj;
 }
 
 //
-// Function: PostRecv
+// Function: GetBufferObj
 // 
-// Description: 
-//    Post an overlapped receive operation on the socket.
+// Description:
+//    Allocate a BUFFER_OBJ. Completion threads allocate from their own magazine
+//    cache; all other threads (and cache misses) fall back to the depot and then
+//    the lookaside list under gBufferListCs. New objects are carved from the
+//    buffer slabs. Only the header is reinitialized here -- the data portion
+//    is overwritten by the next I/O anyway.
 //
-int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
+BUFFER_OBJ *GetBufferObj(int buflen)
 {
-    WSABUF  wbuf;
-    DWORD   bytes,
-            flags;
-    int     rc;
-
-    recvobj->operation = OP_READ;
-
-    wbuf.buf = recvobj->buf;
-    wbuf.len = recvobj->buflen;
-
-    flags = 0;
-
-    EnterCriticalSection(&sock->SockCritSec);
+    BUFFER_OBJ *newobj=NULL;
 
-    rc = WSARecv(
-            sock->s,
-           &wbuf,
-            1,
-           &bytes,
-           &flags,
-           &recvobj->ol,
-            NULL
-            );
+    if (tBufferCache)
+    {
+        newobj = CacheGetBufferObj(tBufferCache);
+    }
 
-    if (rc == SOCKET_ERROR)
+    if (newobj == NULL)
     {
-        rc = NO_ERROR;
-        if (WSAGetLastError() != WSA_IO_PENDING)
+        EnterCriticalSection(&gBufferListCs);
+        if ((gFreeBufferList == NULL) && (gFullMagazines))
         {
-            dbgprint("PostRecv: WSARecv* failed: %d\n", WSAGetLastError());
-            rc = SOCKET_ERROR;
+            BUFFER_MAGAZINE *mag=gFullMagazines;
+
+            // Drain a full magazine from the depot into the lookaside list
+            while (mag->Count > 0)
+            {
+                newobj          = mag->Objs[--mag->Count];
+                newobj->next    = gFreeBufferList;
+                gFreeBufferList = newobj;
+            }
+            gFullMagazines  = mag->next;
+            mag->next       = gEmptyMagazines;
+            gEmptyMagazines = mag;
+        }
+        if (gFreeBufferList == NULL)
+        {
+            newobj = CarveBufferObj(gBufferSlabs, buflen);
+            if (newobj)
+                InterlockedIncrement(&gBufferObjAllocs);
         }
+        else
+        {
+            newobj          = gFreeBufferList;
+            gFreeBufferList = newobj->next;
+        }
+        LeaveCriticalSection(&gBufferListCs);
     }
-    if (rc == NO_ERROR)
+    
+    if (newobj)
     {
-        // Increment outstanding overlapped operations
-        InterlockedIncrement(&sock->OutstandingRecv);
-    }
+        char   *buf=newobj->buf;    // The data buffer stays with the object
 
-    LeaveCriticalSection(&sock->SockCritSec);
+        memset(newobj, 0, sizeof(BUFFER_OBJ));
 
-    return rc;
+        newobj->buf     = buf;
+        newobj->buflen  = buflen;
+        newobj->addrlen = sizeof(newobj->addr);
+    }
+
+    return newobj;
 }
 
 //
-// Function: PostSend
+// Function: FreeBufferObj
 // 
 // Description:
-//    Post an overlapped send operation on the socket.
+//    Free the buffer object. The object is returned to the calling thread's
+//    magazine cache if it has one, otherwise to the free lookaside list. The
+//    object is not cleared until it is handed out again by GetBufferObj.
 //
-int PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj)
+void FreeBufferObj(BUFFER_OBJ *obj)
 {
-    WSABUF  wbuf;
-    DWORD   bytes;
-    int     rc, err;
+    // A framed response keeps the receive buffers it was built from
+    if (obj->response)
+    {
+        FrameResponseFree(obj->response);
+        obj->response = NULL;
+    }
 
-    sendobj->operation = OP_WRITE;
+    // As does a send of a published message its message
+    if (obj->message)
+    {
+        PubSubMessageRelease(obj->message);
+        obj->message = NULL;
 
-    wbuf.buf = sendobj->buf;
-    wbuf.len = sendobj->buflen;
+        InterlockedDecrement(&gDeliveries);
+    }
 
-    EnterCriticalSection(&sock->SockCritSec);
+    // Bulk buffers are only used by a few connections and have their own list
+    if (obj->bBulk)
+    {
+        EnterCriticalSection(&gBufferListCs);
 
-    rc = WSASend(
-            sock->s,
-           &wbuf,
-            1,
-           &bytes,
-            0,
-           &sendobj->ol,
-            NULL
-            );
+        obj->next = gFreeBulkList;
+        gFreeBulkList = obj;
 
-    if (rc == SOCKET_ERROR)
+        LeaveCriticalSection(&gBufferListCs);
+        return;
+    }
+
+    // Objects without a data buffer are zero byte receives or framed responses
+    if (obj->buf == NULL)
     {
-        rc = NO_ERROR;
-        if ((err = WSAGetLastError()) != WSA_IO_PENDING)
-        {
-            if (err == WSAENOBUFS)
-                DebugBreak();
+        EnterCriticalSection(&gBufferListCs);
 
-            dbgprint("PostSend: WSASend* failed: %d [internal = %d]\n", WSAGetLastError(), sendobj->ol.Internal);
-            rc = SOCKET_ERROR;
-        }
+        obj->next = gFreeZeroByteList;
+        gFreeZeroByteList = obj;
+
+        LeaveCriticalSection(&gBufferListCs);
+        return;
     }
-    if (rc == NO_ERROR)
-    {
-        // Increment the outstanding operation count
-        InterlockedIncrement(&sock->OutstandingSend);
 
-        InterlockedIncrement(&gOutstandingSends);
+    if ((tBufferCache) && (CacheFreeBufferObj(tBufferCache, obj)))
+    {
+        return;
     }
 
-    LeaveCriticalSection(&sock->SockCritSec);
+    EnterCriticalSection(&gBufferListCs);
 
-    return rc;
+    obj->next = gFreeBufferList;
+    gFreeBufferList = obj;
+
+    LeaveCriticalSection(&gBufferListCs);
 }
 
 //
-// Function: PostAccept
-// 
+// Function: GetBulkBufferObj
+//
 // Description:
-//    Post an overlapped accept on a listening socket.
+//    Allocate a BUFFER_OBJ with a bulk buffer (-bb) for a connection in bulk
+//    mode. These come from their own slabs and lookaside list.
 //
-int PostAccept(LISTEN_OBJ *listen, BUFFER_OBJ *acceptobj)
+BUFFER_OBJ *GetBulkBufferObj()
 {
-    DWORD   bytes;
-    int     rc;
-
-    acceptobj->operation = OP_ACCEPT;
+    BUFFER_OBJ *newobj=NULL;
 
-    // Create the client socket for an incoming connection
-    acceptobj->sclient = socket(listen->AddressFamily, SOCK_STREAM, IPPROTO_TCP);
-    if (acceptobj->sclient == INVALID_SOCKET)
+    EnterCriticalSection(&gBufferListCs);
+    if (gFreeBulkList == NULL)
     {
-        fprintf(stderr, "PostAccept: socket failed: %d\n", WSAGetLastError());
-        return -1;
+        newobj = CarveBufferObj(gBulkSlabs, gBulkBufferSize);
+        if (newobj)
+            InterlockedIncrement(&gBulkObjAllocs);
+    }
+    else
+    {
+        newobj        = gFreeBulkList;
+        gFreeBulkList = newobj->next;
     }
+    LeaveCriticalSection(&gBufferListCs);
 
-    rc = listen->lpfnAcceptEx(
+    if (newobj)
+    {
+        char   *buf=newobj->buf;
+
+        memset(newobj, 0, sizeof(BUFFER_OBJ));
+
+        newobj->buf     = buf;
+        newobj->buflen  = gBulkBufferSize;
+        newobj->addrlen = sizeof(newobj->addr);
+        newobj->bBulk   = TRUE;
+    }
+
+    return newobj;
+}
+
+//
+// Function: GetRecvBufferObj
+//
+// Description:
+//    Allocate the BUFFER_OBJ for the next receive on a connection: a bulk
+//    buffer in bulk mode, a normal one otherwise.
+//
+BUFFER_OBJ *GetRecvBufferObj(SOCKET_OBJ *sock)
+{
+    if (sock->bBulk)
+        return GetBulkBufferObj();
+
+    return GetBufferObj(gBufferSize);
+}
+
+//
+// Function: GetZeroByteObj
+//
+// Description:
+//    Allocate a BUFFER_OBJ without a data buffer. These are used for the zero
+//    byte receives posted on idle connections (see -z) so that an idle
+//    connection only costs the object header, and for framed responses
+//    whose data lives elsewhere. FreeBufferObj returns these objects to
+//    their own lookaside list.
+//
+BUFFER_OBJ *GetZeroByteObj()
+{
+    BUFFER_OBJ *newobj=NULL;
+
+    EnterCriticalSection(&gBufferListCs);
+    if (gFreeZeroByteList == NULL)
+    {
+        newobj = (BUFFER_OBJ *)HeapAlloc(GetProcessHeap(), 0, sizeof(BUFFER_OBJ));
+        if (newobj == NULL)
+        {
+            fprintf(stderr, "GetZeroByteObj: HeapAlloc failed: %d\n", GetLastError());
+        }
+        else
+        {
+            InterlockedIncrement(&gZeroByteObjAllocs);
+        }
+    }
+    else
+    {
+        newobj            = gFreeZeroByteList;
+        gFreeZeroByteList = newobj->next;
+    }
+    LeaveCriticalSection(&gBufferListCs);
+
+    if (newobj)
+    {
+        memset(newobj, 0, sizeof(BUFFER_OBJ));
+
+        newobj->addrlen = sizeof(newobj->addr);
+    }
+
+    return newobj;
+}
+
+//
+// Function: AllocBenchThread
+//
+// Description:
+//    Thread of the allocation benchmark. Allocates a batch of BUFFER_OBJ and
+//    frees them again until the run is over. A batch is more than the two
+//    magazines hold, so cached threads visit the depot as well.
+//
+DWORD WINAPI AllocBenchThread(LPVOID lpParam)
+{
+    ALLOC_BENCH *bench=(ALLOC_BENCH *)lpParam;
+    BUFFER_OBJ  *objs[ALLOC_BENCH_BATCH];
+    int          i;
+
+    if ((bench->bCached) && (InitBufferCache() == FALSE))
+        return 0;
+
+    WaitForSingleObject(bench->Start, INFINITE);
+
+    while (*bench->Stop == FALSE)
+    {
+        for(i=0; i < ALLOC_BENCH_BATCH ;i++)
+        {
+            objs[i] = GetBufferObj(gBufferSize);
+            if (objs[i] == NULL)
+            {
+                fprintf(stderr, "AllocBenchThread: GetBufferObj failed\n");
+                ExitProcess(-1);
+            }
+        }
+        for(i=0; i < ALLOC_BENCH_BATCH ;i++)
+        {
+            FreeBufferObj(objs[i]);
+        }
+        bench->Allocs += ALLOC_BENCH_BATCH;
+    }
+
+    FreeBufferCache();
+
+    return 0;
+}
+
+//
+// Function: RunAllocBenchmark
+//
+// Description:
+//    Measures the BUFFER_OBJ allocations per second on 1, 2, 4, ... up to
+//    maxthreads threads, first with every allocation taking gBufferListCs
+//    (as threads without a cache do) and then with the completion threads'
+//    magazine caches. Each run lasts ALLOC_BENCH_TIME milliseconds and also
+//    reports how often the magazines went to the depot.
+//
+void RunAllocBenchmark(int maxthreads)
+{
+    ALLOC_BENCH   *bench=NULL;
+    HANDLE         start;
+    volatile LONG  stop;
+    ULONGLONG      allocs;
+    ULONG          tick,
+                   elapsed;
+    LONG           exchanges;
+    BOOL           bCached;
+    int            threads,
+                   mode,
+                   i;
+
+    if (maxthreads > MAX_COMPLETION_THREAD_COUNT)
+        maxthreads = MAX_COMPLETION_THREAD_COUNT;
+
+    bench = (ALLOC_BENCH *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ALLOC_BENCH) * maxthreads);
+    start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if ((bench == NULL) || (start == NULL))
+    {
+        fprintf(stderr, "RunAllocBenchmark: out of resources: %d\n", GetLastError());
+        return;
+    }
+
+    printf("Allocating %d byte BUFFER_OBJ in batches of %d\n", gBufferSize, ALLOC_BENCH_BATCH);
+
+    for(mode=0; mode < 2 ;mode++)
+    {
+        bCached = (mode == 1);
+
+        threads = 1;
+        while (threads <= maxthreads)
+        {
+            stop = FALSE;
+            ResetEvent(start);
+
+            for(i=0; i < threads ;i++)
+            {
+                bench[i].Start   = start;
+                bench[i].Stop    = &stop;
+                bench[i].bCached = bCached;
+                bench[i].Allocs  = 0;
+
+                bench[i].Thread = CreateThread(NULL, 0, AllocBenchThread, (LPVOID)&bench[i], 0, NULL);
+                if (bench[i].Thread == NULL)
+                {
+                    fprintf(stderr, "RunAllocBenchmark: CreateThread failed: %d\n", GetLastError());
+                    ExitProcess(-1);
+                }
+            }
+
+            // Give the threads time to set up their caches
+            Sleep(100);
+
+            exchanges = gMagazineExchanges;
+            tick = GetTickCount();
+
+            SetEvent(start);
+            Sleep(ALLOC_BENCH_TIME);
+            stop = TRUE;
+
+            elapsed = GetTickCount() - tick;
+
+            allocs = 0;
+            for(i=0; i < threads ;i++)
+            {
+                WaitForSingleObject(bench[i].Thread, INFINITE);
+                CloseHandle(bench[i].Thread);
+
+                allocs += bench[i].Allocs;
+            }
+
+            printf("%-8s %3d thread(s): %12I64u allocs/sec, %10I64u per thread, %lu depot exchanges\n",
+                    (bCached) ? "magazine" : "locked",
+                    threads,
+                    allocs * 1000 / elapsed,
+                    allocs * 1000 / elapsed / threads,
+                    gMagazineExchanges - exchanges
+                    );
+
+            // Always finish with the largest count asked for
+            if ((threads < maxthreads) && (threads * 2 > maxthreads))
+                threads = maxthreads;
+            else
+                threads *= 2;
+        }
+    }
+
+    CloseHandle(start);
+    HeapFree(GetProcessHeap(), 0, bench);
+}
+
+//
+// Function: GetSocketObj
+//
+// Description:
+//    Allocate a socket object and initialize its members. A socket object is
+//    allocated for each socket created (either by socket or accept).
+//    Socket objects are returned from a lookaside list if available. Otherwise,
+//    a new object is allocated.
+//
+SOCKET_OBJ *GetSocketObj(SOCKET s, int af)
+{
+    SOCKET_OBJ  *sockobj=NULL;
+
+    EnterCriticalSection(&gSocketListCs);
+    if (gFreeSocketList == NULL)
+    {
+        sockobj = (SOCKET_OBJ *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SOCKET_OBJ));
+        if (sockobj == NULL)
+        {
+            fprintf(stderr, "GetSocketObj: HeapAlloc failed: %d\n", GetLastError());
+        }
+        else
+        {
+            InterlockedIncrement(&gSocketObjAllocs);
+        }
+    }
+    else
+    {
+        sockobj         = gFreeSocketList;
+        gFreeSocketList = sockobj->next;
+        sockobj->next   = NULL;
+    }
+    LeaveCriticalSection(&gSocketListCs);
+
+    // Initialize the members
+    if (sockobj)
+    {
+        sockobj->s  = s;
+        sockobj->af = af;
+
+        FrameParserInit(&sockobj->Parser, gFrameMode, gMaxFrameLength, '\n');
+
+        StrandInit(&sockobj->Strand);
+        StrandWorkInit(&sockobj->Kick, SocketSignalWork);
+        sockobj->strand = &sockobj->Strand;
+
+        InterlockedIncrement(&gCurrentConnections);
+    }
+
+    return sockobj;
+}
+
+//
+// Function: FreeSocketObj
+//
+// Description:
+//    Frees a socket object. The object is added to the lookaside list.
+//    A relayed connection's other leg is freed with it.
+//
+void FreeSocketObj(SOCKET_OBJ *obj)
+{
+    BUFFER_OBJ      *ptr=NULL;
+    SOCKET_OBJ      *peer=NULL;
+
+    // The two legs of a relayed connection are freed together
+    peer = obj->peer;
+    if (peer)
+    {
+        obj->peer  = NULL;
+        peer->peer = NULL;
+
+        FreeSocketObj(peer);
+    }
+    if ((obj->backend) && (obj->PoolState == POOL_PAIRED))
+    {
+        InterlockedDecrement(&obj->backend->Active);
+    }
+
+    // Close the socket if it hasn't already been closed
+    if (obj->s != INVALID_SOCKET)
+    {
+        printf("FreeSocketObj: closing socket\n");
+        closesocket(obj->s);
+        obj->s = INVALID_SOCKET;
+    }
+
+    // Make sure the timer routine is not running and won't be called again
+    if (obj->shard)
+    {
+        TimerCancel(obj->shard->wheel, &obj->Timer);
+    }
+
+    // Drop the partial message, if any, and the buffers it holds
+    FrameParserReset(&obj->Parser);
+
+    InterlockedDecrement(&gCurrentConnections);
+    if (obj->bZeroCopy)
+        InterlockedDecrement(&gZeroCopyConnections);
+    if (obj->bBulk)
+        InterlockedDecrement(&gBulkConnections);
+
+    EnterCriticalSection(&gSocketListCs);
+
+    memset(obj, 0, sizeof(SOCKET_OBJ));
+
+    obj->next = gFreeSocketList;
+    gFreeSocketList = obj;
+
+    LeaveCriticalSection(&gSocketListCs);
+}
+
+//
+// Function: ReadConfigFile
+//
+// Description:
+//      Reads options from a configuration file. The file holds the same
+//      options as the command line, separated by white space or new lines;
+//      a # starts a comment which runs to the end of the line. Options are
+//      applied in order, so command line options after -cf override it.
+//
+void ReadConfigFile(char *file)
+{
+    FILE   *fp=NULL;
+    char   *text=NULL,
+           *ptr=NULL,
+           *args[MAX_CONFIG_ARGS];
+    long    size;
+    int     count;
+
+    fp = fopen(file, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "unable to open %s\n", file);
+        ExitProcess(-1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // The options point into the text so it is never freed
+    text = (char *)HeapAlloc(GetProcessHeap(), 0, size + 1);
+    if (text == NULL)
+    {
+        fprintf(stderr, "ReadConfigFile: HeapAlloc failed: %d\n", GetLastError());
+        ExitProcess(-1);
+    }
+    size = (long)fread(text, 1, size, fp);
+    text[size] = '\0';
+
+    fclose(fp);
+
+    // Split the text into options the way the command line is
+    args[0] = file;
+    count   = 1;
+
+    ptr = text;
+    while (*ptr)
+    {
+        if (*ptr == '#')
+        {
+            while ((*ptr) && (*ptr != '\n'))
+                ptr++;
+            continue;
+        }
+        if ((*ptr == ' ') || (*ptr == '\t') || (*ptr == '\r') || (*ptr == '\n'))
+        {
+            ptr++;
+            continue;
+        }
+
+        if (count >= MAX_CONFIG_ARGS)
+        {
+            fprintf(stderr, "too many options in %s\n", file);
+            ExitProcess(-1);
+        }
+        args[count++] = ptr;
+
+        while ((*ptr) && (*ptr != ' ') && (*ptr != '\t') && (*ptr != '\r') && (*ptr != '\n'))
+            ptr++;
+        if (*ptr)
+            *ptr++ = '\0';
+    }
+
+    ValidateArgs(count, args);
+}
+
+//
+// Function: ValidateArgs
+//
+// Description:
+//      Parses the command line arguments and sets up some global 
+//      variables.
+//
+void ValidateArgs(int argc, char **argv)
+{
+    int     i;
+
+    for(i=1; i < argc ;i++)
+    {
+        if (((argv[i][0] != '/') && (argv[i][0] != '-')) || (strlen(argv[i]) < 2))
+            usage(argv[0]);
+        else
+        {
+            switch (tolower(argv[i][1]))
+            {
+                case 'a':               // address family - IPv4 or IPv6
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'b'))
+                    {
+                        gAllocBenchThreads = atol(argv[++i]);   // allocation benchmark
+                        break;
+                    }
+                    if (argv[i+1][0] == '4')
+                        gAddressFamily = AF_INET;
+                    else if (argv[i+1][0] == '6')
+                        gAddressFamily = AF_INET6;
+                    else
+                        usage(argv[0]);
+                    i++;
+                    break;
+                case 'b':
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)
+                        gBufferSize = atol(argv[++i]);      // buffer size for send/recv
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'b'))
+                        gBulkBufferSize = atol(argv[++i]);  // bulk buffer size
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'k'))
+                        gBulkThreshold = atol(argv[++i]);   // bulk mode threshold
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'c':
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)
+                        gCpuList = argv[++i];           // worker processors
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'f'))
+                        ReadConfigFile(argv[++i]);      // configuration file
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'e':               // endpoint - port number
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gBindPort = argv[++i];
+                    break;
+                case 'f':               // latency output file
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gLatencyFile = argv[++i];
+                    break;
+                case 'k':               // key-value mode
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)
+                    {
+                        gKvMemory = atol(argv[++i]);
+                        gKvStore  = TRUE;
+                    }
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'i'))
+                        gKvItems = atol(argv[++i]);
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'l':
+                    if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'p'))
+                    {
+                        gLargePages = TRUE;             // large page buffers
+                        break;
+                    }
+                    if ((i+1 >= argc) || (strlen(argv[i]) != 2))
+                        usage(argv[0]);
+                    gBindAddr = argv[++i];              // local address for binding
+                    break;
+                case 'm':               // buffered byte budget
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gMaxBufferedBytes = _atoi64(argv[++i]);
+                    break;
+                case 'n':               // number of workers
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gWorkerCount = atol(argv[++i]);
+                    break;
+                case 'p':               // message framing
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'm'))
+                        gMaxFrameLength = atol(argv[++i]);
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'q'))
+                        gSubscriberQueue = atol(argv[++i]);
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 's'))
+                    {
+                        i++;                            // publish/subscribe
+                        if (_stricmp(argv[i], "drop") == 0)
+                            gSlowConsumerPolicy = SLOW_CONSUMER_DROP;
+                        else if (_stricmp(argv[i], "close") == 0)
+                            gSlowConsumerPolicy = SLOW_CONSUMER_CLOSE;
+                        else
+                            usage(argv[0]);
+                        gPubSub = TRUE;
+                    }
+                    else if (_stricmp(argv[i], "-pin") == 0)
+                    {
+                        i++;                            // worker placement
+                        if (_stricmp(argv[i], "none") == 0)
+                            gPlacement = PLACE_NONE;
+                        else if (_stricmp(argv[i], "cpu") == 0)
+                            gPlacement = PLACE_CPU;
+                        else if (_stricmp(argv[i], "node") == 0)
+                            gPlacement = PLACE_NODE;
+                        else if (_stricmp(argv[i], "rss") == 0)
+                            gPlacement = PLACE_RSS;
+                        else
+                            usage(argv[0]);
+                    }
+                    else if (strlen(argv[i]) != 2)
+                        usage(argv[0]);
+                    else if (_stricmp(argv[i+1], "raw") == 0)
+                        gFrameMode = FRAME_MODE_RAW;
+                    else if (_stricmp(argv[i+1], "len") == 0)
+                        gFrameMode = FRAME_MODE_LENGTH;
+                    else if (_stricmp(argv[i+1], "line") == 0)
+                        gFrameMode = FRAME_MODE_DELIMITER;
+                    else
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)
+                        i++;
+                    break;
+                case 'q':               // overload control
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    gOverloadDelay = atol(argv[++i]);
+                    break;
+                case 'r':               // ready mode
+                    gReadyMode = TRUE;
+                    break;
+                case 's':
+                    if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'p'))
+                    {
+                        if (i+1 >= argc)        // spin budget
+                            usage(argv[0]);
+                        gSpinBudget = atol(argv[++i]);
+                    }
+                    else if (strlen(argv[i]) == 2)
+                        gSharded = TRUE;        // sharded mode
+                    else
+                        usage(argv[0]);
+                    break;
+                case 't':               // connection timeouts
+                    if ((i+1 >= argc) || (strlen(argv[i]) != 3))
+                        usage(argv[0]);
+                    if (tolower(argv[i][2]) == 'i')
+                        gIdleTimeout = atol(argv[++i]);
+                    else if (tolower(argv[i][2]) == 'f')
+                        gFirstByteTimeout = atol(argv[++i]);
+                    else if (tolower(argv[i][2]) == 'r')
+                        gMinRate = atol(argv[++i]);
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'u':               // UDP echo
+                    if (strlen(argv[i]) == 2)
+                    {
+                        gSocketType = SOCK_DGRAM;
+                        gProtocol   = IPPROTO_UDP;
+                    }
+                    else if ((i+1 >= argc) || (strlen(argv[i]) != 3))
+                        usage(argv[0]);
+                    else if (tolower(argv[i][2]) == 'g')
+                        gDgramCoalesce = atol(argv[++i]);
+                    else if (tolower(argv[i][2]) == 'o')
+                        gDgramReceives = atol(argv[++i]);
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'w':               // receive watermarks
+                    if ((i+1 >= argc) || (strlen(argv[i]) != 3))
+                        usage(argv[0]);
+                    if (tolower(argv[i][2]) == 'h')
+                        gHighWatermark = atol(argv[++i]);
+                    else if (tolower(argv[i][2]) == 'l')
+                        gLowWatermark = atol(argv[++i]);
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'x':               // relay to backends
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)
+                        gBackendList = argv[++i];
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'p'))
+                        gBackendPool = atol(argv[++i]);
+                    else
+                        usage(argv[0]);
+                    break;
+                case 'z':
+                    if (strlen(argv[i]) == 2)       // zero byte receives
+                    {
+                        gZeroByteRecv = TRUE;
+                    }
+                    else if ((strlen(argv[i]) == 3) && (tolower(argv[i][2]) == 'c') && (i+1 < argc))
+                    {
+                        gZeroCopyThreshold = atol(argv[++i]);   // zero copy sends
+                    }
+                    else
+                    {
+                        usage(argv[0]);
+                    }
+                    break;
+                case 'o':               // overlapped count
+                    if (i+1 >= argc)
+                        usage(argv[0]);
+                    if (strlen(argv[i]) == 2)       // Overlapped accept initial count
+                    {
+                        gInitialAccepts = atol(argv[++i]);
+                    }
+                    else if (strlen(argv[i]) == 3)
+                    {
+                        if (tolower(argv[i][2]) == 'a')
+                            gMaxAccepts = atol(argv[++i]);
+                        else if (tolower(argv[i][2]) == 's')
+                            gMaxSends = atol(argv[++i]);
+                        else if (tolower(argv[i][2]) == 'r')
+                            gMaxReceives = atol(argv[++i]);
+                        else
+                            usage(argv[0]);
+                    }
+                    else
+                    {
+                        usage(argv[0]);
+                    }
+                    break;
+                default:
+                    usage(argv[0]);
+                    break;
+            }
+        }
+    }
+}
+
+//
+// Function: PrintDgramStatistics
+//
+// Description:
+//    Prints the datagram rates of the UDP echo over the last interval.
+//
+void PrintDgramStatistics(ULONG elapsed)
+{
+    ULONGLONG   DgramsRead,
+                DgramsSent,
+                DgramRecvs;
+
+    DgramsRead = StatsRead(STAT_DGRAMS_READ);
+    DgramsSent = StatsRead(STAT_DGRAMS_SENT);
+    DgramRecvs = StatsRead(STAT_DGRAM_RECVS);
+
+    printf("Current datagrams/sec read: %I64u; sent: %I64u\n",
+            (DgramsRead - gDgramsReadLast) / elapsed,
+            (DgramsSent - gDgramsSentLast) / elapsed
+            );
+    printf("Datagrams per receive: %.2f\n",
+            (DgramRecvs > gDgramRecvsLast) ?
+                (double)(DgramsRead - gDgramsReadLast) / (DgramRecvs - gDgramRecvsLast) : 0.0
+            );
+
+    gDgramsReadLast = DgramsRead;
+    gDgramsSentLast = DgramsSent;
+    gDgramRecvsLast = DgramRecvs;
+}
+
+//
+// Function: PrintPubSubStatistics
+//
+// Description:
+//      Prints the fan-out rate of the publish/subscribe mode and the memory
+//      held per published message in flight: the shared message plus a send
+//      object per subscriber it is queued for. For comparison the memory a
+//      copy of the message per subscriber would take is shown as well.
+//
+void PrintPubSubStatistics(ULONG elapsed)
+{
+    ULONGLONG   Published,
+                FanoutSent;
+    LONGLONG    bytes;
+    LONG        messages,
+                deliveries;
+    double      shared,
+                copied;
+
+    Published  = StatsRead(STAT_PUBLISHED);
+    FanoutSent = StatsRead(STAT_FANOUT_SENT);
+
+    printf("Current msgs/sec published: %I64u; delivered: %I64u (fan-out %.1f)\n",
+            (Published - gPublishedLast) / elapsed,
+            (FanoutSent - gFanoutSentLast) / elapsed,
+            (Published > gPublishedLast) ?
+                (double)(FanoutSent - gFanoutSentLast) / (Published - gPublishedLast) : 0.0
+            );
+    printf("Slow consumers: %I64u messages dropped, %lu subscribers closed\n",
+            StatsRead(STAT_FANOUT_DROPS),
+            gSlowConsumers
+            );
+
+    PubSubGetMemory(&messages, &bytes);
+    deliveries = gDeliveries;
+
+    if (messages > 0)
+    {
+        shared = ((double)bytes + (double)deliveries * sizeof(BUFFER_OBJ)) / messages;
+        copied = ((double)deliveries / messages) * (sizeof(BUFFER_OBJ) + (double)bytes / messages);
+
+        printf("In flight: %ld messages, %ld sends; memory per message: %.0f bytes (%.0f with a copy per subscriber)\n",
+                messages,
+                deliveries,
+                shared,
+                copied
+                );
+    }
+
+    PubSubPrintStatistics();
+
+    gPublishedLast  = Published;
+    gFanoutSentLast = FanoutSent;
+}
+
+//
+// Function: PrintKvStatistics
+//
+// Description:
+//      Prints the command rate of the key-value mode and the state of the
+//      store. The latency of the commands is that of the turnaround above.
+//
+void PrintKvStatistics(ULONG elapsed)
+{
+    ULONGLONG   Commands;
+
+    Commands = StatsRead(STAT_KV_COMMANDS);
+
+    printf("Current commands/sec: %I64u\n", (Commands - gKvCommandsLast) / elapsed);
+
+    KvPrintStatistics();
+
+    gKvCommandsLast = Commands;
+}
+
+//
+// Function: PrintStatistics
+//
+// Description:
+//    Print the send/recv statistics for the server
+//
+void PrintStatistics()
+{
+    ULONGLONG   BytesRead,
+                BytesSent,
+                Connections,
+                cputime;
+    FILETIME    created,
+                exited,
+                kernel,
+                user;
+    ULONG       tick, elapsed;
+
+    tick = GetTickCount();
+
+    elapsed = (tick - gStartTime) / 1000;
+
+    if (elapsed == 0)
+        return;
+
+    BytesRead   = StatsRead(STAT_BYTES_READ);
+    BytesSent   = StatsRead(STAT_BYTES_SENT);
+    Connections = StatsRead(STAT_CONNECTIONS);
+
+    printf("\n");
+
+    // Calculate average bytes per second
+    printf("Average BPS sent: %I64u [%I64u]\n", BytesSent / elapsed, BytesSent);
+    printf("Average BPS read: %I64u [%I64u]\n", BytesRead / elapsed, BytesRead);
+
+    StatsPrintLatency(HIST_ACCEPT,     "Accept");
+    StatsPrintLatency(HIST_TURNAROUND, "Turnaround");
+    StatsPrintLatency(HIST_SEND,       "Send");
+    StatsPrintLatency(HIST_SCHEDULER,  "Scheduler");
+
+    if (gLatencyFp)
+    {
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_ACCEPT,     "accept");
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_TURNAROUND, "turnaround");
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_SEND,       "send");
+        StatsWriteLatency(gLatencyFp, elapsed, HIST_SCHEDULER,  "scheduler");
+        fflush(gLatencyFp);
+    }
+
+    elapsed = (tick - gStartTimeLast) / 1000;
+
+    if (elapsed == 0)
+        return;
+
+    // Calculate bytes per second over the last X seconds
+    printf("Current BPS sent: %I64u\n", (BytesSent - gBytesSentLast) / elapsed);
+    printf("Current BPS read: %I64u\n", (BytesRead - gBytesReadLast) / elapsed);
+    printf("Current conns/sec: %I64u\n", (Connections - gConnectionsLast) / elapsed);
+
+    // What moving the data costs, to compare the echo modes
+    if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    {
+        cputime = (((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                  (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime);
+
+        if ((gCpuTimeLast != 0) && (BytesSent > gBytesSentLast))
+        {
+            printf("Processor time per GB sent: %.1f ms\n",
+                    ((double)(cputime - gCpuTimeLast) / 10000) /
+                        ((double)(BytesSent - gBytesSentLast) / (1024 * 1024 * 1024))
+                    );
+        }
+        gCpuTimeLast = cputime;
+    }
+    
+    printf("Total connections: %I64u\n", Connections);
+
+    printf("Buffered bytes: %I64d of %I64d; paused connections: %lu; receive pauses: %lu; resumes: %lu\n",
+            gBufferedBytes,
+            gMaxBufferedBytes,
+            gPausedConnections,
+            gRecvPauses,
+            gRecvResumes
+            );
+
+    if (gZeroCopyThreshold > 0)
+    {
+        printf("Zero copy: %I64u bytes sent on %lu connections\n",
+                StatsRead(STAT_ZEROCOPY_BYTES),
+                gZeroCopyConnections
+                );
+    }
+
+    if (gBulkThreshold > 0)
+    {
+        printf("Bulk connections: %lu; bytes received in bulk buffers: %I64u\n",
+                gBulkConnections,
+                StatsRead(STAT_BULK_BYTES)
+                );
+    }
+
+    if ((gZeroByteRecv) || (gReadyMode))
+    {
+        printf("Zero byte receives: %I64u; ready reads: %I64u; buffer objects allocated per connection: %.2f\n",
+                StatsRead(STAT_RECV_WAKEUPS),
+                StatsRead(STAT_READY_READS),
+                (gCurrentConnections > 0) ? (double)gBufferObjAllocs / gCurrentConnections : 0.0
+                );
+    }
+
+    if (gFrameMode != FRAME_MODE_RAW)
+    {
+        printf("Messages handled: %I64u\n", StatsRead(STAT_FRAMES));
+
+        FramePrintStatistics();
+    }
+
+    if (gOverloadDelay > 0)
+    {
+        LONG    delay=0;
+        int     i;
+
+        for(i=0; i < gShardCount ;i++)
+        {
+            if (gShards[i].QueueDelay > delay)
+                delay = gShards[i].QueueDelay;
+        }
+
+        printf("Load level: %s; queue delay: %ld us; changes: %lu; connections shed: %lu; deferred: %lu\n",
+                (gLoadLevel == LOAD_SHED) ? "shed" : ((gLoadLevel == LOAD_HIGH) ? "high" : "normal"),
+                delay,
+                gLoadChanges,
+                gShedConnections,
+                gDeferredConnections
+                );
+    }
+
+    printf("Timeouts: first byte %lu, idle %lu, slow %lu\n",
+            gFirstByteTimeouts,
+            gIdleTimeouts,
+            gSlowTimeouts
+            );
+
+    printf("Buffer objects allocated: %lu (bulk %lu); magazine exchanges: %lu\n",
+            gBufferObjAllocs, gBulkObjAllocs, gMagazineExchanges);
+
+    SlabPrintStatistics();
+
+    // Everything allocated so far is still held in use or in a lookaside list
+    {
+        ULONGLONG   memory;
+
+        memory = ((ULONGLONG)gBufferObjAllocs * (sizeof(BUFFER_OBJ) + gBufferSize)) +
+                 ((ULONGLONG)gBulkObjAllocs * (sizeof(BUFFER_OBJ) + gBulkBufferSize)) +
+                 ((ULONGLONG)gZeroByteObjAllocs * sizeof(BUFFER_OBJ)) +
+                 ((ULONGLONG)gSocketObjAllocs * sizeof(SOCKET_OBJ));
+
+        printf("Current connections: %lu; memory: %I64u bytes (%I64u per connection)\n",
+                gCurrentConnections,
+                memory,
+                (gCurrentConnections > 0) ? memory / gCurrentConnections : 0
+                );
+    }
+
+    if (gProtocol == IPPROTO_UDP)
+        PrintDgramStatistics(elapsed);
+
+    if (gPubSub)
+        PrintPubSubStatistics(elapsed);
+
+    if (gKvStore)
+        PrintKvStatistics(elapsed);
+
+    gBytesSentLast   = BytesSent;
+    gBytesReadLast   = BytesRead;
+    gConnectionsLast = Connections;
+
+    gStartTimeLast = tick;
+}
+
+//
+// Function: PostRecv
+// 
+// Description: 
+//    Post an overlapped receive operation on the socket.
+//
+int PostRecv(SOCKET_OBJ *sock, BUFFER_OBJ *recvobj)
+{
+    WSABUF  wbuf;
+    DWORD   bytes,
+            flags;
+    int     rc;
+
+    // A receive without a data buffer is a zero byte receive. It completes
+    //    when data arrives but consumes none of it.
+    recvobj->operation = (recvobj->buf == NULL) ? OP_READ_ZERO : OP_READ;
+
+    wbuf.buf = recvobj->buf;
+    wbuf.len = recvobj->buflen;
+
+    flags = 0;
+
+    rc = WSARecv(
+            sock->s,
+           &wbuf,
+            1,
+           &bytes,
+           &flags,
+           &recvobj->ol,
+            NULL
+            );
+
+    if (rc == SOCKET_ERROR)
+    {
+        rc = NO_ERROR;
+        if (WSAGetLastError() != WSA_IO_PENDING)
+        {
+            dbgprint("PostRecv: WSARecv* failed: %d\n", WSAGetLastError());
+            rc = SOCKET_ERROR;
+        }
+    }
+    if (rc == NO_ERROR)
+    {
+        // Increment outstanding overlapped operations
+        sock->OutstandingRecv++;
+    }
+
+    return rc;
+}
+
+//
+// Function: PostSend
+// 
+// Description:
+//    Post an overlapped send operation on the socket.
+//
+int PostSend(SOCKET_OBJ *sock, BUFFER_OBJ *sendobj)
+{
+    WSABUF *wbufs=NULL,
+            wbuf;
+    DWORD   bytes,
+            count;
+    int     rc, err;
+
+    sendobj->operation = OP_WRITE;
+
+    if (sendobj->response)
+    {
+        // A framed response is sent straight from the buffers it refers to
+        wbufs = &sendobj->response->Buffers[sendobj->response->First];
+        count = sendobj->response->BufferCount - sendobj->response->First;
+    }
+    else if (sendobj->message)
+    {
+        // A published message is sent from the one copy all subscribers share
+        wbuf.buf = sendobj->message->Data;
+        wbuf.len = sendobj->message->Length;
+
+        wbufs = &wbuf;
+        count = 1;
+    }
+    else
+    {
+        wbuf.buf = sendobj->buf;
+        wbuf.len = sendobj->buflen;
+
+        wbufs = &wbuf;
+        count = 1;
+    }
+
+    sendobj->PostTime = StatsTimestamp();
+
+    rc = WSASend(
+            sock->s,
+            wbufs,
+            count,
+           &bytes,
+            0,
+           &sendobj->ol,
+            NULL
+            );
+
+    if (rc == SOCKET_ERROR)
+    {
+        rc = NO_ERROR;
+        if ((err = WSAGetLastError()) != WSA_IO_PENDING)
+        {
+            if (err == WSAENOBUFS)
+                DebugBreak();
+
+            dbgprint("PostSend: WSASend* failed: %d [internal = %d]\n", WSAGetLastError(), sendobj->ol.Internal);
+            rc = SOCKET_ERROR;
+        }
+    }
+    if (rc == NO_ERROR)
+    {
+        // Increment the outstanding operation count
+        sock->OutstandingSend++;
+
+        InterlockedIncrement(&gOutstandingSends);
+    }
+
+    return rc;
+}
+
+//
+// Function: PostAccept
+// 
+// Description:
+//    Post an overlapped accept on a listening socket.
+//
+int PostAccept(LISTEN_OBJ *listen, BUFFER_OBJ *acceptobj)
+{
+    DWORD   bytes;
+    int     rc;
+
+    acceptobj->operation = OP_ACCEPT;
+
+    // Create the client socket for an incoming connection
+    acceptobj->sclient = socket(listen->AddressFamily, SOCK_STREAM, IPPROTO_TCP);
+    if (acceptobj->sclient == INVALID_SOCKET)
+    {
+        fprintf(stderr, "PostAccept: socket failed: %d\n", WSAGetLastError());
+        return -1;
+    }
+
+    acceptobj->PostTime = StatsTimestamp();
+
+    rc = listen->lpfnAcceptEx(
             listen->s,
             acceptobj->sclient,
             acceptobj->buf,
-            acceptobj->buflen - ((sizeof(SOCKADDR_STORAGE) + 16) * 2),
+            (gFirstByteTimeout > 0) ? 0 : acceptobj->buflen - ((sizeof(SOCKADDR_STORAGE) + 16) * 2),
             sizeof(SOCKADDR_STORAGE) + 16,
             sizeof(SOCKADDR_STORAGE) + 16,
            &bytes,
-           &acceptobj->ol
+           &acceptobj->ol
+            );
+    if (rc == FALSE)
+    {
+        if (WSAGetLastError() != WSA_IO_PENDING)
+        {
+            printf("PostAccept: AcceptEx failed: %d\n",
+                    WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+    }
+
+    // Increment the outstanding overlapped count for this socket
+    InterlockedIncrement(&listen->PendingAcceptCount);
+
+    return NO_ERROR;
+}
+
+//
+// Function: PostAccepts
+//
+// Description:
+//    Posts up to count additional accepts on the listening socket without
+//    exceeding the maximum (-oa). Returns the number actually posted.
+//
+int PostAccepts(LISTEN_OBJ *listenobj, int count)
+{
+    BUFFER_OBJ *acceptobj=NULL;
+    int         posted;
+
+    // Under high load new connections wait in the listen backlog
+    if (gLoadLevel >= LOAD_HIGH)
+        return 0;
+
+    posted = 0;
+    while ((posted < count) &&
+           (listenobj->PendingAcceptCount < gMaxAccepts) )
+    {
+        acceptobj = GetBufferObj(gBufferSize);
+        if (acceptobj == NULL)
+            break;
+
+        acceptobj->PostAccept = listenobj->AcceptEvent;
+
+        InsertPendingAccept(listenobj, acceptobj);
+
+        if (PostAccept(listenobj, acceptobj) != NO_ERROR)
+        {
+            RemovePendingAccept(listenobj, acceptobj);
+
+            if (acceptobj->sclient != INVALID_SOCKET)
+            {
+                closesocket(acceptobj->sclient);
+                acceptobj->sclient = INVALID_SOCKET;
+            }
+            FreeBufferObj(acceptobj);
+            break;
+        }
+        posted++;
+    }
+    return posted;
+}
+
+//
+// Function: RequestAcceptRepost
+//
+// Description:
+//    Called by the completion threads when an accept has completed. The
+//    first request since the main thread last topped up the pool records
+//    the time and wakes the main thread; later ones just wait for it.
+//
+void RequestAcceptRepost(LISTEN_OBJ *listenobj)
+{
+    if (InterlockedCompareExchange64(&listenobj->RepostRequested, StatsTimestamp(), 0) == 0)
+    {
+        SetEvent(listenobj->RepostAccept);
+    }
+}
+
+//
+// Function: UpdateAcceptTarget
+//
+// Description:
+//    Resizes the pool of pending accepts once per ACCEPT_CONTROL_INTERVAL.
+//    Connections arriving while a completed accept is being replaced find
+//    no AcceptEx and wait in the listen backlog, so the pool must hold at
+//    least the accept rate times the refill latency (with some headroom).
+//    A rising rate is taken immediately while a falling one is smoothed,
+//    and the target shrinks by at most an eighth per interval and not at
+//    all in an interval during which the pool ran dry. The target always
+//    lies between the initial (-o) and maximum (-oa) accept counts.
+//
+void UpdateAcceptTarget(LISTEN_OBJ *listenobj)
+{
+    LONGLONG    target;
+    ULONG       now,
+                elapsed,
+                rate;
+    long        accepts,
+                exhausted;
+
+    now = GetTickCount();
+
+    elapsed = now - listenobj->LastUpdate;
+    if (elapsed < ACCEPT_CONTROL_INTERVAL)
+        return;
+
+    accepts   = listenobj->AcceptCount - listenobj->AcceptCountLast;
+    exhausted = listenobj->ExhaustedCount - listenobj->ExhaustedCountLast;
+
+    listenobj->AcceptCountLast    += accepts;
+    listenobj->ExhaustedCountLast += exhausted;
+    listenobj->LastUpdate          = now;
+
+    rate = (ULONG)(((ULONGLONG)accepts * 1000) / elapsed);
+    if (rate > listenobj->AcceptRate)
+        listenobj->AcceptRate = rate;
+    else
+        listenobj->AcceptRate = (listenobj->AcceptRate * 3 + rate) / 4;
+
+    target = ((LONGLONG)listenobj->AcceptRate * listenobj->RefillLatency * ACCEPT_HEADROOM) / 1000000;
+
+    if (target < listenobj->TargetAcceptCount)
+    {
+        if (exhausted > 0)
+            target = listenobj->TargetAcceptCount;
+        else if (target < listenobj->TargetAcceptCount - (listenobj->TargetAcceptCount / 8))
+            target = listenobj->TargetAcceptCount - (listenobj->TargetAcceptCount / 8);
+    }
+
+    if (target < gInitialAccepts)
+        target = gInitialAccepts;
+    if (target > gMaxAccepts)
+        target = gMaxAccepts;
+
+    listenobj->TargetAcceptCount = (long)target;
+}
+
+//
+// Function: PrintAcceptStatistics
+//
+// Description:
+//    Prints the state of a listening socket's accept pool.
+//
+void PrintAcceptStatistics(LISTEN_OBJ *listenobj)
+{
+    printf("Accept pool: pending %ld target %ld; accepts/sec %lu; refill %lu us; exhausted %ld; refused %ld; from backlog %ld\n",
+            listenobj->PendingAcceptCount,
+            listenobj->TargetAcceptCount,
+            listenobj->AcceptRate,
+            listenobj->RefillLatency,
+            listenobj->ExhaustedCount,
+            listenobj->RefusedCount,
+            listenobj->DrainedCount
+            );
+}
+
+//
+// Function: StartRecv
+//
+// Description:
+//    Posts a receive on the connection: a zero byte receive if -z or -r was
+//    given, otherwise one with a full data buffer.
+//
+int StartRecv(SOCKET_OBJ *sock)
+{
+    BUFFER_OBJ *recvobj=NULL;
+
+    if ((gZeroByteRecv) || (gReadyMode))
+        recvobj = GetZeroByteObj();
+    else
+        recvobj = GetRecvBufferObj(sock);
+
+    if (recvobj == NULL)
+        return SOCKET_ERROR;
+
+    recvobj->sock = sock;
+    if (PostRecv(sock, recvobj) != NO_ERROR)
+    {
+        FreeBufferObj(recvobj);
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: PostNextRecv
+//
+// Description:
+//    Posts the next receive once data has been received on a connection. If
+//    the connection has reached its high watermark, or the server has used up
+//    its buffered byte budget, the receive is paused instead. A paused
+//    receive is counted in OutstandingRecv so the connection is not freed
+//    until ResumeRecv posts or drops it. Must be called on the socket's strand.
+//
+void PostNextRecv(SOCKET_OBJ *sock)
+{
+    if (sock->bClosing == FALSE)
+    {
+        if ((sock->bDeferred) && (gLoadLevel == LOAD_NORMAL))
+        {
+            // The load dropped before the first data arrived
+            sock->bDeferred = FALSE;
+        }
+
+        if (sock->bDeferred)
+        {
+            // The first receive of a connection accepted under high load
+            //    waits for the load to drop (see ResumeRecv). bDeferred
+            //    stays set until then.
+            sock->bRecvPaused = TRUE;
+            sock->OutstandingRecv++;
+            InterlockedIncrement(&gPausedConnections);
+            InterlockedIncrement(&gRecvPauses);
+            InterlockedIncrement(&gDeferredConnections);
+
+            DeferSocket(sock);
+        }
+        else if ((EchoTarget(sock)->QueuedBytes >= gHighWatermark) || (gBufferedBytes >= gMaxBufferedBytes))
+        {
+            sock->bRecvPaused = TRUE;
+            sock->OutstandingRecv++;
+            InterlockedIncrement(&gPausedConnections);
+            InterlockedIncrement(&gRecvPauses);
+
+            // Nothing on the connection itself will resume it if it is only
+            //    waiting for the budget
+            if (gBufferedBytes >= gMaxBufferedBytes)
+            {
+                sock->bOnPausedList = TRUE;
+                InterlockedPushEntrySList(&sock->shard->PausedList, &sock->PausedEntry);
+            }
+        }
+        else if (StartRecv(sock) != NO_ERROR)
+        {
+            sock->bClosing = TRUE;
+        }
+    }
+}
+
+//
+// Function: DeferSocket
+//
+// Description:
+//    Puts a connection whose first receive waits for the load to drop on its
+//    shard's deferred list. If the load is already back to normal the list is
+//    flagged so the connection is not left there until the next drop. Must
+//    be called on the socket's strand.
+//
+void DeferSocket(SOCKET_OBJ *sock)
+{
+    SHARD  *shard=NULL;
+
+    shard = sock->shard;
+
+    sock->bOnPausedList = TRUE;
+
+    EnterCriticalSection(&shard->DeferredCritSec);
+
+    sock->bOnDeferredList = TRUE;
+    sock->DeferredPrev    = NULL;
+    sock->DeferredNext    = shard->DeferredHead;
+    if (shard->DeferredHead)
+        shard->DeferredHead->DeferredPrev = sock;
+    shard->DeferredHead = sock;
+
+    if (gLoadLevel == LOAD_NORMAL)
+        InterlockedExchange(&shard->bResumeDeferred, TRUE);
+
+    LeaveCriticalSection(&shard->DeferredCritSec);
+}
+
+//
+// Function: UndeferSocket
+//
+// Description:
+//    Takes a connection off its shard's deferred list. Returns FALSE if it
+//    is no longer on it, in which case ResumePausedConnections has already
+//    signalled it. Must be called on the socket's strand.
+//
+BOOL UndeferSocket(SOCKET_OBJ *sock)
+{
+    SHARD  *shard=NULL;
+    BOOL    bRemoved;
+
+    shard = sock->shard;
+
+    EnterCriticalSection(&shard->DeferredCritSec);
+
+    bRemoved = sock->bOnDeferredList;
+    if (bRemoved)
+    {
+        if (sock->DeferredPrev)
+            sock->DeferredPrev->DeferredNext = sock->DeferredNext;
+        else
+            shard->DeferredHead = sock->DeferredNext;
+        if (sock->DeferredNext)
+            sock->DeferredNext->DeferredPrev = sock->DeferredPrev;
+
+        sock->bOnDeferredList = FALSE;
+        sock->DeferredPrev    = NULL;
+        sock->DeferredNext    = NULL;
+    }
+
+    LeaveCriticalSection(&shard->DeferredCritSec);
+
+    return bRemoved;
+}
+
+//
+// Function: ResumeRecv
+//
+// Description:
+//    Posts the paused receive of a connection once it has drained to its low
+//    watermark and the server is below the resume mark of its budget. If only
+//    the budget is lacking the socket is put on the shard's paused list. A
+//    deferred first receive also waits for the load to be back to normal and
+//    goes back on the shard's deferred list until then. The paused receive
+//    of a closing connection is simply dropped; a deferred one is taken off
+//    the deferred list for that right away, as the load may stay high for a
+//    long time. Must be called on the socket's strand.
+//
+void ResumeRecv(SOCKET_OBJ *sock)
+{
+    if (sock->bRecvPaused == FALSE)
+        return;
+
+    if (sock->bOnPausedList)
+    {
+        if ((sock->bClosing == FALSE) || (sock->bDeferred == FALSE) || (UndeferSocket(sock) == FALSE))
+            return;
+
+        sock->bOnPausedList = FALSE;
+    }
+
+    if (sock->bClosing == FALSE)
+    {
+        if ((sock->bDeferred) && (gLoadLevel != LOAD_NORMAL))
+        {
+            DeferSocket(sock);
+            return;
+        }
+
+        if (EchoTarget(sock)->QueuedBytes > gLowWatermark)
+            return;
+
+        if (gBufferedBytes >= gResumeBufferedBytes)
+        {
+            sock->bOnPausedList = TRUE;
+            InterlockedPushEntrySList(&sock->shard->PausedList, &sock->PausedEntry);
+            return;
+        }
+
+        if (StartRecv(sock) != NO_ERROR)
+        {
+            sock->bClosing = TRUE;
+        }
+        InterlockedIncrement(&gRecvResumes);
+    }
+
+    sock->bDeferred   = FALSE;
+    sock->bRecvPaused = FALSE;
+    InterlockedDecrement(&gPausedConnections);
+    sock->OutstandingRecv--;
+}
+
+//
+// Function: ResumePausedConnections
+//
+// Description:
+//    Resumes the connections on the shard's paused list as long as the server
+//    stays below the resume mark of its budget. Connections still above their
+//    low watermark stay paused until their own sends complete. The deferred
+//    list is only gone through once the load has dropped back to normal (see
+//    UpdateLoadLevel); closing connections take themselves off it.
+//
+void ResumePausedConnections(SHARD *shard)
+{
+    SLIST_ENTRY *entry=NULL,
+                *next=NULL;
+    SOCKET_OBJ  *sock=NULL,
+                *nextsock=NULL;
+
+    while ((gBufferedBytes < gResumeBufferedBytes) &&
+           ((entry = InterlockedFlushSList(&shard->PausedList)) != NULL))
+    {
+        while (entry)
+        {
+            next = entry->Next;
+            sock = CONTAINING_RECORD(entry, SOCKET_OBJ, PausedEntry);
+
+            SignalSocket(sock, SIGNAL_RESUME);
+
+            entry = next;
+        }
+    }
+
+    // New connections accepted under high load start receiving once the
+    //    load is back to normal
+    if ((shard->bResumeDeferred == FALSE) || (InterlockedExchange(&shard->bResumeDeferred, FALSE) == FALSE))
+        return;
+
+    EnterCriticalSection(&shard->DeferredCritSec);
+    sock = shard->DeferredHead;
+    shard->DeferredHead = NULL;
+    for(nextsock=sock; nextsock ;nextsock=nextsock->DeferredNext)
+        nextsock->bOnDeferredList = FALSE;
+    LeaveCriticalSection(&shard->DeferredCritSec);
+
+    while (sock)
+    {
+        nextsock = sock->DeferredNext;
+        sock->DeferredPrev = NULL;
+        sock->DeferredNext = NULL;
+
+        SignalSocket(sock, SIGNAL_RESUME);
+
+        sock = nextsock;
+    }
+}
+
+//
+// Function: ConnectionTimer
+//
+// Description:
+//    Timer routine of a connection. The deadlines are checked on the
+//    connection's strand (see CheckConnectionTimeouts). The wheel is locked
+//    while this runs so the strand is never run here; if it is idle it is
+//    handed to the shard's completion thread.
+//
+ULONG ConnectionTimer(TIMER *timer)
+{
+    SOCKET_OBJ    *sock=NULL;
+
+    sock = CONTAINING_RECORD(timer, SOCKET_OBJ, Timer);
+
+    if (PostSocketSignal(sock, SIGNAL_TIMER))
+    {
+        if (ProactorPost(sock->shard->proactor, (ULONG_PTR)sock, NULL, 0) == SOCKET_ERROR)
+        {
+            fprintf(stderr, "ConnectionTimer: ProactorPost failed: %d\n", GetLastError());
+        }
+    }
+
+    // Rearmed by CheckConnectionTimeouts
+    return 0;
+}
+
+//
+// Function: CheckConnectionTimeouts
+//
+// Description:
+//    Closes the connection if it has missed its first byte deadline, has been
+//    idle too long or has been trickling data below the minimum rate.
+//    Otherwise the timer is armed for the next deadline. Closing the socket
+//    makes its outstanding operations fail so the connection is then cleaned
+//    up through the normal completion path. Must be called on the socket's
+//    strand.
+//
+void CheckConnectionTimeouts(SOCKET_OBJ *sock)
+{
+    volatile LONG *reason=NULL;
+    ULONGLONG      bytes;
+    ULONG          now,
+                   elapsed,
+                   next;
+
+    next = 0;
+    if (sock->bClosing == FALSE)
+    {
+        now = GetTickCount();
+
+        if ((sock->BytesReceived == 0) && (gFirstByteTimeout > 0))
+        {
+            elapsed = now - sock->AcceptTime;
+            if (elapsed >= (ULONG)gFirstByteTimeout * 1000)
+                reason = &gFirstByteTimeouts;
+            else
+                next = (gFirstByteTimeout * 1000) - elapsed;
+        }
+        else
+        {
+            if (gIdleTimeout > 0)
+            {
+                elapsed = now - sock->LastActivity;
+                if (elapsed >= (ULONG)gIdleTimeout * 1000)
+                    reason = &gIdleTimeouts;
+                else
+                    next = (gIdleTimeout * 1000) - elapsed;
+            }
+            if ((reason == NULL) && (gMinRate > 0))
+            {
+                elapsed = now - sock->RateCheckTime;
+                if (elapsed >= MIN_RATE_WINDOW)
+                {
+                    // A connection which sent nothing is left to the idle timeout
+                    bytes = sock->BytesReceived - sock->BytesAtRateCheck;
+                    if ((bytes > 0) && (bytes < ((ULONGLONG)gMinRate * elapsed) / 1000))
+                        reason = &gSlowTimeouts;
+
+                    sock->BytesAtRateCheck = sock->BytesReceived;
+                    sock->RateCheckTime    = now;
+                    elapsed                = 0;
+                }
+                if ((next == 0) || (MIN_RATE_WINDOW - elapsed < next))
+                    next = MIN_RATE_WINDOW - elapsed;
+            }
+        }
+
+        if (reason)
+        {
+            InterlockedIncrement(reason);
+
+            sock->bClosing = TRUE;
+
+            closesocket(sock->s);
+            sock->s = INVALID_SOCKET;
+
+            // A paused receive has nothing outstanding to fail
+            ResumeRecv(sock);
+
+            CloseRelayPeer(sock);
+        }
+        else if (next > 0)
+        {
+            TimerArm(sock->shard->wheel, &sock->Timer, next);
+        }
+    }
+}
+
+//
+// Function: IsSocketFinished
+//
+// Description:
+//    Returns TRUE if the connection is closing and nothing is outstanding or
+//    queued on it any more.
+//
+BOOL IsSocketFinished(SOCKET_OBJ *sock)
+{
+    if ((sock->bClosing == FALSE) ||
+        (sock->OutstandingSend != 0) ||
+        (sock->OutstandingRecv != 0) ||
+        (sock->PendingSend != 0) ||
+        (sock->bReady) )
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Function: ShutdownRelay
+//
+// Description:
+//    Passes the end of the data on from one leg of a relayed connection to
+//    the other. Once nothing more will be received on from and everything
+//    it received has been sent on to, to is shut down for sending so its
+//    remote side sees the close as well. Must be called on the strand.
+//
+void ShutdownRelay(SOCKET_OBJ *from, SOCKET_OBJ *to)
+{
+    if ((from->bClosing == FALSE) ||
+        (from->OutstandingRecv != 0) ||
+        (to->PendingSend != 0) ||
+        (to->OutstandingSend != 0) ||
+        (to->bShutdown) ||
+        (to->s == INVALID_SOCKET) )
+    {
+        return;
+    }
+
+    to->bShutdown = TRUE;
+
+    if (shutdown(to->s, SD_SEND) == SOCKET_ERROR)
+    {
+        dbgprint("ShutdownRelay: shutdown failed: %d\n", WSAGetLastError());
+    }
+}
+
+//
+// Function: CheckSocketClosed
+//
+// Description:
+//    Finishes a closing connection once nothing is outstanding or queued on
+//    it any more. The socket is closed and the strand released so the
+//    connection is freed when the strand has run its remaining work. Both
+//    legs of a relayed connection are finished together. Must be called on
+//    the socket's strand.
+//
+void CheckSocketClosed(SOCKET_OBJ *sock)
+{
+    SOCKET_OBJ *peer=NULL;
+
+    peer = sock->peer;
+    if (peer)
+    {
+        ShutdownRelay(sock, peer);
+        ShutdownRelay(peer, sock);
+    }
+
+    if ((IsSocketFinished(sock) == FALSE) ||
+        ((peer) && (IsSocketFinished(peer) == FALSE)) ||
+        (sock->strand->bReleased) )
+    {
+        return;
+    }
+
+    // Make sure the timer routines are not running and won't be called again
+    if (sock->shard)
+    {
+        TimerCancel(sock->shard->wheel, &sock->Timer);
+    }
+    if ((peer) && (peer->shard))
+    {
+        TimerCancel(peer->shard->wheel, &peer->Timer);
+    }
+
+    // No message may be delivered once the strand is released
+    PubSubUnsubscribeAll(&sock->PubSub);
+
+    StrandRelease(sock->strand);
+}
+
+//
+// Function: SocketSignalWork
+//
+// Description:
+//    Strand routine which carries out the work other threads requested on
+//    the connection (see PostSocketSignal).
+//
+void SocketSignalWork(STRAND_WORK *work)
+{
+    SOCKET_OBJ *sock=NULL;
+    LONG        signals;
+
+    sock = CONTAINING_RECORD(work, SOCKET_OBJ, Kick);
+
+    signals = InterlockedExchange(&sock->Signals, 0);
+
+    // A timer may have fired just before the connection was finished
+    if (sock->strand->bReleased)
+        return;
+
+    if (signals & SIGNAL_TIMER)
+    {
+        CheckConnectionTimeouts(sock);
+    }
+    if (signals & SIGNAL_RESUME)
+    {
+        sock->bOnPausedList = FALSE;
+        ResumeRecv(sock);
+    }
+    if (signals & SIGNAL_SEND)
+    {
+        SendQueuedOperations(sock);
+    }
+
+    CheckSocketClosed(sock);
+}
+
+//
+// Function: PostSocketSignal
+//
+// Description:
+//    Requests work on the connection from another thread. The signals are
+//    collected until the strand gets to them so the connection's work item
+//    is queued at most once. Returns TRUE if the strand was idle and the
+//    caller must now run it (see RunSocketStrand).
+//
+BOOL PostSocketSignal(SOCKET_OBJ *sock, LONG signal)
+{
+    if (InterlockedOr(&sock->Signals, signal) != 0)
+        return FALSE;
+
+    return StrandPost(sock->strand, &sock->Kick);
+}
+
+//
+// Function: RunSocketStrand
+//
+// Description:
+//    Runs the work queued on the connection's strand and frees the
+//    connection if it was finished by that work.
+//
+void RunSocketStrand(SOCKET_OBJ *sock)
+{
+    if (StrandRun(sock->strand))
+    {
+        FreeSocketObj(sock);
+    }
+}
+
+//
+// Function: SignalSocket
+//
+// Description:
+//    Requests work on the connection and does it right away if no other
+//    thread is working on the connection.
+//
+void SignalSocket(SOCKET_OBJ *sock, LONG signal)
+{
+    if (PostSocketSignal(sock, signal))
+    {
+        RunSocketStrand(sock);
+    }
+}
+
+//
+// Function: StartConnectionTimer
+//
+// Description:
+//    Arms the timer of a newly accepted connection for its first deadline.
+//    The data received with the accept is counted when it is handled as a
+//    receive.
+//
+void StartConnectionTimer(SOCKET_OBJ *sock, ULONG BytesReceived)
+{
+    ULONG   delay;
+
+    sock->AcceptTime    = GetTickCount();
+    sock->LastActivity  = sock->AcceptTime;
+    sock->RateCheckTime = sock->AcceptTime;
+
+    TimerInit(&sock->Timer, ConnectionTimer);
+
+    if ((BytesReceived == 0) && (gFirstByteTimeout > 0))
+        delay = gFirstByteTimeout * 1000;
+    else if (gIdleTimeout > 0)
+        delay = gIdleTimeout * 1000;
+    else if (gMinRate > 0)
+        delay = MIN_RATE_WINDOW;
+    else
+        return;
+
+    TimerArm(sock->shard->wheel, &sock->Timer, delay);
+}
+
+//
+// Function: CheckZeroCopySend
+//
+// Description:
+//    Called with the size of each receive. Once a connection receives at
+//    least the zero copy threshold (-zc) in one go, its send buffer is set
+//    to zero. From then on Winsock sends straight out of the echoed receive
+//    buffers instead of copying them into the socket's send buffer, and a
+//    send only completes (and its buffer is recycled) once the transport no
+//    longer needs the data. Small messages keep the send buffer since a
+//    copy is cheaper for them than waiting for the acknowledgement.
+//
+void CheckZeroCopySend(SOCKET_OBJ *sock, DWORD BytesTransfered)
+{
+    if ((gZeroCopyThreshold <= 0) ||
+        (sock->bZeroCopy) ||
+        (BytesTransfered < (DWORD)gZeroCopyThreshold) )
+    {
+        return;
+    }
+
+    EnableZeroCopySend(sock);
+}
+
+//
+// Function: EnableZeroCopySend
+//
+// Description:
+//    Sets the connection's send buffer to zero so its sends go out directly
+//    from the echoed buffers (see CheckZeroCopySend).
+//
+void EnableZeroCopySend(SOCKET_OBJ *sock)
+{
+    int     optval,
+            optlen;
+
+    if (sock->bZeroCopy)
+        return;
+
+    // Kept to restore it once a bulk transfer is over
+    optlen = sizeof(sock->SendBufferSize);
+    if (getsockopt(sock->s, SOL_SOCKET, SO_SNDBUF, (char *)&sock->SendBufferSize, &optlen) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "EnableZeroCopySend: getsockopt SO_SNDBUF failed: %d\n", WSAGetLastError());
+        return;
+    }
+
+    optval = 0;
+    if (setsockopt(sock->s, SOL_SOCKET, SO_SNDBUF, (char *)&optval, sizeof(optval)) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "EnableZeroCopySend: setsockopt SO_SNDBUF failed: %d\n", WSAGetLastError());
+        return;
+    }
+
+    // Only counted (and uncounted when freed) once the option is set
+    sock->bZeroCopy = TRUE;
+    InterlockedIncrement(&gZeroCopyConnections);
+}
+
+//
+// Function: DisableZeroCopySend
+//
+// Description:
+//    Gives the connection its send buffer back, so small sends are copied
+//    and complete at once instead of waiting for the acknowledgement.
+//
+void DisableZeroCopySend(SOCKET_OBJ *sock)
+{
+    if (sock->bZeroCopy == FALSE)
+        return;
+
+    if (setsockopt(sock->s, SOL_SOCKET, SO_SNDBUF, (char *)&sock->SendBufferSize, sizeof(sock->SendBufferSize)) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "DisableZeroCopySend: setsockopt SO_SNDBUF failed: %d\n", WSAGetLastError());
+        return;
+    }
+
+    sock->bZeroCopy = FALSE;
+    InterlockedDecrement(&gZeroCopyConnections);
+}
+
+//
+// Function: CheckBulkTransfer
+//
+// Description:
+//    Called with each receive before it is echoed. A connection whose
+//    receives keep filling their buffers is in a bulk transfer: once it has
+//    received the bulk threshold (-bk) that way, its next receives use bulk
+//    buffers and its sends skip the send buffer. A bulk receive shorter
+//    than a normal buffer means the transfer is over and the connection
+//    goes back to normal buffers. Bulk mode only applies to the raw echo
+//    since framed messages are handled piece by piece anyway.
+//
+void CheckBulkTransfer(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered)
+{
+    if ((gBulkThreshold <= 0) || (gFrameMode != FRAME_MODE_RAW))
+        return;
+
+    if (buf->bBulk)
+        StatsAdd(STAT_BULK_BYTES, BytesTransfered);
+
+    if (sock->bBulk)
+    {
+        if (BytesTransfered < (DWORD)gBufferSize)
+        {
+            sock->bBulk   = FALSE;
+            sock->FullRun = 0;
+            InterlockedDecrement(&gBulkConnections);
+
+            // Unless the receive still qualifies for zero copy (-zc) on its
+            //    own, the echoes go through the send buffer again
+            if ((gZeroCopyThreshold <= 0) || (BytesTransfered < (DWORD)gZeroCopyThreshold))
+                DisableZeroCopySend(EchoTarget(sock));
+        }
+        return;
+    }
+
+    if (BytesTransfered < (DWORD)buf->buflen)
+    {
+        sock->FullRun = 0;
+        return;
+    }
+
+    sock->FullRun += BytesTransfered;
+    if (sock->FullRun >= gBulkThreshold)
+    {
+        sock->bBulk = TRUE;
+        InterlockedIncrement(&gBulkConnections);
+
+        EnableZeroCopySend(EchoTarget(sock));
+    }
+}
+
+//
+// Function: StartBackends
+//
+// Description:
+//      Sets up the backends of the relay from the -x list of host:port
+//      pairs (an IPv6 address is written in brackets, e.g. [::1]:5151).
+//      The ConnectEx extension is loaded for each backend's address family.
+//      Each backend gets a pool per shard, so the shards must exist by now.
+//      The pools are filled by RefillBackendPool.
+//
+BOOL StartBackends(char *list)
+{
+    BACKEND         *backend=NULL;
+    struct addrinfo *res=NULL;
+    GUID             guidConnectEx = WSAID_CONNECTEX;
+    DWORD            bytes;
+    SOCKET           s;
+    char            *host=NULL,
+                    *port=NULL,
+                    *next=NULL;
+    int              rc;
+
+    for(host=list; (host) && (*host) ;host=next)
+    {
+        next = strchr(host, ',');
+        if (next)
+            *next++ = '\0';
+
+        port = strrchr(host, ':');
+        if (port == NULL)
+        {
+            fprintf(stderr, "backend %s has no port\n", host);
+            return FALSE;
+        }
+        *port++ = '\0';
+
+        if ((host[0] == '[') && (host[strlen(host) - 1] == ']'))
+        {
+            host[strlen(host) - 1] = '\0';
+            host++;
+        }
+
+        res = ResolveAddress(host, port, gAddressFamily, SOCK_STREAM, IPPROTO_TCP);
+        if (res == NULL)
+        {
+            fprintf(stderr, "unable to resolve backend %s\n", host);
+            return FALSE;
+        }
+
+        backend = (BACKEND *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BACKEND));
+        if (backend == NULL)
+        {
+            fprintf(stderr, "Out of memory!\n");
+            return FALSE;
+        }
+
+        backend->Pools = (BACKEND_POOL *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BACKEND_POOL) * gShardCount);
+        if (backend->Pools == NULL)
+        {
+            fprintf(stderr, "Out of memory!\n");
+            return FALSE;
+        }
+
+        backend->host    = host;
+        backend->port    = port;
+        backend->addrlen = (int)res->ai_addrlen;
+        memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+
+        freeaddrinfo(res);
+
+        InitializeCriticalSection(&backend->BackendCritSec);
+
+        // Until a connect fails the backend is assumed to be up
+        backend->bHealthy   = TRUE;
+        backend->RetryDelay = BACKEND_RETRY_MIN;
+        backend->DownUntil  = GetTickCount();
+
+        // Need to load the Winsock extension function from the provider of
+        //    the backend's address family
+        s = socket(backend->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+        {
+            fprintf(stderr, "socket failed: %d\n", WSAGetLastError());
+            return FALSE;
+        }
+        rc = WSAIoctl(
+                s,
+                SIO_GET_EXTENSION_FUNCTION_POINTER,
+               &guidConnectEx,
+                sizeof(guidConnectEx),
+               &backend->lpfnConnectEx,
+                sizeof(backend->lpfnConnectEx),
+               &bytes,
+                NULL,
+                NULL
+                );
+        closesocket(s);
+        if (rc == SOCKET_ERROR)
+        {
+            fprintf(stderr, "WSAIoctl: SIO_GET_EXTENSION_FUNCTION_POINTER failed: %d\n",
+                    WSAGetLastError());
+            return FALSE;
+        }
+
+        printf("Backend address: ");
+        PrintAddress((SOCKADDR *)&backend->addr, backend->addrlen);
+        printf("\n");
+
+        backend->next = gBackends;
+        gBackends     = backend;
+    }
+
+    return (gBackends != NULL);
+}
+
+//
+// Function: PostBackendConnect
+//
+// Description:
+//      Starts a new connection to a backend for its pool. As in chapter05's
+//      iocpclient, the socket is bound to a wildcard address and connected
+//      with an overlapped ConnectEx. The connection is serviced by the given
+//      shard and goes to that shard's pool; see HandleBackendConnect for its
+//      completion.
+//
+int PostBackendConnect(BACKEND *backend, SHARD *shard)
+{
+    SOCKADDR_STORAGE local;
+    BACKEND_POOL    *pool=NULL;
+    SOCKET_OBJ      *sock=NULL;
+    BUFFER_OBJ      *connobj=NULL;
+    SOCKET           s;
+    DWORD            bytes;
+    u_long           optval;
+    BOOL             rc;
+
+    s = socket(backend->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+    {
+        fprintf(stderr, "PostBackendConnect: socket failed: %d\n", WSAGetLastError());
+        return SOCKET_ERROR;
+    }
+
+    // ConnectEx requires a bound socket
+    memset(&local, 0, sizeof(local));
+    local.ss_family = backend->addr.ss_family;
+
+    if (bind(s, (SOCKADDR *)&local, backend->addrlen) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "PostBackendConnect: bind failed: %d\n", WSAGetLastError());
+        closesocket(s);
+        return SOCKET_ERROR;
+    }
+
+    sock = GetSocketObj(s, backend->addr.ss_family);
+    if (sock == NULL)
+    {
+        closesocket(s);
+        return SOCKET_ERROR;
+    }
+
+    sock->backend   = backend;
+    sock->shard     = shard;
+    sock->PoolState = POOL_CONNECTING;
+
+    // Ready receives read the socket without blocking
+    optval = 1;
+    if ((gReadyMode) && (ioctlsocket(sock->s, FIONBIO, &optval) == SOCKET_ERROR))
+    {
+        fprintf(stderr, "PostBackendConnect: ioctlsocket FIONBIO failed: %d\n", WSAGetLastError());
+    }
+
+    connobj = GetZeroByteObj();
+    if ((connobj == NULL) ||
+        (ProactorAssociate(shard->proactor, sock->s, (ULONG_PTR)sock) == SOCKET_ERROR))
+    {
+        if (connobj)
+            FreeBufferObj(connobj);
+        FreeSocketObj(sock);
+        return SOCKET_ERROR;
+    }
+
+    connobj->operation = OP_CONNECT;
+    connobj->sock      = sock;
+
+    pool = &backend->Pools[shard - gShards];
+
+    EnterCriticalSection(&backend->BackendCritSec);
+    pool->Connecting++;
+    backend->Connecting++;
+    LeaveCriticalSection(&backend->BackendCritSec);
+
+    rc = backend->lpfnConnectEx(
+            sock->s,
+            (SOCKADDR *)&backend->addr,
+            backend->addrlen,
+            NULL,
+            0,
+           &bytes,
+           &connobj->ol
+            );
+    if ((rc == FALSE) && (WSAGetLastError() != WSA_IO_PENDING))
+    {
+        fprintf(stderr, "PostBackendConnect: ConnectEx failed: %d\n", WSAGetLastError());
+
+        EnterCriticalSection(&backend->BackendCritSec);
+        pool->Connecting--;
+        backend->Connecting--;
+        LeaveCriticalSection(&backend->BackendCritSec);
+
+        FreeBufferObj(connobj);
+        FreeSocketObj(sock);
+        return SOCKET_ERROR;
+    }
+
+    return NO_ERROR;
+}
+
+//
+// Function: RefillBackendPool
+//
+// Description:
+//      Tops up each of a backend's per shard pools to its share of the -xp
+//      connections (rounded up). A backend out of rotation only gets a
+//      single connect once its retry delay has passed; if that succeeds the
+//      backend is back and the pools are filled. Called by the main thread
+//      every few seconds and when a backend comes back.
+//
+void RefillBackendPool(BACKEND *backend)
+{
+    BACKEND_POOL *pool=NULL;
+    ULONG         now;
+    int           target,
+                  count,
+                  i,
+                  j;
+
+    now = GetTickCount();
+
+    target = (gBackendPool + gShardCount - 1) / gShardCount;
+
+    EnterCriticalSection(&backend->BackendCritSec);
+    if ((backend->bHealthy == FALSE) &&
+        (backend->Connecting == 0) &&
+        ((LONG)(now - backend->DownUntil) >= 0))
+    {
+        count = 1;
+    }
+    else
+    {
+        count = 0;
+    }
+    LeaveCriticalSection(&backend->BackendCritSec);
+
+    if (count)
+    {
+        PostBackendConnect(backend, &gShards[InterlockedIncrement(&gNextShard) % gShardCount]);
+        return;
+    }
+
+    for(i=0; i < gShardCount ;i++)
+    {
+        pool = &backend->Pools[i];
+
+        EnterCriticalSection(&backend->BackendCritSec);
+        if (backend->bHealthy)
+            count = target - pool->IdleCount - pool->Connecting;
+        else
+            count = 0;
+        LeaveCriticalSection(&backend->BackendCritSec);
+
+        for(j=0; j < count ;j++)
+        {
+            if (PostBackendConnect(backend, &gShards[i]) != NO_ERROR)
+                return;
+        }
+    }
+}
+
+//
+// Function: HandleBackendConnect
+//
+// Description:
+//      Handles a completed ConnectEx to a backend. Nothing else refers to the
+//      connection yet, so this runs outside of any strand. A connection that
+//      succeeded keeps a zero byte receive pending as its health check and
+//      is put in the pool of the shard servicing it. The receive is posted under the
+//      backend's lock so that its completion cannot be dispatched before
+//      the connection is in the pool (see GetBackendStrand). A failed
+//      connect takes the backend out of rotation for its retry delay, which
+//      doubles with each failure.
+//
+void HandleBackendConnect(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD error)
+{
+    BACKEND      *backend=NULL;
+    BACKEND_POOL *pool=NULL;
+    BUFFER_OBJ   *recvobj=NULL;
+    ULONG         now;
+    BOOL          bRecovered=FALSE;
+    int           optval=1;
+
+    backend = sock->backend;
+    pool    = &backend->Pools[sock->shard - gShards];
+
+    FreeBufferObj(buf);
+
+    // Need to update the socket context in order to use the shutdown API
+    if ((error == NO_ERROR) &&
+        (setsockopt(sock->s, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, (char *)&optval, sizeof(optval)) == SOCKET_ERROR))
+    {
+        error = WSAGetLastError();
+        fprintf(stderr, "setsockopt: SO_UPDATE_CONNECT_CONTEXT failed: %d\n", error);
+    }
+
+    if (error != NO_ERROR)
+    {
+        now = GetTickCount();
+
+        EnterCriticalSection(&backend->BackendCritSec);
+        pool->Connecting--;
+        backend->Connecting--;
+
+        // Only the first failure of a round of connects counts against the delay
+        if ((LONG)(now - backend->DownUntil) >= 0)
+        {
+            if (backend->bHealthy)
+                printf("Backend %s:%s down: %d\n", backend->host, backend->port, error);
+
+            backend->bHealthy  = FALSE;
+            backend->DownUntil = now + backend->RetryDelay;
+
+            backend->RetryDelay *= 2;
+            if (backend->RetryDelay > BACKEND_RETRY_MAX)
+                backend->RetryDelay = BACKEND_RETRY_MAX;
+        }
+        LeaveCriticalSection(&backend->BackendCritSec);
+
+        InterlockedIncrement(&backend->Failures);
+
+        FreeSocketObj(sock);
+        return;
+    }
+
+    recvobj = GetZeroByteObj();
+
+    EnterCriticalSection(&backend->BackendCritSec);
+    pool->Connecting--;
+    backend->Connecting--;
+
+    if (recvobj)
+    {
+        recvobj->sock = sock;
+        if (PostRecv(sock, recvobj) != NO_ERROR)
+        {
+            FreeBufferObj(recvobj);
+            recvobj = NULL;
+        }
+    }
+    if (recvobj)
+    {
+        if (backend->bHealthy == FALSE)
+        {
+            printf("Backend %s:%s up\n", backend->host, backend->port);
+            bRecovered = TRUE;
+        }
+        backend->bHealthy   = TRUE;
+        backend->RetryDelay = BACKEND_RETRY_MIN;
+
+        sock->PoolState = POOL_IDLE;
+        sock->next      = pool->Idle;
+        pool->Idle      = sock;
+        pool->IdleCount++;
+        backend->IdleCount++;
+    }
+    LeaveCriticalSection(&backend->BackendCritSec);
+
+    // The connection belongs to the pool (or its strand) from here on
+    if (recvobj == NULL)
+        FreeSocketObj(sock);
+    else if (bRecovered)
+        RefillBackendPool(backend);
+}
+
+//
+// Function: GetBackendStrand
+//
+// Description:
+//      Returns the strand a completion on a backend connection runs on. A
+//      pooled connection only has its zero byte receive outstanding, so a
+//      completion while it is idle means the backend closed (or wrote to)
+//      it: the connection is taken out of the pool and handled on its own
+//      strand. Once paired with a client it runs on the client's strand.
+//      The pool lock keeps the pairing from happening in between.
+//
+STRAND *GetBackendStrand(SOCKET_OBJ *sock)
+{
+    BACKEND      *backend=NULL;
+    BACKEND_POOL *pool=NULL;
+    SOCKET_OBJ  **link=NULL;
+    STRAND       *strand=NULL;
+
+    backend = sock->backend;
+    pool    = &backend->Pools[sock->shard - gShards];
+
+    EnterCriticalSection(&backend->BackendCritSec);
+    if (sock->PoolState == POOL_IDLE)
+    {
+        for(link=&pool->Idle; *link != sock ;link=&(*link)->next)
+            ;
+        *link      = sock->next;
+        sock->next = NULL;
+
+        pool->IdleCount--;
+        backend->IdleCount--;
+        sock->PoolState = POOL_DROPPED;
+
+        InterlockedIncrement(&backend->Dropped);
+    }
+    strand = sock->strand;
+    LeaveCriticalSection(&backend->BackendCritSec);
+
+    return strand;
+}
+
+//
+// Function: PairConnection
+//
+// Description:
+//      Pairs a newly accepted client with a pooled backend connection. The
+//      client goes to the healthy backend with the fewest relayed
+//      connections (least outstanding requests) among those with a
+//      connection in the client's shard's pool. Since both connections are
+//      serviced by that shard, the backend connection's work can run on the
+//      client's strand from then on. A replacement connection is started
+//      for the pool. Returns FALSE if no backend connection is ready in
+//      the shard. Must be called on the client's strand.
+//
+BOOL PairConnection(SOCKET_OBJ *sock)
+{
+    BACKEND      *backend=NULL,
+                 *best=NULL;
+    BACKEND_POOL *pool=NULL;
+    SOCKET_OBJ   *conn=NULL;
+    LONG          active,
+                  bestactive=0;
+    int           shard;
+
+    shard = (int)(sock->shard - gShards);
+
+    for(backend=gBackends; backend ;backend=backend->next)
+    {
+        EnterCriticalSection(&backend->BackendCritSec);
+        if ((backend->bHealthy) && (backend->Pools[shard].IdleCount > 0))
+            active = backend->Active;
+        else
+            active = -1;
+        LeaveCriticalSection(&backend->BackendCritSec);
+
+        if ((active >= 0) && ((best == NULL) || (active < bestactive)))
+        {
+            best       = backend;
+            bestactive = active;
+        }
+    }
+    if (best == NULL)
+        return FALSE;
+
+    pool = &best->Pools[shard];
+
+    // The pool may have been emptied since the scan
+    EnterCriticalSection(&best->BackendCritSec);
+
+    conn = pool->Idle;
+    if (conn)
+    {
+        pool->Idle = conn->next;
+        conn->next = NULL;
+
+        pool->IdleCount--;
+        best->IdleCount--;
+
+        conn->PoolState = POOL_PAIRED;
+        conn->strand    = sock->strand;
+        conn->peer      = sock;
+        sock->peer      = conn;
+
+        InterlockedIncrement(&best->Active);
+        InterlockedIncrement(&best->Relayed);
+    }
+    LeaveCriticalSection(&best->BackendCritSec);
+
+    if (conn == NULL)
+        return FALSE;
+
+    PostBackendConnect(best, sock->shard);
+
+    return TRUE;
+}
+
+//
+// Function: PrintBackendStatistics
+//
+// Description:
+//      Prints the state of each backend of the relay.
+//
+void PrintBackendStatistics()
+{
+    BACKEND *backend=NULL;
+
+    for(backend=gBackends; backend ;backend=backend->next)
+    {
+        printf("Backend %s:%s %s: idle %d connecting %d active %ld relayed %ld failed %ld dropped %ld\n",
+                backend->host,
+                backend->port,
+                (backend->bHealthy) ? "up" : "down",
+                backend->IdleCount,
+                backend->Connecting,
+                backend->Active,
+                backend->Relayed,
+                backend->Failures,
+                backend->Dropped
+                );
+    }
+    if (gBackends)
+    {
+        printf("Relay: %ld clients rejected for lack of a backend connection\n", gRelayRejected);
+    }
+}
+
+//
+// Function: ReleaseFrameBuffer
+//
+// Description:
+//    Frees a receive buffer once no message or response refers to it (see
+//    FrameInit).
+//
+void ReleaseFrameBuffer(FRAME_BUFFER *buffer)
+{
+    FreeBufferObj(CONTAINING_RECORD(buffer, BUFFER_OBJ, Frame));
+}
+
+//
+// Function: DeliveryWork
+//
+// Description:
+//    Strand routine which queues a published message for sending to a
+//    subscriber (see DeliverMessage). A subscriber which already has the
+//    subscriber queue limit (-pq) queued is a slow consumer: the message
+//    is dropped for it and, with the close policy, it is disconnected.
+//
+void DeliveryWork(STRAND_WORK *work)
+{
+    BUFFER_OBJ *sendobj=NULL;
+    SOCKET_OBJ *sock=NULL;
+
+    sendobj = CONTAINING_RECORD(work, BUFFER_OBJ, Work);
+    sock    = sendobj->sock;
+
+    // Delivered just before the subscriber closed
+    if ((sock->strand->bReleased) || (sock->bClosing))
+    {
+        FreeBufferObj(sendobj);
+        return;
+    }
+
+    if (sock->QueuedBytes >= gSubscriberQueue)
+    {
+        StatsAdd(STAT_FANOUT_DROPS, 1);
+
+        FreeBufferObj(sendobj);
+
+        if (gSlowConsumerPolicy == SLOW_CONSUMER_CLOSE)
+        {
+            InterlockedIncrement(&gSlowConsumers);
+
+            sock->bClosing = TRUE;
+
+            closesocket(sock->s);
+            sock->s = INVALID_SOCKET;
+
+            // A paused receive has nothing outstanding to fail
+            ResumeRecv(sock);
+
+            CheckSocketClosed(sock);
+        }
+        return;
+    }
+
+    EnqueuePendingOperation(sock, sendobj);
+}
+
+//
+// Function: DeliverMessage
+//
+// Description:
+//    Called by PubSubPublish for each subscriber of the topic. The
+//    subscriber gets a send object without a data buffer which refers to
+//    the shared message, and the object is handed to the subscriber's
+//    strand. The topic is locked while this runs, so an idle strand is
+//    never run here but handed to the subscriber's shard, as the timers do.
+//
+void DeliverMessage(PUBSUB_CLIENT *client, PUBSUB_MESSAGE *message)
+{
+    SOCKET_OBJ *sock=NULL;
+    BUFFER_OBJ *sendobj=NULL;
+
+    sock = CONTAINING_RECORD(client, SOCKET_OBJ, PubSub);
+
+    sendobj = GetZeroByteObj();
+    if (sendobj == NULL)
+    {
+        StatsAdd(STAT_FANOUT_DROPS, 1);
+        return;
+    }
+
+    PubSubMessageAddRef(message);
+    InterlockedIncrement(&gDeliveries);
+
+    sendobj->message = message;
+    sendobj->buflen  = message->Length;
+    sendobj->sock    = sock;
+
+    StrandWorkInit(&sendobj->Work, DeliveryWork);
+
+    if (StrandPost(sock->strand, &sendobj->Work))
+    {
+        if (ProactorPost(sock->shard->proactor, (ULONG_PTR)sock, NULL, 0) == SOCKET_ERROR)
+        {
+            fprintf(stderr, "DeliverMessage: ProactorPost failed: %d\n", GetLastError());
+        }
+    }
+}
+
+//
+// Function: HandlePubSubFrame
+//
+// Description:
+//    Handles a message in publish/subscribe mode (-ps): "S topic",
+//    "U topic" or "P topic data". A published message is copied once,
+//    without the command and framed for the subscribers, into a shared
+//    message which is then delivered to every subscriber of the topic.
+//    Returns FRAME_CLOSE for a malformed command or a failed subscription.
+//    Must be called on the socket's strand.
+//
+int HandlePubSubFrame(SOCKET_OBJ *sock, FRAME *frame)
+{
+    PUBSUB_MESSAGE *message=NULL;
+    char            command[PUBSUB_MAX_TOPIC + 3],
+                   *topic=NULL,
+                   *end=NULL;
+    ULONG           len,
+                    topiclen;
+
+    // The command letter, a space and the topic up to the next space
+    len = FrameCopy(frame, 0, command, sizeof(command));
+    if ((len < 3) || (command[1] != ' '))
+        return FRAME_CLOSE;
+
+    topic    = &command[2];
+    end      = (char *)memchr(topic, ' ', len - 2);
+    topiclen = (end) ? (ULONG)(end - topic) : len - 2;
+
+    switch (toupper(command[0]))
+    {
+        case 'S':
+            if (PubSubSubscribe(&sock->PubSub, topic, topiclen) == FALSE)
+                return FRAME_CLOSE;
+            break;
+        case 'U':
+            PubSubUnsubscribe(&sock->PubSub, topic, topiclen);
+            break;
+        case 'P':
+            len = frame->Length - 2;
+
+            if (gFrameMode == FRAME_MODE_LENGTH)
+            {
+                message = PubSubMessageAlloc(FRAME_HEADER_BYTES + len);
+                if (message == NULL)
+                    return FRAME_CLOSE;
+
+                message->Data[0] = (char)(len >> 24);
+                message->Data[1] = (char)(len >> 16);
+                message->Data[2] = (char)(len >> 8);
+                message->Data[3] = (char)len;
+
+                FrameCopy(frame, 2, message->Data + FRAME_HEADER_BYTES, len);
+            }
+            else
+            {
+                message = PubSubMessageAlloc(len + 1);
+                if (message == NULL)
+                    return FRAME_CLOSE;
+
+                FrameCopy(frame, 2, message->Data, len);
+
+                message->Data[len] = sock->Parser.Delimiter;
+            }
+
+            StatsAdd(STAT_PUBLISHED, 1);
+
+            PubSubPublish(topic, topiclen, message, DeliverMessage);
+
+            // The deliveries hold their own references
+            PubSubMessageRelease(message);
+            break;
+        default:
+            return FRAME_CLOSE;
+    }
+
+    return FRAME_NO_REPLY;
+}
+
+//
+// Function: KvFlushReply
+//
+// Description:
+//    Queues the reply collected for a connection in key-value mode, if any.
+//    Must be called on the socket's strand.
+//
+void KvFlushReply(SOCKET_OBJ *sock)
+{
+    if (sock->KvReply == NULL)
+        return;
+
+    sock->KvReply->sock = sock;
+
+    EnqueuePendingOperation(sock, sock->KvReply);
+
+    sock->KvReply = NULL;
+}
+
+//
+// Function: KvReply
+//
+// Description:
+//    Appends data to the reply of a connection in key-value mode. Replies
+//    are copied into send buffers (buflen counting the bytes written so
+//    far) which are queued when full and by KvFlushReply once the receive
+//    has been parsed, so the replies to pipelined commands share the
+//    sends. If no buffer is available the connection is closed. Must be
+//    called on the socket's strand.
+//
+BOOL KvReply(SOCKET_OBJ *sock, char *data, ULONG len)
+{
+    ULONG   take;
+
+    while (len > 0)
+    {
+        if (sock->KvReply == NULL)
+        {
+            sock->KvReply = GetBufferObj(gBufferSize);
+            if (sock->KvReply == NULL)
+            {
+                sock->bClosing = TRUE;
+                return FALSE;
+            }
+            sock->KvReply->buflen = 0;
+        }
+
+        take = gBufferSize - sock->KvReply->buflen;
+        if (take > len)
+            take = len;
+
+        memcpy(sock->KvReply->buf + sock->KvReply->buflen, data, take);
+
+        sock->KvReply->buflen += take;
+        data                  += take;
+        len                   -= take;
+
+        if (sock->KvReply->buflen == gBufferSize)
+            KvFlushReply(sock);
+    }
+    return TRUE;
+}
+
+//
+// Function: KvReplyText
+//
+// Description:
+//    Appends a reply line and returns the result of the command for
+//    HandleFrames.
+//
+int KvReplyText(SOCKET_OBJ *sock, char *text)
+{
+    if ((KvReply(sock, text, (ULONG)strlen(text)) == FALSE) || (sock->bClosing))
+        return FRAME_CLOSE;
+
+    return FRAME_NO_REPLY;
+}
+
+//
+// Function: KvValueFound
+//
+// Description:
+//    Called by KvGet with a value found for a get: appends it to the reply
+//    of the connection passed as the context.
+//
+void KvValueFound(void *context, char *key, ULONG keylen, ULONG flags, char *value, ULONG len)
+{
+    SOCKET_OBJ *sock=(SOCKET_OBJ *)context;
+    char        header[KV_MAX_KEY + 64];
+    int         rc;
+
+    rc = _snprintf(header, sizeof(header), "VALUE %.*s %lu %lu\r\n", (int)keylen, key, flags, len);
+
+    KvReply(sock, header, rc);
+    KvReply(sock, value, len);
+    KvReply(sock, "\r\n", 2);
+}
+
+//
+// Function: HandleKvFrame
+//
+// Description:
+//    Handles a line or a data block in key-value mode (-k). The commands
+//    are memcached's "get key...", "set key flags exptime bytes [noreply]"
+//    followed by a data block of that many bytes plus "\r\n", and
+//    "delete key [noreply]". The data block is announced to the parser so
+//    it arrives as the next frame whatever it contains, and its value is
+//    copied from the receive buffers into the store. Must be called on the
+//    socket's strand.
+//
+int HandleKvFrame(SOCKET_OBJ *sock, FRAME *frame)
+{
+    char    line[KV_MAX_COMMAND + 1],
+           *tokens[KV_MAX_TOKENS],
+           *end=NULL,
+           *ptr=NULL,
+            crlf[2];
+    ULONG   len,
+            bytes,
+            flags;
+    LONG    exptime;
+    BOOL    noreply;
+    int     count,
+            rc,
+            i;
+
+    // The data block of a set (see below)
+    if (sock->bKvData)
+    {
+        sock->bKvData = FALSE;
+
+        len = frame->Length - 2;
+        FrameCopy(frame, len, crlf, 2);
+        if ((crlf[0] != '\r') || (crlf[1] != '\n'))
+            return KvReplyText(sock, "CLIENT_ERROR bad data chunk\r\n");
+
+        rc = KvSet(sock->KvKey, sock->KvKeyLength, sock->KvFlags, sock->KvExptime, frame, len);
+
+        if (sock->bKvNoReply)
+            return FRAME_NO_REPLY;
+        if (rc == KV_TOO_LARGE)
+            return KvReplyText(sock, "SERVER_ERROR object too large for cache\r\n");
+        if (rc == KV_NO_MEMORY)
+            return KvReplyText(sock, "SERVER_ERROR out of memory storing object\r\n");
+        return KvReplyText(sock, "STORED\r\n");
+    }
+
+    StatsAdd(STAT_KV_COMMANDS, 1);
+
+    len = FrameCopy(frame, 0, line, KV_MAX_COMMAND);
+    if (len < frame->Length)
+        return KvReplyText(sock, "CLIENT_ERROR line too long\r\n");
+    if ((len > 0) && (line[len - 1] == '\r'))
+        len--;
+    line[len] = '\0';
+
+    // Split the line into words
+    count = 0;
+    for(ptr=line; *ptr ;)
+    {
+        if (*ptr == ' ')
+        {
+            *ptr++ = '\0';
+            continue;
+        }
+        if (count == KV_MAX_TOKENS)
+            return KvReplyText(sock, "CLIENT_ERROR bad command line format\r\n");
+
+        tokens[count++] = ptr;
+        while ((*ptr) && (*ptr != ' '))
+            ptr++;
+    }
+
+    if (count == 0)
+        return KvReplyText(sock, "ERROR\r\n");
+
+    if ((strcmp(tokens[0], "get") == 0) && (count > 1))
+    {
+        for(i=1; i < count ;i++)
+        {
+            if (strlen(tokens[i]) > KV_MAX_KEY)
+                return KvReplyText(sock, "CLIENT_ERROR bad command line format\r\n");
+
+            KvGet(tokens[i], (ULONG)strlen(tokens[i]), KvValueFound, sock);
+        }
+        return KvReplyText(sock, "END\r\n");
+    }
+    else if ((strcmp(tokens[0], "set") == 0) && ((count == 5) || (count == 6)))
+    {
+        noreply = ((count == 6) && (strcmp(tokens[5], "noreply") == 0));
+
+        flags   = strtoul(tokens[2], &end, 10);
+        rc      = (*end == '\0');
+        exptime = strtol(tokens[3], &end, 10);
+        rc     &= (*end == '\0');
+        bytes   = strtoul(tokens[4], &end, 10);
+        rc     &= (*end == '\0');
+
+        if ((rc == 0) || ((count == 6) && (noreply == FALSE)) || (strlen(tokens[1]) > KV_MAX_KEY))
+            return KvReplyText(sock, "CLIENT_ERROR bad command line format\r\n");
+
+        // The value may hold anything, so it is received as a block of its
+        //    length. A block the parser can't take can't be skipped either.
+        if ((bytes > (ULONG)gMaxFrameLength) || (FrameParserExpect(&sock->Parser, bytes + 2) == FALSE))
+        {
+            KvReplyText(sock, "SERVER_ERROR object too large for cache\r\n");
+            return FRAME_CLOSE;
+        }
+
+        sock->KvKeyLength = (ULONG)strlen(tokens[1]);
+        memcpy(sock->KvKey, tokens[1], sock->KvKeyLength);
+
+        sock->KvFlags    = flags;
+        sock->KvExptime  = exptime;
+        sock->bKvNoReply = noreply;
+        sock->bKvData    = TRUE;
+
+        return FRAME_NO_REPLY;
+    }
+    else if ((strcmp(tokens[0], "delete") == 0) && ((count == 2) || (count == 3)))
+    {
+        noreply = ((count == 3) && (strcmp(tokens[2], "noreply") == 0));
+
+        if (((count == 3) && (noreply == FALSE)) || (strlen(tokens[1]) > KV_MAX_KEY))
+            return KvReplyText(sock, "CLIENT_ERROR bad command line format\r\n");
+
+        rc = KvDelete(tokens[1], (ULONG)strlen(tokens[1]));
+
+        if (noreply)
+            return FRAME_NO_REPLY;
+        if (rc == FALSE)
+            return KvReplyText(sock, "NOT_FOUND\r\n");
+        return KvReplyText(sock, "DELETED\r\n");
+    }
+
+    return KvReplyText(sock, "ERROR\r\n");
+}
+
+//
+// Function: HandleFrames
+//
+// Description:
+//    Parses the messages in a completed receive and passes each one to the
+//    handler. The responses are queued like echoed data. The receive buffer
+//    is kept as long as a partial message or a response refers to it.
+//    Returns SOCKET_ERROR if a message is malformed or the handler closes
+//    the connection. Must be called on the socket's strand.
+//
+int HandleFrames(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered)
+{
+    FRAME_RESPONSE *response=NULL;
+    BUFFER_OBJ     *sendobj=NULL;
+    ULONG           offset,
+                    used;
+    int             status,
+                    rc;
+
+    // Messages may continue into the unused end of the buffer (see frame.h).
+    //    Every data buffer is gBufferSize bytes, including the accept's.
+    FrameBufferInit(&buf->Frame, buf->buf, BytesTransfered, gBufferSize);
+
+    rc     = NO_ERROR;
+    offset = 0;
+    while ((offset < BytesTransfered) && (rc == NO_ERROR))
+    {
+        status = FrameParse(&sock->Parser, &buf->Frame, buf->buf + offset, BytesTransfered - offset, &used);
+        offset += used;
+
+        if (status == FRAME_INCOMPLETE)
+            break;
+        if (status == FRAME_ERROR)
+        {
+            rc = SOCKET_ERROR;
+            break;
+        }
+
+        StatsAdd(STAT_FRAMES, 1);
+
+        response = FrameResponseGet();
+        if (response == NULL)
+        {
+            rc = SOCKET_ERROR;
+            break;
+        }
+
+        if (gPubSub)
+            status = HandlePubSubFrame(sock, &sock->Parser.Frame);
+        else if (gKvStore)
+            status = HandleKvFrame(sock, &sock->Parser.Frame);
+        else
+            status = gFrameHandler(&sock->Parser.Frame, response);
+
+        // The response holds its own references to the request's buffers
+        FrameParserReset(&sock->Parser);
+
+        if (status != FRAME_REPLY)
+        {
+            FrameResponseFree(response);
+            if (status == FRAME_CLOSE)
+                rc = SOCKET_ERROR;
+            continue;
+        }
+
+        FrameResponseEncode(&sock->Parser, response);
+
+        sendobj = GetZeroByteObj();
+        if (sendobj == NULL)
+        {
+            FrameResponseFree(response);
+            rc = SOCKET_ERROR;
+            break;
+        }
+
+        sendobj->response = response;
+        sendobj->buflen   = response->Length;
+        sendobj->sock     = sock;
+
+        EnqueuePendingOperation(sock, sendobj);
+    }
+
+    // The replies to all the commands in the buffer go out together
+    if (gKvStore)
+        KvFlushReply(sock);
+
+    // Drop the reference taken for parsing
+    FrameBufferRelease(&buf->Frame);
+
+    return rc;
+}
+
+//
+// Function: HandleReceivedData
+//
+// Description:
+//    Handles data received on a connection: it is queued to be echoed (or
+//    relayed) or, when framing, its messages are passed to the handler.
+//    Must be called on the socket's strand.
+//
+void HandleReceivedData(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered)
+{
+    StatsAdd(STAT_BYTES_READ, BytesTransfered);
+
+    sock->BytesReceived += BytesTransfered;
+    sock->LastActivity   = GetTickCount();
+
+    CheckBulkTransfer(sock, buf, BytesTransfered);
+    CheckZeroCopySend(EchoTarget(sock), BytesTransfered);
+
+    if (sock->peer)
+    {
+        // Relay the buffer as is to the other leg
+        buf->buflen = BytesTransfered;
+        buf->sock   = sock->peer;
+
+        EnqueuePendingOperation(sock->peer, buf);
+    }
+    else if (gFrameMode != FRAME_MODE_RAW)
+    {
+        // Pass the messages in the data to the handler
+        if (HandleFrames(sock, buf, BytesTransfered) != NO_ERROR)
+            sock->bClosing = TRUE;
+    }
+    else
+    {
+        // Make the recv a send
+        buf->buflen = BytesTransfered;
+        buf->sock   = sock;
+
+        EnqueuePendingOperation(sock, buf);
+    }
+}
+
+//
+// Function: ReadReadyData
+//
+// Description:
+//    Called when a zero byte receive reports data on a connection in ready
+//    mode (-r). Instead of posting an overlapped receive for each buffer the
+//    data is read with non-blocking recv calls into buffers taken from the
+//    shared pool, up to RECV_DRAIN_COUNT buffers per notification. A buffer
+//    is only taken from the pool once there is data to put in it, so the
+//    buffers in use follow the data in flight rather than the number of
+//    connections. Reading stops early when the connection or the server
+//    reaches its watermark; PostNextRecv then pauses the connection. Must be
+//    called on the socket's strand.
+//
+void ReadReadyData(SOCKET_OBJ *sock)
+{
+    BUFFER_OBJ *recvobj=NULL;
+    int         rc,
+                i;
+
+    for(i=0; i < RECV_DRAIN_COUNT ;i++)
+    {
+        if ((sock->bClosing) ||
+            (EchoTarget(sock)->QueuedBytes >= gHighWatermark) ||
+            (gBufferedBytes >= gMaxBufferedBytes) )
+        {
+            break;
+        }
+
+        recvobj = GetRecvBufferObj(sock);
+        if (recvobj == NULL)
+        {
+            sock->bClosing = TRUE;
+            break;
+        }
+
+        rc = recv(sock->s, recvobj->buf, recvobj->buflen, 0);
+        if (rc == SOCKET_ERROR)
+        {
+            FreeBufferObj(recvobj);
+
+            // Nothing more to read until the next notification
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+            {
+                dbgprint("ReadReadyData: recv failed: %d\n", WSAGetLastError());
+                sock->bClosing = TRUE;
+            }
+            break;
+        }
+        if (rc == 0)
+        {
+            // Graceful close
+            FreeBufferObj(recvobj);
+            sock->bClosing = TRUE;
+            break;
+        }
+
+        StatsAdd(STAT_READY_READS, 1);
+
+        HandleReceivedData(sock, recvobj, rc);
+
+        // A short read means the socket's receive buffer is empty
+        if (rc < gBufferSize)
+            break;
+    }
+}
+
+//
+// Function: HandleSocketIo
+//
+// Description:
+//    Handles a completed operation on a connection. This runs on the
+//    connection's strand so nothing here needs a lock. In the event of a
+//    receive, the data is queued to be echoed and the next receive is posted.
+//    For completed sends, the buffer is freed.
+//
+void HandleSocketIo(SOCKET_OBJ *sockobj, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD error)
+{
+    BUFFER_OBJ *recvobj=NULL;       // Used to post new receives
+
+    if (error != 0)
+    {
+        dbgprint("OP = %d; Error = %d\n", buf->operation, error);
+    }
+
+    if ((sockobj->backend) && (sockobj->peer == NULL))
+    {
+        // The backend closed a pooled connection before it was used (see
+        //    GetBackendStrand). Its zero byte receive is all there is to retire.
+        sockobj->OutstandingRecv--;
+        sockobj->bClosing = TRUE;
+
+        FreeBufferObj(buf);
+
+        CheckSocketClosed(sockobj);
+        return;
+    }
+
+    if (error != NO_ERROR)
+    {
+        // An error occured on a TCP socket, free the associated per I/O buffer.
+        //    The connection is freed once its other operations are complete
+        //    as well.
+        //
+        if ((buf->operation == OP_READ) || (buf->operation == OP_READ_ZERO))
+        {
+            sockobj->OutstandingRecv--;
+        }
+        else if (buf->operation == OP_WRITE)
+        {
+            InterlockedDecrement(&gOutstandingSends);
+
+            // The data will never be echoed so stop receiving as well
+            ReleaseQueuedBytes(sockobj, buf->buflen);
+
+            sockobj->bClosing = TRUE;
+            ResumeRecv(sockobj);
+
+            sockobj->OutstandingSend--;
+        }
+
+        FreeBufferObj(buf);
+
+        printf("err = %d\n", error);
+        sockobj->bClosing = TRUE;
+
+        // An error on either leg of a relayed connection ends both
+        CloseRelayPeer(sockobj);
+
+        CheckSocketClosed(sockobj);
+        return;
+    }
+
+    if (buf->operation == OP_ACCEPTED)
+    {
+        // When relaying, a client without a backend connection is closed
+        if ((gBackends) && (PairConnection(sockobj) == FALSE))
+        {
+            InterlockedIncrement(&gRelayRejected);
+
+            FreeBufferObj(buf);
+
+            sockobj->OutstandingRecv--;
+            sockobj->bClosing = TRUE;
+
+            CheckSocketClosed(sockobj);
+            return;
+        }
+
+        // A new connection handed over by the accepting thread. The data
+        //    received with the accept is treated as a completed receive.
+        StartConnectionTimer(sockobj, BytesTransfered);
+
+        // Under high load the established connections go first
+        if (gLoadLevel >= LOAD_HIGH)
+            sockobj->bDeferred = TRUE;
+
+        if (BytesTransfered == 0)
+        {
+            // With a first byte deadline the accept completes as soon as the
+            //    client connects. The first data arrives with a receive.
+            FreeBufferObj(buf);
+
+            PostNextRecv(sockobj);
+
+            sockobj->OutstandingRecv--;
+        }
+        else
+        {
+            buf->operation = OP_READ;
+        }
+    }
+
+    if (buf->operation == OP_READ)
+    {
+        //
+        // Receive completed successfully
+        //
+        if (BytesTransfered > 0)
+        {
+            HandleReceivedData(sockobj, buf, BytesTransfered);
+
+            // Keep receiving unless the connection or the server has too much
+            //    data queued. The next receive is posted before this one is
+            //    retired so the socket is never seen without outstanding operations.
+            PostNextRecv(sockobj);
+
+            sockobj->OutstandingRecv--;
+        }
+        else
+        {
+            //dbgprint("Got 0 byte receive\n");
+
+            sockobj->OutstandingRecv--;
+
+            // Graceful close - the receive returned 0 bytes read
+            sockobj->bClosing = TRUE;
+
+            // Free the receive buffer
+            FreeBufferObj(buf);
+        }
+    }
+    else if (buf->operation == OP_READ_ZERO)
+    {
+        // Data (or a graceful close) is waiting on the connection. Only now
+        //    attach a real buffer and receive it. The new receive is posted
+        //    before the zero byte receive is retired so the socket is never
+        //    seen without outstanding operations.
+        FreeBufferObj(buf);
+
+        StatsAdd(STAT_RECV_WAKEUPS, 1);
+
+        if (gReadyMode)
+        {
+            // Read what is there right away and wait for more
+            ReadReadyData(sockobj);
+
+            PostNextRecv(sockobj);
+        }
+        else if ((recvobj = GetRecvBufferObj(sockobj)) != NULL)
+        {
+            recvobj->sock = sockobj;
+            if (PostRecv(sockobj, recvobj) != NO_ERROR)
+            {
+                FreeBufferObj(recvobj);
+                sockobj->bClosing = TRUE;
+            }
+        }
+        else
+        {
+            sockobj->bClosing = TRUE;
+        }
+
+        sockobj->OutstandingRecv--;
+    }
+    else if (buf->operation == OP_WRITE)
+    {
+        InterlockedDecrement(&gOutstandingSends);
+
+        // Update the counters
+        StatsAdd(STAT_BYTES_SENT, BytesTransfered);
+        if (sockobj->bZeroCopy)
+            StatsAdd(STAT_ZEROCOPY_BYTES, BytesTransfered);
+        if (buf->message)
+            StatsAdd(STAT_FANOUT_SENT, 1);
+        StatsRecordLatency(HIST_TURNAROUND, buf->QueuedTime);
+        StatsRecordLatency(HIST_SEND, buf->PostTime);
+
+        sockobj->LastActivity = GetTickCount();
+
+        // The echoed data no longer counts against the connection (or the
+        //    other leg when relaying). If its receive was paused it may be
+        //    posted again now.
+        ReleaseQueuedBytes(sockobj, buf->buflen);
+        ResumeRecv(EchoTarget(sockobj));
+
+        FreeBufferObj(buf);
+
+        sockobj->OutstandingSend--;
+    }
+
+    //
+    // Check to see if socket is closing
+    //
+    CheckSocketClosed(sockobj);
+
+    return;
+}
+
+//
+// Function: SocketIoWork
+//
+// Description:
+//    Strand routine of a completed operation (see DispatchSocketIo).
+//
+void SocketIoWork(STRAND_WORK *work)
+{
+    BUFFER_OBJ *buf=NULL;
+
+    buf = CONTAINING_RECORD(work, BUFFER_OBJ, Work);
+
+    HandleSocketIo(buf->sock, buf, buf->BytesTransfered, buf->Error);
+}
+
+//
+// Function: DispatchSocketIo
+//
+// Description:
+//    Hands a completed operation to the connection's strand. If no other
+//    thread is working on the connection it is handled right away on this
+//    thread, otherwise it is queued for the thread which is. A completed
+//    connect to a backend is handled before the connection has a strand.
+//
+void DispatchSocketIo(SOCKET_OBJ *sock, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD error)
+{
+    STRAND  *strand=NULL;
+
+    if (buf->operation == OP_CONNECT)
+    {
+        HandleBackendConnect(sock, buf, error);
+        return;
+    }
+
+    buf->sock            = sock;
+    buf->BytesTransfered = BytesTransfered;
+    buf->Error           = error;
+
+    StrandWorkInit(&buf->Work, SocketIoWork);
+
+    strand = (sock->backend) ? GetBackendStrand(sock) : sock->strand;
+
+    if (StrandDispatch(strand, &buf->Work))
+    {
+        FreeSocketObj(sock);
+    }
+}
+
+//
+// Function: StartConnection
+//
+// Description:
+//    Sets up a newly accepted connection and hands it to its strand. The
+//    object buf carries the data received with the accept (none for a
+//    connection taken from the backlog) and becomes the connection's first
+//    completed receive. Returns FALSE if the connection was dropped.
+//
+BOOL StartConnection(LISTEN_OBJ *listenobj, SHARD *shard, SOCKET s, BUFFER_OBJ *buf, DWORD BytesTransfered)
+{
+    SHARD      *target=NULL;        // Shard the new connection is assigned to
+    SOCKET_OBJ *clientobj=NULL;     // New client object for accepted connections
+    LINGER      linger;
+    u_long      optval;
+    int         cpu;
+
+    // While shedding load, reset new connections before any work is spent on them
+    if (gLoadLevel == LOAD_SHED)
+    {
+        InterlockedIncrement(&gShedConnections);
+
+        linger.l_onoff  = 1;
+        linger.l_linger = 0;
+        setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&linger, sizeof(linger));
+
+        closesocket(s);
+        FreeBufferObj(buf);
+        return FALSE;
+    }
+
+    // Get a new SOCKET_OBJ for the client connection
+    clientobj = GetSocketObj(s, listenobj->AddressFamily);
+    if (clientobj == NULL)
+    {
+        // Can't allocate a socket structure so close the connection
+        InterlockedIncrement(&listenobj->RefusedCount);
+
+        closesocket(s);
+        FreeBufferObj(buf);
+        return FALSE;
+    }
+
+    // In sharded mode spread the connections over the shards, otherwise
+    //    the connection is serviced by the same queue as the listener. With
+    //    rss placement the connection goes to the shard whose worker runs
+    //    where the adapter delivers the connection's packets.
+    if ((gSharded) && (gPlacement == PLACE_RSS) && ((cpu = TopologySocketCpu(s)) >= 0))
+    {
+        target = &gShards[gCpuShard[cpu]];
+        InterlockedIncrement(&gRssPlaced);
+    }
+    else if (gSharded)
+        target = &gShards[InterlockedIncrement(&gNextShard) % gShardCount];
+    else
+        target = shard;
+
+    clientobj->shard = target;
+
+    // Ready receives read the socket without blocking
+    optval = 1;
+    if ((gReadyMode) && (ioctlsocket(clientobj->s, FIONBIO, &optval) == SOCKET_ERROR))
+    {
+        fprintf(stderr, "StartConnection: ioctlsocket FIONBIO failed: %d\n", WSAGetLastError());
+    }
+
+    // Associate the new connection to its shard's completion queue
+    if (ProactorAssociate(target->proactor, clientobj->s, (ULONG_PTR)clientobj) == SOCKET_ERROR)
+    {
+        InterlockedIncrement(&listenobj->RefusedCount);
+
+        FreeBufferObj(buf);
+        FreeSocketObj(clientobj);
+        return FALSE;
+    }
+
+    // The accept buffer is passed on as the connection's first completed
+    //    receive. Nothing else refers to the connection yet so this is the
+    //    last time it is touched outside its strand.
+    buf->operation = OP_ACCEPTED;
+    buf->buflen    = BytesTransfered;
+
+    clientobj->OutstandingRecv = 1;
+
+    if (target != shard)
+    {
+        // Let the owning shard start the connection. In sharded mode the
+        //    connection is then only ever touched by that shard's thread.
+        if (ProactorPost(target->proactor, (ULONG_PTR)clientobj, &buf->ol, BytesTransfered) == SOCKET_ERROR)
+        {
+            FreeBufferObj(buf);
+            FreeSocketObj(clientobj);
+            return FALSE;
+        }
+    }
+    else
+    {
+        DispatchSocketIo(clientobj, buf, BytesTransfered, NO_ERROR);
+    }
+    return TRUE;
+}
+
+//
+// Function: DrainAcceptBacklog
+//
+// Description:
+//    Accepts the connections already waiting in the listening socket's
+//    backlog with accept. The listening socket is non-blocking (it is
+//    registered for FD_ACCEPT) so this stops as soon as the backlog is
+//    empty. A single completed AcceptEx thus takes a whole burst of
+//    connections instead of needing one pending AcceptEx for each of them.
+//
+void DrainAcceptBacklog(LISTEN_OBJ *listenobj, SHARD *shard)
+{
+    BUFFER_OBJ *startobj=NULL;
+    SOCKET      s;
+    int         i;
+
+    for(i=0; i < ACCEPT_DRAIN_COUNT ;i++)
+    {
+        s = accept(listenobj->s, NULL, NULL);
+        if (s == INVALID_SOCKET)
+        {
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+                dbgprint("DrainAcceptBacklog: accept failed: %d\n", WSAGetLastError());
+            break;
+        }
+
+        // The new socket inherits the listening socket's event selection
+        WSAEventSelect(s, NULL, 0);
+
+        StatsAdd(STAT_CONNECTIONS, 1);
+        InterlockedIncrement(&listenobj->AcceptCount);
+        InterlockedIncrement(&listenobj->DrainedCount);
+
+        // The connection starts without data, like an accept with a first
+        //    byte deadline
+        startobj = GetZeroByteObj();
+        if (startobj == NULL)
+        {
+            InterlockedIncrement(&listenobj->RefusedCount);
+            closesocket(s);
+            break;
+        }
+
+        StartConnection(listenobj, shard, s, startobj, 0);
+    }
+}
+
+//
+// Function: PostDgramRecv
+//
+// Description:
+//    Posts a receive of one or more (coalesced) datagrams on a UDP socket.
+//
+int PostDgramRecv(DGRAM_OBJ *dgram, DGRAM_BUFFER *dgrambuf)
+{
+    int     rc;
+
+    dgrambuf->Buffer.operation = OP_READ_DGRAM;
+    dgrambuf->Buffer.addrlen   = sizeof(dgrambuf->Buffer.addr);
+
+    dgrambuf->Data.buf = dgrambuf->Buffer.buf;
+    dgrambuf->Data.len = dgrambuf->Buffer.buflen;
+
+    dgrambuf->Msg.name          = (SOCKADDR *)&dgrambuf->Buffer.addr;
+    dgrambuf->Msg.namelen       = dgrambuf->Buffer.addrlen;
+    dgrambuf->Msg.lpBuffers     = &dgrambuf->Data;
+    dgrambuf->Msg.dwBufferCount = 1;
+    dgrambuf->Msg.Control.buf   = dgrambuf->Control;
+    dgrambuf->Msg.Control.len   = sizeof(dgrambuf->Control);
+    dgrambuf->Msg.dwFlags       = 0;
+
+    memset(&dgrambuf->Buffer.ol, 0, sizeof(dgrambuf->Buffer.ol));
+
+    // The WSAMSG is updated when the receive completes so it lives in the
+    //    DGRAM_BUFFER rather than on the stack
+    rc = dgram->lpfnWSARecvMsg(
+            dgram->s,
+           &dgrambuf->Msg,
+            NULL,
+           &dgrambuf->Buffer.ol,
+            NULL
             );
-    if (rc == FALSE)
+    if (rc == SOCKET_ERROR)
     {
         if (WSAGetLastError() != WSA_IO_PENDING)
         {
-            printf("PostAccept: AcceptEx failed: %d\n",
-                    WSAGetLastError());
+            dbgprint("PostDgramRecv: WSARecvMsg* failed: %d\n", WSAGetLastError());
             return SOCKET_ERROR;
         }
     }
+    return NO_ERROR;
+}
 
-    // Increment the outstanding overlapped count for this socket
-    InterlockedIncrement(&listen->PendingAcceptCount);
+//
+// Function: PostDgramSend
+//
+// Description:
+//    Echoes the datagrams received into a buffer back to their sender. A
+//    coalesced receive is sent with its segment size so the stack splits it
+//    into the original datagrams again.
+//
+int PostDgramSend(DGRAM_OBJ *dgram, DGRAM_BUFFER *dgrambuf, DWORD bytes, DWORD segment)
+{
+    WSACMSGHDR *cmsg=NULL;
+    int         rc;
+
+    dgrambuf->Buffer.operation = OP_WRITE_DGRAM;
+    dgrambuf->Buffer.PostTime  = StatsTimestamp();
+
+    // The sender's address and its length are already in the WSAMSG
+    dgrambuf->Data.len = bytes;
+
+    dgrambuf->Msg.dwFlags = 0;
+    if ((segment > 0) && (bytes > segment))
+    {
+        cmsg = (WSACMSGHDR *)dgrambuf->Control;
+        cmsg->cmsg_len   = WSA_CMSG_LEN(sizeof(DWORD));
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type  = UDP_SEND_MSG_SIZE;
+        *(DWORD *)WSA_CMSG_DATA(cmsg) = segment;
+
+        dgrambuf->Msg.Control.buf = dgrambuf->Control;
+        dgrambuf->Msg.Control.len = WSA_CMSG_SPACE(sizeof(DWORD));
+    }
+    else
+    {
+        dgrambuf->Msg.Control.buf = NULL;
+        dgrambuf->Msg.Control.len = 0;
+    }
+
+    memset(&dgrambuf->Buffer.ol, 0, sizeof(dgrambuf->Buffer.ol));
 
+    rc = WSASendMsg(
+            dgram->s,
+           &dgrambuf->Msg,
+            0,
+            NULL,
+           &dgrambuf->Buffer.ol,
+            NULL
+            );
+    if (rc == SOCKET_ERROR)
+    {
+        if (WSAGetLastError() != WSA_IO_PENDING)
+        {
+            dbgprint("PostDgramSend: WSASendMsg failed: %d\n", WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+    }
     return NO_ERROR;
 }
 
+//
+// Function: DgramSegmentSize
+//
+// Description:
+//    Returns the size of the datagrams coalesced into a completed receive,
+//    or zero if the receive holds a single datagram.
+//
+DWORD DgramSegmentSize(WSAMSG *msg)
+{
+    WSACMSGHDR *cmsg=NULL;
+
+    cmsg = WSA_CMSG_FIRSTHDR(msg);
+    while (cmsg)
+    {
+        if ((cmsg->cmsg_level == IPPROTO_UDP) && (cmsg->cmsg_type == UDP_COALESCED_INFO))
+        {
+            return *(DWORD *)WSA_CMSG_DATA(cmsg);
+        }
+        cmsg = WSA_CMSG_NXTHDR(msg, cmsg);
+    }
+    return 0;
+}
+
+//
+// Function: HandleDgramIo
+//
+// Description:
+//    Handles a completed operation on a UDP socket. A completed receive is
+//    echoed back from the same buffer; a completed send (or a failed
+//    operation) posts the receive again. UDP sockets have no per sender
+//    state so this needs no strand.
+//
+void HandleDgramIo(DGRAM_OBJ *dgram, BUFFER_OBJ *buf, DWORD BytesTransfered, DWORD error)
+{
+    DGRAM_BUFFER *dgrambuf=NULL;
+    DWORD         segment,
+                  count;
+
+    dgrambuf = CONTAINING_RECORD(buf, DGRAM_BUFFER, Buffer);
+
+    if ((buf->operation == OP_READ_DGRAM) && (error == NO_ERROR))
+    {
+        segment = DgramSegmentSize(&dgrambuf->Msg);
+        count   = ((segment > 0) && (BytesTransfered > segment)) ?
+                        (BytesTransfered + segment - 1) / segment : 1;
+
+        dgrambuf->Segment = segment;
+
+        StatsAdd(STAT_BYTES_READ, BytesTransfered);
+        StatsAdd(STAT_DGRAMS_READ, count);
+        StatsAdd(STAT_DGRAM_RECVS, 1);
+
+        // Per worker as well, to see how the datagrams spread over the workers
+        if (tWorker)
+            tWorker->Dgrams += count;
+
+        buf->QueuedTime = StatsTimestamp();
+        buf->addrlen    = dgrambuf->Msg.namelen;
+
+        if (PostDgramSend(dgram, dgrambuf, BytesTransfered, segment) == NO_ERROR)
+            return;
+    }
+    else if ((buf->operation == OP_WRITE_DGRAM) && (error == NO_ERROR))
+    {
+        segment = dgrambuf->Segment;
+        count   = ((segment > 0) && (BytesTransfered > segment)) ?
+                        (BytesTransfered + segment - 1) / segment : 1;
+
+        StatsAdd(STAT_BYTES_SENT, BytesTransfered);
+        StatsAdd(STAT_DGRAMS_SENT, count);
+        StatsRecordLatency(HIST_TURNAROUND, buf->QueuedTime);
+        StatsRecordLatency(HIST_SEND, buf->PostTime);
+    }
+    else
+    {
+        // Failed sends and ICMP errors only lose datagrams; keep receiving
+        dbgprint("HandleDgramIo: OP = %d; Error = %d\n", buf->operation, error);
+    }
+
+    if (PostDgramRecv(dgram, dgrambuf) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "HandleDgramIo: unable to post a receive: %d\n", WSAGetLastError());
+    }
+}
+
+//
+// Function: StartDgramSocket
+//
+// Description:
+//    Creates a UDP socket for the datagram echo on the given address,
+//    enables receive coalescing if the stack supports both it and send
+//    segmentation, and posts its receives.
+//
+DGRAM_OBJ *StartDgramSocket(struct addrinfo *ptr, SHARD *shard)
+{
+    GUID          guidWSARecvMsg = WSAID_WSARECVMSG;
+    DGRAM_OBJ    *dgram=NULL;
+    DGRAM_BUFFER *dgrambufs=NULL;
+    char         *data=NULL;
+    DWORD         bytes,
+                  optval;
+    BOOL          reset;
+    int           optlen,
+                  buflen,
+                  rc,
+                  i;
+
+    dgram = (DGRAM_OBJ *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DGRAM_OBJ));
+    if (dgram == NULL)
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return NULL;
+    }
+
+    dgram->AddressFamily = ptr->ai_family;
+
+    dgram->s = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+    if (dgram->s == INVALID_SOCKET)
+    {
+        fprintf(stderr, "socket failed: %d\n", WSAGetLastError());
+        return NULL;
+    }
+
+    rc = bind(dgram->s, ptr->ai_addr, (int)ptr->ai_addrlen);
+    if (rc == SOCKET_ERROR)
+    {
+        fprintf(stderr, "bind failed: %d\n", WSAGetLastError());
+        return NULL;
+    }
+
+    // Don't fail the pending receives when a client's port is unreachable
+    reset = FALSE;
+    WSAIoctl(dgram->s, SIO_UDP_CONNRESET, &reset, sizeof(reset), NULL, 0, &bytes, NULL, NULL);
+
+    // Give the stack room to queue a burst of datagrams
+    optval = DGRAM_SOCKET_BUFFER;
+    setsockopt(dgram->s, SOL_SOCKET, SO_RCVBUF, (char *)&optval, sizeof(optval));
+
+    rc = WSAIoctl(
+            dgram->s,
+            SIO_GET_EXTENSION_FUNCTION_POINTER,
+           &guidWSARecvMsg,
+            sizeof(guidWSARecvMsg),
+           &dgram->lpfnWSARecvMsg,
+            sizeof(dgram->lpfnWSARecvMsg),
+           &bytes,
+            NULL,
+            NULL
+            );
+    if (rc == SOCKET_ERROR)
+    {
+        fprintf(stderr, "WSAIoctl: SIO_GET_EXTENSION_FUNCTION_POINTER failed: %d\n",
+                WSAGetLastError());
+        return NULL;
+    }
+
+    // A coalesced receive can only be echoed in one send if the stack can
+    //    segment it again, so only enable coalescing along with send offload
+    if (gDgramCoalesce > 0)
+    {
+        optlen = sizeof(optval);
+        if (getsockopt(dgram->s, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (char *)&optval, &optlen) == SOCKET_ERROR)
+        {
+            printf("UDP send segmentation not supported (%d)\n", WSAGetLastError());
+        }
+        else
+        {
+            optval = gDgramCoalesce;
+            if (setsockopt(dgram->s, IPPROTO_UDP, UDP_RECV_MAX_COALESCED_SIZE, (char *)&optval, sizeof(optval)) == SOCKET_ERROR)
+                printf("UDP receive coalescing not supported (%d)\n", WSAGetLastError());
+            else
+                dgram->Coalesce = gDgramCoalesce;
+        }
+    }
+
+    if (ProactorAssociate(shard->proactor, dgram->s, (ULONG_PTR)dgram) == SOCKET_ERROR)
+    {
+        return NULL;
+    }
+
+    // The receives and their buffers are never freed
+    buflen = (dgram->Coalesce > 0) ? dgram->Coalesce : gBufferSize;
+
+    dgrambufs = (DGRAM_BUFFER *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DGRAM_BUFFER) * gDgramReceives);
+    data      = (char *)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)buflen * gDgramReceives);
+    if ((dgrambufs == NULL) || (data == NULL))
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return NULL;
+    }
+
+    for(i=0; i < gDgramReceives ;i++)
+    {
+        dgrambufs[i].Buffer.buf    = data + ((SIZE_T)buflen * i);
+        dgrambufs[i].Buffer.buflen = buflen;
+
+        if (PostDgramRecv(dgram, &dgrambufs[i]) == SOCKET_ERROR)
+        {
+            fprintf(stderr, "Unable to post any receives: %d\n", WSAGetLastError());
+            return NULL;
+        }
+    }
+
+    printf("UDP receives pending: %d; largest coalesced receive: %lu\n",
+            gDgramReceives, dgram->Coalesce);
+
+    return dgram;
+}
+
 //
 // Function: HandleIo
 //
 // Description:
-//    This function handles the IO on a socket. In the event of a receive, the 
-//    completed receive is posted again. For completed accepts, another AcceptEx
-//    is posted. For completed sends, the buffer is freed.
+//    This function handles the IO on a socket. For completed accepts, the
+//    new connection is set up and handed to its strand and another AcceptEx
+//    is requested. Datagram operations are handled directly. Everything else
+//    is passed to the connection's strand (see HandleSocketIo).
+//
+void HandleIo(ULONG_PTR key, BUFFER_OBJ *buf, SHARD *shard, DWORD BytesTransfered, DWORD error)
+{
+    LISTEN_OBJ *listenobj=NULL;
+
+    if ((buf->operation == OP_READ_DGRAM) || (buf->operation == OP_WRITE_DGRAM))
+    {
+        HandleDgramIo((DGRAM_OBJ *)key, buf, BytesTransfered, error);
+        return;
+    }
+
+    if (buf->operation != OP_ACCEPT)
+    {
+        DispatchSocketIo((SOCKET_OBJ *)key, buf, BytesTransfered, error);
+        return;
+    }
+
+    listenobj = (LISTEN_OBJ *)key;
+
+    if (error != NO_ERROR)
+    {
+        dbgprint("OP = %d; Error = %d\n", buf->operation, error);
+
+        printf("Accept failed\n");
+
+        // Take the accept out of the pool and have it replaced
+        InterlockedDecrement(&listenobj->PendingAcceptCount);
+        InterlockedIncrement(&listenobj->RefusedCount);
+
+        RemovePendingAccept(listenobj, buf);
+
+        closesocket(buf->sclient);
+        buf->sclient = INVALID_SOCKET;
+
+        FreeBufferObj(buf);
+
+        RequestAcceptRepost(listenobj);
+        return;
+    }
+
+    SOCKADDR_STORAGE *LocalSockaddr=NULL,
+                     *RemoteSockaddr=NULL;
+    int               LocalSockaddrLen,
+                      RemoteSockaddrLen;
+
+    // Update counters
+    StatsAdd(STAT_CONNECTIONS, 1);
+    InterlockedDecrement(&listenobj->PendingAcceptCount);
+    InterlockedIncrement(&listenobj->AcceptCount);
+    StatsRecordLatency(HIST_ACCEPT, buf->PostTime);
+
+    // Print the client's addresss
+    listenobj->lpfnGetAcceptExSockaddrs(
+            buf->buf,
+            buf->buflen - ((sizeof(SOCKADDR_STORAGE) + 16) * 2),
+            sizeof(SOCKADDR_STORAGE) + 16,
+            sizeof(SOCKADDR_STORAGE) + 16,
+            (SOCKADDR **)&LocalSockaddr,
+           &LocalSockaddrLen,
+            (SOCKADDR **)&RemoteSockaddr,
+           &RemoteSockaddrLen
+            );
+
+    RemovePendingAccept(listenobj, buf);
+
+    StartConnection(listenobj, shard, buf->sclient, buf, BytesTransfered);
+
+    // Take the connections waiting in the backlog as well
+    if (gReadyMode)
+    {
+        DrainAcceptBacklog(listenobj, shard);
+    }
+
+    RequestAcceptRepost(listenobj);
+
+    return;
+}
+
+//
+// Function: PostLoadProbe
+//
+// Description:
+//    Posts the shard's probe to its completion queue every
+//    LOAD_PROBE_INTERVAL when overload control (-q) is on. The probe queues
+//    up behind the completions already waiting, so the time until it is
+//    dequeued is the delay every completion currently sees.
+//
+void PostLoadProbe(SHARD *shard)
+{
+    ULONG   now;
+
+    if (gOverloadDelay <= 0)
+        return;
+
+    now = GetTickCount();
+    if (now - shard->ProbeTime < LOAD_PROBE_INTERVAL)
+        return;
+
+    if (InterlockedCompareExchange(&shard->bProbePending, TRUE, FALSE) != FALSE)
+        return;
+
+    shard->ProbeTime       = now;
+    shard->Probe.operation = OP_PROBE;
+    shard->Probe.PostTime  = StatsTimestamp();
+
+    if (ProactorPost(shard->proactor, 0, &shard->Probe.ol, 0) == SOCKET_ERROR)
+    {
+        InterlockedExchange(&shard->bProbePending, FALSE);
+    }
+}
+
+//
+// Function: HandleLoadProbe
+//
+// Description:
+//    Called when the shard's probe is dequeued. Updates the shard's smoothed
+//    completion queue delay and the server's load level.
+//
+void HandleLoadProbe(SHARD *shard)
+{
+    LONGLONG    delay;
+
+    delay = ((StatsTimestamp() - shard->Probe.PostTime) * 1000000) / gPerfFrequency.QuadPart;
+
+    InterlockedExchange(&shard->QueueDelay, (LONG)((shard->QueueDelay * 3 + delay) / 4));
+    InterlockedExchange(&shard->bProbePending, FALSE);
+
+    UpdateLoadLevel();
+}
+
+//
+// Function: UpdateLoadLevel
+//
+// Description:
+//    Sets the load level from the largest completion queue delay of the
+//    shards and the buffered byte budget. The level rises as soon as a mark
+//    is passed but only falls once the delay is below half of it, so the
+//    server doesn't flap around a mark. When the load is back to normal the
+//    listeners are woken to refill their accept pools and the shards are
+//    flagged to resume their deferred connections.
+//
+void UpdateLoadLevel()
+{
+    LISTEN_OBJ *listenobj=NULL;
+    LONG        delay,
+                level,
+                old;
+    int         i;
+
+    delay = 0;
+    for(i=0; i < gShardCount ;i++)
+    {
+        if (gShards[i].QueueDelay > delay)
+            delay = gShards[i].QueueDelay;
+    }
+
+    old = gLoadLevel;
+
+    if (delay >= gOverloadDelay * LOAD_SHED_FACTOR)
+        level = LOAD_SHED;
+    else if ((old == LOAD_SHED) && (delay >= (gOverloadDelay * LOAD_SHED_FACTOR) / 2))
+        level = LOAD_SHED;
+    else if ((delay >= gOverloadDelay) || (gBufferedBytes >= gMaxBufferedBytes))
+        level = LOAD_HIGH;
+    else if ((old != LOAD_NORMAL) && (delay >= gOverloadDelay / 2))
+        level = LOAD_HIGH;
+    else
+        level = LOAD_NORMAL;
+
+    if (InterlockedCompareExchange(&gLoadLevel, level, old) != old)
+        return;
+    if (level == old)
+        return;
+
+    InterlockedIncrement(&gLoadChanges);
+
+    if (level == LOAD_NORMAL)
+    {
+        for(i=0; i < gShardCount ;i++)
+            InterlockedExchange(&gShards[i].bResumeDeferred, TRUE);
+
+        for(listenobj=gListenSockets; listenobj ;listenobj=listenobj->next)
+            SetEvent(listenobj->RepostAccept);
+    }
+}
+
+//
+// Function: GetWorkerCompletions
+//
+// Description:
+//    Dequeues the next batch of completions for a worker. With a spin budget
+//    the queue is first polled without blocking until the budget runs out;
+//    only then does the worker block in the kernel, for at most a timer
+//    tick so that the timer wheel keeps advancing.
+//
+int GetWorkerCompletions(WORKER *worker, PROACTOR_EVENT *events)
+{
+    LONGLONG    deadline;
+    int         count;
+
+    if (gSpinBudget > 0)
+    {
+        deadline = StatsTimestamp() + (gSpinBudget * gPerfFrequency.QuadPart) / 1000000;
+        do
+        {
+            count = ProactorGetCompletions(worker->shard->proactor, events, MAX_PROACTOR_BATCH, 0);
+            if (count != SOCKET_ERROR)
+            {
+                worker->SpinHits++;
+                return count;
+            }
+            if (GetLastError() != WAIT_TIMEOUT)
+                return SOCKET_ERROR;
+
+            YieldProcessor();
+        } while (StatsTimestamp() < deadline);
+    }
+
+    worker->Parks++;
+
+    // Wake up every tick so the timer wheel advances even when idle
+    return ProactorGetCompletions(worker->shard->proactor, events, MAX_PROACTOR_BATCH, TIMER_TICK);
+}
+
+//
+// Function: CompletionThread
+// 
+// Description:
+//    This is the completion thread which services our completion port. One of
+//    these threads is created per worker (see -n and -c) and placed on its
+//    processor according to -pin. The thread sits in 
+//    an infinite loop dequeuing batches of completed socket IO and handling
+//    them. Sends queued while handling a batch are posted together once the
+//    whole batch has been handled.
 //
-void HandleIo(ULONG_PTR key, BUFFER_OBJ *buf, HANDLE CompPort, DWORD BytesTransfered, DWORD error)
+DWORD WINAPI CompletionThread(LPVOID lpParam)
 {
-    LISTEN_OBJ *listenobj=NULL;
-    SOCKET_OBJ *sockobj=NULL,
-               *clientobj=NULL;     // New client object for accepted connections
-    BUFFER_OBJ *recvobj=NULL,       // Used to post new receives on accepted connections
-               *sendobj=NULL;       // Used to post new sends for data received
-    BOOL        bCleanupSocket;
+    WORKER         *worker;             // This thread
+    SHARD          *shard;              // Shard serviced by this thread
+    PROACTOR_EVENT  events[MAX_PROACTOR_BATCH], // Completed I/O
+                   *event;
+    SOCKET          s;
+    BUFFER_OBJ     *bufobj=NULL;        // Per I/O object for completed I/O
+    DWORD           BytesTransfered,    // Number of bytes transfered
+                    Flags;              // Flags for completed I/O
+    int             rc, 
+                    error,
+                    count,
+                    i;
 
-    if (error != 0)
+    worker = (WORKER *)lpParam;
+    shard  = worker->shard;
+
+    tWorker = worker;
+
+    // Set up this thread's BUFFER_OBJ magazines
+    if (InitBufferCache() == FALSE)
     {
-        dbgprint("OP = %d; Error = %d\n", buf->operation, error);
+        SetEvent(gWorkerExit);
+        ExitThread(-1);
+        return -1;
     }
 
-    bCleanupSocket = FALSE;
-
-    if (error != NO_ERROR)
+    while (1)
     {
-        // An error occured on a TCP socket, free the associated per I/O buffer
-        // and see if there are any more outstanding operations. If so we must
-        // wait until they are complete as well.
-        //
-        if (buf->operation != OP_ACCEPT)
+        count = GetWorkerCompletions(worker, events);
+        if ((count == SOCKET_ERROR) && (GetLastError() == WAIT_TIMEOUT))
         {
-            sockobj = (SOCKET_OBJ *)key;
-            if (buf->operation == OP_READ)
-            {
-                if ((InterlockedDecrement(&sockobj->OutstandingRecv) == 0) &&
-                    (sockobj->OutstandingSend == 0) )
-                {
-                    dbgprint("Freeing socket obj in GetOverlappedResult\n");
-                    FreeSocketObj(sockobj);
-                }
-            }
-            else if (buf->operation == OP_WRITE)
-            {
-                if ((InterlockedDecrement(&sockobj->OutstandingSend) == 0) &&
-                    (sockobj->OutstandingRecv == 0) )
-                {
-                    dbgprint("Freeing socket obj in GetOverlappedResult\n");
-                    FreeSocketObj(sockobj);
-                }
-            }
+            count = 0;
         }
-        else
+        else if (count == SOCKET_ERROR)
         {
-            listenobj = (LISTEN_OBJ *)key;
-
-            printf("Accept failed\n");
-
-            closesocket(buf->sclient);
-            buf->sclient = INVALID_SOCKET;
+            fprintf(stderr, "CompletionThread: GetWorkerCompletions failed: %d\n",
+                    GetLastError());
+            break;
         }
 
-        FreeBufferObj(buf);
-
-        return;
-    }
-
-    if (buf->operation == OP_ACCEPT)
-    {
-        HANDLE            hrc;
-        SOCKADDR_STORAGE *LocalSockaddr=NULL,
-                         *RemoteSockaddr=NULL;
-        int               LocalSockaddrLen,
-                          RemoteSockaddrLen;
-
-        listenobj = (LISTEN_OBJ *)key;
-
-        // Update counters
-        InterlockedIncrement(&gConnections);
-        InterlockedIncrement(&gConnectionsLast);
-        InterlockedDecrement(&listenobj->PendingAcceptCount);
-        InterlockedExchangeAdd(&gBytesRead, BytesTransfered);
-        InterlockedExchangeAdd(&gBytesReadLast, BytesTransfered);
-
-        // Print the client's addresss
-        listenobj->lpfnGetAcceptExSockaddrs(
-                buf->buf,
-                buf->buflen - ((sizeof(SOCKADDR_STORAGE) + 16) * 2),
-                sizeof(SOCKADDR_STORAGE) + 16,
-                sizeof(SOCKADDR_STORAGE) + 16,
-                (SOCKADDR **)&LocalSockaddr,
-               &LocalSockaddrLen,
-                (SOCKADDR **)&RemoteSockaddr,
-               &RemoteSockaddrLen
-                );
-
-        RemovePendingAccept(listenobj, buf);
+        worker->Completions += count;
 
-        // Get a new SOCKET_OBJ for the client connection
-        clientobj = GetSocketObj(buf->sclient, listenobj->AddressFamily);
-        if (clientobj)
+        for(i=0; i < count ;i++)
         {
-            // Associate the new connection to our completion port
-            hrc = CreateIoCompletionPort(
-                    (HANDLE)clientobj->s,
-                    CompPort,
-                    (ULONG_PTR)clientobj,
-                    0
-                    );
-            if (hrc == NULL)
+            event           = &events[i];
+
+            // A completion without an overlapped structure either hands
+            //    this thread a connection's strand to run (see ConnectionTimer)
+            //    or only wakes it to resume paused connections (see
+            //    ReleaseQueuedBytes)
+            if (event->lpOverlapped == NULL)
             {
-                fprintf(stderr, "CompletionThread: CreateIoCompletionPort failed: %d\n",
-                        GetLastError());
-                return;
+                if (event->Key)
+                    RunSocketStrand((SOCKET_OBJ *)event->Key);
+                continue;
             }
 
-            sendobj = buf;
-            sendobj->buflen = BytesTransfered;
+            bufobj          = CONTAINING_RECORD(event->lpOverlapped, BUFFER_OBJ, ol);
+            BytesTransfered = event->BytesTransfered;
 
-            // Post the send - this is the first one for this connection so just do it
-            sendobj->sock = clientobj;
-            //PostSend(clientobj, sendobj);
-            EnqueuePendingOperation(&gPendingSendList, &gPendingSendListEnd, sendobj, OP_WRITE);
-        }
-        else
-        {
-            // Can't allocate a socket structure so close the connection
-            closesocket(buf->sclient);
-            buf->sclient = INVALID_SOCKET;
-            FreeBufferObj(buf);
-        }
-        
-		if (error != NO_ERROR)
-		{
-            // Check for socket closure
-            EnterCriticalSection(&clientobj->SockCritSec);
-            if ( (clientobj->OutstandingSend == 0) &&
-                 (clientobj->OutstandingRecv == 0) )
+            if (bufobj->operation == OP_PROBE)
             {
-                closesocket(clientobj->s);
-                clientobj->s = INVALID_SOCKET;
-                FreeSocketObj(clientobj);
+                HandleLoadProbe(shard);
+                continue;
             }
-            else
+            error           = NO_ERROR;
+
+            if (event->Error != NO_ERROR)
             {
-                clientobj->bClosing = TRUE;
+                // If the operation failed, call WSAGetOverlappedResult to translate the
+                //    error code into a Winsock error code.
+                if (bufobj->operation == OP_ACCEPT)
+                {
+                    s = ((LISTEN_OBJ *)event->Key)->s;
+                }
+                else if ((bufobj->operation == OP_READ_DGRAM) || (bufobj->operation == OP_WRITE_DGRAM))
+                {
+                    s = ((DGRAM_OBJ *)event->Key)->s;
+                }
+                else
+                {
+                    s = ((SOCKET_OBJ *)event->Key)->s;
+                }
+              
+                dbgprint("CompletionThread: operation failed: 0x%x\n",
+                        event->Error);
+
+                rc = WSAGetOverlappedResult(
+                        s,
+                       &bufobj->ol,
+                       &BytesTransfered,
+                        FALSE,
+                       &Flags
+                        );
+                if (rc == FALSE)
+                {
+                    error = WSAGetLastError();
+                }
             }
-            LeaveCriticalSection(&clientobj->SockCritSec);
-
-            error = NO_ERROR;
-		}
-
-        InterlockedIncrement(&listenobj->RepostCount);
-        SetEvent(listenobj->RepostAccept);
-    }
-    else if (buf->operation == OP_READ)
-    {
-        sockobj = (SOCKET_OBJ *)key;
-
-        InterlockedDecrement(&sockobj->OutstandingRecv);
+            // Handle the IO operation
+            HandleIo(event->Key, bufobj, shard, BytesTransfered, error);
+        }
 
-        //
-        // Receive completed successfully
-        //
-        if (BytesTransfered > 0)
-        {
-            InterlockedExchangeAdd(&gBytesRead, BytesTransfered);
-            InterlockedExchangeAdd(&gBytesReadLast, BytesTransfered);
+        // Post the sends queued by this batch
+        ProcessPendingOperations(shard);
 
-            // Make the recv a send
-            sendobj         = buf;
-            sendobj->buflen = BytesTransfered;
+        // Measure how long completions wait in the queue
+        PostLoadProbe(shard);
 
-            sendobj->sock = sockobj;
-            //PostSend(sockobj, sendobj);
-            EnqueuePendingOperation(&gPendingSendList, &gPendingSendListEnd, sendobj, OP_WRITE);
-        }
-        else
-        {
-            //dbgprint("Got 0 byte receive\n");
+        // Resume the connections that were waiting for the buffered byte budget
+        ResumePausedConnections(shard);
 
-            // Graceful close - the receive returned 0 bytes read
-            sockobj->bClosing = TRUE;
+        // Expire the connection timers that are due
+        TimerWheelAdvance(shard->wheel);
+    }
 
-            // Free the receive buffer
-            FreeBufferObj(buf);
+    SetEvent(gWorkerExit);
+    ExitThread(0);
+    return 0;
+}
 
-            // If this was the last outstanding operation on socket, clean it up
-            EnterCriticalSection(&sockobj->SockCritSec);
+//
+// Function: SetupWorkers
+//
+// Description:
+//    Decides how many workers to start and which processor each is placed
+//    on, and maps every processor to the shard which services connections
+//    received there (used by rss placement). Must be called before the
+//    shards are created as it sets their number in sharded mode.
+//
+BOOL SetupWorkers()
+{
+    TOPOLOGY_CPU cpu,
+                 other;
+    int          cpus[TOPOLOGY_MAX_CPUS],
+                 cpucount,
+                 i,
+                 j;
+
+    if (TopologyInit() == 0)
+    {
+        fprintf(stderr, "unable to enumerate the processors\n");
+        return FALSE;
+    }
 
-            if ((sockobj->OutstandingSend == 0) && 
-                (sockobj->OutstandingRecv == 0) )
-            {
-                bCleanupSocket = TRUE;
-            }
-            LeaveCriticalSection(&sockobj->SockCritSec);
+    if (gCpuList)
+    {
+        cpucount = TopologyParseCpuList(gCpuList, cpus, TOPOLOGY_MAX_CPUS);
+        if (cpucount <= 0)
+        {
+            fprintf(stderr, "invalid processor list: %s\n", gCpuList);
+            return FALSE;
         }
     }
-    else if (buf->operation == OP_WRITE)
+    else
     {
-        sockobj = (SOCKET_OBJ *)key;
+        cpucount = TopologyCpuCount();
+        for(i=0; i < cpucount ;i++)
+            cpus[i] = i;
+    }
 
-        InterlockedDecrement(&sockobj->OutstandingSend);
-        InterlockedDecrement(&gOutstandingSends);
+    if (gWorkerCount <= 0)
+        gWorkerCount = cpucount;
+    if (gWorkerCount > MAX_COMPLETION_THREAD_COUNT)
+        gWorkerCount = MAX_COMPLETION_THREAD_COUNT;
 
-        // Update the counters
-        InterlockedExchangeAdd(&gBytesSent, BytesTransfered);
-        InterlockedExchangeAdd(&gBytesSentLast, BytesTransfered);
+    // Sharded workers are pinned unless told otherwise
+    if (gPlacement == -1)
+        gPlacement = (gSharded) ? PLACE_CPU : PLACE_NONE;
 
-        buf->buflen = gBufferSize;
+    // In sharded mode each worker gets its own queue which only it services
+    if (gSharded)
+        gShardCount = gWorkerCount;
 
-        if (sockobj->bClosing == FALSE)
-        {
-            buf->sock = sockobj;
-            PostRecv(sockobj, buf);
-        }
+    gWorkers = (WORKER *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(WORKER) * gWorkerCount);
+    if (gWorkers == NULL)
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return FALSE;
+    }
+
+    // More workers than processors share them round robin
+    for(i=0; i < gWorkerCount ;i++)
+    {
+        gWorkers[i].Cpu = cpus[i % cpucount];
     }
 
-    ProcessPendingOperations();
+    // Connections received on a worker's processor go to its shard; those
+    //    received elsewhere to a worker on the same node, or any worker
+    for(i=0; i < TopologyCpuCount() ;i++)
+        gCpuShard[i] = -1;
 
-    if (sockobj)
+    for(i=0; i < gWorkerCount ;i++)
     {
-        if (error != NO_ERROR)
-        {
-            printf("err = %d\n", error);
-            sockobj->bClosing = TRUE;
-        }
+        if (gCpuShard[gWorkers[i].Cpu] == -1)
+            gCpuShard[gWorkers[i].Cpu] = i % gShardCount;
+    }
+    for(i=0; i < TopologyCpuCount() ;i++)
+    {
+        if (gCpuShard[i] != -1)
+            continue;
 
-        //
-        // Check to see if socket is closing
-        //
-        if ( (sockobj->OutstandingSend == 0) &&
-             (sockobj->OutstandingRecv == 0) &&
-             (sockobj->bClosing) )
-        {
-            bCleanupSocket = TRUE;
-        }
+        TopologyGetCpu(i, &cpu);
 
-        if (bCleanupSocket)
+        gCpuShard[i] = i % gShardCount;
+        for(j=0; j < gWorkerCount ;j++)
         {
-            closesocket(sockobj->s);
-            sockobj->s = INVALID_SOCKET;
-
-            FreeSocketObj(sockobj);
+            // Start at a different worker for each processor to spread the load
+            TopologyGetCpu(gWorkers[(i + j) % gWorkerCount].Cpu, &other);
+            if (other.Node == cpu.Node)
+            {
+                gCpuShard[i] = ((i + j) % gWorkerCount) % gShardCount;
+                break;
+            }
         }
     }
 
-    return;
+    return TRUE;
 }
 
 //
-// Function: CompletionThread
-// 
+// Function: PrintWorkerStatistics
+//
 // Description:
-//    This is the completion thread which services our completion port. One of
-//    these threads is created per processor on the system. The thread sits in 
-//    an infinite loop calling GetQueuedCompletionStatus and handling socket
-//    IO that completed.
+//    Prints where each worker runs, how busy its processor has kept it
+//    since the last call and how many completions (and for the UDP echo,
+//    datagrams) it handled per second.
 //
-DWORD WINAPI CompletionThread(LPVOID lpParam)
+void PrintWorkerStatistics()
 {
-    ULONG_PTR    Key;
-    SOCKET       s;
-    BUFFER_OBJ  *bufobj=NULL;           // Per I/O object for completed I/O
-    OVERLAPPED  *lpOverlapped=NULL;     // Pointer to overlapped structure for completed I/O
-    HANDLE       CompletionPort;        // Completion port handle
-    DWORD        BytesTransfered,       // Number of bytes transfered
-                 Flags;                 // Flags for completed I/O
-    int          rc, 
-                 error;
-
-    CompletionPort = (HANDLE)lpParam;
-    while (1)
+    FILETIME     created,
+                 exited,
+                 kernel,
+                 user;
+    TOPOLOGY_CPU cpu;
+    ULONGLONG    cputime,
+                 completions,
+                 spinhits,
+                 parks,
+                 dgrams,
+                 totalcpu=0,
+                 totalcompletions=0,
+                 totalspinhits=0,
+                 totalparks=0;
+    ULONG        now,
+                 elapsed,
+                 totalelapsed=0;
+    double       util;
+    int          i;
+
+    now = GetTickCount();
+
+    for(i=0; i < gWorkerCount ;i++)
     {
-        error = NO_ERROR;
-        rc = GetQueuedCompletionStatus(
-                CompletionPort,
-               &BytesTransfered,
-                (PULONG_PTR)&Key,
-               &lpOverlapped,
-                INFINITE
-                );
+        if (GetThreadTimes(gWorkers[i].Thread, &created, &exited, &kernel, &user) == FALSE)
+            continue;
 
-        bufobj = CONTAINING_RECORD(lpOverlapped, BUFFER_OBJ, ol);
+        cputime = (((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                  (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime);
 
-        if (rc == FALSE)
+        completions = gWorkers[i].Completions;
+        spinhits    = gWorkers[i].SpinHits;
+        parks       = gWorkers[i].Parks;
+        dgrams      = gWorkers[i].Dgrams;
+
+        elapsed = now - gWorkers[i].LastSample;
+        if ((gWorkers[i].LastSample != 0) && (elapsed > 0))
         {
-            // If the call fails, call WSAGetOverlappedResult to translate the
-            //    error code into a Winsock error code.
-            if (bufobj->operation == OP_ACCEPT)
-            {
-                s = ((LISTEN_OBJ *)Key)->s;
-            }
-            else
-            {
-                s = ((SOCKET_OBJ *)Key)->s;
-            }
-          
-            dbgprint("CompletionThread: GetQueuedCompletionStatus failed: %d [0x%x]\n",
-                    GetLastError(), lpOverlapped->Internal);
-
-            rc = WSAGetOverlappedResult(
-                    s,
-                   &bufobj->ol,
-                   &BytesTransfered,
-                    FALSE,
-                   &Flags
+            // Processor time is in 100ns units
+            util = (100.0 * (cputime - gWorkers[i].CpuTimeLast)) / ((double)elapsed * 10000);
+
+            TopologyGetCpu(gWorkers[i].Cpu, &cpu);
+
+            printf("Worker %3d: shard %3d; cpu %4d (group %d node %d); util %5.1f%%; completions/sec %I64u",
+                    i,
+                    (int)(gWorkers[i].shard - gShards),
+                    gWorkers[i].Cpu,
+                    cpu.Processor.Group,
+                    cpu.Node,
+                    util,
+                    ((completions - gWorkers[i].CompletionsLast) * 1000) / elapsed
                     );
-            if (rc == FALSE)
+            if (gProtocol == IPPROTO_UDP)
             {
-                error = WSAGetLastError();
+                printf("; datagrams/sec %I64u",
+                        ((dgrams - gWorkers[i].DgramsLast) * 1000) / elapsed
+                        );
             }
+            printf("\n");
+
+            totalcpu         += cputime - gWorkers[i].CpuTimeLast;
+            totalcompletions += completions - gWorkers[i].CompletionsLast;
+            totalspinhits    += spinhits - gWorkers[i].SpinHitsLast;
+            totalparks       += parks - gWorkers[i].ParksLast;
+            totalelapsed      = elapsed;
         }
-        // Handle the IO operation
-        HandleIo(Key, bufobj, CompletionPort, BytesTransfered, error);
+
+        gWorkers[i].CpuTimeLast     = cputime;
+        gWorkers[i].CompletionsLast = completions;
+        gWorkers[i].SpinHitsLast    = spinhits;
+        gWorkers[i].ParksLast       = parks;
+        gWorkers[i].DgramsLast      = dgrams;
+        gWorkers[i].LastSample      = now;
     }
 
-    ExitThread(0);
-    return 0;
+    // The cost of the spin budget: processor time per completion and how
+    //    often polling found work before the worker had to block
+    if ((totalelapsed > 0) && (totalcompletions > 0))
+    {
+        printf("Spin budget %d us: cpu %.2f us per completion; %I64u%% of waits found work spinning; parks/sec %I64u\n",
+                gSpinBudget,
+                (double)totalcpu / 10 / totalcompletions,
+                (totalspinhits * 100) / (totalspinhits + totalparks),
+                (totalparks * 1000) / totalelapsed
+                );
+    }
+
+    if (gPlacement == PLACE_RSS)
+        printf("Connections placed by RSS processor: %lu\n", gRssPlaced);
 }
 
 //
@@ -1178,16 +6168,17 @@ int __cdecl main(int argc, char **argv)
 {
     WSADATA          wsd;
     SYSTEM_INFO      sysinfo;
+    DGRAM_OBJ       *DgramSockets=NULL,
+                    *dgram=NULL;
     LISTEN_OBJ      *ListenSockets=NULL,
                     *listenobj=NULL;
     SOCKET_OBJ      *sockobj=NULL;
     BUFFER_OBJ      *acceptobj=NULL;
+    BACKEND         *backend=NULL;
     GUID             guidAcceptEx = WSAID_ACCEPTEX,
                      guidGetAcceptExSockaddrs = WSAID_GETACCEPTEXSOCKADDRS;
     DWORD            bytes;
-    HANDLE           CompletionPort,
-                     WaitEvents[MAX_COMPLETION_THREAD_COUNT],
-                     hrc;
+    HANDLE           WaitEvents[MAXIMUM_WAIT_OBJECTS];
     int              endpointcount=0,
                      waitcount=0,
                      interval,
@@ -1208,22 +6199,99 @@ int __cdecl main(int argc, char **argv)
 
     InitializeCriticalSection(&gSocketListCs);
     InitializeCriticalSection(&gBufferListCs);
-    InitializeCriticalSection(&gPendingCritSec);
 
-    // Create the completion port used by this server
-    CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, (ULONG_PTR)NULL, 0);
-    if (CompletionPort == NULL)
+    QueryPerformanceFrequency(&gPerfFrequency);
+
+    StatsInit();
+
+    if (SlabInit(gLargePages) == FALSE)
     {
-        fprintf(stderr, "CreateIoCompletionPort failed: %d\n", GetLastError());
-        return -1;
+        fprintf(stderr, "Large pages unavailable, using normal pages for the buffers\n");
+    }
+
+    if (gLowWatermark > gHighWatermark)
+        gLowWatermark = gHighWatermark;
+
+    gResumeBufferedBytes = (gMaxBufferedBytes / 4) * 3;
+
+    // The broker speaks framed messages, lines unless -p says otherwise
+    if (gPubSub)
+    {
+        if ((gProtocol == IPPROTO_UDP) || (gBackendList))
+        {
+            fprintf(stderr, "publish/subscribe mode (-ps) only applies to the TCP server\n");
+            return -1;
+        }
+        if (gFrameMode == FRAME_MODE_RAW)
+            gFrameMode = FRAME_MODE_DELIMITER;
+
+        if (PubSubInit() == FALSE)
+            return -1;
+    }
+
+    // The cache speaks memcached's text protocol: lines, with the data of
+    //    a set read as a block of its length (see HandleKvFrame)
+    if (gKvStore)
+    {
+        if ((gProtocol == IPPROTO_UDP) || (gBackendList) || (gPubSub))
+        {
+            fprintf(stderr, "key-value mode (-k) only applies to the TCP echo server\n");
+            return -1;
+        }
+        gFrameMode = FRAME_MODE_DELIMITER;
+    }
+
+    if (gLatencyFile)
+    {
+        gLatencyFp = fopen(gLatencyFile, "a");
+        if (gLatencyFp == NULL)
+        {
+            fprintf(stderr, "unable to open %s\n", gLatencyFile);
+            return -1;
+        }
+        fprintf(gLatencyFp, "seconds,operation,count,p50_us,p90_us,p99_us,p999_us,max_us\n");
     }
 
     // Find out how many processors are on this system
     GetSystemInfo(&sysinfo);
 
-    if (sysinfo.dwNumberOfProcessors > MAX_COMPLETION_THREAD_COUNT)
+    // Decide on the workers and their placement
+    if (SetupWorkers() == FALSE)
+    {
+        return -1;
+    }
+
+    // One partition of the store per worker
+    if ((gKvStore) && (KvInit(gWorkerCount, (ULONGLONG)gKvMemory * 1024 * 1024, gKvItems) == FALSE))
     {
-        sysinfo.dwNumberOfProcessors = MAX_COMPLETION_THREAD_COUNT;
+        return -1;
+    }
+
+    // Create the completion queue(s) used by this server. In sharded mode each
+    //    worker thread gets its own queue which only it services.
+    gShards = (SHARD *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SHARD) * gShardCount);
+    if (gShards == NULL)
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+    for(i=0; i < gShardCount ;i++)
+    {
+        InitializeSListHead(&gShards[i].ReadyList);
+        InitializeSListHead(&gShards[i].PausedList);
+        InitializeCriticalSection(&gShards[i].DeferredCritSec);
+
+        gShards[i].proactor = ProactorCreate((gSharded) ? 1 : 0);
+        if (gShards[i].proactor == NULL)
+        {
+            return -1;
+        }
+
+        gShards[i].wheel = TimerWheelCreate(TIMER_TICK);
+        if (gShards[i].wheel == NULL)
+        {
+            return -1;
+        }
     }
 
     // Round the buffer size to the next increment of the page size
@@ -1234,21 +6302,104 @@ int __cdecl main(int argc, char **argv)
 
     printf("Buffer size = %lu (page size = %lu)\n", 
         gBufferSize, sysinfo.dwPageSize);
+
+    // A receive never returns more than a (rounded) buffer
+    if (gZeroCopyThreshold > gBufferSize)
+    {
+        fprintf(stderr, "zero copy threshold %d exceeds the buffer size, using %d\n",
+                gZeroCopyThreshold, gBufferSize);
+        gZeroCopyThreshold = gBufferSize;
+    }
+
+    // Bulk buffers are at least as large as normal ones
+    if ((gBulkThreshold > 0) && (gBulkBufferSize < gBufferSize))
+    {
+        fprintf(stderr, "bulk buffer size %d is below the buffer size, using %d\n",
+                gBulkBufferSize, gBufferSize);
+        gBulkBufferSize = gBufferSize;
+    }
+
+    // A message can't span more segments than frame.h allows
+    if (gFrameMode != FRAME_MODE_RAW)
+    {
+        if (gMaxFrameLength > ((FRAME_MAX_SEGMENTS - 2) / 2) * gBufferSize)
+        {
+            fprintf(stderr, "maximum message size %d too large for the buffer size, using %d\n",
+                    gMaxFrameLength, ((FRAME_MAX_SEGMENTS - 2) / 2) * gBufferSize);
+            gMaxFrameLength = ((FRAME_MAX_SEGMENTS - 2) / 2) * gBufferSize;
+        }
+
+        FrameInit(ReleaseFrameBuffer);
+    }
+
+    // The allocation benchmark runs instead of the server
+    if (gAllocBenchThreads > 0)
+    {
+        RunAllocBenchmark(gAllocBenchThreads);
+        return 0;
+    }
     
+    // The main thread waits for the listening sockets' events and for
+    //    any worker exiting
+    gWorkerExit = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (gWorkerExit == NULL)
+    {
+        fprintf(stderr, "CreateEvent failed: %d\n", GetLastError());
+        return -1;
+    }
+    WaitEvents[waitcount++] = gWorkerExit;
+
     // Create the worker threads to service the completion notifications
-    for(waitcount=0; waitcount < (int)sysinfo.dwNumberOfProcessors ;waitcount++)
+    for(i=0; i < gWorkerCount ;i++)
     {
-        WaitEvents[waitcount] = CreateThread(NULL, 0, CompletionThread, (LPVOID)CompletionPort, 0, NULL);
-        if (WaitEvents[waitcount] == NULL)
+        gWorkers[i].shard = &gShards[i % gShardCount];
+
+        // Place the worker before it runs so that the memory it touches
+        //    first (its magazines and statistics) comes from its node
+        gWorkers[i].Thread = CreateThread(
+                NULL,
+                0,
+                CompletionThread,
+                (LPVOID)&gWorkers[i],
+                CREATE_SUSPENDED,
+                NULL
+                );
+        if (gWorkers[i].Thread == NULL)
         {
             fprintf(stderr, "CreatThread failed: %d\n", GetLastError());
             return -1;
         }
+
+        TopologyPlaceThread(gWorkers[i].Thread, gWorkers[i].Cpu, gPlacement);
+
+        ResumeThread(gWorkers[i].Thread);
     }
 
+    printf("Workers: %d on %d shard(s), %d processors\n",
+            gWorkerCount, gShardCount, TopologyCpuCount());
+
     printf("Local address: %s; Port: %s; Family: %d\n",
             gBindAddr, gBindPort, gAddressFamily);
 
+    // Establish the relay's backend connections before taking clients
+    if (gBackendList)
+    {
+        if (gProtocol == IPPROTO_UDP)
+        {
+            fprintf(stderr, "the relay (-x) only applies to TCP\n");
+            return -1;
+        }
+        if (StartBackends(gBackendList) == FALSE)
+        {
+            fprintf(stderr, "Unable to set up the backends!\n");
+            return -1;
+        }
+        for(backend=gBackends; backend ;backend=backend->next)
+        {
+            RefillBackendPool(backend);
+        }
+    }
+
     // Obtain the "wildcard" addresses for all the available address families
     res = ResolveAddress(gBindAddr, gBindPort, gAddressFamily, gSocketType, gProtocol);
     if (res == NULL)
@@ -1265,6 +6416,23 @@ int __cdecl main(int argc, char **argv)
         PrintAddress(ptr->ai_addr, ptr->ai_addrlen); 
         printf("\n");
 
+        // UDP sockets only need their receives posted
+        if (gProtocol == IPPROTO_UDP)
+        {
+            dgram = StartDgramSocket(ptr, &gShards[endpointcount % gShardCount]);
+            if (dgram == NULL)
+            {
+                return -1;
+            }
+
+            dgram->next   = DgramSockets;
+            DgramSockets  = dgram;
+
+            endpointcount++;
+            ptr = ptr->ai_next;
+            continue;
+        }
+
         listenobj = (LISTEN_OBJ *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(LISTEN_OBJ));
         if (listenobj == NULL)
         {
@@ -1272,7 +6440,8 @@ int __cdecl main(int argc, char **argv)
             return -1;
         }
         
-        listenobj->LoWaterMark = gInitialAccepts;
+        listenobj->TargetAcceptCount = gInitialAccepts;
+        listenobj->LastUpdate        = GetTickCount();
 
         InitializeCriticalSection(&listenobj->ListenCritSec);
         
@@ -1303,15 +6472,19 @@ int __cdecl main(int argc, char **argv)
         }
 
         // Add the event to the liste of waiting events
+        if (waitcount + 2 > MAXIMUM_WAIT_OBJECTS)
+        {
+            fprintf(stderr, "too many listening sockets\n");
+            return -1;
+        }
         WaitEvents[waitcount++] = listenobj->AcceptEvent;
 
         WaitEvents[waitcount++] = listenobj->RepostAccept;
 
-        // Associate the socket and its SOCKET_OBJ to the completion port
-        hrc = CreateIoCompletionPort((HANDLE)listenobj->s, CompletionPort, (ULONG_PTR)listenobj, 0);
-        if (hrc == NULL)
+        // Associate the socket and its LISTEN_OBJ to a completion queue. In sharded
+        //    mode the listener's shard only hands accepted connections out.
+        if (ProactorAssociate(gShards[endpointcount % gShardCount].proactor, listenobj->s, (ULONG_PTR)listenobj) == SOCKET_ERROR)
         {
-            fprintf(stderr, "CreateIoCompletionPort failed: %d\n", GetLastError());
             return -1;
         }
 
@@ -1379,20 +6552,10 @@ int __cdecl main(int argc, char **argv)
         }
 
         // Initiate the initial accepts for each listen socket
-        for(i=0; i < gInitialAccepts ;i++)
+        if (PostAccepts(listenobj, gInitialAccepts) == 0)
         {
-            acceptobj = GetBufferObj(gBufferSize);
-            if (acceptobj == NULL)
-            {
-                fprintf(stderr, "Out of memory!\n");
-                return -1;
-            }
-
-            acceptobj->PostAccept = listenobj->AcceptEvent;
-
-            InsertPendingAccept(listenobj, acceptobj);
-
-            PostAccept(listenobj, acceptobj);
+            fprintf(stderr, "Unable to post any accepts!\n");
+            return -1;
         }
 
         //
@@ -1414,6 +6577,8 @@ int __cdecl main(int argc, char **argv)
     // free the addrinfo structure for the 'bind' address
     freeaddrinfo(res);
 
+    gListenSockets = ListenSockets;
+
     gStartTime = gStartTimeLast = GetTickCount();
 
     interval = 0;
@@ -1436,6 +6601,31 @@ int __cdecl main(int argc, char **argv)
             interval++;
 
             PrintStatistics();
+            PrintWorkerStatistics();
+            for(i=0; i < gShardCount ;i++)
+            {
+                ProactorPrintStatistics(gShards[i].proactor);
+            }
+
+            // Let the accept pools shrink while idle and top up any accept
+            //    which could not be reposted earlier
+            listenobj = ListenSockets;
+            while (listenobj)
+            {
+                UpdateAcceptTarget(listenobj);
+                PrintAcceptStatistics(listenobj);
+
+                PostAccepts(listenobj, listenobj->TargetAcceptCount - listenobj->PendingAcceptCount);
+
+                listenobj = listenobj->next;
+            }
+
+            // Top up the backends' pools and retry the backends which are down
+            for(backend=gBackends; backend ;backend=backend->next)
+            {
+                RefillBackendPool(backend);
+            }
+            PrintBackendStatistics();
 
             if (interval == 36)
             {
@@ -1504,7 +6694,7 @@ int __cdecl main(int argc, char **argv)
                 {
                     continue;
                 }
-                if (index < (int)sysinfo.dwNumberOfProcessors)
+                if (WaitEvents[index] == gWorkerExit)
                 {
                     // One of the completion threads exited
                     //   This is bad so just bail - a real server would want
@@ -1526,7 +6716,7 @@ int __cdecl main(int argc, char **argv)
                     if (listenobj)
                     {
                         WSANETWORKEVENTS ne;
-                        int              limit=0;
+                        LONGLONG         requested=0;
 
                         if (listenobj->AcceptEvent == WaitEvents[index])
                         {
@@ -1543,32 +6733,36 @@ int __cdecl main(int argc, char **argv)
                             }
                             if ((ne.lNetworkEvents & FD_ACCEPT) == FD_ACCEPT)
                             {
-                                // We got an FD_ACCEPT so post multiple accepts to 
-                                // cover the burst
-                                limit = BURST_ACCEPT_COUNT;
+                                // A connection arrived with no AcceptEx pending, so
+                                //    the pool is too small for the current arrival
+                                //    rate. Double it right away to cover the burst.
+                                listenobj->ExhaustedCount++;
+
+                                listenobj->TargetAcceptCount *= 2;
+                                if (listenobj->TargetAcceptCount > gMaxAccepts)
+                                    listenobj->TargetAcceptCount = gMaxAccepts;
                             }
                         }
                         else if (listenobj->RepostAccept == WaitEvents[index])
                         {
-                            // Semaphore is signaled
-                            limit = InterlockedExchange(&listenobj->RepostCount, 0);
-
+                            // Accepts have completed. Reset the event before taking
+                            //    the request so that a later request sets it again.
                             ResetEvent(listenobj->RepostAccept);
+
+                            requested = InterlockedExchange64(&listenobj->RepostRequested, 0);
                         }
 
-                        i = 0;
-                        while ( (i++ < limit) &&
-                                (listenobj->PendingAcceptCount < gMaxAccepts) )
-                        {
-                            acceptobj = GetBufferObj(gBufferSize);
-                            if (acceptobj)
-                            {
-                                acceptobj->PostAccept = listenobj->AcceptEvent;
+                        UpdateAcceptTarget(listenobj);
 
-                                InsertPendingAccept(listenobj, acceptobj);
+                        PostAccepts(listenobj, listenobj->TargetAcceptCount - listenobj->PendingAcceptCount);
 
-                                PostAccept(listenobj, acceptobj);
-                            }
+                        if (requested != 0)
+                        {
+                            // Time from the accept completing to its replacement
+                            //    being posted
+                            requested = ((StatsTimestamp() - requested) * 1000000) / gPerfFrequency.QuadPart;
+
+                            listenobj->RefillLatency = (ULONG)((listenobj->RefillLatency * 7 + requested) / 8);
                         }
                     }
                 }
@@ -0,0 +1,615 @@
+//
+// Sample: Load generator for the key-value mode of the I/O Completion Port Server
+//
+// Files:
+//      kvbench.cpp       - this file
+//      resolve.cpp       - Common name resolution routines
+//      resolve.h         - Header file for name resolution routines
+//      stats.cpp         - Per-thread counters and latency histograms
+//      stats.h           - Header file for statistics routines
+//
+// Description:
+//      This sample measures the key-value mode of iocpserver (-k), or any
+//      memcached server. It opens the given number of connections, each
+//      serviced by its own thread which keeps exactly one command
+//      outstanding: it sends a get or a set of a random key, waits for the
+//      reply and times it. The mix of gets and sets (-g), the number of
+//      keys (-k) and the size of the values (-v) are given on the command
+//      line. Every key is set once before the run, so gets hit unless the
+//      server evicted the key.
+//
+//      Each second the operations per second are printed. At the end of
+//      the run the totals, the hit rate and the latency percentiles of
+//      gets and sets are printed. The latencies are recorded in the same
+//      per-thread histograms the server uses, so they can be compared with
+//      the server's turnaround. Since each connection waits for each reply,
+//      the throughput is limited by the latency: use enough connections to
+//      keep the server's workers busy, and compare runs with different
+//      numbers of them to see where the latency starts to climb.
+//
+//      For example, against a local server:
+//          iocpserver.exe -k 1024 -s
+//          kvbench.exe -c 32 -g 90 -v 100 -d 30
+//
+// Compile:
+//      cl -o kvbench.exe kvbench.cpp resolve.cpp stats.cpp ws2_32.lib
+//
+// Usage:
+//      kvbench.exe [options]
+//          -a 4|6     Address family, 4 = IPv4, 6 = IPv6 [default = unspecified]
+//          -c count   Number of connections
+//          -d secs    Duration of the run
+//          -e port    Port number
+//          -g percent Share of gets, the rest are sets
+//          -k count   Number of keys
+//          -n server  Server address or name to connect to
+//          -v bytes   Size of the values set
+//
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "resolve.h"
+#include "stats.h"
+
+#define DEFAULT_CONNECTIONS         16     // Connections (one thread each)
+#define DEFAULT_DURATION            10     // Seconds of the run
+#define DEFAULT_GET_PERCENT         90     // Share of gets
+#define DEFAULT_KEY_COUNT           10000  // Keys chosen from
+#define DEFAULT_VALUE_SIZE          100    // Bytes per value
+#define MAX_CONNECTIONS             512    // Each connection's thread has its statistics
+#define MAX_VALUE_SIZE              (1024 * 1024)
+#define REPLY_BUFFER_SIZE           65536  // Received data not yet parsed
+
+int   gAddressFamily = AF_UNSPEC,       // default to unspecified
+      gConnections   = DEFAULT_CONNECTIONS,
+      gDuration      = DEFAULT_DURATION,
+      gGetPercent    = DEFAULT_GET_PERCENT,
+      gKeyCount      = DEFAULT_KEY_COUNT,
+      gValueSize     = DEFAULT_VALUE_SIZE;
+
+char *gServer        = "localhost",     // server to connect to
+     *gPort          = "5150";          // port of the server
+
+volatile LONG gStop=0;                  // Set when the run is over
+
+//
+// Statistics counters and latency histograms (see stats.h)
+//
+#define STAT_GETS           0
+#define STAT_SETS           1
+#define STAT_HITS           2
+#define STAT_ERRORS         3           // Connections which failed
+
+#define HIST_GET            0           // Get sent until its reply arrived
+#define HIST_SET            1           // Set sent until its reply arrived
+
+//
+// A connection to the server and the thread running commands on it
+//
+typedef struct _BENCH_CONN
+{
+    SOCKET      s;
+    ULONG       Seed;                   // Picks the keys and commands
+
+    char       *Command;                // The command being sent
+    char       *Reply;                  // Data received and not yet parsed
+    ULONG       ReplyStart,
+                ReplyEnd;
+} BENCH_CONN;
+
+//
+// Function: usage
+//
+// Description:
+//      Prints usage information and exits the process.
+//
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-a 4|6] [-n server] [-e port] [-c count] [-d secs]\n",
+            progname);
+    fprintf(stderr, "  -a  4|6     Address family, 4 = IPv4, 6 = IPv6 [default = unspecified]\n"
+                    "  -c  count   Number of connections [default = %d]\n"
+                    "  -d  secs    Duration of the run [default = %d]\n"
+                    "  -e  port    Port number [default = %s]\n"
+                    "  -g  percent Share of gets, the rest are sets [default = %d]\n"
+                    "  -k  count   Number of keys [default = %d]\n"
+                    "  -n  server  Server address or name to connect to [default = %s]\n"
+                    "  -v  bytes   Size of the values set [default = %d]\n",
+                    DEFAULT_CONNECTIONS,
+                    DEFAULT_DURATION,
+                    gPort,
+                    DEFAULT_GET_PERCENT,
+                    DEFAULT_KEY_COUNT,
+                    gServer,
+                    DEFAULT_VALUE_SIZE
+                    );
+    ExitProcess(-1);
+}
+
+//
+// Function: ValidateArgs
+//
+// Description:
+//      Parses the command line arguments and sets up some global variables.
+//
+void ValidateArgs(int argc, char **argv)
+{
+    int     i;
+
+    for(i=1; i < argc ;i++)
+    {
+        if (((argv[i][0] != '/') && (argv[i][0] != '-')) || (strlen(argv[i]) != 2) || (i+1 >= argc))
+            usage(argv[0]);
+
+        switch (tolower(argv[i][1]))
+        {
+            case 'a':               // address family - IPv4 or IPv6
+                if (argv[i+1][0] == '4')
+                    gAddressFamily = AF_INET;
+                else if (argv[i+1][0] == '6')
+                    gAddressFamily = AF_INET6;
+                else
+                    usage(argv[0]);
+                i++;
+                break;
+            case 'c':               // connections
+                gConnections = atol(argv[++i]);
+                break;
+            case 'd':               // duration
+                gDuration = atol(argv[++i]);
+                break;
+            case 'e':               // endpoint - port number
+                gPort = argv[++i];
+                break;
+            case 'g':               // share of gets
+                gGetPercent = atol(argv[++i]);
+                break;
+            case 'k':               // keys
+                gKeyCount = atol(argv[++i]);
+                break;
+            case 'n':               // server
+                gServer = argv[++i];
+                break;
+            case 'v':               // value size
+                gValueSize = atol(argv[++i]);
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if ((gConnections < 1) || (gConnections > MAX_CONNECTIONS) ||
+        (gDuration < 1) || (gGetPercent < 0) || (gGetPercent > 100) ||
+        (gKeyCount < 1) || (gValueSize < 0) || (gValueSize > MAX_VALUE_SIZE))
+    {
+        usage(argv[0]);
+    }
+}
+
+//
+// Function: Random
+//
+// Description:
+//      Returns the next number of the connection's xorshift sequence.
+//
+ULONG Random(BENCH_CONN *conn)
+{
+    conn->Seed ^= conn->Seed << 13;
+    conn->Seed ^= conn->Seed >> 17;
+    conn->Seed ^= conn->Seed << 5;
+
+    return conn->Seed;
+}
+
+//
+// Function: SendAll
+//
+// Description:
+//      Sends the whole buffer. Returns SOCKET_ERROR on failure.
+//
+int SendAll(BENCH_CONN *conn, char *buf, int len)
+{
+    int     rc;
+
+    while (len > 0)
+    {
+        rc = send(conn->s, buf, len, 0);
+        if (rc == SOCKET_ERROR)
+        {
+            fprintf(stderr, "send failed: %d\n", WSAGetLastError());
+            return SOCKET_ERROR;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: FillReply
+//
+// Description:
+//      Receives more of the server's replies behind the data not yet
+//      parsed. Returns SOCKET_ERROR if the connection failed or closed.
+//
+int FillReply(BENCH_CONN *conn)
+{
+    int     rc;
+
+    // Move the unparsed data to the front
+    if (conn->ReplyStart > 0)
+    {
+        memmove(conn->Reply, conn->Reply + conn->ReplyStart, conn->ReplyEnd - conn->ReplyStart);
+        conn->ReplyEnd  -= conn->ReplyStart;
+        conn->ReplyStart = 0;
+    }
+    if (conn->ReplyEnd == REPLY_BUFFER_SIZE)
+    {
+        fprintf(stderr, "reply line too long\n");
+        return SOCKET_ERROR;
+    }
+
+    rc = recv(conn->s, conn->Reply + conn->ReplyEnd, REPLY_BUFFER_SIZE - conn->ReplyEnd, 0);
+    if (rc == SOCKET_ERROR)
+    {
+        fprintf(stderr, "recv failed: %d\n", WSAGetLastError());
+        return SOCKET_ERROR;
+    }
+    if (rc == 0)
+    {
+        fprintf(stderr, "server closed the connection\n");
+        return SOCKET_ERROR;
+    }
+    conn->ReplyEnd += rc;
+
+    return NO_ERROR;
+}
+
+//
+// Function: ReadLine
+//
+// Description:
+//      Returns the next reply line without its "\r\n", or NULL on failure.
+//      The line is only valid until the next read.
+//
+char *ReadLine(BENCH_CONN *conn)
+{
+    char   *line=NULL,
+           *end=NULL;
+
+    for(;;)
+    {
+        line = conn->Reply + conn->ReplyStart;
+        end  = (char *)memchr(line, '\n', conn->ReplyEnd - conn->ReplyStart);
+        if (end)
+            break;
+
+        if (FillReply(conn) == SOCKET_ERROR)
+            return NULL;
+    }
+
+    conn->ReplyStart = (ULONG)(end + 1 - conn->Reply);
+
+    *end = '\0';
+    if ((end > line) && (end[-1] == '\r'))
+        end[-1] = '\0';
+
+    return line;
+}
+
+//
+// Function: SkipBytes
+//
+// Description:
+//      Consumes the given number of bytes of the replies (a value).
+//
+int SkipBytes(BENCH_CONN *conn, ULONG len)
+{
+    ULONG   take;
+
+    while (len > 0)
+    {
+        if ((conn->ReplyStart == conn->ReplyEnd) && (FillReply(conn) == SOCKET_ERROR))
+            return SOCKET_ERROR;
+
+        take = conn->ReplyEnd - conn->ReplyStart;
+        if (take > len)
+            take = len;
+
+        conn->ReplyStart += take;
+        len              -= take;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: DoSet
+//
+// Description:
+//      Sets a key and waits for the reply.
+//
+int DoSet(BENCH_CONN *conn, ULONG key)
+{
+    char   *line=NULL;
+    int     len;
+
+    len = sprintf(conn->Command, "set key:%lu 0 0 %d\r\n", key, gValueSize);
+
+    memset(conn->Command + len, 'x', gValueSize);
+    len += gValueSize;
+    conn->Command[len++] = '\r';
+    conn->Command[len++] = '\n';
+
+    if (SendAll(conn, conn->Command, len) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+
+    line = ReadLine(conn);
+    if (line == NULL)
+        return SOCKET_ERROR;
+    if (strcmp(line, "STORED") != 0)
+    {
+        fprintf(stderr, "set failed: %s\n", line);
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: DoGet
+//
+// Description:
+//      Gets a key and waits for the reply. Sets hit if the key was found.
+//
+int DoGet(BENCH_CONN *conn, ULONG key, BOOL *hit)
+{
+    char   *line=NULL,
+           *bytes=NULL;
+    int     len;
+
+    *hit = FALSE;
+
+    len = sprintf(conn->Command, "get key:%lu\r\n", key);
+
+    if (SendAll(conn, conn->Command, len) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+
+    line = ReadLine(conn);
+    if (line == NULL)
+        return SOCKET_ERROR;
+
+    // "VALUE key flags bytes", then the value and "\r\n"
+    if (strncmp(line, "VALUE ", 6) == 0)
+    {
+        bytes = strrchr(line, ' ');
+
+        if (SkipBytes(conn, strtoul(bytes + 1, NULL, 10) + 2) == SOCKET_ERROR)
+            return SOCKET_ERROR;
+
+        line = ReadLine(conn);
+        if (line == NULL)
+            return SOCKET_ERROR;
+
+        *hit = TRUE;
+    }
+
+    if (strcmp(line, "END") != 0)
+    {
+        fprintf(stderr, "get failed: %s\n", line);
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: BenchThread
+//
+// Description:
+//      Runs commands on a connection until the run is over, timing each
+//      one.
+//
+DWORD WINAPI BenchThread(LPVOID lpParam)
+{
+    BENCH_CONN *conn=(BENCH_CONN *)lpParam;
+    LONGLONG    start;
+    ULONG       key;
+    BOOL        hit;
+    int         rc;
+
+    while (gStop == 0)
+    {
+        key = Random(conn) % gKeyCount;
+
+        start = StatsTimestamp();
+
+        if ((int)(Random(conn) % 100) < gGetPercent)
+        {
+            rc = DoGet(conn, key, &hit);
+            if (rc == NO_ERROR)
+            {
+                StatsRecordLatency(HIST_GET, start);
+                StatsAdd(STAT_GETS, 1);
+                if (hit)
+                    StatsAdd(STAT_HITS, 1);
+            }
+        }
+        else
+        {
+            rc = DoSet(conn, key);
+            if (rc == NO_ERROR)
+            {
+                StatsRecordLatency(HIST_SET, start);
+                StatsAdd(STAT_SETS, 1);
+            }
+        }
+
+        if (rc == SOCKET_ERROR)
+        {
+            StatsAdd(STAT_ERRORS, 1);
+            break;
+        }
+    }
+
+    ExitThread(0);
+    return 0;
+}
+
+//
+// Function: main
+//
+// Description:
+//      This is the main program. It connects to the server, sets every
+//      key once and then runs the commands on all connections for the
+//      duration, printing the operations per second as it goes and the
+//      latency percentiles at the end.
+//
+int __cdecl main(int argc, char **argv)
+{
+    WSADATA          wsd;
+    BENCH_CONN      *conns=NULL;
+    HANDLE          *threads=NULL;
+    ULONGLONG        ops,
+                     opsLast,
+                     gets,
+                     hits;
+    ULONG            start,
+                     elapsed;
+    struct addrinfo *res=NULL;
+    BOOL             nodelay=TRUE;
+    int              i;
+
+    ValidateArgs(argc, argv);
+
+    if (WSAStartup(MAKEWORD(2,2), &wsd) != 0)
+    {
+        fprintf(stderr, "unable to load Winsock!\n");
+        return -1;
+    }
+
+    StatsInit();
+
+    res = ResolveAddress(gServer, gPort, gAddressFamily, SOCK_STREAM, IPPROTO_TCP);
+    if (res == NULL)
+    {
+        fprintf(stderr, "unable to resolve %s\n", gServer);
+        return -1;
+    }
+
+    conns   = (BENCH_CONN *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH_CONN) * gConnections);
+    threads = (HANDLE *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(HANDLE) * gConnections);
+    if ((conns == NULL) || (threads == NULL))
+    {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+
+    printf("Connecting %d connections to ", gConnections);
+    PrintAddress(res->ai_addr, (int)res->ai_addrlen);
+    printf("\n");
+
+    for(i=0; i < gConnections ;i++)
+    {
+        conns[i].Seed = GetTickCount() + i * 2654435761UL;
+        if (conns[i].Seed == 0)
+            conns[i].Seed = 1;
+
+        conns[i].Command = (char *)HeapAlloc(GetProcessHeap(), 0, gValueSize + 512);
+        conns[i].Reply   = (char *)HeapAlloc(GetProcessHeap(), 0, REPLY_BUFFER_SIZE);
+        if ((conns[i].Command == NULL) || (conns[i].Reply == NULL))
+        {
+            fprintf(stderr, "Out of memory!\n");
+            return -1;
+        }
+
+        conns[i].s = socket(res->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        if (conns[i].s == INVALID_SOCKET)
+        {
+            fprintf(stderr, "socket failed: %d\n", WSAGetLastError());
+            return -1;
+        }
+
+        // Commands are small and each waits for the last, so don't delay them
+        setsockopt(conns[i].s, IPPROTO_TCP, TCP_NODELAY, (char *)&nodelay, sizeof(nodelay));
+
+        if (connect(conns[i].s, res->ai_addr, (int)res->ai_addrlen) == SOCKET_ERROR)
+        {
+            fprintf(stderr, "connect failed: %d\n", WSAGetLastError());
+            return -1;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    // Set every key once so the gets find them
+    printf("Setting %d keys of %d bytes\n", gKeyCount, gValueSize);
+    for(i=0; i < gKeyCount ;i++)
+    {
+        if (DoSet(&conns[i % gConnections], i) == SOCKET_ERROR)
+            return -1;
+    }
+
+    for(i=0; i < gConnections ;i++)
+    {
+        threads[i] = CreateThread(NULL, 0, BenchThread, (LPVOID)&conns[i], 0, NULL);
+        if (threads[i] == NULL)
+        {
+            fprintf(stderr, "CreateThread failed: %d\n", GetLastError());
+            return -1;
+        }
+    }
+
+    start   = GetTickCount();
+    opsLast = 0;
+    for(elapsed=1; elapsed <= (ULONG)gDuration ;elapsed++)
+    {
+        Sleep(1000);
+
+        ops = StatsRead(STAT_GETS) + StatsRead(STAT_SETS);
+
+        printf("%4lu s: %I64u ops/sec\n", elapsed, ops - opsLast);
+        opsLast = ops;
+
+        if (StatsRead(STAT_ERRORS) == (ULONGLONG)gConnections)
+            break;
+    }
+
+    InterlockedExchange(&gStop, 1);
+
+    WaitForMultipleObjects(gConnections > MAXIMUM_WAIT_OBJECTS ? MAXIMUM_WAIT_OBJECTS : gConnections,
+            threads, TRUE, INFINITE);
+    for(i=MAXIMUM_WAIT_OBJECTS; i < gConnections ;i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+    }
+
+    elapsed = GetTickCount() - start;
+
+    gets = StatsRead(STAT_GETS);
+    hits = StatsRead(STAT_HITS);
+    ops  = gets + StatsRead(STAT_SETS);
+
+    printf("\n%I64u operations in %lu ms: %I64u ops/sec; %I64u gets (%.1f%% hits); %I64u connections failed\n",
+            ops,
+            elapsed,
+            (elapsed > 0) ? (ops * 1000) / elapsed : 0,
+            gets,
+            (gets > 0) ? (100.0 * hits) / gets : 0.0,
+            StatsRead(STAT_ERRORS)
+            );
+
+    StatsPrintLatency(HIST_GET, "Get");
+    StatsPrintLatency(HIST_SET, "Set");
+
+    for(i=0; i < gConnections ;i++)
+    {
+        closesocket(conns[i].s);
+        CloseHandle(threads[i]);
+    }
+
+    WSACleanup();
+    return 0;
+}
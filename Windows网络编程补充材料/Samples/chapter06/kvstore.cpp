@@ -0,0 +1,541 @@
+//
+// Key-value store routines
+//
+// Files:
+//      kvstore.cpp     - Key-value store routines
+//      kvstore.h       - Header file for the key-value store routines
+//
+// Description:
+//      This file contains the partitioned hash tables, the slab allocated
+//      items and the CLOCK eviction of the server's key-value mode. See
+//      kvstore.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "frame.h"
+#include "kvstore.h"
+
+#define KV_LOCK_SPIN        4000            // Spins before a partition lock blocks
+#define KV_RELATIVE_LIMIT   (60 * 60 * 24 * 30) // Larger expiration times are absolute (as memcached)
+
+//
+// A stored item: the header followed by the key and the value, all in one
+//    chunk of its size class. Free chunks are linked through next.
+//
+typedef struct _KV_ITEM
+{
+    struct _KV_ITEM *next;          // Link in the free list of the size class
+    ULONG            Hash,
+                     Flags,         // Opaque to the server, returned with the value
+                     Expires,       // time() at which the item expires, 0 = never
+                     ValueLength;
+    USHORT           KeyLength;
+    UCHAR            SizeClass,
+                     Referenced;    // CLOCK bit, set by each get
+    char             Data[1];       // Key, then value
+} KV_ITEM;
+
+//
+// A slot of the open addressing table. Hash is 0 for an empty slot.
+//
+typedef struct _KV_SLOT
+{
+    ULONG            Hash;
+    KV_ITEM         *Item;
+} KV_SLOT;
+
+//
+// A partition of the store with its own lock, table and memory
+//
+typedef struct _KV_PARTITION
+{
+    CRITICAL_SECTION PartitionCritSec;
+
+    KV_SLOT         *Slots;
+    ULONG            Mask,          // Number of slots - 1
+                     Hand,          // Next slot the clock hand looks at
+                     ItemCount,
+                     MaxItems,
+                     PageCount,
+                     MaxPages;
+
+    KV_ITEM         *FreeItems[KV_SIZE_CLASSES];
+    ULONG            ClassItems[KV_SIZE_CLASSES];   // Items of each class stored
+
+    ULONGLONG        Hits,          // Updated under the lock
+                     Misses,
+                     Evictions,
+                     Expirations;
+
+    char             Pad[64];       // Keeps the next partition's lock off these lines
+} KV_PARTITION;
+
+KV_PARTITION *gPartitions=NULL;
+int           gPartitionCount=0;
+
+//
+// Function: KvInit
+//
+// Description:
+//    Sets up one partition for each worker. The memory (in bytes) and the
+//    number of items the store may hold are divided evenly among them.
+//
+BOOL KvInit(int partitions, ULONGLONG memory, ULONG items)
+{
+    KV_PARTITION *part=NULL;
+    ULONG         slots;
+    int           i;
+
+    gPartitions = (KV_PARTITION *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(KV_PARTITION) * partitions);
+    if (gPartitions == NULL)
+    {
+        fprintf(stderr, "KvInit: HeapAlloc failed: %d\n", GetLastError());
+        return FALSE;
+    }
+    gPartitionCount = partitions;
+
+    for(i=0; i < partitions ;i++)
+    {
+        part = &gPartitions[i];
+
+        part->MaxItems = items / partitions;
+        if (part->MaxItems == 0)
+            part->MaxItems = 1;
+        part->MaxPages = (ULONG)(memory / partitions / KV_SLAB_PAGE);
+        if (part->MaxPages == 0)
+            part->MaxPages = 1;
+
+        // At least a third more slots than items, rounded up to a power of two
+        for(slots=16; slots < part->MaxItems + part->MaxItems / 3 ;slots *= 2)
+            ;
+
+        part->Slots = (KV_SLOT *)VirtualAlloc(NULL, sizeof(KV_SLOT) * slots, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (part->Slots == NULL)
+        {
+            fprintf(stderr, "KvInit: VirtualAlloc failed: %d\n", GetLastError());
+            return FALSE;
+        }
+        part->Mask = slots - 1;
+
+        InitializeCriticalSectionAndSpinCount(&part->PartitionCritSec, KV_LOCK_SPIN);
+    }
+    return TRUE;
+}
+
+//
+// Function: KeyHash
+//
+// Description:
+//    Hashes a key (FNV-1a, 64 bits). The upper half picks the partition and
+//    the lower half, which is never 0, is the hash kept in the table.
+//
+KV_PARTITION *KeyHash(char *key, ULONG keylen, ULONG *hash)
+{
+    ULONGLONG   h=14695981039346656037ULL;
+    ULONG       i;
+
+    for(i=0; i < keylen ;i++)
+    {
+        h ^= (UCHAR)key[i];
+        h *= 1099511628211ULL;
+    }
+
+    *hash = (ULONG)h;
+    if (*hash == 0)
+        *hash = 1;
+
+    return &gPartitions[(ULONG)(h >> 32) % gPartitionCount];
+}
+
+//
+// Function: IsExpired
+//
+// Description:
+//    Returns TRUE if the item has expired.
+//
+BOOL IsExpired(KV_ITEM *item, ULONG now)
+{
+    return ((item->Expires != 0) && (item->Expires <= now));
+}
+
+//
+// Function: FindSlot
+//
+// Description:
+//    Returns the slot holding the key, or -1 if the key isn't stored. The
+//    partition must be locked.
+//
+LONG FindSlot(KV_PARTITION *part, char *key, ULONG keylen, ULONG hash)
+{
+    KV_SLOT *slot=NULL;
+    ULONG    i;
+
+    for(i=hash & part->Mask; part->Slots[i].Hash != 0 ;i=(i + 1) & part->Mask)
+    {
+        slot = &part->Slots[i];
+
+        if ((slot->Hash == hash) &&
+            (slot->Item->KeyLength == keylen) &&
+            (memcmp(slot->Item->Data, key, keylen) == 0))
+        {
+            return (LONG)i;
+        }
+    }
+    return -1;
+}
+
+//
+// Function: FreeItem
+//
+// Description:
+//    Returns an item's chunk to the free list of its size class. The
+//    partition must be locked.
+//
+void FreeItem(KV_PARTITION *part, KV_ITEM *item)
+{
+    part->ClassItems[item->SizeClass]--;
+    part->ItemCount--;
+
+    item->next = part->FreeItems[item->SizeClass];
+    part->FreeItems[item->SizeClass] = item;
+}
+
+//
+// Function: RemoveSlot
+//
+// Description:
+//    Empties a slot and frees its item. The slots following it in the same
+//    run are shifted back into the gap where their probe sequence allows,
+//    so lookups never need tombstones. The partition must be locked.
+//
+void RemoveSlot(KV_PARTITION *part, ULONG i)
+{
+    KV_ITEM *item=part->Slots[i].Item;
+    ULONG    j,
+             home;
+
+    for(j=(i + 1) & part->Mask; part->Slots[j].Hash != 0 ;j=(j + 1) & part->Mask)
+    {
+        home = part->Slots[j].Hash & part->Mask;
+
+        // The entry may move back unless its home lies between the gap and it
+        if (((j - home) & part->Mask) >= ((j - i) & part->Mask))
+        {
+            part->Slots[i] = part->Slots[j];
+            i = j;
+        }
+    }
+
+    part->Slots[i].Hash = 0;
+    part->Slots[i].Item = NULL;
+
+    FreeItem(part, item);
+}
+
+//
+// Function: EvictItem
+//
+// Description:
+//    Advances the clock hand until it finds an item of the size class (any
+//    class if SizeClass is -1) which was not referenced since the hand last
+//    passed, or which has expired, and evicts it. Returns FALSE if no item
+//    could be evicted within two turns of the hand. The partition must be
+//    locked.
+//
+BOOL EvictItem(KV_PARTITION *part, int SizeClass)
+{
+    KV_ITEM *item=NULL;
+    ULONG    now,
+             n,
+             i;
+
+    if ((part->ItemCount == 0) ||
+        ((SizeClass >= 0) && (part->ClassItems[SizeClass] == 0)))
+    {
+        return FALSE;
+    }
+
+    now = (ULONG)time(NULL);
+
+    // The first turn may only clear the reference bits
+    for(n=0; n < 2 * (part->Mask + 1) ;n++)
+    {
+        i          = part->Hand;
+        part->Hand = (part->Hand + 1) & part->Mask;
+
+        item = part->Slots[i].Item;
+        if ((item == NULL) || ((SizeClass >= 0) && (item->SizeClass != SizeClass)))
+            continue;
+
+        if (IsExpired(item, now))
+        {
+            part->Expirations++;
+        }
+        else if (item->Referenced)
+        {
+            item->Referenced = 0;
+            continue;
+        }
+        else
+        {
+            part->Evictions++;
+        }
+
+        RemoveSlot(part, i);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//
+// Function: AllocItem
+//
+// Description:
+//    Takes a chunk of the size class: from the class's free list, from a
+//    new page while the partition is below its share of the memory, or
+//    by evicting an item of the class. The partition must be locked.
+//
+KV_ITEM *AllocItem(KV_PARTITION *part, int SizeClass)
+{
+    KV_ITEM *item=NULL;
+    char    *page=NULL;
+    ULONG    size,
+             offset;
+
+    if ((part->FreeItems[SizeClass] == NULL) && (part->PageCount < part->MaxPages))
+    {
+        page = (char *)VirtualAlloc(NULL, KV_SLAB_PAGE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (page == NULL)
+        {
+            fprintf(stderr, "AllocItem: VirtualAlloc failed: %d\n", GetLastError());
+        }
+        else
+        {
+            part->PageCount++;
+
+            // Carve the whole page into chunks of this class
+            size = KV_MIN_ITEM << SizeClass;
+            for(offset=0; offset + size <= KV_SLAB_PAGE ;offset += size)
+            {
+                item = (KV_ITEM *)(page + offset);
+
+                item->SizeClass = (UCHAR)SizeClass;
+                item->next      = part->FreeItems[SizeClass];
+                part->FreeItems[SizeClass] = item;
+            }
+        }
+    }
+
+    if ((part->FreeItems[SizeClass] == NULL) && (EvictItem(part, SizeClass) == FALSE))
+        return NULL;
+
+    item = part->FreeItems[SizeClass];
+    part->FreeItems[SizeClass] = item->next;
+
+    part->ClassItems[SizeClass]++;
+    part->ItemCount++;
+
+    return item;
+}
+
+//
+// Function: KvSet
+//
+// Description:
+//    Stores the first len bytes of the frame as the value of the key,
+//    replacing any previous value. The expiration time follows memcached:
+//    0 never expires, up to 30 days is relative to now, larger values are
+//    a time() and a negative time has the item expire at once. Returns
+//    KV_TOO_LARGE if the item exceeds the largest chunk and KV_NO_MEMORY
+//    if nothing could be evicted to make room; the key is removed in both
+//    cases.
+//
+int KvSet(char *key, ULONG keylen, ULONG flags, LONG exptime, FRAME *data, ULONG len)
+{
+    KV_PARTITION *part=NULL;
+    KV_ITEM      *item=NULL;
+    ULONG         hash,
+                  expires,
+                  i;
+    LONG          found;
+    int           SizeClass,
+                  rc;
+
+    part = KeyHash(key, keylen, &hash);
+
+    SizeClass = 0;
+    while ((SizeClass < KV_SIZE_CLASSES) &&
+           ((ULONG)(KV_MIN_ITEM << SizeClass) < FIELD_OFFSET(KV_ITEM, Data) + keylen + len))
+    {
+        SizeClass++;
+    }
+
+    expires = 0;
+    if (exptime > KV_RELATIVE_LIMIT)
+        expires = (ULONG)exptime;
+    else if (exptime > 0)
+        expires = (ULONG)time(NULL) + exptime;
+
+    EnterCriticalSection(&part->PartitionCritSec);
+
+    // The old value goes first: making room below may move the slots
+    found = FindSlot(part, key, keylen, hash);
+    if (found >= 0)
+        RemoveSlot(part, (ULONG)found);
+
+    rc = KV_STORED;
+    if (SizeClass == KV_SIZE_CLASSES)
+    {
+        rc = KV_TOO_LARGE;
+    }
+    else if (exptime >= 0)
+    {
+        if (part->ItemCount >= part->MaxItems)
+            EvictItem(part, -1);
+
+        item = AllocItem(part, SizeClass);
+        if (item == NULL)
+        {
+            rc = KV_NO_MEMORY;
+        }
+        else
+        {
+            item->Hash        = hash;
+            item->Flags       = flags;
+            item->Expires     = expires;
+            item->ValueLength = len;
+            item->KeyLength   = (USHORT)keylen;
+            item->Referenced  = 0;
+
+            memcpy(item->Data, key, keylen);
+            FrameCopy(data, 0, item->Data + keylen, len);
+
+            for(i=hash & part->Mask; part->Slots[i].Hash != 0 ;i=(i + 1) & part->Mask)
+                ;
+            part->Slots[i].Hash = hash;
+            part->Slots[i].Item = item;
+        }
+    }
+
+    LeaveCriticalSection(&part->PartitionCritSec);
+
+    return rc;
+}
+
+//
+// Function: KvGet
+//
+// Description:
+//    Looks the key up and, if it is stored and not expired, calls Found
+//    with its value and marks it referenced. Returns FALSE on a miss.
+//
+BOOL KvGet(char *key, ULONG keylen, LPKV_VALUE Found, void *context)
+{
+    KV_PARTITION *part=NULL;
+    KV_ITEM      *item=NULL;
+    ULONG         hash;
+    LONG          i;
+
+    part = KeyHash(key, keylen, &hash);
+
+    EnterCriticalSection(&part->PartitionCritSec);
+
+    i = FindSlot(part, key, keylen, hash);
+    if ((i >= 0) && (IsExpired(part->Slots[i].Item, (ULONG)time(NULL))))
+    {
+        part->Expirations++;
+        RemoveSlot(part, (ULONG)i);
+        i = -1;
+    }
+
+    if (i < 0)
+    {
+        part->Misses++;
+        LeaveCriticalSection(&part->PartitionCritSec);
+        return FALSE;
+    }
+
+    item = part->Slots[i].Item;
+    item->Referenced = 1;
+    part->Hits++;
+
+    Found(context, key, keylen, item->Flags, item->Data + item->KeyLength, item->ValueLength);
+
+    LeaveCriticalSection(&part->PartitionCritSec);
+
+    return TRUE;
+}
+
+//
+// Function: KvDelete
+//
+// Description:
+//    Removes the key. Returns FALSE if it wasn't stored.
+//
+BOOL KvDelete(char *key, ULONG keylen)
+{
+    KV_PARTITION *part=NULL;
+    ULONG         hash;
+    LONG          i;
+
+    part = KeyHash(key, keylen, &hash);
+
+    EnterCriticalSection(&part->PartitionCritSec);
+
+    i = FindSlot(part, key, keylen, hash);
+    if (i >= 0)
+        RemoveSlot(part, (ULONG)i);
+
+    LeaveCriticalSection(&part->PartitionCritSec);
+
+    return (i >= 0);
+}
+
+//
+// Function: KvPrintStatistics
+//
+// Description:
+//    Prints the items and memory of the store and its hit rate. The
+//    partitions are read without their locks, so the sums are approximate.
+//
+void KvPrintStatistics()
+{
+    ULONGLONG   items=0,
+                pages=0,
+                hits=0,
+                misses=0,
+                evictions=0,
+                expirations=0;
+    int         i;
+
+    for(i=0; i < gPartitionCount ;i++)
+    {
+        items       += gPartitions[i].ItemCount;
+        pages       += gPartitions[i].PageCount;
+        hits        += gPartitions[i].Hits;
+        misses      += gPartitions[i].Misses;
+        evictions   += gPartitions[i].Evictions;
+        expirations += gPartitions[i].Expirations;
+    }
+
+    printf("Store: %I64u items in %I64u MB over %d partitions; hits %I64u misses %I64u (%.1f%%); evicted %I64u expired %I64u\n",
+            items,
+            (pages * KV_SLAB_PAGE) / (1024 * 1024),
+            gPartitionCount,
+            hits,
+            misses,
+            (hits + misses) ? (100.0 * hits) / (hits + misses) : 0.0,
+            evictions,
+            expirations
+            );
+}
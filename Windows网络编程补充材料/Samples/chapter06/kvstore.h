@@ -0,0 +1,76 @@
+//
+// Key-value store routines
+//
+// Files:
+//      kvstore.h       - Header file for the key-value store routines
+//
+// Description:
+//      This file declares the storage of the server's key-value mode, which
+//      speaks the get, set and delete commands of the memcached text
+//      protocol.
+//
+//      The store is split into partitions, one per worker thread, and a key
+//      belongs to the partition picked by its hash. Each partition has its
+//      own lock, hash table and memory, so workers serving different keys
+//      rarely meet on a lock or a cache line.
+//
+//      A partition's hash table uses open addressing with linear probing.
+//      A slot holds only the key's hash and a pointer to the item, so a
+//      lookup scans a few adjacent slots comparing hashes and only touches
+//      an item whose hash matches. Deleting shifts the following slots back
+//      instead of leaving tombstones. The table has a third more slots than
+//      the partition may hold items, which keeps the probe sequences short.
+//
+//      An item (header, key and value) lives in one chunk of a slab. Chunks
+//      come in power of two size classes from KV_MIN_ITEM to KV_SLAB_PAGE
+//      bytes, and a page is carved into chunks of a single class when that
+//      class runs out. Pages are never returned or moved to another class;
+//      once the partition's share of the memory is used up an item of the
+//      same class is evicted to make room. A set fails if its class got no
+//      page before the memory ran out, so give each partition a few pages
+//      per size class in use.
+//
+//      Eviction follows the CLOCK algorithm: a get sets the item's reference
+//      bit and the clock hand sweeps the hash table, clearing the bits and
+//      evicting the first item of the needed size class found without one.
+//      Expired items are evicted whatever their bit.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _KVSTORE_H_
+#define _KVSTORE_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define KV_MAX_KEY          250             // Longest key (as memcached)
+#define KV_MIN_ITEM         64              // Smallest chunk
+#define KV_SLAB_PAGE        (1024 * 1024)   // Bytes carved into chunks of one class at a time
+#define KV_SIZE_CLASSES     15              // KV_MIN_ITEM << 14 == KV_SLAB_PAGE
+
+#define KV_STORED           0               // KvSet results
+#define KV_TOO_LARGE        1
+#define KV_NO_MEMORY        2
+
+//
+// Called with the item found by KvGet. The partition is locked during the
+//    call so the value must be copied out before returning.
+//
+typedef void (*LPKV_VALUE)(void *context, char *key, ULONG keylen, ULONG flags, char *value, ULONG len);
+
+BOOL  KvInit(int partitions, ULONGLONG memory, ULONG items);
+int   KvSet(char *key, ULONG keylen, ULONG flags, LONG exptime, FRAME *data, ULONG len);
+BOOL  KvGet(char *key, ULONG keylen, LPKV_VALUE Found, void *context);
+BOOL  KvDelete(char *key, ULONG keylen);
+void  KvPrintStatistics();
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
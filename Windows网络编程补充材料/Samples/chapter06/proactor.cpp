@@ -0,0 +1,235 @@
+//
+// Completion queue (proactor) routines
+//
+// Files:
+//      proactor.cpp    - Completion queue routines
+//      proactor.h      - Header file for the completion queue routines
+//
+// Description:
+//      This file contains the I/O completion port implementation of the
+//      completion queue used by the server. See proactor.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "proactor.h"
+
+//
+// Function: ProactorCreate
+//
+// Description:
+//    Creates the completion queue. Concurrency is the number of threads
+//    allowed to process completions at the same time (0 = one per CPU).
+//
+PROACTOR *ProactorCreate(DWORD Concurrency)
+{
+    PROACTOR *proactor=NULL;
+
+    proactor = (PROACTOR *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROACTOR));
+    if (proactor == NULL)
+    {
+        fprintf(stderr, "ProactorCreate: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+
+    proactor->CompletionPort = CreateIoCompletionPort(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            (ULONG_PTR)NULL,
+            Concurrency
+            );
+    if (proactor->CompletionPort == NULL)
+    {
+        fprintf(stderr, "ProactorCreate: CreateIoCompletionPort failed: %d\n", GetLastError());
+        HeapFree(GetProcessHeap(), 0, proactor);
+        return NULL;
+    }
+
+    return proactor;
+}
+
+//
+// Function: ProactorAssociate
+//
+// Description:
+//    Associates a socket with the completion queue. All operations completing
+//    on the socket are returned with the given key.
+//
+int ProactorAssociate(PROACTOR *proactor, SOCKET s, ULONG_PTR Key)
+{
+    HANDLE  hrc;
+
+    hrc = CreateIoCompletionPort((HANDLE)s, proactor->CompletionPort, Key, 0);
+    if (hrc == NULL)
+    {
+        fprintf(stderr, "ProactorAssociate: CreateIoCompletionPort failed: %d\n",
+                GetLastError());
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorGetCompletion
+//
+// Description:
+//    Waits for the next completed operation. If the operation itself failed
+//    the event is still returned with its Error field set. SOCKET_ERROR is
+//    only returned when no completion was dequeued (timeout or a failure of
+//    the queue itself).
+//
+int ProactorGetCompletion(PROACTOR *proactor, PROACTOR_EVENT *event, DWORD Timeout)
+{
+    BOOL    rc;
+
+    event->lpOverlapped = NULL;
+    event->Error        = NO_ERROR;
+
+    rc = GetQueuedCompletionStatus(
+            proactor->CompletionPort,
+           &event->BytesTransfered,
+           &event->Key,
+           &event->lpOverlapped,
+            Timeout
+            );
+    if (rc == FALSE)
+    {
+        if (event->lpOverlapped == NULL)
+        {
+            return SOCKET_ERROR;
+        }
+        event->Error = GetLastError();
+    }
+
+    InterlockedIncrement(&proactor->DequeueCalls);
+    InterlockedIncrement(&proactor->Completions);
+
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorGetCompletions
+//
+// Description:
+//    Waits for completed operations and returns up to count of them with a
+//    single call into the kernel. Returns the number of events filled in, or
+//    SOCKET_ERROR if nothing was dequeued. As with ProactorGetCompletion the
+//    Error field of each event is set if that particular operation failed.
+//
+int ProactorGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout)
+{
+    OVERLAPPED_ENTRY entries[MAX_PROACTOR_BATCH];
+    ULONG            removed=0,
+                     i;
+    LONG             maxbatch;
+    BOOL             rc;
+
+    if (count > MAX_PROACTOR_BATCH)
+        count = MAX_PROACTOR_BATCH;
+
+    rc = GetQueuedCompletionStatusEx(
+            proactor->CompletionPort,
+            entries,
+            count,
+           &removed,
+            Timeout,
+            FALSE
+            );
+    if ((rc == FALSE) || (removed == 0))
+    {
+        return SOCKET_ERROR;
+    }
+
+    for(i=0; i < removed ;i++)
+    {
+        events[i].Key             = entries[i].lpCompletionKey;
+        events[i].lpOverlapped    = entries[i].lpOverlapped;
+        events[i].BytesTransfered = entries[i].dwNumberOfBytesTransferred;
+
+        // The status of each operation is kept in its overlapped structure
+        if (entries[i].lpOverlapped)
+            events[i].Error       = (DWORD)entries[i].lpOverlapped->Internal;
+        else
+            events[i].Error       = NO_ERROR;
+    }
+
+    InterlockedIncrement(&proactor->DequeueCalls);
+    InterlockedExchangeAdd(&proactor->Completions, removed);
+
+    maxbatch = proactor->MaxBatch;
+    while ((LONG)removed > maxbatch)
+    {
+        if (InterlockedCompareExchange(&proactor->MaxBatch, removed, maxbatch) == maxbatch)
+            break;
+        maxbatch = proactor->MaxBatch;
+    }
+
+    return (int)removed;
+}
+
+//
+// Function: ProactorPost
+//
+// Description:
+//    Queues a completion to the completion queue as if the operation described
+//    by lpOverlapped had just completed successfully with the given key.
+//    lpOverlapped may be NULL to simply wake a thread waiting on the queue.
+//
+int ProactorPost(PROACTOR *proactor, ULONG_PTR Key, OVERLAPPED *lpOverlapped, DWORD BytesTransfered)
+{
+    BOOL    rc;
+
+    if (lpOverlapped)
+        lpOverlapped->Internal = 0;
+
+    rc = PostQueuedCompletionStatus(
+            proactor->CompletionPort,
+            BytesTransfered,
+            Key,
+            lpOverlapped
+            );
+    if (rc == FALSE)
+    {
+        fprintf(stderr, "ProactorPost: PostQueuedCompletionStatus failed: %d\n",
+                GetLastError());
+        return SOCKET_ERROR;
+    }
+    return NO_ERROR;
+}
+
+//
+// Function: ProactorPrintStatistics
+//
+// Description:
+//    Prints how many completions were harvested per call into the kernel
+//    since the last time this routine was called.
+//
+void ProactorPrintStatistics(PROACTOR *proactor)
+{
+    LONG    calls,
+            completions,
+            maxbatch;
+
+    calls       = InterlockedExchange(&proactor->DequeueCalls, 0);
+    completions = InterlockedExchange(&proactor->Completions, 0);
+    maxbatch    = InterlockedExchange(&proactor->MaxBatch, 0);
+
+    if (calls == 0)
+        return;
+
+    printf("Completions per dequeue: %lu.%02lu (%lu completions, %lu calls, max batch %lu)\n",
+            completions / calls,
+            ((completions % calls) * 100) / calls,
+            completions,
+            calls,
+            maxbatch
+            );
+}
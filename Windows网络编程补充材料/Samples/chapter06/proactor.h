@@ -0,0 +1,72 @@
+//
+// Completion queue (proactor) routines
+//
+// Files:
+//      proactor.h      - Header file for the completion queue routines
+//
+// Description:
+//      This file declares a small abstraction over the completion queue
+//      used by the server. The server posts overlapped operations and
+//      then waits for their completions through these routines only, so
+//      the completion driven state machine in HandleIo does not depend
+//      on how completions are harvested. The only backend provided is
+//      the I/O completion port.
+//
+//      The io_uring and epoll backends live in the chapter05 server's copy
+//      of these routines. This server stays Windows only: besides the
+//      completion port it depends on AcceptEx and ConnectEx, UDP send and
+//      receive coalescing through WSASendMsg and WSARecvMsg, and the RSS
+//      and processor group queries used to place its shards.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _PROACTOR_H_
+#define _PROACTOR_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define MAX_PROACTOR_BATCH      64      // Most completions dequeued per call
+
+//
+// The completion queue. For the completion port backend this is simply
+//    the port handle.
+//
+typedef struct _PROACTOR
+{
+    HANDLE          CompletionPort;
+
+    // Batch statistics (see ProactorGetCompletions)
+    volatile LONG   DequeueCalls,       // Number of successful dequeue calls
+                    Completions,        // Completions returned by those calls
+                    MaxBatch;           // Largest batch returned
+} PROACTOR;
+
+//
+// A single completed operation as returned by ProactorGetCompletion
+//
+typedef struct _PROACTOR_EVENT
+{
+    ULONG_PTR       Key;                // Completion key given to ProactorAssociate
+    OVERLAPPED     *lpOverlapped;       // Overlapped structure of the completed I/O
+    DWORD           BytesTransfered;    // Number of bytes transfered
+    DWORD           Error;              // Completion status (NO_ERROR on success)
+} PROACTOR_EVENT;
+
+PROACTOR *ProactorCreate(DWORD Concurrency);
+int       ProactorAssociate(PROACTOR *proactor, SOCKET s, ULONG_PTR Key);
+int       ProactorGetCompletion(PROACTOR *proactor, PROACTOR_EVENT *event, DWORD Timeout);
+int       ProactorGetCompletions(PROACTOR *proactor, PROACTOR_EVENT *events, int count, DWORD Timeout);
+int       ProactorPost(PROACTOR *proactor, ULONG_PTR Key, OVERLAPPED *lpOverlapped, DWORD BytesTransfered);
+void      ProactorPrintStatistics(PROACTOR *proactor);
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
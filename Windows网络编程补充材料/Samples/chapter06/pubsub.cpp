@@ -0,0 +1,421 @@
+//
+// Publish/subscribe routines
+//
+// Files:
+//      pubsub.cpp      - Publish/subscribe routines
+//      pubsub.h        - Header file for the publish/subscribe routines
+//
+// Description:
+//      This file contains the topic table and the reference counted messages
+//      of the server's publish/subscribe mode. See pubsub.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pubsub.h"
+
+//
+// A topic and its subscribers. Protected by the lock of its bucket.
+//
+typedef struct _PUBSUB_TOPIC
+{
+    char                    Name[PUBSUB_MAX_TOPIC];
+    ULONG                   NameLength;
+
+    PUBSUB_CLIENT         **Subscribers;
+    int                     SubscriberCount,
+                            SubscriberMax;  // Entries allocated in Subscribers
+
+    struct _PUBSUB_TOPIC   *next;
+} PUBSUB_TOPIC;
+
+typedef struct _PUBSUB_BUCKET
+{
+    CRITICAL_SECTION        BucketCritSec;
+    PUBSUB_TOPIC           *Topics;
+} PUBSUB_BUCKET;
+
+PUBSUB_BUCKET  *gTopicTable=NULL;
+
+volatile LONG     gTopicCount=0,        // Topics with at least one subscriber
+                  gSubscriptions=0,     // Subscriptions of all clients
+                  gMessagesLive=0;      // Messages not yet freed
+volatile LONGLONG gMessageBytesLive=0;  // Bytes allocated for them
+
+//
+// Function: PubSubInit
+//
+// Description:
+//    Allocates the topic table.
+//
+BOOL PubSubInit()
+{
+    int     i;
+
+    gTopicTable = (PUBSUB_BUCKET *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PUBSUB_BUCKET) * PUBSUB_TABLE_SIZE);
+    if (gTopicTable == NULL)
+    {
+        fprintf(stderr, "PubSubInit: HeapAlloc failed: %d\n", GetLastError());
+        return FALSE;
+    }
+
+    for(i=0; i < PUBSUB_TABLE_SIZE ;i++)
+    {
+        InitializeCriticalSection(&gTopicTable[i].BucketCritSec);
+    }
+    return TRUE;
+}
+
+//
+// Function: TopicBucket
+//
+// Description:
+//    Returns the bucket of a topic name (FNV-1a hash).
+//
+PUBSUB_BUCKET *TopicBucket(char *topic, ULONG len)
+{
+    ULONG   hash=2166136261,
+            i;
+
+    for(i=0; i < len ;i++)
+    {
+        hash ^= (UCHAR)topic[i];
+        hash *= 16777619;
+    }
+    return &gTopicTable[hash % PUBSUB_TABLE_SIZE];
+}
+
+//
+// Function: FindTopic
+//
+// Description:
+//    Looks a topic up in its bucket, which must be locked.
+//
+PUBSUB_TOPIC *FindTopic(PUBSUB_BUCKET *bucket, char *topic, ULONG len)
+{
+    PUBSUB_TOPIC *ptr=NULL;
+
+    for(ptr=bucket->Topics; ptr ;ptr=ptr->next)
+    {
+        if ((ptr->NameLength == len) && (memcmp(ptr->Name, topic, len) == 0))
+            break;
+    }
+    return ptr;
+}
+
+//
+// Function: RemoveSubscriber
+//
+// Description:
+//    Takes a client off a topic's subscriber list and frees the topic if
+//    this was its last subscriber. The topic's bucket must be locked.
+//
+void RemoveSubscriber(PUBSUB_BUCKET *bucket, PUBSUB_TOPIC *topic, PUBSUB_CLIENT *client)
+{
+    PUBSUB_TOPIC **link=NULL;
+    int            i;
+
+    for(i=0; i < topic->SubscriberCount ;i++)
+    {
+        if (topic->Subscribers[i] == client)
+        {
+            // Order doesn't matter, move the last one into the gap
+            topic->Subscribers[i] = topic->Subscribers[--topic->SubscriberCount];
+            InterlockedDecrement(&gSubscriptions);
+            break;
+        }
+    }
+
+    if (topic->SubscriberCount > 0)
+        return;
+
+    for(link=&bucket->Topics; *link != topic ;link=&(*link)->next)
+        ;
+    *link = topic->next;
+
+    InterlockedDecrement(&gTopicCount);
+
+    HeapFree(GetProcessHeap(), 0, topic->Subscribers);
+    HeapFree(GetProcessHeap(), 0, topic);
+}
+
+//
+// Function: PubSubSubscribe
+//
+// Description:
+//    Subscribes a client to a topic, creating the topic if needed. Returns
+//    FALSE if the name is too long, the client has too many subscriptions
+//    or memory is short. Subscribing twice to a topic has no effect. The
+//    calls for one client must not overlap.
+//
+BOOL PubSubSubscribe(PUBSUB_CLIENT *client, char *topic, ULONG len)
+{
+    PUBSUB_BUCKET  *bucket=NULL;
+    PUBSUB_TOPIC   *ptr=NULL;
+    PUBSUB_CLIENT **grown=NULL;
+    BOOL            rc=FALSE;
+    int             i;
+
+    if ((len == 0) || (len > PUBSUB_MAX_TOPIC))
+        return FALSE;
+
+    bucket = TopicBucket(topic, len);
+
+    EnterCriticalSection(&bucket->BucketCritSec);
+
+    ptr = FindTopic(bucket, topic, len);
+
+    // Already subscribed?
+    for(i=0; (ptr) && (i < client->TopicCount) ;i++)
+    {
+        if (client->Topics[i] == ptr)
+        {
+            LeaveCriticalSection(&bucket->BucketCritSec);
+            return TRUE;
+        }
+    }
+    if (client->TopicCount >= PUBSUB_MAX_SUBSCRIPTIONS)
+    {
+        LeaveCriticalSection(&bucket->BucketCritSec);
+        return FALSE;
+    }
+
+    if (ptr == NULL)
+    {
+        ptr = (PUBSUB_TOPIC *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PUBSUB_TOPIC));
+        if (ptr == NULL)
+        {
+            fprintf(stderr, "PubSubSubscribe: HeapAlloc failed: %d\n", GetLastError());
+            LeaveCriticalSection(&bucket->BucketCritSec);
+            return FALSE;
+        }
+        memcpy(ptr->Name, topic, len);
+        ptr->NameLength = len;
+
+        ptr->next       = bucket->Topics;
+        bucket->Topics  = ptr;
+
+        InterlockedIncrement(&gTopicCount);
+    }
+
+    // Grow the subscriber list by doubling
+    if (ptr->SubscriberCount == ptr->SubscriberMax)
+    {
+        if (ptr->Subscribers == NULL)
+            grown = (PUBSUB_CLIENT **)HeapAlloc(GetProcessHeap(), 0, sizeof(PUBSUB_CLIENT *) * 16);
+        else
+            grown = (PUBSUB_CLIENT **)HeapReAlloc(GetProcessHeap(), 0, ptr->Subscribers,
+                    sizeof(PUBSUB_CLIENT *) * ptr->SubscriberMax * 2);
+        if (grown)
+        {
+            ptr->Subscribers   = grown;
+            ptr->SubscriberMax = (ptr->SubscriberMax == 0) ? 16 : ptr->SubscriberMax * 2;
+        }
+    }
+
+    if (ptr->SubscriberCount < ptr->SubscriberMax)
+    {
+        ptr->Subscribers[ptr->SubscriberCount++]  = client;
+        client->Topics[client->TopicCount++]      = ptr;
+
+        InterlockedIncrement(&gSubscriptions);
+        rc = TRUE;
+    }
+    else
+    {
+        fprintf(stderr, "PubSubSubscribe: HeapReAlloc failed: %d\n", GetLastError());
+
+        // Don't leave an empty topic behind
+        if (ptr->SubscriberCount == 0)
+            RemoveSubscriber(bucket, ptr, client);
+    }
+
+    LeaveCriticalSection(&bucket->BucketCritSec);
+
+    return rc;
+}
+
+//
+// Function: PubSubUnsubscribe
+//
+// Description:
+//    Unsubscribes a client from a topic. Once this returns, no message
+//    published to the topic is delivered to the client any more.
+//
+void PubSubUnsubscribe(PUBSUB_CLIENT *client, char *topic, ULONG len)
+{
+    PUBSUB_BUCKET *bucket=NULL;
+    int            i;
+
+    if ((len == 0) || (len > PUBSUB_MAX_TOPIC))
+        return;
+
+    bucket = TopicBucket(topic, len);
+
+    EnterCriticalSection(&bucket->BucketCritSec);
+
+    for(i=0; i < client->TopicCount ;i++)
+    {
+        if ((client->Topics[i]->NameLength == len) &&
+            (memcmp(client->Topics[i]->Name, topic, len) == 0))
+        {
+            RemoveSubscriber(bucket, client->Topics[i], client);
+
+            client->Topics[i] = client->Topics[--client->TopicCount];
+            break;
+        }
+    }
+
+    LeaveCriticalSection(&bucket->BucketCritSec);
+}
+
+//
+// Function: PubSubUnsubscribeAll
+//
+// Description:
+//    Unsubscribes a client from all its topics, e.g. when its connection is
+//    closed. Once this returns no more messages are delivered to it.
+//
+void PubSubUnsubscribeAll(PUBSUB_CLIENT *client)
+{
+    PUBSUB_BUCKET *bucket=NULL;
+    PUBSUB_TOPIC  *topic=NULL;
+
+    while (client->TopicCount > 0)
+    {
+        topic  = client->Topics[--client->TopicCount];
+        bucket = TopicBucket(topic->Name, topic->NameLength);
+
+        EnterCriticalSection(&bucket->BucketCritSec);
+        RemoveSubscriber(bucket, topic, client);
+        LeaveCriticalSection(&bucket->BucketCritSec);
+    }
+}
+
+//
+// Function: PubSubPublish
+//
+// Description:
+//    Calls Deliver with the message for each subscriber of the topic and
+//    returns the number of subscribers. Deliver takes its own references;
+//    the caller still holds (and must release) its own.
+//
+int PubSubPublish(char *topic, ULONG len, PUBSUB_MESSAGE *message, LPPUBSUB_DELIVER Deliver)
+{
+    PUBSUB_BUCKET *bucket=NULL;
+    PUBSUB_TOPIC  *ptr=NULL;
+    int            count=0,
+                   i;
+
+    if ((len == 0) || (len > PUBSUB_MAX_TOPIC))
+        return 0;
+
+    bucket = TopicBucket(topic, len);
+
+    EnterCriticalSection(&bucket->BucketCritSec);
+
+    ptr = FindTopic(bucket, topic, len);
+    if (ptr)
+    {
+        for(i=0; i < ptr->SubscriberCount ;i++)
+        {
+            Deliver(ptr->Subscribers[i], message);
+        }
+        count = ptr->SubscriberCount;
+    }
+
+    LeaveCriticalSection(&bucket->BucketCritSec);
+
+    return count;
+}
+
+//
+// Function: PubSubMessageAlloc
+//
+// Description:
+//    Allocates a message of len bytes with a single reference held by the
+//    caller.
+//
+PUBSUB_MESSAGE *PubSubMessageAlloc(ULONG len)
+{
+    PUBSUB_MESSAGE *message=NULL;
+    ULONG           size;
+
+    size = FIELD_OFFSET(PUBSUB_MESSAGE, Data) + len;
+
+    message = (PUBSUB_MESSAGE *)HeapAlloc(GetProcessHeap(), 0, size);
+    if (message == NULL)
+    {
+        fprintf(stderr, "PubSubMessageAlloc: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+
+    message->RefCount = 1;
+    message->Length   = len;
+
+    InterlockedIncrement(&gMessagesLive);
+    InterlockedExchangeAdd64(&gMessageBytesLive, size);
+
+    return message;
+}
+
+//
+// Function: PubSubMessageAddRef
+//
+// Description:
+//    Takes another reference on a message.
+//
+void PubSubMessageAddRef(PUBSUB_MESSAGE *message)
+{
+    InterlockedIncrement(&message->RefCount);
+}
+
+//
+// Function: PubSubMessageRelease
+//
+// Description:
+//    Drops a reference on a message and frees it with the last one.
+//
+void PubSubMessageRelease(PUBSUB_MESSAGE *message)
+{
+    if (InterlockedDecrement(&message->RefCount) != 0)
+        return;
+
+    InterlockedDecrement(&gMessagesLive);
+    InterlockedExchangeAdd64(&gMessageBytesLive, -(LONGLONG)(FIELD_OFFSET(PUBSUB_MESSAGE, Data) + message->Length));
+
+    HeapFree(GetProcessHeap(), 0, message);
+}
+
+//
+// Function: PubSubGetMemory
+//
+// Description:
+//    Returns the number of messages alive and the bytes allocated for them.
+//
+void PubSubGetMemory(LONG *messages, LONGLONG *bytes)
+{
+    *messages = gMessagesLive;
+    *bytes    = gMessageBytesLive;
+}
+
+//
+// Function: PubSubPrintStatistics
+//
+// Description:
+//    Prints the number of topics and subscriptions.
+//
+void PubSubPrintStatistics()
+{
+    printf("Topics: %ld with %ld subscriptions\n",
+            gTopicCount,
+            gSubscriptions
+            );
+}
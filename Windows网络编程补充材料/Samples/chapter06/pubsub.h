@@ -0,0 +1,88 @@
+//
+// Publish/subscribe routines
+//
+// Files:
+//      pubsub.h        - Header file for the publish/subscribe routines
+//
+// Description:
+//      This file declares the topics of the server's publish/subscribe mode.
+//      Clients subscribe to topics by name; a message published to a topic
+//      is handed to every subscriber through a delivery routine supplied by
+//      the caller.
+//
+//      A published message is held in a single PUBSUB_MESSAGE whatever the
+//      number of subscribers. The message is reference counted with
+//      interlocked operations since its references are dropped by the
+//      subscribers' threads: the delivery routine takes a reference for each
+//      send of the message and the message is freed when the last one is
+//      released.
+//
+//      Topics are kept in a hash table. Each bucket has its own lock which
+//      covers its topics and their subscriber lists, so publishing to one
+//      topic does not hold up the others. The delivery routine is called
+//      with the bucket locked; it must only queue the message and must not
+//      subscribe or unsubscribe. A topic is freed along with its last
+//      subscriber.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _PUBSUB_H_
+#define _PUBSUB_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define PUBSUB_MAX_TOPIC            64      // Longest topic name
+#define PUBSUB_MAX_SUBSCRIPTIONS    16      // Topics a client may subscribe to
+#define PUBSUB_TABLE_SIZE           1024    // Hash buckets of the topic table
+
+struct _PUBSUB_TOPIC;
+
+//
+// The subscriptions of a client. This is embedded in the client's
+//    connection object and zero initialized.
+//
+typedef struct _PUBSUB_CLIENT
+{
+    struct _PUBSUB_TOPIC   *Topics[PUBSUB_MAX_SUBSCRIPTIONS];
+    int                     TopicCount;
+} PUBSUB_CLIENT;
+
+//
+// A published message, encoded as it is sent to the subscribers
+//
+typedef struct _PUBSUB_MESSAGE
+{
+    volatile LONG   RefCount;
+    ULONG           Length;             // Bytes in Data
+    char            Data[1];
+} PUBSUB_MESSAGE;
+
+//
+// Called with each subscriber of a topic a message is published to
+//
+typedef void (*LPPUBSUB_DELIVER)(PUBSUB_CLIENT *client, PUBSUB_MESSAGE *message);
+
+BOOL            PubSubInit();
+BOOL            PubSubSubscribe(PUBSUB_CLIENT *client, char *topic, ULONG len);
+void            PubSubUnsubscribe(PUBSUB_CLIENT *client, char *topic, ULONG len);
+void            PubSubUnsubscribeAll(PUBSUB_CLIENT *client);
+int             PubSubPublish(char *topic, ULONG len, PUBSUB_MESSAGE *message, LPPUBSUB_DELIVER Deliver);
+
+PUBSUB_MESSAGE *PubSubMessageAlloc(ULONG len);
+void            PubSubMessageAddRef(PUBSUB_MESSAGE *message);
+void            PubSubMessageRelease(PUBSUB_MESSAGE *message);
+
+void            PubSubGetMemory(LONG *messages, LONGLONG *bytes);
+void            PubSubPrintStatistics();
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,258 @@
+//
+// Buffer slab routines
+//
+// Files:
+//      slab.cpp        - Buffer slab routines
+//      slab.h          - Header file for the buffer slab routines
+//
+// Description:
+//      This file contains the NUMA local, large page backed slabs the server
+//      allocates its I/O buffers from. See slab.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+SIZE_T        gLargePageSize=0;         // Large page size, 0 if large pages aren't used
+
+volatile LONG gSlabCount=0,             // Slabs allocated
+              gLargePageSlabs=0,        // Slabs whose payloads are in large pages
+              gLargePageFailures=0;     // Large page allocations which fell back to small pages
+
+//
+// Function: EnableLockMemoryPrivilege
+//
+// Description:
+//    Enables SeLockMemoryPrivilege in the process token. Large pages can
+//    only be allocated with this privilege, which the account must have
+//    been granted ("Lock pages in memory").
+//
+BOOL EnableLockMemoryPrivilege()
+{
+    TOKEN_PRIVILEGES    tp;
+    HANDLE              token;
+    BOOL                rc;
+
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token) == FALSE)
+    {
+        fprintf(stderr, "EnableLockMemoryPrivilege: OpenProcessToken failed: %d\n", GetLastError());
+        return FALSE;
+    }
+
+    tp.PrivilegeCount           = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    rc = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid);
+    if (rc == FALSE)
+    {
+        fprintf(stderr, "EnableLockMemoryPrivilege: LookupPrivilegeValue failed: %d\n", GetLastError());
+    }
+    else
+    {
+        // AdjustTokenPrivileges succeeds even if the privilege wasn't granted
+        rc = AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL);
+        if ((rc == FALSE) || (GetLastError() == ERROR_NOT_ALL_ASSIGNED))
+        {
+            fprintf(stderr, "EnableLockMemoryPrivilege: SeLockMemoryPrivilege not held\n");
+            rc = FALSE;
+        }
+    }
+
+    CloseHandle(token);
+
+    return rc;
+}
+
+//
+// Function: SlabInit
+//
+// Description:
+//    Initializes the slab routines. If bLargePages is set, the payloads of
+//    the slabs are allocated in large pages when possible; otherwise (or if
+//    the process can't use large pages) they are in ordinary pages.
+//
+BOOL SlabInit(BOOL bLargePages)
+{
+    gLargePageSize = 0;
+
+    if (bLargePages == FALSE)
+        return TRUE;
+
+    if (GetLargePageMinimum() == 0)
+    {
+        fprintf(stderr, "SlabInit: large pages are not supported\n");
+        return FALSE;
+    }
+    if (EnableLockMemoryPrivilege() == FALSE)
+    {
+        return FALSE;
+    }
+
+    gLargePageSize = GetLargePageMinimum();
+
+    return TRUE;
+}
+
+//
+// Function: SlabCurrentNode
+//
+// Description:
+//    Returns the NUMA node of the processor the calling thread runs on.
+//
+ULONG SlabCurrentNode()
+{
+    PROCESSOR_NUMBER processor;
+    USHORT           node;
+
+    // The group aware calls also work past the first 64 processors
+    GetCurrentProcessorNumberEx(&processor);
+    if (GetNumaProcessorNodeEx(&processor, &node) == FALSE)
+        return 0;
+
+    if (node >= SLAB_MAX_NODES)
+        return 0;
+
+    return node;
+}
+
+//
+// Function: SlabCreate
+//
+// Description:
+//    Allocates a slab of objects with the given header and payload sizes on
+//    a NUMA node. The slab holds as many objects as fit in SLAB_PAYLOAD_BYTES
+//    of payload (at least one).
+//
+BUFFER_SLAB *SlabCreate(ULONG HeaderSize, ULONG PayloadSize, ULONG Node)
+{
+    BUFFER_SLAB *slab=NULL;
+    SIZE_T       bytes;
+
+    slab = (BUFFER_SLAB *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BUFFER_SLAB));
+    if (slab == NULL)
+    {
+        fprintf(stderr, "SlabCreate: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+
+    slab->Node          = Node;
+    slab->HeaderStride  = (HeaderSize + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+    slab->PayloadStride = (PayloadSize + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+    if (slab->PayloadStride == 0)
+        slab->PayloadStride = SLAB_CACHE_LINE;
+
+    bytes = SLAB_PAYLOAD_BYTES;
+    if (bytes < slab->PayloadStride)
+        bytes = slab->PayloadStride;
+
+    if (gLargePageSize > 0)
+    {
+        // Large page allocations must be a multiple of the large page size
+        bytes = (bytes + gLargePageSize - 1) & ~(gLargePageSize - 1);
+
+        slab->Payloads = (char *)VirtualAllocExNuma(
+                GetCurrentProcess(),
+                NULL,
+                bytes,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                PAGE_READWRITE,
+                Node
+                );
+        if (slab->Payloads)
+        {
+            slab->bLargePages = TRUE;
+            InterlockedIncrement(&gLargePageSlabs);
+        }
+        else
+        {
+            // Physical memory is too fragmented for large pages
+            InterlockedIncrement(&gLargePageFailures);
+        }
+    }
+
+    if (slab->Payloads == NULL)
+    {
+        slab->Payloads = (char *)VirtualAllocExNuma(
+                GetCurrentProcess(),
+                NULL,
+                bytes,
+                MEM_RESERVE | MEM_COMMIT,
+                PAGE_READWRITE,
+                Node
+                );
+        if (slab->Payloads == NULL)
+        {
+            fprintf(stderr, "SlabCreate: VirtualAllocExNuma failed: %d\n", GetLastError());
+            HeapFree(GetProcessHeap(), 0, slab);
+            return NULL;
+        }
+    }
+
+    slab->PayloadBytes = bytes;
+    slab->Count        = (ULONG)(bytes / slab->PayloadStride);
+
+    // The headers are small and hot so they are kept apart from the data
+    slab->Headers = (char *)VirtualAllocExNuma(
+            GetCurrentProcess(),
+            NULL,
+            (SIZE_T)slab->Count * slab->HeaderStride,
+            MEM_RESERVE | MEM_COMMIT,
+            PAGE_READWRITE,
+            Node
+            );
+    if (slab->Headers == NULL)
+    {
+        fprintf(stderr, "SlabCreate: VirtualAllocExNuma failed: %d\n", GetLastError());
+        VirtualFree(slab->Payloads, 0, MEM_RELEASE);
+        HeapFree(GetProcessHeap(), 0, slab);
+        return NULL;
+    }
+
+    InterlockedIncrement(&gSlabCount);
+
+    return slab;
+}
+
+//
+// Function: SlabCarve
+//
+// Description:
+//    Returns the header and payload of the next unused object in the slab.
+//    Returns FALSE if the slab is used up. The caller serializes access to
+//    the slab.
+//
+BOOL SlabCarve(BUFFER_SLAB *slab, void **Header, char **Payload)
+{
+    if (slab->Used >= slab->Count)
+        return FALSE;
+
+    *Header  = slab->Headers  + ((SIZE_T)slab->Used * slab->HeaderStride);
+    *Payload = slab->Payloads + ((SIZE_T)slab->Used * slab->PayloadStride);
+
+    slab->Used++;
+
+    return TRUE;
+}
+
+//
+// Function: SlabPrintStatistics
+//
+// Description:
+//    Prints how many slabs have been allocated and how many are in large pages.
+//
+void SlabPrintStatistics()
+{
+    printf("Buffer slabs: %lu (%lu in large pages, %lu large page failures)\n",
+            gSlabCount,
+            gLargePageSlabs,
+            gLargePageFailures
+            );
+}
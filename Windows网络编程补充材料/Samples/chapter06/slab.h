@@ -0,0 +1,66 @@
+//
+// Buffer slab routines
+//
+// Files:
+//      slab.h          - Header file for the buffer slab routines
+//
+// Description:
+//      This file declares the slabs the server carves its I/O buffers from.
+//      A slab is a dense array of object headers together with a separate,
+//      contiguous region holding one payload per header. Both are allocated
+//      on a given NUMA node. The payload region is backed by large pages
+//      when these are available, which cuts the number of TLB entries the
+//      data needs and keeps it locked in memory so the pages never have to
+//      be faulted back in for an I/O.
+//
+//      Headers and payloads are each padded to a whole number of cache
+//      lines so that objects used by different threads never share one.
+//
+//      Slabs are never freed. Objects carved from them are recycled by the
+//      caller.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define SLAB_CACHE_LINE         64
+#define SLAB_PAYLOAD_BYTES      (2 * 1024 * 1024)   // Payload bytes per slab (rounded to large pages)
+#define SLAB_MAX_NODES          64                  // NUMA nodes slabs are kept for
+
+typedef struct _BUFFER_SLAB
+{
+    char               *Headers,        // Count headers of HeaderStride bytes
+                       *Payloads;       // Count payloads of PayloadStride bytes
+
+    ULONG               HeaderStride,
+                        PayloadStride,
+                        Count,          // Objects in the slab
+                        Used;           // Objects carved so far
+
+    SIZE_T              PayloadBytes;   // Size of the payload region
+    ULONG               Node;           // NUMA node the slab is allocated on
+    BOOL                bLargePages;    // Is the payload region in large pages?
+
+    struct _BUFFER_SLAB *next;
+} BUFFER_SLAB;
+
+BOOL         SlabInit(BOOL bLargePages);
+ULONG        SlabCurrentNode();
+BUFFER_SLAB *SlabCreate(ULONG HeaderSize, ULONG PayloadSize, ULONG Node);
+BOOL         SlabCarve(BUFFER_SLAB *slab, void **Header, char **Payload);
+void         SlabPrintStatistics();
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
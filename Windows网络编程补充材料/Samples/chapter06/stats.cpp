@@ -0,0 +1,301 @@
+//
+// Server statistics routines
+//
+// Files:
+//      stats.cpp       - Server statistics routines
+//      stats.h         - Header file for the statistics routines
+//
+// Description:
+//      This file contains the per-thread counters and latency histograms
+//      used by the server. See stats.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <windows.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+THREAD_STATS *gThreadStats[MAX_STATS_THREADS];  // Statistics of each registered thread
+volatile LONG gThreadStatsCount=0;              // Number of registered threads
+
+LARGE_INTEGER gStatsFrequency;                  // Performance counter ticks per second
+
+__declspec(thread) THREAD_STATS *tStats=NULL;   // Statistics of the calling thread
+
+//
+// Function: StatsInit
+//
+// Description:
+//    Initializes the statistics. Must be called before any other thread
+//    updates a counter or records a latency.
+//
+void StatsInit()
+{
+    QueryPerformanceFrequency(&gStatsFrequency);
+}
+
+//
+// Function: GetThreadStats
+//
+// Description:
+//    Returns the statistics block of the calling thread, allocating and
+//    registering it on first use.
+//
+THREAD_STATS *GetThreadStats()
+{
+    LONG    slot;
+
+    if (tStats == NULL)
+    {
+        slot = InterlockedIncrement(&gThreadStatsCount) - 1;
+        if (slot >= MAX_STATS_THREADS)
+        {
+            fprintf(stderr, "GetThreadStats: too many threads\n");
+            ExitProcess(-1);
+        }
+
+        // VirtualAlloc returns zeroed, page aligned memory so no other thread's
+        //    statistics share a cache line with this one
+        tStats = (THREAD_STATS *)VirtualAlloc(NULL, sizeof(THREAD_STATS), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (tStats == NULL)
+        {
+            fprintf(stderr, "GetThreadStats: VirtualAlloc failed: %d\n", GetLastError());
+            ExitProcess(-1);
+        }
+
+        gThreadStats[slot] = tStats;
+    }
+    return tStats;
+}
+
+//
+// Function: StatsAdd
+//
+// Description:
+//    Adds the value to one of the calling thread's counters.
+//
+void StatsAdd(int counter, ULONGLONG value)
+{
+    GetThreadStats()->Counters[counter] += value;
+}
+
+//
+// Function: StatsRead
+//
+// Description:
+//    Returns the sum of the counter over all threads.
+//
+ULONGLONG StatsRead(int counter)
+{
+    ULONGLONG   total;
+    LONG        count,
+                i;
+
+    total = 0;
+    count = gThreadStatsCount;
+    if (count > MAX_STATS_THREADS)
+        count = MAX_STATS_THREADS;
+    for(i=0; i < count ;i++)
+    {
+        if (gThreadStats[i])
+            total += gThreadStats[i]->Counters[counter];
+    }
+    return total;
+}
+
+//
+// Function: StatsTimestamp
+//
+// Description:
+//    Returns the current time in performance counter ticks. Operations
+//    save this when posted and pass it to StatsRecordLatency on completion.
+//
+LONGLONG StatsTimestamp()
+{
+    LARGE_INTEGER   now;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+//
+// Function: HistogramIndex
+//
+// Description:
+//    Returns the histogram bucket for a value in microseconds.
+//
+int HistogramIndex(ULONGLONG value)
+{
+    unsigned long   msb;
+    int             shift;
+
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+
+    if (value >= ((ULONGLONG)1 << (HISTOGRAM_MAX_BITS + 1)))
+        value = ((ULONGLONG)1 << (HISTOGRAM_MAX_BITS + 1)) - 1;
+
+    if ((value >> 32) != 0)
+    {
+        _BitScanReverse(&msb, (unsigned long)(value >> 32));
+        msb += 32;
+    }
+    else
+    {
+        _BitScanReverse(&msb, (unsigned long)value);
+    }
+
+    // Keep the top HISTOGRAM_SUB_BITS+1 bits of the value
+    shift = msb - HISTOGRAM_SUB_BITS;
+
+    return ((shift + 1) * HISTOGRAM_SUB_BUCKETS) +
+           (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+//
+// Function: HistogramValue
+//
+// Description:
+//    Returns the largest value in microseconds recorded in the given bucket.
+//
+ULONGLONG HistogramValue(int index)
+{
+    int     shift;
+
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    shift = (index / HISTOGRAM_SUB_BUCKETS) - 1;
+
+    return ((ULONGLONG)((index % HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+//
+// Function: StatsRecordLatency
+//
+// Description:
+//    Records the time elapsed since StartTime (see StatsTimestamp) in one of
+//    the calling thread's histograms.
+//
+void StatsRecordLatency(int histogram, LONGLONG StartTime)
+{
+    LONGLONG    elapsed;
+
+    elapsed = StatsTimestamp() - StartTime;
+    if (elapsed < 0)
+        elapsed = 0;
+
+    GetThreadStats()->Histograms[histogram][HistogramIndex((elapsed * 1000000) / gStatsFrequency.QuadPart)]++;
+}
+
+//
+// Function: GetPercentiles
+//
+// Description:
+//    Sums the histogram over all threads and returns the number of values
+//    recorded along with the 50th, 90th, 99th and 99.9th percentiles and
+//    the maximum (in microseconds).
+//
+ULONGLONG GetPercentiles(int histogram, ULONGLONG *percentiles)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    ULONGLONG   buckets[HISTOGRAM_BUCKETS],
+                total,
+                seen;
+    LONG        count,
+                i;
+    int         j,
+                q;
+
+    memset(buckets, 0, sizeof(buckets));
+
+    total = 0;
+    count = gThreadStatsCount;
+    if (count > MAX_STATS_THREADS)
+        count = MAX_STATS_THREADS;
+    for(i=0; i < count ;i++)
+    {
+        if (gThreadStats[i] == NULL)
+            continue;
+
+        for(j=0; j < HISTOGRAM_BUCKETS ;j++)
+        {
+            buckets[j] += gThreadStats[i]->Histograms[histogram][j];
+            total      += gThreadStats[i]->Histograms[histogram][j];
+        }
+    }
+
+    memset(percentiles, 0, sizeof(ULONGLONG) * 5);
+    if (total == 0)
+        return 0;
+
+    seen = 0;
+    q    = 0;
+    for(j=0; (j < HISTOGRAM_BUCKETS) && (q < 5) ;j++)
+    {
+        seen += buckets[j];
+        while ((q < 5) && (seen > 0) && (seen >= (ULONGLONG)(quantiles[q] * total)))
+        {
+            percentiles[q++] = HistogramValue(j);
+        }
+    }
+    return total;
+}
+
+//
+// Function: StatsPrintLatency
+//
+// Description:
+//    Prints the percentiles of a latency histogram.
+//
+void StatsPrintLatency(int histogram, char *name)
+{
+    ULONGLONG   percentiles[5],
+                total;
+
+    total = GetPercentiles(histogram, percentiles);
+
+    printf("%s latency (us): count %I64u p50 %I64u p90 %I64u p99 %I64u p99.9 %I64u max %I64u\n",
+            name,
+            total,
+            percentiles[0],
+            percentiles[1],
+            percentiles[2],
+            percentiles[3],
+            percentiles[4]
+            );
+}
+
+//
+// Function: StatsWriteLatency
+//
+// Description:
+//    Writes the percentiles of a latency histogram as a comma separated
+//    line: elapsed seconds, name, count, p50, p90, p99, p99.9, max.
+//
+void StatsWriteLatency(FILE *fp, ULONG elapsed, int histogram, char *name)
+{
+    ULONGLONG   percentiles[5],
+                total;
+
+    total = GetPercentiles(histogram, percentiles);
+
+    fprintf(fp, "%lu,%s,%I64u,%I64u,%I64u,%I64u,%I64u,%I64u\n",
+            elapsed,
+            name,
+            total,
+            percentiles[0],
+            percentiles[1],
+            percentiles[2],
+            percentiles[3],
+            percentiles[4]
+            );
+}
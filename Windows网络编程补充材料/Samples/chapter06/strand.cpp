@@ -0,0 +1,154 @@
+//
+// Strand routines
+//
+// Files:
+//      strand.cpp      - Strand routines
+//      strand.h        - Header file for the strand routines
+//
+// Description:
+//      This file contains the strands used by the server to serialize the
+//      work done on a connection. See strand.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "strand.h"
+
+//
+// Function: StrandInit
+//
+// Description:
+//    Initializes an idle, empty strand.
+//
+void StrandInit(STRAND *strand)
+{
+    InitializeSListHead(&strand->Queue);
+
+    strand->Pending   = 0;
+    strand->bReleased = FALSE;
+}
+
+//
+// Function: StrandWorkInit
+//
+// Description:
+//    Initializes a work item which calls Routine when it is run.
+//
+void StrandWorkInit(STRAND_WORK *work, LPSTRAND_ROUTINE Routine)
+{
+    work->Entry.Next = NULL;
+    work->Routine    = Routine;
+}
+
+//
+// Function: StrandPost
+//
+// Description:
+//    Queues a work item on the strand. Returns TRUE if the strand was idle,
+//    in which case the caller now owns it and must call StrandRun (or have
+//    another thread call it). The item is counted before it is queued so
+//    the owner never stops while a post is half done.
+//
+BOOL StrandPost(STRAND *strand, STRAND_WORK *work)
+{
+    BOOL    bOwner;
+
+    bOwner = (InterlockedIncrement(&strand->Pending) == 1);
+
+    InterlockedPushEntrySList(&strand->Queue, &work->Entry);
+
+    return bOwner;
+}
+
+//
+// Function: StrandRun
+//
+// Description:
+//    Runs the work queued on the strand until no more is pending. Must only
+//    be called by the owner (see StrandPost). Returns TRUE if the strand was
+//    released, after which the caller must not touch it again except to free
+//    the object holding it.
+//
+BOOL StrandRun(STRAND *strand)
+{
+    SLIST_ENTRY *entry=NULL,
+                *next=NULL,
+                *batch=NULL;
+    STRAND_WORK *work=NULL;
+    LONG         done;
+    BOOL         bReleased;
+
+    while (1)
+    {
+        // Work is pushed LIFO so reverse it to run it in the order posted
+        entry = InterlockedFlushSList(&strand->Queue);
+
+        batch = NULL;
+        while (entry)
+        {
+            next        = entry->Next;
+            entry->Next = batch;
+            batch       = entry;
+            entry       = next;
+        }
+
+        done = 0;
+        while (batch)
+        {
+            next = batch->Next;
+            work = CONTAINING_RECORD(batch, STRAND_WORK, Entry);
+
+            work->Routine(work);
+            done++;
+
+            batch = next;
+        }
+
+        // Read this while the strand is still ours
+        bReleased = strand->bReleased;
+
+        if (InterlockedExchangeAdd(&strand->Pending, -done) == done)
+            break;
+
+        // Another thread counted an item and is about to queue it
+        if (done == 0)
+            YieldProcessor();
+    }
+
+    return bReleased;
+}
+
+//
+// Function: StrandDispatch
+//
+// Description:
+//    Posts a work item and, if the strand was idle, runs it on the calling
+//    thread along with anything queued behind it. Returns TRUE if the strand
+//    was released (see StrandRun).
+//
+BOOL StrandDispatch(STRAND *strand, STRAND_WORK *work)
+{
+    if (StrandPost(strand, work) == FALSE)
+        return FALSE;
+
+    return StrandRun(strand);
+}
+
+//
+// Function: StrandRelease
+//
+// Description:
+//    Called from a work item to indicate that nothing more will be posted to
+//    the strand. StrandRun returns TRUE once the work already queued is done.
+//
+void StrandRelease(STRAND *strand)
+{
+    strand->bReleased = TRUE;
+}
@@ -0,0 +1,70 @@
+//
+// Strand routines
+//
+// Files:
+//      strand.h        - Header file for the strand routines
+//
+// Description:
+//      This file declares a strand: a queue of work items which are run one
+//      at a time, in the order they were posted, without any lock. Whichever
+//      thread posts to an idle strand becomes its owner and runs the work
+//      until the queue is empty; a thread posting to a busy strand just
+//      queues the item and leaves it to the owner. Everything that touches
+//      the state guarded by a strand must run as one of its work items.
+//
+//      The owner may release the strand from within a work item, meaning
+//      that no more work will be posted to it. StrandRun then reports the
+//      release once the queue is drained and the caller can free the object
+//      holding the strand.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _STRAND_H_
+#define _STRAND_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+struct _STRAND_WORK;
+
+//
+// Called to run a work item on its strand
+//
+typedef void (*LPSTRAND_ROUTINE)(struct _STRAND_WORK *work);
+
+//
+// A work item. This is embedded in the object it operates on and may be
+//    posted again as soon as its routine has been called.
+//
+typedef struct _STRAND_WORK
+{
+    SLIST_ENTRY         Entry;          // Link in the strand's queue
+
+    LPSTRAND_ROUTINE    Routine;
+} STRAND_WORK;
+
+typedef struct _STRAND
+{
+    SLIST_HEADER        Queue;          // Work posted but not yet run (LIFO)
+
+    volatile LONG       Pending;        // Work posted but not yet finished
+    BOOL                bReleased;      // No more work will be posted
+} STRAND;
+
+void StrandInit(STRAND *strand);
+void StrandWorkInit(STRAND_WORK *work, LPSTRAND_ROUTINE Routine);
+BOOL StrandPost(STRAND *strand, STRAND_WORK *work);
+BOOL StrandRun(STRAND *strand);
+BOOL StrandDispatch(STRAND *strand, STRAND_WORK *work);
+void StrandRelease(STRAND *strand);
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+//
+// Timer wheel routines
+//
+// Files:
+//      timer.cpp       - Timer wheel routines
+//      timer.h         - Header file for the timer wheel routines
+//
+// Description:
+//      This file contains the hierarchical timing wheel used by the server
+//      to time out connections. See timer.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+//
+// Function: TimerWheelCreate
+//
+// Description:
+//    Creates a timer wheel which advances every TickMs milliseconds.
+//
+TIMER_WHEEL *TimerWheelCreate(ULONG TickMs)
+{
+    TIMER_WHEEL *wheel=NULL;
+    TIMER       *head=NULL;
+    int          level,
+                 i;
+
+    wheel = (TIMER_WHEEL *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TIMER_WHEEL));
+    if (wheel == NULL)
+    {
+        fprintf(stderr, "TimerWheelCreate: HeapAlloc failed: %d\n", GetLastError());
+        return NULL;
+    }
+
+    InitializeCriticalSection(&wheel->WheelCritSec);
+
+    wheel->TickMs      = (TickMs > 0) ? TickMs : 1;
+    wheel->CurrentTime = GetTickCount();
+
+    // Each slot is an empty circular list
+    for(level=0; level < TIMER_WHEEL_LEVELS ;level++)
+    {
+        for(i=0; i < TIMER_WHEEL_SLOTS ;i++)
+        {
+            head = &wheel->Slots[level][i];
+            head->next = head->prev = head;
+        }
+    }
+
+    return wheel;
+}
+
+//
+// Function: TimerInit
+//
+// Description:
+//    Initializes a disarmed timer which calls Routine when it expires.
+//
+void TimerInit(TIMER *timer, LPTIMER_ROUTINE Routine)
+{
+    timer->next    = NULL;
+    timer->prev    = NULL;
+    timer->Expires = 0;
+    timer->Routine = Routine;
+}
+
+//
+// Function: UnlinkTimer
+//
+// Description:
+//    Removes a timer from the slot it is in.
+//
+void UnlinkTimer(TIMER *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    timer->next = timer->prev = NULL;
+}
+
+//
+// Function: InsertTimer
+//
+// Description:
+//    Places a timer in the slot covering its expiration. Timers further out
+//    than the wheel's range are clamped to its end. Must be called with the
+//    wheel locked.
+//
+void InsertTimer(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    TIMER  *head=NULL;
+    ULONG   delta;
+    int     level;
+
+    delta = timer->Expires - wheel->CurrentTick;
+    if ((LONG)delta < 0)
+    {
+        // Already due, expire it on the next tick processed
+        timer->Expires = wheel->CurrentTick;
+        delta = 0;
+    }
+    else if (delta >= ((ULONG)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+    {
+        delta = ((ULONG)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        timer->Expires = wheel->CurrentTick + delta;
+    }
+
+    level = 0;
+    while ((level < TIMER_WHEEL_LEVELS - 1) &&
+           (delta >= ((ULONG)1 << (TIMER_WHEEL_BITS * (level + 1)))))
+    {
+        level++;
+    }
+
+    head = &wheel->Slots[level][(timer->Expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+    timer->next       = head;
+    timer->prev       = head->prev;
+    head->prev->next  = timer;
+    head->prev        = timer;
+}
+
+//
+// Function: DetachSlot
+//
+// Description:
+//    Moves all the timers of a slot onto the list headed by list.
+//
+void DetachSlot(TIMER *head, TIMER *list)
+{
+    if (head->next == head)
+    {
+        list->next = list->prev = list;
+        return;
+    }
+
+    list->next       = head->next;
+    list->prev       = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+
+    head->next = head->prev = head;
+}
+
+//
+// Function: TimerArm
+//
+// Description:
+//    Arms the timer to expire in DelayMs milliseconds (rounded up to whole
+//    ticks). If the timer is already armed it is rescheduled.
+//
+void TimerArm(TIMER_WHEEL *wheel, TIMER *timer, ULONG DelayMs)
+{
+    EnterCriticalSection(&wheel->WheelCritSec);
+
+    if (timer->next)
+    {
+        UnlinkTimer(timer);
+        InterlockedDecrement(&wheel->Armed);
+    }
+
+    timer->Expires = wheel->CurrentTick + ((DelayMs + wheel->TickMs - 1) / wheel->TickMs);
+
+    InsertTimer(wheel, timer);
+    InterlockedIncrement(&wheel->Armed);
+
+    LeaveCriticalSection(&wheel->WheelCritSec);
+}
+
+//
+// Function: TimerCancel
+//
+// Description:
+//    Disarms the timer. Once this returns the timer's routine is not running
+//    and will not be called.
+//
+void TimerCancel(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    EnterCriticalSection(&wheel->WheelCritSec);
+
+    if (timer->next)
+    {
+        UnlinkTimer(timer);
+        InterlockedDecrement(&wheel->Armed);
+    }
+
+    LeaveCriticalSection(&wheel->WheelCritSec);
+}
+
+//
+// Function: TimerWheelAdvance
+//
+// Description:
+//    Processes every tick that has elapsed since the last call and calls the
+//    routines of the timers which expired. If another thread is already
+//    advancing the wheel this returns immediately. Returns the number of
+//    timers which expired.
+//
+int TimerWheelAdvance(TIMER_WHEEL *wheel)
+{
+    TIMER   list,
+           *timer=NULL;
+    ULONG   now,
+            tick,
+            delay;
+    int     expired,
+            level;
+
+    now = GetTickCount();
+
+    if (now - wheel->CurrentTime < wheel->TickMs)
+        return 0;
+
+    if (TryEnterCriticalSection(&wheel->WheelCritSec) == FALSE)
+        return 0;
+
+    expired = 0;
+    while (now - wheel->CurrentTime >= wheel->TickMs)
+    {
+        tick = wheel->CurrentTick;
+
+        // When a level wraps around, the timers of the next slot of the level
+        //    above are redistributed into it
+        for(level=1; level < TIMER_WHEEL_LEVELS ;level++)
+        {
+            if (((tick >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) != 0)
+                break;
+
+            DetachSlot(&wheel->Slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], &list);
+            while (list.next != &list)
+            {
+                timer = list.next;
+                UnlinkTimer(timer);
+                InsertTimer(wheel, timer);
+            }
+        }
+
+        // Expire the timers of this tick
+        DetachSlot(&wheel->Slots[0][tick & TIMER_WHEEL_MASK], &list);
+        while (list.next != &list)
+        {
+            timer = list.next;
+            UnlinkTimer(timer);
+
+            InterlockedDecrement(&wheel->Armed);
+            InterlockedIncrement(&wheel->Expired);
+            expired++;
+
+            delay = timer->Routine(timer);
+            if (delay > 0)
+            {
+                timer->Expires = tick + ((delay + wheel->TickMs - 1) / wheel->TickMs);
+
+                InsertTimer(wheel, timer);
+                InterlockedIncrement(&wheel->Armed);
+            }
+        }
+
+        wheel->CurrentTick++;
+        wheel->CurrentTime += wheel->TickMs;
+    }
+
+    LeaveCriticalSection(&wheel->WheelCritSec);
+
+    return expired;
+}
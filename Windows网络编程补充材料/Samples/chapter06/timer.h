@@ -0,0 +1,87 @@
+//
+// Timer wheel routines
+//
+// Files:
+//      timer.h         - Header file for the timer wheel routines
+//
+// Description:
+//      This file declares a hierarchical timing wheel. Time advances in
+//      ticks of a fixed number of milliseconds. The first level holds one
+//      slot per tick for the next TIMER_WHEEL_SLOTS ticks; each further level
+//      covers TIMER_WHEEL_SLOTS times the range of the one below it. A timer
+//      is placed in the level which covers its expiration and moved down
+//      (cascaded) as its expiration comes into range of the lower level.
+//      Arming and cancelling a timer is O(1) as is expiring it (each timer
+//      is cascaded at most once per level).
+//
+//      The wheel is not serviced by a thread of its own. Whoever owns it
+//      calls TimerWheelAdvance periodically (the completion threads do this
+//      after each batch of completions) and expired timers are called back
+//      from there.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      4       // Range is TIMER_WHEEL_SLOTS^4 ticks
+
+struct _TIMER;
+
+//
+// Called when a timer expires. Returns the number of milliseconds after
+//    which the timer should expire again or 0 to leave it disarmed. The
+//    routine is called with the wheel locked so it must not arm or cancel
+//    any timer itself.
+//
+typedef ULONG (*LPTIMER_ROUTINE)(struct _TIMER *timer);
+
+//
+// A timer. This is embedded in the object it times.
+//
+typedef struct _TIMER
+{
+    struct _TIMER  *next,               // Links in the wheel slot (NULL if disarmed)
+                   *prev;
+
+    ULONG           Expires;            // Tick at which the timer expires
+
+    LPTIMER_ROUTINE Routine;
+} TIMER;
+
+typedef struct _TIMER_WHEEL
+{
+    CRITICAL_SECTION WheelCritSec;      // Protects the slots
+
+    ULONG           TickMs,             // Milliseconds per tick
+                    CurrentTick;        // Next tick to be processed
+    volatile ULONG  CurrentTime;        // GetTickCount of CurrentTick
+
+    volatile LONG   Armed,              // Timers currently armed
+                    Expired;            // Timers which have expired
+
+    TIMER           Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads
+} TIMER_WHEEL;
+
+TIMER_WHEEL *TimerWheelCreate(ULONG TickMs);
+void         TimerInit(TIMER *timer, LPTIMER_ROUTINE Routine);
+void         TimerArm(TIMER_WHEEL *wheel, TIMER *timer, ULONG DelayMs);
+void         TimerCancel(TIMER_WHEEL *wheel, TIMER *timer);
+int          TimerWheelAdvance(TIMER_WHEEL *wheel);
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif
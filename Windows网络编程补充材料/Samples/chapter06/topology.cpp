@@ -0,0 +1,254 @@
+//
+// Worker topology routines
+//
+// Files:
+//      topology.cpp    - Worker topology routines
+//      topology.h      - Header file for the worker topology routines
+//
+// Description:
+//      This file contains the routines which enumerate the processors and
+//      NUMA nodes of the system and place the completion threads on them.
+//      See topology.h.
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#include <winsock2.h>
+#include <mstcpip.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "topology.h"
+
+TOPOLOGY_CPU gCpus[TOPOLOGY_MAX_CPUS];  // Processors by index
+int          gCpuCount=0;
+
+int          gGroupBase[TOPOLOGY_MAX_CPUS / 64],    // Index of each group's processor 0
+             gGroupCount=0;
+
+//
+// Function: TopologyInit
+//
+// Description:
+//    Enumerates the active processors of all processor groups along with
+//    their NUMA nodes. Returns the number of processors.
+//
+int TopologyInit()
+{
+    WORD    group;
+    DWORD   count,
+            i;
+    USHORT  node;
+
+    gCpuCount   = 0;
+    gGroupCount = GetActiveProcessorGroupCount();
+    if (gGroupCount > TOPOLOGY_MAX_CPUS / 64)
+        gGroupCount = TOPOLOGY_MAX_CPUS / 64;
+
+    for(group=0; group < gGroupCount ;group++)
+    {
+        gGroupBase[group] = gCpuCount;
+
+        count = GetActiveProcessorCount(group);
+        for(i=0; (i < count) && (gCpuCount < TOPOLOGY_MAX_CPUS) ;i++)
+        {
+            gCpus[gCpuCount].Processor.Group     = group;
+            gCpus[gCpuCount].Processor.Number    = (BYTE)i;
+            gCpus[gCpuCount].Processor.Reserved  = 0;
+
+            if (GetNumaProcessorNodeEx(&gCpus[gCpuCount].Processor, &node) == FALSE)
+                node = 0;
+            gCpus[gCpuCount].Node = node;
+
+            gCpuCount++;
+        }
+    }
+
+    return gCpuCount;
+}
+
+//
+// Function: TopologyCpuCount
+//
+// Description:
+//    Returns the number of processors found by TopologyInit.
+//
+int TopologyCpuCount()
+{
+    return gCpuCount;
+}
+
+//
+// Function: TopologyCpuIndex
+//
+// Description:
+//    Returns the index of a processor, or -1 if it is unknown.
+//
+int TopologyCpuIndex(PROCESSOR_NUMBER *Processor)
+{
+    int     index;
+
+    if (Processor->Group >= gGroupCount)
+        return -1;
+
+    index = gGroupBase[Processor->Group] + Processor->Number;
+    if ((index >= gCpuCount) || (gCpus[index].Processor.Group != Processor->Group))
+        return -1;
+
+    return index;
+}
+
+//
+// Function: TopologyGetCpu
+//
+// Description:
+//    Returns the processor with the given index.
+//
+BOOL TopologyGetCpu(int index, TOPOLOGY_CPU *cpu)
+{
+    if ((index < 0) || (index >= gCpuCount))
+        return FALSE;
+
+    *cpu = gCpus[index];
+
+    return TRUE;
+}
+
+//
+// Function: TopologyParseCpuList
+//
+// Description:
+//    Parses a list of processor indexes and ranges such as "0-7,16,18-19"
+//    into indexes. Returns the number of processors in the list, or -1 if
+//    the list is malformed or names a processor which doesn't exist.
+//
+int TopologyParseCpuList(char *list, int *indexes, int max)
+{
+    char   *ptr=list,
+           *end=NULL;
+    long    first,
+            last;
+    int     count=0;
+
+    while (*ptr)
+    {
+        first = strtol(ptr, &end, 10);
+        if (end == ptr)
+            return -1;
+
+        last = first;
+        ptr  = end;
+        if (*ptr == '-')
+        {
+            ptr++;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr)
+                return -1;
+            ptr = end;
+        }
+
+        if ((first < 0) || (last < first) || (last >= gCpuCount))
+        {
+            fprintf(stderr, "TopologyParseCpuList: no processor %ld\n", last);
+            return -1;
+        }
+
+        while ((first <= last) && (count < max))
+        {
+            indexes[count++] = first++;
+        }
+
+        if (*ptr == ',')
+            ptr++;
+        else if (*ptr != '\0')
+            return -1;
+    }
+
+    return count;
+}
+
+//
+// Function: TopologyPlaceThread
+//
+// Description:
+//    Places a thread on the processor with the given index: pinned to it
+//    (PLACE_CPU, PLACE_RSS) or bound to its NUMA node (PLACE_NODE). The
+//    processor is made the thread's ideal processor in either case.
+//
+BOOL TopologyPlaceThread(HANDLE thread, int index, int mode)
+{
+    GROUP_AFFINITY  affinity;
+
+    if ((mode == PLACE_NONE) || (index < 0) || (index >= gCpuCount))
+        return TRUE;
+
+    memset(&affinity, 0, sizeof(affinity));
+
+    if (mode == PLACE_NODE)
+    {
+        // A node never spans processor groups
+        if (GetNumaNodeProcessorMaskEx(gCpus[index].Node, &affinity) == FALSE)
+        {
+            fprintf(stderr, "TopologyPlaceThread: GetNumaNodeProcessorMaskEx failed: %d\n",
+                    GetLastError());
+            return FALSE;
+        }
+    }
+    else
+    {
+        affinity.Group = gCpus[index].Processor.Group;
+        affinity.Mask  = ((ULONG_PTR)1) << gCpus[index].Processor.Number;
+    }
+
+    if (SetThreadGroupAffinity(thread, &affinity, NULL) == FALSE)
+    {
+        fprintf(stderr, "TopologyPlaceThread: SetThreadGroupAffinity failed: %d\n",
+                GetLastError());
+        return FALSE;
+    }
+
+    SetThreadIdealProcessorEx(thread, &gCpus[index].Processor, NULL);
+
+    return TRUE;
+}
+
+//
+// Function: TopologySocketCpu
+//
+// Description:
+//    Returns the index of the processor that receive side scaling delivers
+//    the connection's packets to, or -1 if this isn't known (RSS disabled
+//    or not supported by the adapter or the system). The query first
+//    appeared in the Windows 8 SDK; built with older headers the processor
+//    is never known and RSS placement falls back to the default.
+//
+int TopologySocketCpu(SOCKET s)
+{
+#ifdef SIO_QUERY_RSS_PROCESSOR_INFO
+    SOCKET_PROCESSOR_AFFINITY   rss;
+    DWORD                       bytes;
+
+    if (WSAIoctl(
+            s,
+            SIO_QUERY_RSS_PROCESSOR_INFO,
+            NULL,
+            0,
+           &rss,
+            sizeof(rss),
+           &bytes,
+            NULL,
+            NULL
+            ) == SOCKET_ERROR)
+    {
+        return -1;
+    }
+
+    return TopologyCpuIndex(&rss.Processor);
+#else
+    return -1;
+#endif
+}
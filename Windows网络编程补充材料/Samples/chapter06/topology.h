@@ -0,0 +1,60 @@
+//
+// Worker topology routines
+//
+// Files:
+//      topology.h      - Header file for the worker topology routines
+//
+// Description:
+//      This file declares the routines the server uses to place its
+//      completion threads. Processors are numbered 0..N-1 across all
+//      processor groups (group 0 first), so more than 64 processors can be
+//      addressed. A worker can be pinned to one processor, bound to the NUMA
+//      node of a processor, or left to the scheduler.
+//
+//      For receive side scaling (RSS) aligned placement, the processor the
+//      network adapter delivers a connection's packets to can be queried so
+//      that the connection is serviced by the worker pinned there (or at
+//      least one on the same NUMA node).
+//
+// Compile:
+//      See iocpserver.cpp
+//
+// Usage:
+//      See iocpserver.cpp
+//
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#ifdef _cplusplus
+extern "C" {
+#endif
+
+#define TOPOLOGY_MAX_CPUS       2048    // Processors addressed (32 groups of 64)
+
+#define PLACE_NONE              0       // Let the scheduler place the worker
+#define PLACE_CPU               1       // Pin the worker to its processor
+#define PLACE_NODE              2       // Bind the worker to its processor's NUMA node
+#define PLACE_RSS               3       // Pin, and service connections on their RSS processor
+
+//
+// A processor
+//
+typedef struct _TOPOLOGY_CPU
+{
+    PROCESSOR_NUMBER    Processor;      // Group and number within the group
+    USHORT              Node;           // NUMA node of the processor
+} TOPOLOGY_CPU;
+
+int  TopologyInit();
+int  TopologyCpuCount();
+int  TopologyCpuIndex(PROCESSOR_NUMBER *Processor);
+BOOL TopologyGetCpu(int index, TOPOLOGY_CPU *cpu);
+int  TopologyParseCpuList(char *list, int *indexes, int max);
+BOOL TopologyPlaceThread(HANDLE thread, int index, int mode);
+int  TopologySocketCpu(SOCKET s);
+
+#ifdef _cplusplus
+}
+#endif
+
+#endif